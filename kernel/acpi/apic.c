@@ -95,7 +95,7 @@ void apic_parse()
 
 	kfree(lapic_device);
 
-	lapic_base = (void*)vmm_request_map(madt->local_apic, 2, PAGE_PRESENT | PAGE_RW | PAGE_UNCACHEABLE);
+	lapic_base = ioremap(madt->local_apic, PAGE_SIZE, IOREMAP_UC);
 
 	char *ptr = (char*)madt->records;
 	uint32_t bytes = 0;
@@ -170,7 +170,7 @@ void apic_register_ioapic(madt_ioapic_t *data)
 	ioapics[ioapic_count].gsi = data->gsi;
 
 	// map the I/O APIC -- uncacheable because hardware MMIO
-	ioapics[ioapic_count].base = vmm_request_map(data->base, 1, PAGE_PRESENT | PAGE_RW | PAGE_UNCACHEABLE);
+	ioapics[ioapic_count].base = (size_t)ioremap(data->base, PAGE_SIZE, IOREMAP_UC);
 
 	// now read from the I/O APIC to determine how many IRQs it can handle
 	ioapics[ioapic_count].irq_count = (uint32_t)(ioapic_read(ioapic_count, IOAPIC_VER) >> 16) & 0xFF;
@@ -31,9 +31,9 @@ void acpi_load_fadt()
 
 	dsdt_physical = (uint64_t)acpi_dsdt;
 
-	acpi_header_t *dsdt_header = (acpi_header_t*)vmm_request_map((size_t)acpi_dsdt, 1, PAGE_PRESENT | PAGE_RW);
-	acpi_dsdt = (acpi_aml_t*)vmm_request_map((size_t)acpi_dsdt, (size_t)(dsdt_header->length + PAGE_SIZE - 1) / PAGE_SIZE, PAGE_PRESENT | PAGE_RW);
-	vmm_unmap((size_t)dsdt_header, 1);
+	acpi_header_t *dsdt_header = (acpi_header_t*)ioremap((size_t)acpi_dsdt, sizeof(acpi_header_t), IOREMAP_WB);
+	acpi_dsdt = (acpi_aml_t*)ioremap((size_t)acpi_dsdt, dsdt_header->length, IOREMAP_WB);
+	iounmap(dsdt_header);
 
 	// do the checksum
 	if(acpi_checksum(acpi_dsdt) != 0)
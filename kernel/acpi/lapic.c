@@ -73,6 +73,20 @@ inline void lapic_eoi()
 	lapic_write(LAPIC_EOI, 0);
 }
 
+// lapic_send_ipi(): Sends a fixed IPI to a single CPU
+// Param:	uint8_t apic_id - local APIC ID of destination
+// Param:	uint8_t vector - interrupt vector
+// Return:	Nothing
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector)
+{
+	// wait for any previous IPI to be delivered
+	while(lapic_read(LAPIC_COMMAND) & 0x1000);
+
+	lapic_write(LAPIC_COMMAND_ID, (uint32_t)apic_id << 24);
+	lapic_write(LAPIC_COMMAND, 0x4000 | vector);	// physical destination, fixed
+}
+
 // lapic_spurious(): Local APIC spurious IRQ handler
 // Param:	Nothing
 // Return:	Nothing
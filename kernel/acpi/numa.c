@@ -0,0 +1,359 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#include <acpi.h>
+#include <numa.h>
+#include <mm.h>
+#include <cpu.h>
+#include <apic.h>
+#include <kprintf.h>
+
+// Nodes are numbered in the order their proximity domains first appear in the
+// SRAT, so node numbers are always dense even if domain numbers aren't
+
+acpi_srat_t *srat;
+acpi_slit_t *slit;
+
+size_t numa_node_count = 1;
+uint32_t numa_domains[MAX_NUMA_NODES];		// proximity domain of each node
+uint8_t numa_distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+uint8_t numa_fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];	// nodes, nearest first
+uint8_t numa_cpu_nodes[256];			// by APIC ID
+
+numa_range_t numa_ranges[MAX_NUMA_RANGES];
+size_t numa_range_count = 0;
+
+int numa_find_domain(uint32_t);
+uint8_t numa_add_domain(uint32_t);
+void numa_parse_srat();
+void numa_parse_slit();
+void numa_build_fallback();
+
+// numa_init(): Detects NUMA nodes and splits physical memory between them
+// Param:	Nothing
+// Return:	Nothing
+
+void numa_init()
+{
+	size_t i, j;
+
+	numa_node_count = 1;
+	numa_range_count = 0;
+	numa_domains[0] = 0;
+
+	for(i = 0; i < 256; i++)
+		numa_cpu_nodes[i] = 0;
+
+	for(i = 0; i < MAX_NUMA_NODES; i++)
+	{
+		for(j = 0; j < MAX_NUMA_NODES; j++)
+		{
+			if(i == j)
+				numa_distance[i][j] = NUMA_LOCAL_DISTANCE;
+			else
+				numa_distance[i][j] = NUMA_REMOTE_DISTANCE;
+		}
+	}
+
+	srat = acpi_scan("SRAT", 0);
+	if(!srat)
+	{
+		kprintf("numa: ACPI SRAT not present, all memory is in one node.\n");
+		numa_build_fallback();
+		return;
+	}
+
+	numa_node_count = 0;
+	numa_parse_srat();
+
+	if(!numa_node_count)
+	{
+		kprintf("numa: ACPI SRAT has no enabled entries, all memory is in one node.\n");
+		numa_node_count = 1;
+		numa_build_fallback();
+		return;
+	}
+
+	slit = acpi_scan("SLIT", 0);
+	if(slit)
+		numa_parse_slit();
+
+	numa_build_fallback();
+
+	// and now the PMM can sort its free memory into nodes
+	pmm_numa_init();
+}
+
+// numa_cpu_node(): Returns the NUMA node of a CPU
+// Param:	uint8_t apic_id - local APIC ID
+// Return:	uint8_t - NUMA node
+
+uint8_t numa_cpu_node(uint8_t apic_id)
+{
+	return numa_cpu_nodes[apic_id];
+}
+
+// numa_memory_node(): Returns the NUMA node of a physical address
+// Param:	paddr_t address - physical address
+// Return:	uint8_t - NUMA node, 0 if the address isn't in the SRAT
+
+uint8_t numa_memory_node(paddr_t address)
+{
+	size_t i = 0;
+	while(i < numa_range_count)
+	{
+		if((uint64_t)address >= numa_ranges[i].base && (uint64_t)address < numa_ranges[i].base + numa_ranges[i].length)
+			return numa_ranges[i].node;
+
+		i++;
+	}
+
+	return 0;
+}
+
+// numa_set_policy(): Sets the allocation policy of the current CPU
+// Param:	uint8_t policy - NUMA_POLICY_LOCAL, NUMA_POLICY_INTERLEAVE or NUMA_POLICY_BIND
+// Param:	uint8_t node - node for NUMA_POLICY_BIND
+// Return:	Nothing
+
+void numa_set_policy(uint8_t policy, uint8_t node)
+{
+	if(!pmm_pcp_ready)
+		return;
+
+	if(node >= numa_node_count)
+		node = 0;
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	cpu->numa_policy = policy;
+	cpu->numa_bind_node = node;
+}
+
+// numa_dump(): Shows NUMA nodes, their memory, and distances
+// Param:	Nothing
+// Return:	Nothing
+
+void numa_dump()
+{
+	size_t node, i;
+	size_t present, cpus;
+
+	for(node = 0; node < numa_node_count; node++)
+	{
+		// SRAT ranges may cover holes, so count the RAM that's there
+		present = 0;
+		for(i = 0; i < pmm_frame_count; i++)
+		{
+			if(pmm_frames[i].node == node && pmm_frames[i].tag != PMM_TAG_RESERVED)
+				present++;
+		}
+
+		cpus = 0;
+		for(i = 0; i < lapic_count; i++)
+		{
+			if(numa_cpu_nodes[lapics[i].apic_id] == node)
+				cpus++;
+		}
+
+		kprintf("numa: node %d (domain %d): %d CPUs, %d MB, %d MB free, %d MB used\n", node, numa_domains[node], cpus, present / 256, pmm_node_free[node] / 256, (present - pmm_node_free[node]) / 256);
+
+		kprintf("numa: node %d distances:", node);
+		for(i = 0; i < numa_node_count; i++)
+			kprintf(" %d", numa_distance[node][i]);
+
+		kprintf("\n");
+	}
+}
+
+/* Internal Functions */
+
+// numa_find_domain(): Finds the node of a proximity domain
+// Param:	uint32_t domain - proximity domain
+// Return:	int - node, -1 if not present
+
+int numa_find_domain(uint32_t domain)
+{
+	size_t i = 0;
+	while(i < numa_node_count)
+	{
+		if(numa_domains[i] == domain)
+			return (int)i;
+
+		i++;
+	}
+
+	return -1;
+}
+
+// numa_add_domain(): Returns the node of a proximity domain, adding it if new
+// Param:	uint32_t domain - proximity domain
+// Return:	uint8_t - node
+
+uint8_t numa_add_domain(uint32_t domain)
+{
+	int node = numa_find_domain(domain);
+	if(node >= 0)
+		return (uint8_t)node;
+
+	if(numa_node_count >= MAX_NUMA_NODES)
+	{
+		kprintf("numa: too many proximity domains, putting domain %d in node 0.\n", domain);
+		return 0;
+	}
+
+	numa_domains[numa_node_count] = domain;
+	numa_node_count++;
+	return numa_node_count - 1;
+}
+
+// numa_parse_srat(): Parses CPU and memory affinity from the SRAT
+// Param:	Nothing
+// Return:	Nothing
+
+void numa_parse_srat()
+{
+	uint8_t *entry = srat->entries;
+	uint8_t *end = (uint8_t*)srat + srat->header.length;
+
+	srat_lapic_t *lapic;
+	srat_memory_t *memory;
+	srat_x2apic_t *x2apic;
+	uint32_t domain;
+	uint8_t node;
+
+	while(entry + 2 <= end)
+	{
+		if(entry[1] < 2 || entry + entry[1] > end)
+			break;		// corrupt table
+
+		switch(entry[0])
+		{
+		case SRAT_ENTRY_LAPIC:
+			if(entry[1] < sizeof(srat_lapic_t))
+				break;
+
+			lapic = (srat_lapic_t*)entry;
+			if(!(lapic->flags & SRAT_ENABLED))
+				break;
+
+			domain = lapic->domain_low | (lapic->domain_high[0] << 8) | (lapic->domain_high[1] << 16) | (lapic->domain_high[2] << 24);
+			numa_cpu_nodes[lapic->apic_id] = numa_add_domain(domain);
+			break;
+
+		case SRAT_ENTRY_X2APIC:
+			if(entry[1] < sizeof(srat_x2apic_t))
+				break;
+
+			x2apic = (srat_x2apic_t*)entry;
+			if(!(x2apic->flags & SRAT_ENABLED) || x2apic->x2apic_id > 0xFF)
+				break;
+
+			numa_cpu_nodes[x2apic->x2apic_id] = numa_add_domain(x2apic->domain);
+			break;
+
+		case SRAT_ENTRY_MEMORY:
+			if(entry[1] < sizeof(srat_memory_t))
+				break;
+
+			memory = (srat_memory_t*)entry;
+			if(!(memory->flags & SRAT_ENABLED) || !memory->length)
+				break;
+
+			node = numa_add_domain(memory->domain);
+
+			if(numa_range_count >= MAX_NUMA_RANGES)
+			{
+				kprintf("numa: too many memory ranges, ignoring 0x%xq.\n", memory->base);
+				break;
+			}
+
+			numa_ranges[numa_range_count].base = memory->base;
+			numa_ranges[numa_range_count].length = memory->length;
+			numa_ranges[numa_range_count].node = node;
+			numa_range_count++;
+
+			kprintf("numa: memory 0x%xq - 0x%xq is in node %d\n", memory->base, memory->base + memory->length, node);
+			break;
+
+		default:
+			break;
+		}
+
+		entry += entry[1];
+	}
+}
+
+// numa_parse_slit(): Parses node distances from the SLIT
+// Param:	Nothing
+// Return:	Nothing
+
+void numa_parse_slit()
+{
+	size_t i, j;
+	int from, to;
+
+	// proximity domains in the SRAT are at most 32 bits, but nobody has more
+	// than 255 of them, and count * count mustn't overflow
+	if(slit->count > 0xFF)
+	{
+		kprintf("numa: ACPI SLIT claims %d domains, ignoring.\n", (uint32_t)slit->count);
+		return;
+	}
+
+	size_t count = (size_t)slit->count;
+
+	if(sizeof(acpi_slit_t) + (count * count) > slit->header.length)
+	{
+		kprintf("numa: ACPI SLIT is too small for %d domains, ignoring.\n", count);
+		return;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		from = numa_find_domain(i);
+		if(from < 0)
+			continue;
+
+		for(j = 0; j < count; j++)
+		{
+			to = numa_find_domain(j);
+			if(to < 0)
+				continue;
+
+			numa_distance[from][to] = slit->distances[(i * count) + j];
+		}
+	}
+}
+
+// numa_build_fallback(): Sorts the nodes by distance from each node
+// Param:	Nothing
+// Return:	Nothing
+
+void numa_build_fallback()
+{
+	size_t node, i, j;
+	uint8_t tmp;
+
+	for(node = 0; node < numa_node_count; node++)
+	{
+		for(i = 0; i < numa_node_count; i++)
+			numa_fallback[node][i] = i;
+
+		// insertion sort, nodes are few
+		for(i = 1; i < numa_node_count; i++)
+		{
+			j = i;
+			while(j > 0 && numa_distance[node][numa_fallback[node][j]] < numa_distance[node][numa_fallback[node][j-1]])
+			{
+				tmp = numa_fallback[node][j];
+				numa_fallback[node][j] = numa_fallback[node][j-1];
+				numa_fallback[node][j-1] = tmp;
+				j--;
+			}
+		}
+	}
+}
+
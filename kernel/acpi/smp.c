@@ -12,12 +12,26 @@
 #include <cpu.h>
 #include <gdt.h>
 #include <idt.h>
+#include <tlb.h>
+#include <numa.h>
+#include <ksm.h>
+#include <shrink.h>
 
 int smp_boot_ap(size_t);
 void smp_wait();
+cpu_t *smp_alloc_cpu(size_t);
+
+// Every CPU's cpu_t is allocated by the BSP, and an AP loads FS with it before
+// it runs any other C code, so the AP never allocates memory without one. That
+// way pmm_pcp_ready only ever goes from 0 to 1, when the BSP registers, and
+// from then on FS is valid on every running CPU.
 
 size_t current_ap;		// this will tell the APs which index they are
 uint8_t ap_flag;		// this will tell the BSP if the AP started up
+void *smp_ap_stack;		// top of the stack the trampoline switches to
+slab_cache_t *cpu_cache = NULL;	// cpu_t structures, one cache line each at least
+cpu_t *smp_cpus[MAX_LAPICS];	// by CPU index, NULL if it never started
+uint32_t smp_online_cpus = 0;	// bitmap of registered CPU indexes
 
 // smp_init(): Initializes application processors
 // Param:	Nothing
@@ -28,9 +42,14 @@ void smp_init()
 	kprintf("smp: total of %d usable CPUs present.\n", lapic_count);
 
 	idt_install(0xFF, (size_t)&lapic_spurious_stub);
+	tlb_init();
 
 	// register the bsp
+	if(!smp_alloc_cpu(0))
+		panic("Unable to allocate BSP cpu_t.");
+
 	smp_register_cpu(0);
+	pmm_pcp_ready = 1;
 
 	if(lapic_count <= 1)
 	{
@@ -81,6 +100,19 @@ int smp_boot_ap(size_t ap)
 
 	ap_flag = 0;
 
+	// the AP runs on this stack and loads FS with this cpu_t before anything else
+	cpu_t *cpu = smp_cpus[ap];
+	if(!cpu)
+		cpu = smp_alloc_cpu(ap);
+
+	if(!cpu)
+	{
+		kprintf("smp: unable to allocate cpu_t for CPU index %d.\n", ap);
+		return 1;
+	}
+
+	smp_ap_stack = cpu->stack;
+
 	// send the AP an INIT IPI
 	lapic_write(LAPIC_COMMAND_ID, (uint32_t)(apic_id & 0xF) << 24);
 	lapic_write(LAPIC_COMMAND, 0x4500);
@@ -113,39 +145,89 @@ int smp_boot_ap(size_t ap)
 
 void smp_kmain()
 {
-	kprintf("smp: CPU index %d started up.\n", current_ap);
 	smp_register_cpu(current_ap);
+	kprintf("smp: CPU index %d started up.\n", current_ap);
 
 	lapic_init();
 
 	ap_flag = 1;
 
 	while(1)
+	{
+		zero_pool_idle();
+		ksm_idle();
+		shrink_idle();
 		asm volatile ("sti\nhlt");
+	}
 }
 
 // smp_register_cpu(): Registers a CPU that has started up
-// Modifies the GDT in 32-bit mode, uses MSR_FS_BASE in 64-bit mode
+// Uses the cpu_t from smp_alloc_cpu() and allocates nothing, so an AP can call
+// it before FS is valid; loads FS in 32-bit mode, MSR_FS_BASE in 64-bit mode
 // Param:	size_t index - CPU index
 // Return:	Nothing
 
 void smp_register_cpu(size_t index)
 {
-	cpu_t *cpu = kmalloc(sizeof(cpu_t));
-	cpu->index = index;
-	cpu->stack = kmalloc(STACK_SIZE) + STACK_SIZE;
-
 #if __i386__
-	gdt_set_entry(GDT_CPU_INFO + index, (uint32_t)cpu, GDT_ACCESS_PRESENT | GDT_ACCESS_RW, GDT_FLAGS_PMODE);
-	gdt_set_limit(GDT_CPU_INFO + index, sizeof(cpu_t));
 	flush_gdt(gdtr, 0x08, 0x10);
 	load_fs((GDT_CPU_INFO + index) << 3);
 #endif
 
+	// every CPU has a PAT of its own, the BSP's is already programmed
+	ioremap_cpu_init();
+
 #if __x86_64__
+	cpu_t *cpu = smp_cpus[index];
+	cpu->space = &vmm_kernel_space;
 	write_msr(MSR_FS_BASE, (uint64_t)cpu);
+	tlb_cpu_init();
 #endif
+
+	smp_online_cpus |= (1 << index);
 }
 
+// smp_alloc_cpu(): Allocates and fills in the cpu_t of a CPU, on the BSP
+// Param:	size_t index - CPU index
+// Return:	cpu_t * - cpu_t, NULL on error
+
+cpu_t *smp_alloc_cpu(size_t index)
+{
+	if(!cpu_cache)
+		cpu_cache = slab_create("cpu_t", sizeof(cpu_t), CACHE_LINE_SIZE);
 
+	cpu_t *cpu = slab_alloc(cpu_cache);
+	if(!cpu)
+		return NULL;
+
+	// not lazy, a stack page fault would have no stack to push its frame on
+	size_t stack = vmm_alloc(KERNEL_HEAP, STACK_SIZE >> PAGE_SIZE_SHIFT, PAGE_PRESENT | PAGE_RW | VMM_NOZERO);
+	cpu->scratch = kmalloc(sizeof(scratch_t));
+	if(!stack || !cpu->scratch)
+	{
+		if(stack)
+			vmm_free(stack, STACK_SIZE >> PAGE_SIZE_SHIFT);
+		if(cpu->scratch)
+			kfree(cpu->scratch);
+
+		slab_free(cpu_cache, cpu);
+		return NULL;
+	}
+
+	cpu->index = index;
+	cpu->stack = (void*)(stack + STACK_SIZE);
+	scratch_init(cpu->scratch);
+
+	cpu->numa_node = numa_cpu_node(lapics[index].apic_id);
+	cpu->numa_policy = NUMA_POLICY_LOCAL;
+	cpu->numa_interleave = cpu->numa_node;
+
+#if __i386__
+	gdt_set_entry(GDT_CPU_INFO + index, (uint32_t)cpu, GDT_ACCESS_PRESENT | GDT_ACCESS_RW, GDT_FLAGS_PMODE);
+	gdt_set_limit(GDT_CPU_INFO + index, sizeof(cpu_t));
+#endif
+
+	smp_cpus[index] = cpu;
+	return cpu;
+}
 
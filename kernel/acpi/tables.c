@@ -43,7 +43,11 @@ void acpi_init()
 	// but we will for each table that we use
 	kprintf("acpi: 'RSD PTR ' 0x%xd v%xb\n", (uint32_t)rsdp, rsdp->revision);
 
-	rsdt = (acpi_rsdt_t*)vmm_request_map(rsdp->rsdt, 4, PAGE_PRESENT | PAGE_RW);
+	// map the header first to know how long the RSDT is
+	rsdt = (acpi_rsdt_t*)ioremap(rsdp->rsdt, sizeof(acpi_header_t), IOREMAP_WB);
+	size_t rsdt_length = rsdt->header.length;
+	iounmap(rsdt);
+	rsdt = (acpi_rsdt_t*)ioremap(rsdp->rsdt, rsdt_length, IOREMAP_WB);
 
 	if(acpi_checksum(rsdt) != 0)
 	{
@@ -60,10 +64,10 @@ void acpi_init()
 
 	while(i < rsdt_count)
 	{
-		header = (acpi_header_t*)vmm_request_map(rsdt->tables[i], 1, PAGE_PRESENT | PAGE_RW);
+		header = (acpi_header_t*)ioremap(rsdt->tables[i], sizeof(acpi_header_t), IOREMAP_WB);
 		kprintf("acpi: '%c%c%c%c' 0x%xq len %d v%xb OEM '%c%c%c%c%c%c'\n", header->signature[0], header->signature[1], header->signature[2], header->signature[3], (uint64_t)rsdt->tables[i], header->length, header->revision, header->oem[0], header->oem[1], header->oem[2], header->oem[3], header->oem[4], header->oem[5]);
 
-		vmm_unmap((size_t)header, 1);
+		iounmap(header);
 		i++;
 	}
 
@@ -119,12 +123,11 @@ void *acpi_scan(char *signature, size_t index)
 
 	size_t rsdt_count = (rsdt->header.length - sizeof(acpi_header_t)) / sizeof(uint32_t);
 	size_t i = 0;
-	size_t pages;
 	acpi_header_t *header;
 
 	while(1)
 	{
-		header = (acpi_header_t*)vmm_request_map(rsdt->tables[i], 1, PAGE_PRESENT | PAGE_RW);
+		header = (acpi_header_t*)ioremap(rsdt->tables[i], sizeof(acpi_header_t), IOREMAP_WB);
 		if(memcmp(header->signature, signature, 4) == 0)
 		{
 			if(count == index)
@@ -133,7 +136,7 @@ void *acpi_scan(char *signature, size_t index)
 				count++;
 		}
 
-		vmm_unmap((size_t)header, 1);
+		iounmap(header);
 		i++;
 		if(i >= rsdt_count)
 		{
@@ -143,16 +146,15 @@ void *acpi_scan(char *signature, size_t index)
 	}
 
 	// map the table in virtual memory
-	pages = (header->length + PAGE_SIZE - 1) / PAGE_SIZE;
-	void *ptr = (void*)vmm_request_map(rsdt->tables[i], pages, PAGE_PRESENT | PAGE_RW);
-	vmm_unmap((size_t)header, 1);
+	void *ptr = ioremap(rsdt->tables[i], header->length, IOREMAP_WB);
+	iounmap(header);
 
 	// and verify the checksum before returning
 	if(acpi_checksum(ptr) == 0)
 		return ptr;
 	else
 	{
-		vmm_unmap((size_t)ptr, pages);
+		iounmap(ptr);
 		return NULL;
 	}
 }
@@ -167,8 +167,10 @@ use32
 	push 0x00000002
 	popfd
 
-	; enable SSE
-	mov eax, 0x600
+	; enable SSE, and PAE if the BSP uses it
+	extrn vmm_cr4
+	mov eax, [vmm_cr4]
+	or eax, 0x600
 	mov cr4, eax
 
 	mov eax, cr0
@@ -181,8 +183,8 @@ use32
 	fwait
 
 	; paging
-	extrn page_directory
-	mov eax, [page_directory]
+	extrn vmm_cr3
+	mov eax, [vmm_cr3]
 	mov cr3, eax
 
 	mov eax, cr0
@@ -191,14 +193,9 @@ use32
 	and eax, not 0x60000000
 	mov cr0, eax
 
-	; allocate temporary stack
-	extrn kmalloc
-	push 8192
-	mov eax, kmalloc
-	call eax
-
-	mov esp, eax
-	add esp, 8192
+	; the BSP allocated our stack along with our cpu_t
+	extrn smp_ap_stack
+	mov esp, [smp_ap_stack]
 
 	extrn smp_kmain
 	jmp 0x08:smp_kmain
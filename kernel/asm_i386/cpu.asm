@@ -52,6 +52,28 @@ read_cr4:
 	mov eax, cr4
 	ret
 
+; uint64_t read_tsc()
+public read_tsc
+read_tsc:
+	rdtsc				; edx:eax is already how uint64_t is returned
+	ret
+
+; void write_msr(uint32_t msr, uint64_t value)
+public write_msr
+write_msr:
+	mov ecx, [esp+4]	; msr
+	mov eax, [esp+8]	; low dword
+	mov edx, [esp+12]	; high dword
+	wrmsr
+	ret
+
+; uint64_t read_msr(uint32_t msr)
+public read_msr
+read_msr:
+	mov ecx, [esp+4]
+	rdmsr				; edx:eax, like read_tsc()
+	ret
+
 ; void flush_tlb(size_t base, size_t count)
 public flush_tlb
 flush_tlb:
@@ -69,20 +91,54 @@ flush_tlb:
 .done:
 	ret
 
+; void read_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *registers)
+public read_cpuid
+read_cpuid:
+	push ebx
+	push edi
+
+	mov eax, [esp+12]	; leaf
+	mov ecx, [esp+16]	; subleaf
+	mov edi, [esp+20]	; registers
+	cpuid
+
+	mov [edi], eax
+	mov [edi+4], ebx
+	mov [edi+8], ecx
+	mov [edi+12], edx
+
+	pop edi
+	pop ebx
+	ret
+
 ; void acquire_lock(lock_t *)
+extrn tlb_requests_active
+extrn tlb_shootdown_poll
+
 public acquire_lock
 acquire_lock:
 	mov eax, [esp+4]		; lock_t *
 
 .loop:
 	bt dword[eax], 0
-	jc .loop
+	jc .wait
 
 	lock bts dword[eax], 0
-	jc .loop
+	jc .wait
 
 	ret
 
+.wait:
+	; whoever holds it may be waiting for us to take a TLB shootdown, and
+	; we may have interrupts disabled
+	pause
+	cmp dword[tlb_requests_active], 0
+	je .loop
+
+	call tlb_shootdown_poll
+	mov eax, [esp+4]
+	jmp .loop
+
 ; void release_lock(lock_t *)
 public release_lock
 release_lock:
@@ -90,6 +146,20 @@ release_lock:
 	btr dword[eax], 0
 	ret
 
+; int try_lock(lock_t *)
+public try_lock
+try_lock:
+	mov edx, [esp+4]		; lock_t *
+	xor eax, eax
+
+	lock bts dword[edx], 0
+	jc .done
+
+	inc eax				; we have it
+
+.done:
+	ret
+
 ; void flush_gdt(gdtr_t *, uint16_t, uint16_t)
 public flush_gdt
 flush_gdt:
@@ -244,15 +314,6 @@ gpf_handler:
 	add esp, 8
 	iret
 
-public page_handler
-page_handler:
-	push page_text
-	mov ebp, esp
-	call exception_handler
-
-	add esp, 8
-	iret
-
 public reserved_handler
 reserved_handler:
 	push 0
@@ -330,7 +391,6 @@ tss_text			db "Corrupt TSS",0
 segment_text			db "Memory segment not present",0
 stack_text			db "Stack segment error",0
 gpf_text			db "General protection fault",0
-page_text			db "Page fault",0
 reserved_text			db "Reserved exception",0
 floating_text			db "x87 floating point error",0
 alignment_text			db "Alignment check",0
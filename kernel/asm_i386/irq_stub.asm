@@ -68,6 +68,34 @@ acpi_irq_stub:
 	irq_exit
 	iret
 
+public tlb_shootdown_stub
+tlb_shootdown_stub:
+	irq_enter
+
+	extrn tlb_shootdown_irq
+	call tlb_shootdown_irq
+
+	irq_exit
+	iret
+
+; Page faults may be handled and return, so they save everything like IRQs
+; Stack after irq_enter: 8 registers, error code, EIP, CS, EFLAGS
+public page_fault_stub
+page_fault_stub:
+	irq_enter
+
+	mov eax, cr2
+	push dword[esp+44]	; EFLAGS
+	push dword[esp+36]	; error code
+	push eax
+
+	extrn vmm_page_fault
+	call vmm_page_fault
+	add esp, 12
+
+	irq_exit
+	add esp, 4		; error code
+	iret
 
 
 
@@ -141,4 +141,57 @@ sse2_copy:
 	pop esi
 	ret
 
+; void *memset(void *destination, int value, size_t count)
+public memset
+memset:
+	push edi
+
+	mov edi, [esp+4+4]
+	movzx eax, byte[esp+4+8]
+	imul eax, 0x01010101	; value in every byte
+
+	mov ecx, [esp+4+12]
+	shr ecx, 2
+	rep stosd
+
+	mov ecx, [esp+4+12]
+	and ecx, 3
+	rep stosb
+
+	mov eax, [esp+4+4]
+	pop edi
+	ret
+
+; void sse2_zero_pages(void *destination, size_t count)
+; Zeroes 4 KB pages with non-temporal stores, bypassing the caches
+public sse2_zero_pages
+sse2_zero_pages:
+	mov eax, [esp+4]	; destination
+	mov ecx, [esp+8]	; count
+	shl ecx, 5		; 32 blocks of 128 bytes per page
+
+	cmp ecx, 0
+	je .done
+
+	pxor xmm0, xmm0
+
+.loop:
+	movntdq [eax], xmm0
+	movntdq [eax+0x10], xmm0
+	movntdq [eax+0x20], xmm0
+	movntdq [eax+0x30], xmm0
+	movntdq [eax+0x40], xmm0
+	movntdq [eax+0x50], xmm0
+	movntdq [eax+0x60], xmm0
+	movntdq [eax+0x70], xmm0
+
+	add eax, 128
+	loop .loop
+
+	sfence
+
+.done:
+	ret
+
+
 
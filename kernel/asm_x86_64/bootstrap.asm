@@ -131,13 +131,10 @@ times 512 - ($-trampoline16) db 0
 	finit
 	fwait
 
-	extrn kmalloc
-	mov rdi, 16384		; temporary stack
-	mov rax, kmalloc
-	call rax
-
-	mov rsp, rax
-	add rsp, 16384
+	; the BSP allocated our stack along with our cpu_t
+	extrn smp_ap_stack
+	mov rax, smp_ap_stack
+	mov rsp, [rax]
 
 	extrn smp_kmain
 	mov rax, smp_kmain
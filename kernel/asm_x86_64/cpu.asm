@@ -52,6 +52,14 @@ read_cr4:
 	mov rax, cr4
 	ret
 
+; uint64_t read_tsc()
+public read_tsc
+read_tsc:
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	ret
+
 ; void flush_tlb(size_t base, size_t count)
 public flush_tlb
 flush_tlb:
@@ -72,20 +80,60 @@ flush_tlb:
 	popfq
 	ret
 
+; void invpcid_flush(uint64_t type, uint64_t pcid, size_t address)
+public invpcid_flush
+invpcid_flush:
+	push rdx		; descriptor: PCID, then linear address
+	push rsi
+	invpcid rdi, [rsp]
+	add rsp, 16
+	ret
+
+; void read_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *registers)
+public read_cpuid
+read_cpuid:
+	push rbx
+	mov r8, rdx
+
+	mov eax, edi
+	mov ecx, esi
+	cpuid
+
+	mov [r8], eax
+	mov [r8+4], ebx
+	mov [r8+8], ecx
+	mov [r8+12], edx
+
+	pop rbx
+	ret
+
 ; void acquire_lock(lock_t *)
+extrn tlb_requests_active
+extrn tlb_shootdown_poll
+
 public acquire_lock
 acquire_lock:
-	mov rax, rdi		; lock_t *
-
-.loop:
-	bt qword[rax], 0
-	jc .loop
+	bt qword[rdi], 0
+	jc .wait
 
-	lock bts qword[rax], 0
-	jc .loop
+	lock bts qword[rdi], 0
+	jc .wait
 
 	ret
 
+.wait:
+	; whoever holds it may be waiting for us to take a TLB shootdown, and
+	; we may have interrupts disabled
+	pause
+	mov rax, tlb_requests_active
+	cmp dword[rax], 0
+	je acquire_lock
+
+	push rdi		; also keeps the stack aligned for the call
+	call tlb_shootdown_poll
+	pop rdi
+	jmp acquire_lock
+
 ; void release_lock(lock_t *)
 public release_lock
 release_lock:
@@ -93,6 +141,19 @@ release_lock:
 	btr qword[rax], 0
 	ret
 
+; int try_lock(lock_t *)
+public try_lock
+try_lock:
+	xor eax, eax
+
+	lock bts qword[rdi], 0
+	jc .done
+
+	inc eax				; we have it
+
+.done:
+	ret
+
 ; void flush_gdt(gdtr_t *, uint16_t, uint16_t)
 public flush_gdt
 flush_gdt:
@@ -253,14 +314,6 @@ gpf_handler:
 
 	iretq
 
-public page_handler
-page_handler:
-	pop rsi
-	mov rdi, page_text
-	call exception_handler
-
-	iretq
-
 public reserved_handler
 reserved_handler:
 	mov rsi, 0
@@ -333,7 +386,6 @@ tss_text			db "Corrupt TSS",0
 segment_text			db "Memory segment not present",0
 stack_text			db "Stack segment error",0
 gpf_text			db "General protection fault",0
-page_text			db "Page fault",0
 reserved_text			db "Reserved exception",0
 floating_text			db "x87 floating point error",0
 alignment_text			db "Alignment check",0
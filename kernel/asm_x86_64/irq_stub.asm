@@ -96,7 +96,38 @@ acpi_irq_stub:
 	irq_exit
 	iretq
 
+public tlb_shootdown_stub
+tlb_shootdown_stub:
+	irq_enter
+
+	extrn tlb_shootdown_irq
+	call tlb_shootdown_irq
+
+	irq_exit
+	iretq
+
+; Page faults may be handled and return, so they save everything like IRQs
+; Stack after irq_enter: 15 registers, error code, RIP, CS, RFLAGS, RSP, SS
+public page_fault_stub
+page_fault_stub:
+	irq_enter
 
+	mov rdi, cr2
+	mov rsi, [rsp+120]	; error code
+	mov rdx, [rsp+144]	; RFLAGS
+
+	; the error code left the stack misaligned for C
+	mov rbx, rsp
+	and rsp, -16
+
+	extrn vmm_page_fault
+	call vmm_page_fault
+
+	mov rsp, rbx
+
+	irq_exit
+	add rsp, 8		; error code
+	iretq
 
 
 
@@ -124,4 +124,55 @@ sse2_copy:
 
 	ret
 
+; void *memset(void *destination, int value, size_t count)
+public memset
+memset:
+	mov r8, rdi
+
+	movzx eax, sil
+	mov r9, 0x0101010101010101
+	imul rax, r9		; value in every byte
+
+	mov rcx, rdx
+	shr rcx, 3
+	rep stosq
+
+	mov rcx, rdx
+	and rcx, 7
+	rep stosb
+
+	mov rax, r8
+	ret
+
+; void sse2_zero_pages(void *destination, size_t count)
+; Zeroes 4 KB pages with non-temporal stores, bypassing the caches
+public sse2_zero_pages
+sse2_zero_pages:
+	mov rcx, rsi
+	shl rcx, 5		; 32 blocks of 128 bytes per page
+
+	cmp rcx, 0
+	je .done
+
+	pxor xmm0, xmm0
+
+.loop:
+	movntdq [rdi], xmm0
+	movntdq [rdi+0x10], xmm0
+	movntdq [rdi+0x20], xmm0
+	movntdq [rdi+0x30], xmm0
+	movntdq [rdi+0x40], xmm0
+	movntdq [rdi+0x50], xmm0
+	movntdq [rdi+0x60], xmm0
+	movntdq [rdi+0x70], xmm0
+
+	add rdi, 128
+	loop .loop
+
+	sfence
+
+.done:
+	ret
+
+
 
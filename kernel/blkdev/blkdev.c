@@ -14,6 +14,8 @@
 blkdev_t *blkdevs;
 size_t blkdev_count = 0;
 
+int blkdev_driver_read(dev_t, uint64_t, uint64_t, void *);
+
 // blkdev_init(): Initializes block devices
 // Param:	multiboot_info_t *multiboot_info - pointer to multiboot information
 // Return:	Nothing
@@ -21,6 +23,7 @@ size_t blkdev_count = 0;
 void blkdev_init(multiboot_info_t *multiboot_info)
 {
 	blkdevs = kcalloc(sizeof(blkdev_t), MAX_BLKDEVS);
+	blkdev_cache_init();
 	initrd_init(multiboot_info);
 }
 
@@ -57,6 +60,11 @@ dev_t blkdev_register(uint8_t type, uint16_t sector_size, void *info, char *name
 
 	blkdevs[device].name[63] = 0;
 
+	blkdevs[device].cache_hits = 0;
+	blkdevs[device].cache_misses = 0;
+	blkdevs[device].cache_evictions = 0;
+	blkdevs[device].cache_buffers = 0;
+
 	blkdev_count++;
 	return device;
 }
@@ -75,10 +83,39 @@ int blkdev_read(dev_t device, uint64_t lba, uint64_t count, void *buffer)
 
 	blkdev_t *blkdev = &blkdevs[device];
 
+	if(blkdev->type != BLKDEV_NONE && blkdev->sector_size)
+	{
+		if(blkdev_cache_read(device, lba * blkdev->sector_size, count * blkdev->sector_size, buffer) == 0)
+			return 0;
+	}
+
+	return blkdev_driver_read(device, lba, count, buffer);
+}
+
+// blkdev_write(): Writes to a block device
+// Param:	dev_t device - device to write to
+// Param:	uint64_t lba - starting LBA sector
+// Param:	uint64_t count - count of sectors to write
+// Param:	void *buffer - buffer to write from
+// Return:	int - return status
+
+int blkdev_write(dev_t device, uint64_t lba, uint64_t count, void *buffer)
+{
+	if(!count)
+		return 0;
+
+	blkdev_t *blkdev = &blkdevs[device];
+
 	if(blkdev->type == BLKDEV_INITRD)
-		return initrd_read(blkdev, lba, count, buffer);
+	{
+		int status = initrd_write(blkdev, lba, count, buffer);
+		if(status == 0)
+			blkdev_cache_write(device, lba * blkdev->sector_size, count * blkdev->sector_size, buffer);
 
-	kprintf("blkdev: read non-present device %d, LBA 0x%xq count %d\n", device, lba, count);
+		return status;
+	}
+
+	kprintf("blkdev: write non-present device %d, LBA 0x%xq count %d\n", device, lba, count);
 	return BLKDEV_NODEV;
 }
 
@@ -99,23 +136,81 @@ int blkdev_read_bytes(dev_t device, uint64_t base, uint64_t count, void *buffer)
 	if(blkdev->type == 0 || blkdev->sector_size == 0)
 		return BLKDEV_NODEV;
 
+	// buffers hold whole sectors, so this needs no bounce buffer
+	if(blkdev_cache_read(device, base, count, buffer) == 0)
+		return 0;
+
 	uint64_t lba = base / blkdev->sector_size;	// round down
 	uint64_t byte_start = base % blkdev->sector_size;
-	uint64_t count_sectors = (count / blkdev->sector_size) + 1;
+	uint64_t count_sectors = (byte_start + count + blkdev->sector_size - 1) / blkdev->sector_size;
 
-	void *tmp_buffer = kcalloc(blkdev->sector_size, count_sectors);
-	int status = blkdev_read(device, lba, count_sectors, tmp_buffer);
+	// the bounce buffer only lives during this call
+	void *tmp_buffer = scratch_alloc(blkdev->sector_size * count_sectors);
+	int status = blkdev_driver_read(device, lba, count_sectors, tmp_buffer);
 	if(status != 0)
 	{
-		kfree(tmp_buffer);
+		scratch_free(tmp_buffer);
 		return status;
 	}
 
 	memcpy(buffer, tmp_buffer + byte_start, count);
-	kfree(tmp_buffer);
+	scratch_free(tmp_buffer);
 	return 0;
 }
 
+// blkdev_write_bytes(): Writes to a block device using byte-indexing instead of sectors
+// Param:	dev_t device - device to write to
+// Param:	uint64_t base - starting byte
+// Param:	uint64_t count - count of bytes to write
+// Param:	void *buffer - buffer to write from
+// Return:	int - return status
+
+int blkdev_write_bytes(dev_t device, uint64_t base, uint64_t count, void *buffer)
+{
+	if(!count)
+		return 0;
+
+	blkdev_t *blkdev = &blkdevs[device];
+
+	if(blkdev->type == 0 || blkdev->sector_size == 0)
+		return BLKDEV_NODEV;
+
+	uint64_t lba = base / blkdev->sector_size;	// round down
+	uint64_t byte_start = base % blkdev->sector_size;
+	uint64_t count_sectors = (byte_start + count + blkdev->sector_size - 1) / blkdev->sector_size;
+
+	// sectors are written whole, so keep what's around the bytes we change
+	void *tmp_buffer = scratch_alloc(blkdev->sector_size * count_sectors);
+	int status = blkdev_read(device, lba, count_sectors, tmp_buffer);
+	if(status != 0)
+	{
+		scratch_free(tmp_buffer);
+		return status;
+	}
+
+	memcpy(tmp_buffer + byte_start, buffer, count);
+	status = blkdev_write(device, lba, count_sectors, tmp_buffer);
+	scratch_free(tmp_buffer);
+	return status;
+}
+
+/* Internal Functions */
 
+// blkdev_driver_read(): Reads from a block device's driver, bypassing the cache
+// Param:	dev_t device - device to read from
+// Param:	uint64_t lba - starting LBA sector
+// Param:	uint64_t count - count of sectors to read
+// Param:	void *buffer - buffer to read into
+// Return:	int - return status
 
+int blkdev_driver_read(dev_t device, uint64_t lba, uint64_t count, void *buffer)
+{
+	blkdev_t *blkdev = &blkdevs[device];
+
+	if(blkdev->type == BLKDEV_INITRD)
+		return initrd_read(blkdev, lba, count, buffer);
+
+	kprintf("blkdev: read non-present device %d, LBA 0x%xq count %d\n", device, lba, count);
+	return BLKDEV_NODEV;
+}
 
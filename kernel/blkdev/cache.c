@@ -0,0 +1,490 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Block Device Buffer Cache */
+
+#include <blkdev.h>
+#include <mm.h>
+#include <shrink.h>
+#include <string.h>
+#include <kprintf.h>
+#include <lock.h>
+
+// Reads from block devices go through a cache of BLKDEV_BUFFER_SIZE-byte
+// buffers, so a filesystem that reads the same metadata over and over only
+// reaches the driver the first time. Buffers are found by device and buffer
+// number through a hash table, and kept on one LRU list, most recently used
+// first. When the cache is at its budget, or memory runs low, the least
+// recently used buffers that nobody holds are dropped. Writes go to the driver
+// first and then to any buffer holding the same bytes, so nothing is dirty.
+//
+// Buffer data lives in frames of its own, reached through kmap(), so dropping
+// a buffer never needs vmm_mutex and the shrinker can run inside pmm_alloc().
+// For the same reason the heads of dropped buffers aren't given back to their
+// slab, which could free the slab, but kept on a spare list for later misses.
+// On a miss, a placeholder marked BLKDEV_BUFFER_LOADING goes in the table and
+// the buffer is allocated and read without blkdev_cache_mutex, so hits and
+// other devices don't wait for the driver. Anyone else looking for it tries
+// again until it's ready, and a write that lands meanwhile has it read again.
+// Lock order is blkdev_cache_mutex, then pmm_mutex.
+
+blkdev_buffer_t *blkdev_hash[BLKDEV_BUFFER_HASH];
+blkdev_buffer_t *blkdev_lru = NULL;		// most recently used
+blkdev_buffer_t *blkdev_lru_tail = NULL;	// least recently used
+blkdev_buffer_t *blkdev_spare = NULL;		// heads of evicted buffers, linked by hash_next
+slab_cache_t *blkdev_buffer_cache = NULL;
+lock_t blkdev_cache_mutex = 0;
+
+size_t blkdev_buffers = 0;
+size_t blkdev_cache_limit = 0;			// zero until blkdev_cache_init()
+uint64_t blkdev_cache_shrunk = 0;
+
+int blkdev_driver_read(dev_t, uint64_t, uint64_t, void *);
+size_t blkdev_cache_hash(dev_t, uint64_t);
+blkdev_buffer_t *blkdev_cache_find(dev_t, uint64_t);
+void blkdev_lru_remove(blkdev_buffer_t *);
+void blkdev_lru_add(blkdev_buffer_t *);
+void blkdev_cache_unlink(blkdev_buffer_t *);
+size_t blkdev_cache_evict(size_t);
+size_t blkdev_cache_count();
+size_t blkdev_cache_shrink(size_t);
+
+// blkdev_cache_init(): Sets up the buffer cache
+// Param:	Nothing
+// Return:	Nothing
+
+void blkdev_cache_init()
+{
+	blkdev_buffer_cache = slab_create("blkdev_buffer_t", sizeof(blkdev_buffer_t), 0);
+
+	blkdev_cache_limit = BLKDEV_CACHE_BUDGET;
+	if(blkdev_cache_limit > total_pages / BLKDEV_CACHE_DIVISOR)
+		blkdev_cache_limit = total_pages / BLKDEV_CACHE_DIVISOR;
+
+	// only ever try_lock()s, so allocations may call it
+	shrink_register("buffer cache", blkdev_cache_count, blkdev_cache_shrink, 5, SHRINKER_DIRECT);
+
+	kprintf("blkdev: buffer cache budget is %d buffers, %d KB\n", blkdev_cache_limit, blkdev_cache_limit * (BLKDEV_BUFFER_SIZE / 1024));
+}
+
+// blkdev_cache_budget(): Changes how many buffers the cache may hold
+// Param:	size_t buffers - new budget, zero turns the cache off
+// Return:	Nothing
+
+void blkdev_cache_budget(size_t buffers)
+{
+	acquire_lock(&blkdev_cache_mutex);
+
+	blkdev_cache_limit = buffers;
+	if(blkdev_buffers > blkdev_cache_limit)
+		blkdev_cache_evict(blkdev_buffers - blkdev_cache_limit);
+
+	release_lock(&blkdev_cache_mutex);
+}
+
+// blkdev_buffer_get(): Returns a buffer of a device, reading it on a miss
+// Param:	dev_t device - device
+// Param:	uint64_t block - buffer number, byte offset / BLKDEV_BUFFER_SIZE
+// Return:	blkdev_buffer_t * - held buffer, NULL if it can't be cached or read
+
+blkdev_buffer_t *blkdev_buffer_get(dev_t device, uint64_t block)
+{
+	if(device >= MAX_BLKDEVS)
+		return NULL;
+
+	blkdev_t *blkdev = &blkdevs[device];
+	if(blkdev->type == BLKDEV_NONE || !blkdev->sector_size || (BLKDEV_BUFFER_SIZE % blkdev->sector_size))
+		return NULL;
+
+	blkdev_buffer_t *buffer, *placeholder;
+	size_t sectors = BLKDEV_BUFFER_SIZE / blkdev->sector_size;
+	size_t hash;
+	void *data;
+	int status;
+
+again:
+	acquire_lock(&blkdev_cache_mutex);
+
+	buffer = blkdev_cache_find(device, block);
+	if(buffer)
+	{
+		// another CPU is still reading it
+		if(buffer->flags & BLKDEV_BUFFER_LOADING)
+		{
+			release_lock(&blkdev_cache_mutex);
+			goto again;
+		}
+
+		buffer->refcount++;
+		blkdev_lru_remove(buffer);
+		blkdev_lru_add(buffer);
+		blkdev->cache_hits++;
+
+		release_lock(&blkdev_cache_mutex);
+		return buffer;
+	}
+
+	blkdev->cache_misses++;
+
+	// make room, and give up when every buffer is held
+	if(blkdev_buffers >= blkdev_cache_limit && !blkdev_cache_evict(blkdev_buffers - blkdev_cache_limit + 1))
+	{
+		release_lock(&blkdev_cache_mutex);
+		return NULL;
+	}
+
+	// count it now, so other misses meanwhile stay within the budget
+	blkdev_buffers++;
+
+	placeholder = blkdev_spare;
+	if(placeholder)
+		blkdev_spare = placeholder->hash_next;
+
+	release_lock(&blkdev_cache_mutex);
+
+	if(!placeholder)
+		placeholder = slab_alloc_nozero(blkdev_buffer_cache);
+
+	if(placeholder)
+	{
+		placeholder->frame = pmm_alloc_zone(1, PMM_ZONE_NORMAL);
+		if(!placeholder->frame)
+		{
+			slab_free(blkdev_buffer_cache, placeholder);
+			placeholder = NULL;
+		}
+	}
+
+	acquire_lock(&blkdev_cache_mutex);
+
+	// another CPU may have started on the same buffer
+	buffer = blkdev_cache_find(device, block);
+	if(!placeholder || buffer)
+	{
+		blkdev_buffers--;
+		release_lock(&blkdev_cache_mutex);
+
+		if(!placeholder)
+			return NULL;
+
+		pmm_mark_free(placeholder->frame, 1);
+		slab_free(blkdev_buffer_cache, placeholder);
+		goto again;
+	}
+
+	buffer = placeholder;
+	buffer->device = device;
+	buffer->block = block;
+	buffer->refcount = 1;
+	buffer->flags = BLKDEV_BUFFER_LOADING;
+
+	hash = blkdev_cache_hash(device, block);
+	buffer->hash_next = blkdev_hash[hash];
+	blkdev_hash[hash] = buffer;
+	blkdev_lru_add(buffer);
+	blkdev->cache_buffers++;
+
+	release_lock(&blkdev_cache_mutex);
+
+	pmm_set_tag(buffer->frame, 1, PMM_TAG_BUFFER);
+
+	// whole buffers are read, so the next reads nearby are hits
+	data = kmap(buffer->frame);
+	status = blkdev_driver_read(device, block * sectors, sectors, data);
+	kunmap(data);
+
+	acquire_lock(&blkdev_cache_mutex);
+
+	// most likely the last, partial buffer of the device, or a write beat us
+	if(status != 0 || (buffer->flags & BLKDEV_BUFFER_STALE))
+	{
+		blkdev_cache_unlink(buffer);
+		release_lock(&blkdev_cache_mutex);
+
+		pmm_mark_free(buffer->frame, 1);
+		slab_free(blkdev_buffer_cache, buffer);
+
+		if(status != 0)
+			return NULL;
+
+		goto again;
+	}
+
+	buffer->flags = 0;
+
+	release_lock(&blkdev_cache_mutex);
+	return buffer;
+}
+
+// blkdev_buffer_put(): Drops a hold on a buffer
+// Param:	blkdev_buffer_t *buffer - buffer from blkdev_buffer_get()
+// Return:	Nothing
+
+void blkdev_buffer_put(blkdev_buffer_t *buffer)
+{
+	if(!buffer)
+		return;
+
+	acquire_lock(&blkdev_cache_mutex);
+
+	if(buffer->refcount)
+		buffer->refcount--;
+	else
+		kprintf("blkdev: buffer 0x%xq of device %d released too many times\n", buffer->block, buffer->device);
+
+	release_lock(&blkdev_cache_mutex);
+}
+
+// blkdev_cache_read(): Reads bytes of a device through the buffer cache
+// Param:	dev_t device - device
+// Param:	uint64_t base - starting byte
+// Param:	uint64_t count - count of bytes
+// Param:	void *destination - where to copy them
+// Return:	int - 0 on success, BLKDEV_IO if the caller should read uncached
+
+int blkdev_cache_read(dev_t device, uint64_t base, uint64_t count, void *destination)
+{
+	uint64_t offset, size;
+	blkdev_buffer_t *buffer;
+	void *data;
+
+	while(count)
+	{
+		offset = base % BLKDEV_BUFFER_SIZE;
+		size = BLKDEV_BUFFER_SIZE - offset;
+		if(size > count)
+			size = count;
+
+		buffer = blkdev_buffer_get(device, base / BLKDEV_BUFFER_SIZE);
+		if(!buffer)
+			return BLKDEV_IO;
+
+		data = kmap(buffer->frame);
+		memcpy(destination, data + offset, size);
+		kunmap(data);
+		blkdev_buffer_put(buffer);
+
+		base += size;
+		count -= size;
+		destination += size;
+	}
+
+	return 0;
+}
+
+// blkdev_cache_write(): Updates cached buffers after bytes were written to a device
+// Buffers that aren't cached aren't read in
+// Param:	dev_t device - device
+// Param:	uint64_t base - starting byte
+// Param:	uint64_t count - count of bytes
+// Param:	void *source - bytes that were written
+// Return:	Nothing
+
+void blkdev_cache_write(dev_t device, uint64_t base, uint64_t count, void *source)
+{
+	uint64_t offset, size;
+	blkdev_buffer_t *buffer;
+	void *data;
+
+	acquire_lock(&blkdev_cache_mutex);
+
+	while(count)
+	{
+		offset = base % BLKDEV_BUFFER_SIZE;
+		size = BLKDEV_BUFFER_SIZE - offset;
+		if(size > count)
+			size = count;
+
+		buffer = blkdev_cache_find(device, base / BLKDEV_BUFFER_SIZE);
+		if(buffer && (buffer->flags & BLKDEV_BUFFER_LOADING))
+		{
+			// the read may already have passed these bytes
+			buffer->flags |= BLKDEV_BUFFER_STALE;
+		} else if(buffer)
+		{
+			data = kmap(buffer->frame);
+			memcpy(data + offset, source, size);
+			kunmap(data);
+		}
+
+		base += size;
+		count -= size;
+		source += size;
+	}
+
+	release_lock(&blkdev_cache_mutex);
+}
+
+// blkdev_cache_dump(): Shows the buffer cache and how well it does for each device
+// Param:	Nothing
+// Return:	Nothing
+
+void blkdev_cache_dump()
+{
+	acquire_lock(&blkdev_cache_mutex);
+
+	kprintf("blkdev: %d of %d buffers cached, %d dropped by the shrinker\n", blkdev_buffers, blkdev_cache_limit, (uint32_t)blkdev_cache_shrunk);
+
+	size_t i;
+	uint64_t lookups;
+	for(i = 0; i < MAX_BLKDEVS; i++)
+	{
+		if(blkdevs[i].type == BLKDEV_NONE)
+			continue;
+
+		lookups = blkdevs[i].cache_hits + blkdevs[i].cache_misses;
+		if(!lookups)
+			lookups = 1;
+
+		kprintf("blkdev: %s: %d hits, %d misses, %d%% hit rate, %d evictions, %d buffers\n", blkdevs[i].name, (uint32_t)blkdevs[i].cache_hits, (uint32_t)blkdevs[i].cache_misses, (uint32_t)((blkdevs[i].cache_hits * 100) / lookups), (uint32_t)blkdevs[i].cache_evictions, blkdevs[i].cache_buffers);
+	}
+
+	release_lock(&blkdev_cache_mutex);
+}
+
+/* Internal Functions */
+
+// blkdev_cache_hash(): Returns the hash bucket of a buffer
+// Param:	dev_t device - device
+// Param:	uint64_t block - buffer number
+// Return:	size_t - bucket
+
+size_t blkdev_cache_hash(dev_t device, uint64_t block)
+{
+	// neighbouring buffers go to neighbouring buckets
+	return (size_t)((block + ((uint64_t)device * 0x9E3779B1)) % BLKDEV_BUFFER_HASH);
+}
+
+// blkdev_cache_find(): Finds a cached buffer, called with the lock held
+// Param:	dev_t device - device
+// Param:	uint64_t block - buffer number
+// Return:	blkdev_buffer_t * - buffer, NULL if not cached
+
+blkdev_buffer_t *blkdev_cache_find(dev_t device, uint64_t block)
+{
+	blkdev_buffer_t *buffer = blkdev_hash[blkdev_cache_hash(device, block)];
+	while(buffer)
+	{
+		if(buffer->device == device && buffer->block == block)
+			return buffer;
+
+		buffer = buffer->hash_next;
+	}
+
+	return NULL;
+}
+
+// blkdev_lru_remove(): Takes a buffer off the LRU list
+// Param:	blkdev_buffer_t *buffer - buffer
+// Return:	Nothing
+
+void blkdev_lru_remove(blkdev_buffer_t *buffer)
+{
+	if(buffer->lru_prev)
+		buffer->lru_prev->lru_next = buffer->lru_next;
+	else
+		blkdev_lru = buffer->lru_next;
+
+	if(buffer->lru_next)
+		buffer->lru_next->lru_prev = buffer->lru_prev;
+	else
+		blkdev_lru_tail = buffer->lru_prev;
+}
+
+// blkdev_lru_add(): Puts a buffer at the front of the LRU list
+// Param:	blkdev_buffer_t *buffer - buffer
+// Return:	Nothing
+
+void blkdev_lru_add(blkdev_buffer_t *buffer)
+{
+	buffer->lru_prev = NULL;
+	buffer->lru_next = blkdev_lru;
+
+	if(blkdev_lru)
+		blkdev_lru->lru_prev = buffer;
+	else
+		blkdev_lru_tail = buffer;
+
+	blkdev_lru = buffer;
+}
+
+// blkdev_cache_unlink(): Takes a buffer out of the cache, called with the lock held
+// Param:	blkdev_buffer_t *buffer - buffer
+// Return:	Nothing
+
+void blkdev_cache_unlink(blkdev_buffer_t *buffer)
+{
+	blkdev_buffer_t **link = &blkdev_hash[blkdev_cache_hash(buffer->device, buffer->block)];
+	while(link[0] != buffer)
+		link = &link[0]->hash_next;
+
+	link[0] = buffer->hash_next;
+	blkdev_lru_remove(buffer);
+
+	blkdevs[buffer->device].cache_buffers--;
+	blkdev_buffers--;
+}
+
+// blkdev_cache_evict(): Drops the least recently used buffers nobody holds
+// Called with the lock held
+// Param:	size_t count - count of buffers to drop
+// Return:	size_t - count of buffers dropped
+
+size_t blkdev_cache_evict(size_t count)
+{
+	size_t evicted = 0;
+	blkdev_buffer_t *buffer = blkdev_lru_tail;
+	blkdev_buffer_t *previous;
+
+	while(buffer && evicted < count)
+	{
+		previous = buffer->lru_prev;
+		if(buffer->refcount)
+		{
+			buffer = previous;
+			continue;
+		}
+
+		blkdev_cache_unlink(buffer);
+		blkdevs[buffer->device].cache_evictions++;
+
+		pmm_mark_free(buffer->frame, 1);
+		buffer->hash_next = blkdev_spare;
+		blkdev_spare = buffer;
+
+		evicted++;
+		buffer = previous;
+	}
+
+	return evicted;
+}
+
+// blkdev_cache_count(): Returns how many frames the cache could give back
+// Param:	Nothing
+// Return:	size_t - count of buffers, held ones are few enough to count too
+
+size_t blkdev_cache_count()
+{
+	return blkdev_buffers;
+}
+
+// blkdev_cache_shrink(): Drops buffers when memory runs low
+// Param:	size_t count - count of frames wanted
+// Return:	size_t - count of frames freed
+
+size_t blkdev_cache_shrink(size_t count)
+{
+	// the allocation that called us may be from inside the cache
+	if(!try_lock(&blkdev_cache_mutex))
+		return 0;
+
+	size_t freed = blkdev_cache_evict(count);
+	blkdev_cache_shrunk += freed;
+
+	release_lock(&blkdev_cache_mutex);
+	return freed;
+}
+
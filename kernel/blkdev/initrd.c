@@ -69,6 +69,23 @@ int initrd_read(blkdev_t *device, uint64_t lba, uint64_t count, void *buffer)
 	return 0;
 }
 
+// initrd_write(): Writes to the initrd
+// Param:	blkdev_t *device - device to write
+// Param:	uint64_t lba - starting LBA sector
+// Param:	uint64_t count - count of sectors to write
+// Param:	void *buffer - buffer to write from
+// Return:	int - return status
+
+int initrd_write(blkdev_t *device, uint64_t lba, uint64_t count, void *buffer)
+{
+	blkdev_initrd_t *initrd = (blkdev_initrd_t*)&device->data[0];
+	if((lba + count) >= initrd->size_sectors)
+		return BLKDEV_IO;
+
+	// it's only in memory, so writes last until reboot
+	memcpy(initrd->base + (lba * INITRD_SECTOR_SIZE), buffer, count * INITRD_SECTOR_SIZE);
+	return 0;
+}
 
 
 
@@ -37,7 +37,7 @@ int hpet_init()
 		return 1;
 	}
 
-	hpet_base = vmm_request_map(hpet->base.base, 1, PAGE_PRESENT | PAGE_RW | PAGE_UNCACHEABLE);
+	hpet_base = (size_t)ioremap(hpet->base.base, PAGE_SIZE, IOREMAP_UC);
 	kprintf("hpet: base MMIO is 0x%xd\n", hpet->base.base);
 
 #if __i386__
@@ -0,0 +1,260 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Directory Entry Cache */
+
+#include <dcache.h>
+#include <vfs.h>
+#include <mm.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+
+// Filesystems resolve each component of a path by asking here first, with the
+// inode of the directory and the name, and only read the directory on a miss.
+// Names that turned out not to exist are cached too, as negative entries, so
+// failed lookups -- like searching PATH -- are as cheap as successful ones.
+// Entries are found through a hash table and kept on an LRU list, most
+// recently used first; once there are DCACHE_SIZE of them, the least recently
+// used one is reused. Nothing writes directories yet, so entries never go stale.
+
+dentry_t *dcache_hash_table[DCACHE_HASH];
+dentry_t *dcache_lru = NULL;			// most recently used
+dentry_t *dcache_lru_tail = NULL;		// least recently used
+slab_cache_t *dcache_slab = NULL;
+lock_t dcache_mutex = 0;
+
+size_t dcache_count = 0;
+size_t dcache_negative = 0;			// negative entries among them
+uint64_t dcache_evictions = 0;
+dcache_stats_t dcache_stats[DCACHE_DEPTHS];
+
+uint32_t dcache_hash(mountpoint_t *, ino_t, const char *);
+dentry_t *dcache_find(mountpoint_t *, ino_t, const char *, uint32_t);
+void dcache_unlink(dentry_t *);
+void dcache_link(dentry_t *);
+
+// dcache_init(): Sets up the directory entry cache
+// Param:	Nothing
+// Return:	Nothing
+
+void dcache_init()
+{
+	dcache_slab = slab_create("dentry_t", sizeof(dentry_t), 0);
+}
+
+// dcache_lookup(): Looks up a name in a directory
+// Param:	mountpoint_t *mountpoint - mountpoint of the directory
+// Param:	ino_t parent - inode of the directory
+// Param:	const char *name - name of the entry, without slashes
+// Param:	size_t depth - which component of the path this is, for the counters
+// Param:	ino_t *destination - where to store the inode on a hit
+// Return:	int - DCACHE_HIT, DCACHE_NEGATIVE or DCACHE_MISS
+
+int dcache_lookup(mountpoint_t *mountpoint, ino_t parent, const char *name, size_t depth, ino_t *destination)
+{
+	if(depth >= DCACHE_DEPTHS)
+		depth = DCACHE_DEPTHS - 1;
+
+	uint32_t hash = dcache_hash(mountpoint, parent, name);
+
+	acquire_lock(&dcache_mutex);
+
+	dentry_t *dentry = dcache_find(mountpoint, parent, name, hash);
+	if(!dentry)
+	{
+		dcache_stats[depth].misses++;
+		release_lock(&dcache_mutex);
+		return DCACHE_MISS;
+	}
+
+	dcache_unlink(dentry);
+	dcache_link(dentry);
+
+	if(!dentry->inode)
+	{
+		dcache_stats[depth].negative_hits++;
+		release_lock(&dcache_mutex);
+		return DCACHE_NEGATIVE;
+	}
+
+	dcache_stats[depth].hits++;
+	destination[0] = dentry->inode;
+
+	release_lock(&dcache_mutex);
+	return DCACHE_HIT;
+}
+
+// dcache_add(): Remembers what a name in a directory leads to
+// Param:	mountpoint_t *mountpoint - mountpoint of the directory
+// Param:	ino_t parent - inode of the directory
+// Param:	const char *name - name of the entry, without slashes
+// Param:	ino_t inode - inode it leads to, zero if it doesn't exist
+// Return:	Nothing
+
+void dcache_add(mountpoint_t *mountpoint, ino_t parent, const char *name, ino_t inode)
+{
+	if(strlen(name) > DCACHE_NAME_MAX)
+		return;
+
+	uint32_t hash = dcache_hash(mountpoint, parent, name);
+
+	acquire_lock(&dcache_mutex);
+
+	// another CPU may have looked up the same name meanwhile
+	dentry_t *dentry = dcache_find(mountpoint, parent, name, hash);
+	if(dentry)
+	{
+		release_lock(&dcache_mutex);
+		return;
+	}
+
+	if(dcache_count >= DCACHE_SIZE)
+	{
+		dentry = dcache_lru_tail;
+		dcache_unlink(dentry);
+		dcache_evictions++;
+	} else
+	{
+		dentry = slab_alloc_nozero(dcache_slab);
+		if(!dentry)
+		{
+			release_lock(&dcache_mutex);
+			return;
+		}
+	}
+
+	dentry->mountpoint = mountpoint;
+	dentry->parent = parent;
+	dentry->inode = inode;
+	dentry->hash = hash;
+	strcpy(dentry->name, name);
+	dcache_link(dentry);
+
+	release_lock(&dcache_mutex);
+}
+
+// dcache_dump(): Shows how often lookups of each path component were cached
+// Param:	Nothing
+// Return:	Nothing
+
+void dcache_dump()
+{
+	acquire_lock(&dcache_mutex);
+
+	kprintf("dcache: %d entries, %d of them negative, %d evictions\n", dcache_count, dcache_negative, (uint32_t)dcache_evictions);
+
+	size_t i;
+	uint64_t hits, lookups;
+	for(i = 0; i < DCACHE_DEPTHS; i++)
+	{
+		hits = dcache_stats[i].hits + dcache_stats[i].negative_hits;
+		lookups = hits + dcache_stats[i].misses;
+		if(!lookups)
+			continue;
+
+		kprintf("dcache: component %d%s: %d hits, %d negative hits, %d misses, %d%% hit rate\n", i, (i == DCACHE_DEPTHS - 1) ? " and deeper" : "", (uint32_t)dcache_stats[i].hits, (uint32_t)dcache_stats[i].negative_hits, (uint32_t)dcache_stats[i].misses, (uint32_t)((hits * 100) / lookups));
+	}
+
+	release_lock(&dcache_mutex);
+}
+
+/* Internal Functions */
+
+// dcache_hash(): Hashes a name within a directory
+// Param:	mountpoint_t *mountpoint - mountpoint of the directory
+// Param:	ino_t parent - inode of the directory
+// Param:	const char *name - name of the entry
+// Return:	uint32_t - hash
+
+uint32_t dcache_hash(mountpoint_t *mountpoint, ino_t parent, const char *name)
+{
+	// FNV-1a over the name, then mix in where it is
+	uint32_t hash = 2166136261;
+	while(name[0])
+	{
+		hash ^= (uint8_t)name[0];
+		hash *= 16777619;
+		name++;
+	}
+
+	hash ^= (uint32_t)parent * 0x9E3779B1;
+	hash ^= (uint32_t)((size_t)mountpoint >> 4);
+	return hash;
+}
+
+// dcache_find(): Finds an entry, called with the lock held
+// Param:	mountpoint_t *mountpoint - mountpoint of the directory
+// Param:	ino_t parent - inode of the directory
+// Param:	const char *name - name of the entry
+// Param:	uint32_t hash - hash from dcache_hash()
+// Return:	dentry_t * - entry, NULL if not cached
+
+dentry_t *dcache_find(mountpoint_t *mountpoint, ino_t parent, const char *name, uint32_t hash)
+{
+	dentry_t *dentry = dcache_hash_table[hash % DCACHE_HASH];
+	while(dentry)
+	{
+		if(dentry->hash == hash && dentry->parent == parent && dentry->mountpoint == mountpoint && strcmp(dentry->name, name) == 0)
+			return dentry;
+
+		dentry = dentry->hash_next;
+	}
+
+	return NULL;
+}
+
+// dcache_unlink(): Takes an entry out of the hash table and the LRU list
+// Param:	dentry_t *dentry - entry
+// Return:	Nothing
+
+void dcache_unlink(dentry_t *dentry)
+{
+	dentry_t **link = &dcache_hash_table[dentry->hash % DCACHE_HASH];
+	while(link[0] != dentry)
+		link = &link[0]->hash_next;
+
+	link[0] = dentry->hash_next;
+
+	if(dentry->lru_prev)
+		dentry->lru_prev->lru_next = dentry->lru_next;
+	else
+		dcache_lru = dentry->lru_next;
+
+	if(dentry->lru_next)
+		dentry->lru_next->lru_prev = dentry->lru_prev;
+	else
+		dcache_lru_tail = dentry->lru_prev;
+
+	dcache_count--;
+	if(!dentry->inode)
+		dcache_negative--;
+}
+
+// dcache_link(): Puts an entry in the hash table, at the front of the LRU list
+// Param:	dentry_t *dentry - entry
+// Return:	Nothing
+
+void dcache_link(dentry_t *dentry)
+{
+	size_t bucket = dentry->hash % DCACHE_HASH;
+	dentry->hash_next = dcache_hash_table[bucket];
+	dcache_hash_table[bucket] = dentry;
+
+	dentry->lru_prev = NULL;
+	dentry->lru_next = dcache_lru;
+	if(dcache_lru)
+		dcache_lru->lru_prev = dentry;
+	else
+		dcache_lru_tail = dentry;
+
+	dcache_lru = dentry;
+
+	dcache_count++;
+	if(!dentry->inode)
+		dcache_negative++;
+}
+
@@ -122,17 +122,17 @@ ssize_t devfs_read(int handle, char *buffer, size_t count)
 	uint16_t *word;
 	uint32_t *dword;
 
-	if(strcmp(files[handle].path, "/dev/vesafb") == 0)
+	if(strcmp(files[handle]->path, "/dev/vesafb") == 0)
 	{
-		void *framebuffer = (void*)HW_FRAMEBUFFER + files[handle].position;
+		void *framebuffer = (void*)hw_framebuffer + files[handle]->position;
 		memcpy(buffer, framebuffer, count);
 
-		files[handle].position += count;
+		files[handle]->position += count;
 		release_lock(&vfs_mutex);
 		return count;
-	} else if(strcmp(files[handle].path, "/dev/initrd") == 0)
+	} else if(strcmp(files[handle]->path, "/dev/initrd") == 0)
 	{
-		blkdev_base = (uint64_t)files[handle].position;
+		blkdev_base = (uint64_t)files[handle]->position;
 		blkdev_status = blkdev_read_bytes(0, blkdev_base, count, buffer);
 		release_lock(&vfs_mutex);
 
@@ -140,13 +140,13 @@ ssize_t devfs_read(int handle, char *buffer, size_t count)
 			return count;
 		else
 			return EIO;
-	} else if(strcmp(files[handle].path, "/dev/zero") == 0 || strcmp(files[handle].path, "/dev/null") == 0)
+	} else if(strcmp(files[handle]->path, "/dev/zero") == 0 || strcmp(files[handle]->path, "/dev/null") == 0)
 	{
 		// simply put zeroes
 		memset(buffer, 0, count);
 		release_lock(&vfs_mutex);
 		return count;
-	} else if(strcmp(files[handle].path, "/dev/random") == 0 || strcmp(files[handle].path, "/dev/urandom") == 0)
+	} else if(strcmp(files[handle]->path, "/dev/random") == 0 || strcmp(files[handle]->path, "/dev/urandom") == 0)
 	{
 		// random numbers here
 		while(random_count < count)
@@ -157,24 +157,24 @@ ssize_t devfs_read(int handle, char *buffer, size_t count)
 
 		release_lock(&vfs_mutex);
 		return count;
-	} else if(strcmp(files[handle].path, "/dev/port") == 0)
+	} else if(strcmp(files[handle]->path, "/dev/port") == 0)
 	{
 		// read from I/O port here
 		if(count == 1)
 		{
 			byte = (uint8_t*)buffer;
-			byte[0] = inb((uint16_t)files[handle].position);
+			byte[0] = inb((uint16_t)files[handle]->position);
 		} else if(count == 2)
 		{
 			word = (uint16_t*)buffer;
-			word[0] = inw((uint16_t)files[handle].position);
+			word[0] = inw((uint16_t)files[handle]->position);
 		} else if(count == 4)
 		{
 			dword = (uint32_t*)buffer;
-			dword[0] = ind((uint16_t)files[handle].position);
+			dword[0] = ind((uint16_t)files[handle]->position);
 		} else
 		{
-			kprintf("devfs: attempted to read undefined size %d from I/O port 0x%xw\n", count, (uint16_t)files[handle].position);
+			kprintf("devfs: attempted to read undefined size %d from I/O port 0x%xw\n", count, (uint16_t)files[handle]->position);
 			release_lock(&vfs_mutex);
 			return EIO;
 		}
@@ -195,52 +195,64 @@ ssize_t devfs_read(int handle, char *buffer, size_t count)
 
 ssize_t devfs_write(int handle, char *buffer, size_t count)
 {
+	int blkdev_status;
+	uint64_t blkdev_base;
 	uint8_t *byte;
 	uint16_t *word;
 	uint32_t *dword;
 
 	// handle framebuffer first for graphics performance later on
-	if(strcmp(files[handle].path, "/dev/vesafb") == 0)
+	if(strcmp(files[handle]->path, "/dev/vesafb") == 0)
 	{
-		void *framebuffer = (void*)HW_FRAMEBUFFER + files[handle].position;
+		void *framebuffer = (void*)hw_framebuffer + files[handle]->position;
 		memcpy(framebuffer, buffer, count);
 
-		files[handle].position += count;
+		files[handle]->position += count;
 		release_lock(&vfs_mutex);
 		return count;
-	} else if(strcmp(files[handle].path, "/dev/zero") == 0 || strcmp(files[handle].path, "/dev/null") == 0)
+	} else if(strcmp(files[handle]->path, "/dev/initrd") == 0)
+	{
+		blkdev_base = (uint64_t)files[handle]->position;
+		blkdev_status = blkdev_write_bytes(0, blkdev_base, count, buffer);
+		release_lock(&vfs_mutex);
+
+		if(blkdev_status == 0)
+			return count;
+		else
+			return EIO;
+	} else if(strcmp(files[handle]->path, "/dev/zero") == 0 || strcmp(files[handle]->path, "/dev/null") == 0)
 	{
 		// don't do anything, but return success
 		release_lock(&vfs_mutex);
 		return count;
-	} else if(strcmp(files[handle].path, "/dev/tty") == 0)
+	} else if(strcmp(files[handle]->path, "/dev/tty") == 0)
 	{
 		tty_write(buffer, count, get_tty());
 		release_lock(&vfs_mutex);
 		return count;
-	} else if(memcmp(files[handle].path, "/dev/tty", 8) == 0)
+	} else if(memcmp(files[handle]->path, "/dev/tty", 8) == 0)
 	{
-		tty_write(buffer, count, (size_t)files[handle].path[8] - 48);
+		tty_write(buffer, count, (size_t)files[handle]->path[8] - 48);
 		release_lock(&vfs_mutex);
 		return count;
-	} else if(strcmp(files[handle].path, "/dev/port") == 0)
+	} else if(strcmp(files[handle]->path, "/dev/port") == 0)
 	{
 		// write to I/O ports here!
 		if(count == 1)
 		{
 			byte = (uint8_t*)buffer;
-			outb((uint16_t)files[handle].position, byte[0]);
+			outb((uint16_t)files[handle]->position, byte[0]);
 		} else if(count == 2)
 		{
 			word = (uint16_t*)buffer;
-			outw((uint16_t)files[handle].position, word[0]);
+			outw((uint16_t)files[handle]->position, word[0]);
 		} else if(count == 4)
 		{
 			dword = (uint32_t*)buffer;
-			outd((uint16_t)files[handle].position, dword[0]);
+			outd((uint16_t)files[handle]->position, dword[0]);
 		} else
 		{
-			kprintf("devfs: attempted to write undefined size %d to I/O port 0x%xw\n", count, (uint16_t)files[handle].position);
+			kprintf("devfs: attempted to write undefined size %d to I/O port 0x%xw\n", count, (uint16_t)files[handle]->position);
 			release_lock(&vfs_mutex);
 			return EIO;
 		}
@@ -11,14 +11,117 @@
 #include <kprintf.h>
 #include <mm.h>
 #include <string.h>
+#include <lock.h>
+#include <dcache.h>
 
 int ext2_read_superblock(mountpoint_t *, ext2_superblock_t *);
 int ext2_get_inode(mountpoint_t *, const char *, uint32_t *);
-int ext2_read_block(mountpoint_t *, ext2_superblock_t *, uint32_t, uint32_t, void *);
-int ext2_read_metadata(mountpoint_t *, ext2_superblock_t *, uint32_t, ext2_inode_t *);
-int ext2_read_inode(mountpoint_t *, ext2_superblock_t *, ext2_inode_t *, void *);
-int ext2_read_singly(mountpoint_t *, ext2_superblock_t *, uint32_t, void *, size_t *);
-int ext2_read_doubly(mountpoint_t *, ext2_superblock_t *, uint32_t, void *, size_t *);
+int ext2_find_entry(mountpoint_t *, uint32_t, const char *, uint32_t *);
+int ext2_read_block(mountpoint_t *, uint32_t, uint32_t, void *);
+int ext2_read_metadata(mountpoint_t *, uint32_t, ext2_inode_t *);
+int ext2_read_inode(mountpoint_t *, ext2_inode_t *, void *);
+int ext2_read_singly(mountpoint_t *, uint32_t, void *, size_t *);
+int ext2_read_doubly(mountpoint_t *, uint32_t, void *, size_t *);
+int ext2_write_block(mountpoint_t *, uint32_t, uint32_t, void *);
+int ext2_file_block(mountpoint_t *, ext2_inode_t *, uint32_t, uint32_t *);
+int ext2_page_io(mountpoint_t *, uint32_t, size_t, void *, int);
+int ext2_iget(mountpoint_t *, uint32_t, ext2_cached_inode_t **);
+void ext2_iput(mountpoint_t *, ext2_cached_inode_t *);
+ext2_cached_inode_t *ext2_icache_find(ext2_mount_t *, uint32_t);
+void ext2_icache_unlink(ext2_mount_t *, ext2_cached_inode_t *);
+void ext2_icache_link(ext2_mount_t *, ext2_cached_inode_t *);
+
+// ext2_mount(): Reads and checks the superblock and block group descriptors
+// Called by mount() without vfs_mutex, since the device is read through the VFS
+// Param:	mountpoint_t *mountpoint - mountpoint, with the device filled in
+// Return:	int - status code
+
+int ext2_mount(mountpoint_t *mountpoint)
+{
+	ext2_mount_t *ext2 = kcalloc(1, sizeof(ext2_mount_t));
+	if(!ext2)
+		return ENOMEM;
+
+	ext2_superblock_t *superblock = &ext2->superblock;
+	int status = ext2_read_superblock(mountpoint, superblock);
+	if(status != 0)
+	{
+		kfree(ext2);
+		return status;
+	}
+
+	if(superblock->ext2_magic != EXT2_MAGIC)
+	{
+		kprintf("ext2: %s has bad magic 0x%xw, not ext2\n", mountpoint->device, superblock->ext2_magic);
+		kfree(ext2);
+		return EINVAL;
+	}
+
+	if(superblock->version_high >= 1 && (superblock->required_features & ~EXT2_FEATURES_SUPPORTED))
+	{
+		kprintf("ext2: %s needs unsupported features 0x%xd\n", mountpoint->device, superblock->required_features & ~EXT2_FEATURES_SUPPORTED);
+		kfree(ext2);
+		return EINVAL;
+	}
+
+	if(superblock->block_size > EXT2_MAX_BLOCK_SIZE || !superblock->blocks_per_group || !superblock->inodes_per_group || superblock->total_blocks <= superblock->superblock_number)
+		goto corrupt;
+
+	ext2->block_size = 1024 << superblock->block_size;
+	ext2->inode_size = 128;		// ext2 < v1.0
+	if(superblock->version_high >= 1)
+		ext2->inode_size = (uint32_t)superblock->inode_struct_size;
+
+	// inodes never get smaller than in v0, and are a power of two
+	if(ext2->inode_size < 128 || ext2->inode_size > ext2->block_size || (ext2->inode_size & (ext2->inode_size - 1)))
+		goto corrupt;
+
+	ext2->inodes_per_group = superblock->inodes_per_group;
+	ext2->pointers_per_block = ext2->block_size / sizeof(uint32_t);
+	ext2->first_block = superblock->superblock_number;
+	ext2->group_count = (superblock->total_blocks - ext2->first_block + superblock->blocks_per_group - 1) / superblock->blocks_per_group;
+
+	if((uint64_t)ext2->group_count * ext2->inodes_per_group < superblock->total_inodes)
+		goto corrupt;
+
+	// the descriptor table starts in the block after the superblock
+	uint32_t table_blocks = ((ext2->group_count * sizeof(ext2_block_group_t)) + ext2->block_size - 1) / ext2->block_size;
+	ext2->groups = kmalloc(table_blocks * ext2->block_size);
+	if(!ext2->groups)
+	{
+		kfree(ext2);
+		return ENOMEM;
+	}
+
+	mountpoint->fs_data = ext2;
+	status = ext2_read_block(mountpoint, ext2->first_block + 1, table_blocks, ext2->groups);
+	if(status != 0)
+	{
+		mountpoint->fs_data = NULL;
+		kfree(ext2->groups);
+		kfree(ext2);
+		return status;
+	}
+
+	size_t i;
+	for(i = 0; i < ext2->group_count; i++)
+	{
+		if(!ext2->groups[i].inode_table || ext2->groups[i].inode_table >= superblock->total_blocks)
+		{
+			mountpoint->fs_data = NULL;
+			kfree(ext2->groups);
+			goto corrupt;
+		}
+	}
+
+	kprintf("ext2: %s has %d-byte blocks, %d-byte inodes, %d block groups\n", mountpoint->device, ext2->block_size, ext2->inode_size, ext2->group_count);
+	return 0;
+
+corrupt:
+	kprintf("ext2: %s has a corrupt superblock\n", mountpoint->device);
+	kfree(ext2);
+	return EINVAL;
+}
 
 // ext2_stat(): Returns stat() information for a file on an ext2 volume
 // Param:	mountpoint_t *mountpoint - pointer to mountpoint structure
@@ -35,29 +138,14 @@ int ext2_stat(mountpoint_t *mountpoint, const char *path, struct stat *destinati
 	if(status != 0)
 		return status;
 
-	// read the superblock to determine inode size
-	// then we can read the inode metadata, which has what we need for stat()
-	ext2_superblock_t *superblock = kmalloc(1024);
-	status = ext2_read_superblock(mountpoint, superblock);
-	if(status != 0)
-	{
-		kfree(superblock);
-		return status;
-	}
+	// the inode metadata has what we need for stat()
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
+	ext2_inode_t *metadata = scratch_alloc(sizeof(ext2_inode_t));
 
-	uint32_t inode_size = 128;
-	if(superblock->version_high >= 1)
-		inode_size = (uint32_t)superblock->inode_struct_size;
-
-	// allocate space for the inode metadata
-	ext2_inode_t *metadata = kmalloc(inode_size);
-
-	// and read the metadata
-	status = ext2_read_metadata(mountpoint, superblock, inode_index, metadata);
+	status = ext2_read_metadata(mountpoint, inode_index, metadata);
 	if(status != 0)
 	{
-		kfree(superblock);
-		kfree(metadata);
+		scratch_free(metadata);
 		return status;
 	}
 
@@ -70,7 +158,7 @@ int ext2_stat(mountpoint_t *mountpoint, const char *path, struct stat *destinati
 	destination->st_mtime = metadata->mtime;
 	destination->st_ctime = metadata->ctime;
 	destination->st_atime = metadata->atime;
-	destination->st_blksize = 1024 << superblock->block_size;
+	destination->st_blksize = ext2->block_size;
 	destination->st_blocks = (destination->st_size + destination->st_blksize - 1) / destination->st_blksize;
 
 	destination->st_mode = 0;
@@ -130,8 +218,7 @@ int ext2_stat(mountpoint_t *mountpoint, const char *path, struct stat *destinati
 	if(metadata->type & EXT2_EXECUTE_OTHER)
 		destination->st_mode |= S_IXOTH;
 
-	kfree(superblock);
-	kfree(metadata);
+	scratch_free(metadata);
 	return 0;
 }
 
@@ -144,43 +231,30 @@ int ext2_stat(mountpoint_t *mountpoint, const char *path, struct stat *destinati
 
 ssize_t ext2_read(mountpoint_t *mountpoint, file_handle_t *file, void *buffer, size_t count)
 {
-	if(file->present != 1 || !file->flags & O_RDONLY)
+	if(!file->flags & O_RDONLY)
 		return EBADF;
 
-	ext2_superblock_t *superblock = kmalloc(1024);
-	int status = ext2_read_superblock(mountpoint, superblock);
-	if(status != 0)
-		return status;
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
 
 	// get the file's inode number
 	uint32_t inode_index;
-	status = ext2_get_inode(mountpoint, file->path, &inode_index);
+	int status = ext2_get_inode(mountpoint, file->path, &inode_index);
 	if(status != 0)
-	{
-		kfree(superblock);
 		return status;
-	}
 
 	// read the metadata
-	uint32_t inode_size = 128;
-	if(superblock->version_high >= 1)
-		inode_size = (uint32_t)superblock->inode_struct_size;
-
-	// allocate space for the inode metadata
-	ext2_inode_t *metadata = kmalloc(inode_size);
-	status = ext2_read_metadata(mountpoint, superblock, inode_index, metadata);
+	ext2_inode_t *metadata = scratch_alloc(sizeof(ext2_inode_t));
+	status = ext2_read_metadata(mountpoint, inode_index, metadata);
 	if(status != 0)
 	{
-		kfree(superblock);
-		kfree(metadata);
+		scratch_free(metadata);
 		return status;
 	}
 
 	// determine how much is readable
 	if(file->position >= metadata->size_low)
 	{
-		kfree(superblock);
-		kfree(metadata);
+		scratch_free(metadata);
 		return EIO;
 	}
 
@@ -191,13 +265,12 @@ ssize_t ext2_read(mountpoint_t *mountpoint, file_handle_t *file, void *buffer, s
 	// code ASAP.
 
 	// read the file
-	void *tmp_buffer = kmalloc(metadata->size_low + (1024 << superblock->block_size));
-	status = ext2_read_inode(mountpoint, superblock, metadata, tmp_buffer);
+	void *tmp_buffer = scratch_alloc(metadata->size_low + ext2->block_size);
+	status = ext2_read_inode(mountpoint, metadata, tmp_buffer);
 	if(status != 0)
 	{
-		kfree(superblock);
-		kfree(metadata);
-		kfree(tmp_buffer);
+		scratch_free(metadata);
+		scratch_free(tmp_buffer);
 		return EIO;
 	}
 
@@ -205,15 +278,63 @@ ssize_t ext2_read(mountpoint_t *mountpoint, file_handle_t *file, void *buffer, s
 	memcpy(buffer, tmp_buffer + file->position, count);
 	file->position += count;
 
-	kfree(superblock);
-	kfree(metadata);
-	kfree(tmp_buffer);
+	scratch_free(metadata);
+	scratch_free(tmp_buffer);
 	return count;
 }
 
+// ext2_read_page(): Reads one page of a file, for the page cache
+// Param:	mountpoint_t *mountpoint - pointer to mountpoint structure
+// Param:	uint32_t inode - inode number of the file
+// Param:	size_t page - page number within the file
+// Param:	void *destination - PAGE_SIZE bytes to read into, zeroed past the end of file
+// Return:	int - status code
+
+int ext2_read_page(mountpoint_t *mountpoint, uint32_t inode, size_t page, void *destination)
+{
+	return ext2_page_io(mountpoint, inode, page, destination, 0);
+}
+
+// ext2_write_page(): Writes one page of a file back, for the page cache
+// Only blocks the file already has are written, nothing is allocated
+// Param:	mountpoint_t *mountpoint - pointer to mountpoint structure
+// Param:	uint32_t inode - inode number of the file
+// Param:	size_t page - page number within the file
+// Param:	void *source - PAGE_SIZE bytes to write
+// Return:	int - status code
+
+int ext2_write_page(mountpoint_t *mountpoint, uint32_t inode, size_t page, void *source)
+{
+	return ext2_page_io(mountpoint, inode, page, source, 1);
+}
+
+// ext2_dump(): Shows how well the inode cache of each volume does
+// Param:	Nothing
+// Return:	Nothing
+
+void ext2_dump()
+{
+	size_t i;
+	ext2_mount_t *ext2;
+	uint64_t lookups;
+
+	for(i = 0; i < MAX_MOUNTPOINTS; i++)
+	{
+		if(!mountpoints[i] || mountpoints[i]->present != 1 || !mountpoints[i]->fs_data || strcmp(mountpoints[i]->fstype, "ext2") != 0)
+			continue;
+
+		ext2 = (ext2_mount_t*)mountpoints[i]->fs_data;
+		lookups = ext2->inode_hits + ext2->inode_misses;
+		if(!lookups)
+			lookups = 1;
+
+		kprintf("ext2: %s: %d inodes cached, %d hits, %d misses, %d%% hit rate, %d evictions\n", mountpoints[i]->device, ext2->inode_count, (uint32_t)ext2->inode_hits, (uint32_t)ext2->inode_misses, (uint32_t)((ext2->inode_hits * 100) / lookups), (uint32_t)ext2->inode_evictions);
+	}
+}
+
 /* Internal Functions */
 
-// ext2_read_superblock(): Returns the superblock & block group descriptor table
+// ext2_read_superblock(): Reads the superblock, only done by ext2_mount()
 // Param:	mountpoint_t *mountpoint - pointer to mountpoint structure
 // Param:	ext2_superblock_t *destination - where to store superblock
 // Return:	int - status code
@@ -248,6 +369,8 @@ int ext2_read_superblock(mountpoint_t *mountpoint, ext2_superblock_t *destinatio
 }
 
 // ext2_get_inode(): Returns the inode number of a file/directory
+// Each component is looked up in the dentry cache first, and only a miss reads
+// the directory; what it finds, or doesn't, is added to the cache
 // Param:	mountpoint_t *mountpoint - pointer to mountpoint structure
 // Param:	const char *path - path of file/directory
 // Param:	uint32_t *destination - where to store inode number
@@ -256,146 +379,142 @@ int ext2_read_superblock(mountpoint_t *mountpoint, ext2_superblock_t *destinatio
 int ext2_get_inode(mountpoint_t *mountpoint, const char *path, uint32_t *destination)
 {
 	path += strlen(mountpoint->path);
+	while(path[0] == '/')
+		path++;
 
-	// read the superblock
-	ext2_superblock_t *superblock = kmalloc(sizeof(ext2_superblock_t));
-	int status = ext2_read_superblock(mountpoint, superblock);
-	if(status != 0)
-		return status;
+	if(path[0] == 0)
+		return 1;
 
 	// start at the root directory
 	uint32_t inode = EXT2_ROOT_INODE;
-	ext2_inode_t *inode_metadata;
-
-	if(superblock->version_high >= 1)
-		inode_metadata = kmalloc(superblock->inode_struct_size);
-	else
-		inode_metadata = kmalloc(128);
+	uint32_t child;
+	ino_t cached;
+	char name[256];
+	size_t length, depth = 0;
+	int status;
 
-	ext2_directory_t *dir = kcalloc(sizeof(ext2_directory_t) + 512, 512);
-	status = ext2_read_metadata(mountpoint, superblock, inode, inode_metadata);
-	if(status != 0)
+	while(path[0] != 0)
 	{
-		kfree(superblock);
-		kfree(dir);
-		kfree(inode_metadata);
-		return status;
-	}
+		length = 0;
+		while(path[length] != '/' && path[length] != 0)
+			length++;
 
-	status = ext2_read_inode(mountpoint, superblock, inode_metadata, dir);
-	if(status != 0)
-	{
-		kfree(superblock);
-		kfree(dir);
-		kfree(inode_metadata);
-		return status;
-	}
+		if(length > 255)
+			return ENAMETOOLONG;
 
-	char path_ent[64];
-	size_t i = 0;
-	char last_ent = 0;		// set to 1 when this is the last entry
-	ext2_directory_t *dirent;
+		memcpy(name, path, length);
+		name[length] = 0;
 
-	dirent = dir;
+		path += length;
+		while(path[0] == '/')
+			path++;
 
-find_ent:
+		status = dcache_lookup(mountpoint, inode, name, depth, &cached);
+		if(status == DCACHE_NEGATIVE)
+			return 1;
 
-	i = 0;
+		if(status == DCACHE_HIT)
+		{
+			child = (uint32_t)cached;
+		} else
+		{
+			status = ext2_find_entry(mountpoint, inode, name, &child);
+			if(status != 0)
+				return status;
 
-	if(path[0] == 0)
-	{
-		kfree(dir);
-		kfree(superblock);
-		return 1;
-	}
+			dcache_add(mountpoint, inode, name, child);
+			if(!child)
+				return 1;
+		}
 
-	while(path[0] != '/' && path[0] != 0)
-	{
-		path_ent[i] = path[0];
-		path++;
-		i++;
+		inode = child;
+		depth++;
 	}
 
-	if(path[0] == 0)
-		last_ent = 1;
-	else
-		path++;
+	destination[0] = inode;
+	return 0;
+}
+
+// ext2_find_entry(): Looks up a name in a directory
+// Param:	mountpoint_t *mountpoint - pointer to mountpoint structure
+// Param:	uint32_t directory - inode number of the directory
+// Param:	const char *name - name to look up
+// Param:	uint32_t *destination - where to store inode number, zero if not found
+// Return:	int - status code
 
-	path_ent[i] = 0;
+int ext2_find_entry(mountpoint_t *mountpoint, uint32_t directory, const char *name, uint32_t *destination)
+{
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
+	destination[0] = 0;
 
-	//kprintf("ext2: search directory for %s\n", path_ent);
+	ext2_inode_t *metadata = scratch_alloc(sizeof(ext2_inode_t));
+	int status = ext2_read_metadata(mountpoint, directory, metadata);
+	if(status != 0)
+	{
+		scratch_free(metadata);
+		return status;
+	}
 
-	while(dirent->entry_size != 0)
+	// make sure it is a directory
+	if((metadata->type >> 12) != EXT2_DIR)
 	{
-		if(strcmp(dirent->file_name, path_ent) == 0)
-			goto found_ent;
+		scratch_free(metadata);
+		return ENOTDIR;
+	}
 
-		dirent = (ext2_directory_t*)((size_t)dirent + dirent->entry_size);
+	// whole blocks are read
+	size_t size = metadata->size_low;
+	void *entries = scratch_alloc(size + ext2->block_size);
+	status = ext2_read_inode(mountpoint, metadata, entries);
+	if(status != 0)
+	{
+		scratch_free(entries);
+		scratch_free(metadata);
+		return status;
 	}
 
-	//kprintf("ext2: entry %s not found\n", path_ent);
-	kfree(dir);
-	kfree(superblock);
-	kfree(inode_metadata);
-	return 1;
+	// names aren't null-terminated on disk
+	size_t length = strlen(name);
+	size_t offset = 0;
+	ext2_directory_t *dirent;
 
-found_ent:
-	if(last_ent == 1)
-	{
-		destination[0] = dirent->inode;
-		kfree(dir);
-		kfree(superblock);
-		kfree(inode_metadata);
-		return 0;
-	} else
+	while(offset + sizeof(ext2_directory_t) <= size)
 	{
-		// read the next inode metadata
-		inode = dirent->inode;
-		status = ext2_read_metadata(mountpoint, superblock, inode, inode_metadata);
-		if(status != 0)
-		{
-			kfree(superblock);
-			kfree(dir);
-			kfree(inode_metadata);
-			return status;
-		}
+		dirent = (ext2_directory_t*)(entries + offset);
 
-		status = ext2_read_inode(mountpoint, superblock, inode_metadata, dir);
-		if(status != 0)
-		{
-			kfree(superblock);
-			kfree(dir);
-			kfree(inode_metadata);
-			return status;
-		}
+		// a corrupt entry must not take the name outside itself or the directory
+		if(dirent->entry_size < sizeof(ext2_directory_t) || offset + dirent->entry_size > size)
+			break;
+
+		if(sizeof(ext2_directory_t) + dirent->name_length > dirent->entry_size)
+			break;
 
-		// make sure it is a directory
-		if((inode_metadata->type >> 12) != EXT2_DIR)
+		if(dirent->inode && dirent->name_length == length && memcmp(dirent->file_name, name, length) == 0)
 		{
-			kfree(superblock);
-			kfree(dir);
-			kfree(inode_metadata);
-			return ENOTDIR;
+			destination[0] = dirent->inode;
+			break;
 		}
 
-		dirent = dir;
-		goto find_ent;
+		offset += dirent->entry_size;
 	}
+
+	scratch_free(entries);
+	scratch_free(metadata);
+	return 0;
 }
 
 // ext2_read_block(): Reads a block
 // Param:	mountpoint_t *mountpoint - mountpoint
-// Param:	ext2_superblock_t *superblock - superblock
 // Param:	uint32_t block - block address
 // Param:	uint32_t count - block count
 // Param:	void *destination - destination to read
 // Return:	int - return status
 
-int ext2_read_block(mountpoint_t *mountpoint, ext2_superblock_t *superblock, uint32_t block, uint32_t count, void *destination)
+int ext2_read_block(mountpoint_t *mountpoint, uint32_t block, uint32_t count, void *destination)
 {
-	uint32_t block_size = 1024 << superblock->block_size;
-	off_t byte_offset = block * block_size;
-	size_t byte_count = count * block_size;
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
+	off_t byte_offset = block * ext2->block_size;
+	size_t byte_count = count * ext2->block_size;
 
 	int handle;
 	handle = open(mountpoint->device, O_RDONLY);
@@ -424,84 +543,222 @@ int ext2_read_block(mountpoint_t *mountpoint, ext2_superblock_t *superblock, uin
 }
 
 // ext2_read_metadata(): Reads an inode's metadata
+// Only ext2_inode_t is copied, ext2->inode_size is just the on-disk stride and
+// the fields of larger inodes past it aren't used
 // Param:	mountpoint_t *mountpoint - mountpoint
-// Param:	ext2_superblock_t *superblock - superblock
 // Param:	uint32_t inode - inode number
-// Param:	ext2_inode_t *destination - destination buffer
+// Param:	ext2_inode_t *destination - destination, sizeof(ext2_inode_t) bytes
 // Return:	int - status
 
-int ext2_read_metadata(mountpoint_t *mountpoint, ext2_superblock_t *superblock, uint32_t inode, ext2_inode_t *destination)
+int ext2_read_metadata(mountpoint_t *mountpoint, uint32_t inode, ext2_inode_t *destination)
 {
-	inode--;		// because inode numbering starts at one
-	uint32_t block_group = inode / superblock->inodes_per_group;
-
-	// read the block group descriptor table
-	uint32_t block_table_address, block_size;
-	block_size = 1024 << superblock->block_size;
-	if(block_size == 1024)
-		block_table_address = 2;
-	else
-		block_table_address = 1;
+	ext2_cached_inode_t *cached;
+	int status = ext2_iget(mountpoint, inode, &cached);
+	if(status != 0)
+		return status;
 
-	// determine how many block groups there are
-	uint32_t block_group_count;
+	memcpy(destination, &cached->inode, sizeof(ext2_inode_t));
+	ext2_iput(mountpoint, cached);
+	return 0;
+}
 
-	block_group_count = superblock->total_blocks / superblock->blocks_per_group;
-	block_group_count++;
+// ext2_iget(): Returns an inode from the inode cache, reading it on a miss
+// Inodes are found through a hash table and kept on an LRU list, most recently
+// used first. A miss reads only the block holding the inode, without the
+// cache's lock, since that goes through the VFS; if another CPU read the same
+// inode meanwhile, its copy is used. Once EXT2_INODE_CACHE inodes are cached,
+// the least recently used one nobody holds makes room for the next.
+// Param:	mountpoint_t *mountpoint - mountpoint
+// Param:	uint32_t number - inode number
+// Param:	ext2_cached_inode_t **destination - where to store the held inode
+// Return:	int - status
 
-	ext2_block_group_t *block_groups = kcalloc(sizeof(ext2_block_group_t), block_group_count);
+int ext2_iget(mountpoint_t *mountpoint, uint32_t number, ext2_cached_inode_t **destination)
+{
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
 
-	int status;
-	status = ext2_read_block(mountpoint, superblock, block_table_address, ((block_group_count * sizeof(ext2_block_group_t)) + block_size - 1) / block_size, block_groups);
-	if(status != 0)
+	if(!number || number > ext2->superblock.total_inodes)
 	{
-		kprintf("ext2: unable to read inode %d\n", inode+1);
-		kfree(block_groups);
-		return status;
+		kprintf("ext2: inode %d doesn't exist on %s\n", number, mountpoint->device);
+		return EIO;
 	}
 
-	// get inode index block address
-	uint32_t inode_index = block_groups[block_group].inode_table;
-	kfree(block_groups);
+	acquire_lock(&ext2->inode_lock);
 
-	uint32_t inode_size = 128;		// ext2 < v1.0
-	if(superblock->version_high >= 1)
-		inode_size = (uint32_t)superblock->inode_struct_size;
+	ext2_cached_inode_t *cached = ext2_icache_find(ext2, number);
+	if(cached)
+	{
+		cached->refcount++;
+		ext2_icache_unlink(ext2, cached);
+		ext2_icache_link(ext2, cached);
+		ext2->inode_hits++;
+
+		release_lock(&ext2->inode_lock);
+		destination[0] = cached;
+		return 0;
+	}
+
+	ext2->inode_misses++;
+	release_lock(&ext2->inode_lock);
 
-	ext2_inode_t *inodes = kcalloc(inode_size, superblock->inodes_per_group);
-	uint32_t index = inode % superblock->inodes_per_group;
+	// find the block of the inode table that holds it
+	uint32_t group = (number - 1) / ext2->inodes_per_group;
+	size_t offset = (size_t)((number - 1) % ext2->inodes_per_group) * ext2->inode_size;
+	uint32_t block = ext2->groups[group].inode_table + (offset / ext2->block_size);
 
-	// read the inode table
-	status = ext2_read_block(mountpoint, superblock, inode_index, ((inode_size * superblock->inodes_per_group) + block_size - 1) / block_size, inodes);
+	void *buffer = scratch_alloc(ext2->block_size);
+	int status = ext2_read_block(mountpoint, block, 1, buffer);
 	if(status != 0)
 	{
-		kfree(inodes);
+		scratch_free(buffer);
 		return status;
 	}
 
-	// copy the requested inode
-	memcpy(destination, &inodes[index], inode_size);
-	kfree(inodes);
+	ext2_cached_inode_t *new_inode = kmalloc(sizeof(ext2_cached_inode_t));
+	if(!new_inode)
+	{
+		scratch_free(buffer);
+		return ENOMEM;
+	}
+
+	new_inode->number = number;
+	new_inode->refcount = 1;
+	memcpy(&new_inode->inode, buffer + (offset % ext2->block_size), sizeof(ext2_inode_t));
+	scratch_free(buffer);
+
+	acquire_lock(&ext2->inode_lock);
+
+	cached = ext2_icache_find(ext2, number);
+	if(cached)
+	{
+		cached->refcount++;
+		release_lock(&ext2->inode_lock);
+
+		kfree(new_inode);
+		destination[0] = cached;
+		return 0;
+	}
+
+	// make room, unless every inode is held
+	cached = ext2->inode_lru_tail;
+	while(ext2->inode_count >= EXT2_INODE_CACHE && cached)
+	{
+		ext2_cached_inode_t *previous = cached->lru_prev;
+		if(!cached->refcount)
+		{
+			ext2_icache_unlink(ext2, cached);
+			ext2->inode_evictions++;
+			kfree(cached);
+		}
+
+		cached = previous;
+	}
+
+	ext2_icache_link(ext2, new_inode);
+
+	release_lock(&ext2->inode_lock);
+	destination[0] = new_inode;
 	return 0;
 }
 
+// ext2_iput(): Drops a hold on a cached inode
+// Param:	mountpoint_t *mountpoint - mountpoint
+// Param:	ext2_cached_inode_t *cached - inode from ext2_iget()
+// Return:	Nothing
+
+void ext2_iput(mountpoint_t *mountpoint, ext2_cached_inode_t *cached)
+{
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
+
+	acquire_lock(&ext2->inode_lock);
+	if(cached->refcount)
+		cached->refcount--;
+	release_lock(&ext2->inode_lock);
+}
+
+// ext2_icache_find(): Finds a cached inode, called with the lock held
+// Param:	ext2_mount_t *ext2 - mount context
+// Param:	uint32_t number - inode number
+// Return:	ext2_cached_inode_t * - inode, NULL if not cached
+
+ext2_cached_inode_t *ext2_icache_find(ext2_mount_t *ext2, uint32_t number)
+{
+	ext2_cached_inode_t *cached = ext2->inode_hash[number % EXT2_INODE_HASH];
+	while(cached)
+	{
+		if(cached->number == number)
+			return cached;
+
+		cached = cached->hash_next;
+	}
+
+	return NULL;
+}
+
+// ext2_icache_unlink(): Takes an inode out of the hash table and the LRU list
+// Param:	ext2_mount_t *ext2 - mount context
+// Param:	ext2_cached_inode_t *cached - inode
+// Return:	Nothing
+
+void ext2_icache_unlink(ext2_mount_t *ext2, ext2_cached_inode_t *cached)
+{
+	ext2_cached_inode_t **link = &ext2->inode_hash[cached->number % EXT2_INODE_HASH];
+	while(link[0] != cached)
+		link = &link[0]->hash_next;
+
+	link[0] = cached->hash_next;
+
+	if(cached->lru_prev)
+		cached->lru_prev->lru_next = cached->lru_next;
+	else
+		ext2->inode_lru = cached->lru_next;
+
+	if(cached->lru_next)
+		cached->lru_next->lru_prev = cached->lru_prev;
+	else
+		ext2->inode_lru_tail = cached->lru_prev;
+
+	ext2->inode_count--;
+}
+
+// ext2_icache_link(): Puts an inode in the hash table, at the front of the LRU list
+// Param:	ext2_mount_t *ext2 - mount context
+// Param:	ext2_cached_inode_t *cached - inode
+// Return:	Nothing
+
+void ext2_icache_link(ext2_mount_t *ext2, ext2_cached_inode_t *cached)
+{
+	size_t hash = cached->number % EXT2_INODE_HASH;
+	cached->hash_next = ext2->inode_hash[hash];
+	ext2->inode_hash[hash] = cached;
+
+	cached->lru_prev = NULL;
+	cached->lru_next = ext2->inode_lru;
+	if(ext2->inode_lru)
+		ext2->inode_lru->lru_prev = cached;
+	else
+		ext2->inode_lru_tail = cached;
+
+	ext2->inode_lru = cached;
+	ext2->inode_count++;
+}
+
 // ext2_read_inode(): Reads contents of an inode
 // Param:	mountpoint_t *mountpoint - mountpoint
-// Param:	ext2_superblock_t *superblock - superblock
 // Param:	ext2_inode_t *inode - inode to read
 // Param:	void *destination - destination to read
 // Return:	int - return status
 
-int ext2_read_inode(mountpoint_t *mountpoint, ext2_superblock_t *superblock, ext2_inode_t *inode, void *destination)
+int ext2_read_inode(mountpoint_t *mountpoint, ext2_inode_t *inode, void *destination)
 {
 	// we have the actual inode metadata, read the direct blocks first
 	size_t direct_count = 0;
 	int status;
-	uint32_t block_size = 1024 << superblock->block_size;
+	uint32_t block_size = ((ext2_mount_t*)mountpoint->fs_data)->block_size;
 
 	while(direct_count < 12 && inode->direct_blocks[direct_count] != 0)
 	{
-		status = ext2_read_block(mountpoint, superblock, inode->direct_blocks[direct_count], 1, destination);
+		status = ext2_read_block(mountpoint, inode->direct_blocks[direct_count], 1, destination);
 		if(status != 0)
 			return status;
 
@@ -513,7 +770,7 @@ int ext2_read_inode(mountpoint_t *mountpoint, ext2_superblock_t *superblock, ext
 
 	if(inode->singly_block != 0)
 	{
-		status = ext2_read_singly(mountpoint, superblock, inode->singly_block, destination, &indirect_size);
+		status = ext2_read_singly(mountpoint, inode->singly_block, destination, &indirect_size);
 		if(status != 0)
 			return status;
 
@@ -522,7 +779,7 @@ int ext2_read_inode(mountpoint_t *mountpoint, ext2_superblock_t *superblock, ext
 
 	if(inode->doubly_block != 0)
 	{
-		status = ext2_read_doubly(mountpoint, superblock, inode->doubly_block, destination, &indirect_size);
+		status = ext2_read_doubly(mountpoint, inode->doubly_block, destination, &indirect_size);
 		if(status != 0)
 			return status;
 
@@ -540,25 +797,23 @@ int ext2_read_inode(mountpoint_t *mountpoint, ext2_superblock_t *superblock, ext
 
 // ext2_read_singly(): Reads a singly indirect block
 // Param:	mountpoint_t *mountpoint - mountpoint structure
-// Param:	ext2_superblock_t *superblock - superblock
 // Param:	uint32_t block - block number
 // Param:	void *destination - destination to read into
 // Param:	size_t *size - destination to store byte count
 // Return:	int - status code
 
-int ext2_read_singly(mountpoint_t *mountpoint, ext2_superblock_t *superblock, uint32_t block, void *destination, size_t *size)
+int ext2_read_singly(mountpoint_t *mountpoint, uint32_t block, void *destination, size_t *size)
 {
 	size[0] = 0;
 
-	size_t count;
-	uint32_t block_size = 1024 << superblock->block_size;
-
-	count = block_size / sizeof(uint32_t);		// number of block pointers
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
+	uint32_t block_size = ext2->block_size;
+	size_t count = ext2->pointers_per_block;
 
 	// read the singly block
-	uint32_t *singly_block = kmalloc(block_size);
+	uint32_t *singly_block = scratch_alloc(block_size);
 	int status;
-	status = ext2_read_block(mountpoint, superblock, block, 1, singly_block);
+	status = ext2_read_block(mountpoint, block, 1, singly_block);
 	if(status != 0)
 		return status;
 
@@ -566,7 +821,7 @@ int ext2_read_singly(mountpoint_t *mountpoint, ext2_superblock_t *superblock, ui
 	size_t i = 0;
 	while(i < count && singly_block[i] != 0)
 	{
-		status = ext2_read_block(mountpoint, superblock, singly_block[i], 1, destination);
+		status = ext2_read_block(mountpoint, singly_block[i], 1, destination);
 		if(status != 0)
 			return status;
 
@@ -575,31 +830,29 @@ int ext2_read_singly(mountpoint_t *mountpoint, ext2_superblock_t *superblock, ui
 		i++;
 	}
 
-	kfree(singly_block);
+	scratch_free(singly_block);
 	return 0;
 }
 
 // ext2_read_doubly(): Reads a doubly indirect block
 // Param:	mountpoint_t *mountpoint - mountpoint structure
-// Param:	ext2_superblock_t *superblock - superblock
 // Param:	uint32_t block - block number
 // Param:	void *destination - destination to read into
 // Param:	size_t *size - destination to store byte count
 // Return:	int - status code
 
-int ext2_read_doubly(mountpoint_t *mountpoint, ext2_superblock_t *superblock, uint32_t block, void *destination, size_t *size)
+int ext2_read_doubly(mountpoint_t *mountpoint, uint32_t block, void *destination, size_t *size)
 {
 	size[0] = 0;
 
-	size_t count;
-	uint32_t block_size = 1024 << superblock->block_size;
-
-	count = block_size / sizeof(uint32_t);		// number of block pointers
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
+	uint32_t block_size = ext2->block_size;
+	size_t count = ext2->pointers_per_block;
 
 	// read the doubly block
-	uint32_t *doubly_block = kmalloc(block_size);
+	uint32_t *doubly_block = scratch_alloc(block_size);
 	int status;
-	status = ext2_read_block(mountpoint, superblock, block, 1, doubly_block);
+	status = ext2_read_block(mountpoint, block, 1, doubly_block);
 	if(status != 0)
 		return status;
 
@@ -608,7 +861,7 @@ int ext2_read_doubly(mountpoint_t *mountpoint, ext2_superblock_t *superblock, ui
 	size_t entry_size;
 	while(i < count && doubly_block[i] != 0)
 	{
-		status = ext2_read_singly(mountpoint, superblock, doubly_block[i], destination, &entry_size);
+		status = ext2_read_singly(mountpoint, doubly_block[i], destination, &entry_size);
 		if(status != 0)
 			return status;
 
@@ -617,11 +870,199 @@ int ext2_read_doubly(mountpoint_t *mountpoint, ext2_superblock_t *superblock, ui
 		i++;
 	}
 
-	kfree(doubly_block);
+	scratch_free(doubly_block);
 	return 0;
 }
 
+// ext2_write_block(): Writes a block
+// Param:	mountpoint_t *mountpoint - mountpoint
+// Param:	uint32_t block - block address
+// Param:	uint32_t count - block count
+// Param:	void *source - source to write
+// Return:	int - return status
+
+int ext2_write_block(mountpoint_t *mountpoint, uint32_t block, uint32_t count, void *source)
+{
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
+	off_t byte_offset = block * ext2->block_size;
+	size_t byte_count = count * ext2->block_size;
+
+	int handle;
+	handle = open(mountpoint->device, O_RDWR);
+	if(handle < 0)
+	{
+		kprintf("ext2: failed to write block %d on device %s\n", block, mountpoint->device);
+		return EIO;
+	}
 
+	if(lseek(handle, byte_offset, SEEK_SET) != byte_offset)
+	{
+		kprintf("ext2: failed to write block %d on device %s\n", block, mountpoint->device);
+		close(handle);
+		return EIO;
+	}
+
+	if(write(handle, (char*)source, byte_count) != byte_count)
+	{
+		kprintf("ext2: failed to write block %d on device %s\n", block, mountpoint->device);
+		close(handle);
+		return EIO;
+	}
+
+	close(handle);
+	return 0;
+}
+
+// ext2_file_block(): Returns the block holding a given block of a file
+// Param:	mountpoint_t *mountpoint - mountpoint
+// Param:	ext2_inode_t *inode - inode metadata
+// Param:	uint32_t block - block number within the file
+// Param:	uint32_t *destination - where to store the block address, zero for a hole
+// Return:	int - status code
+
+int ext2_file_block(mountpoint_t *mountpoint, ext2_inode_t *inode, uint32_t block, uint32_t *destination)
+{
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
+	uint32_t block_size = ext2->block_size;
+	uint64_t count = ext2->pointers_per_block;
+	uint64_t index = block;
+	uint64_t span;			// file blocks under each pointer of the current level
+	uint32_t pointer;
+	int status;
+
+	if(index < 12)
+	{
+		destination[0] = inode->direct_blocks[index];
+		return 0;
+	}
+
+	// find which tree the block is in, and how deep it is
+	index -= 12;
+	if(index < count)
+	{
+		pointer = inode->singly_block;
+		span = 1;
+	} else if(index - count < count * count)
+	{
+		index -= count;
+		pointer = inode->doubly_block;
+		span = count;
+	} else
+	{
+		index -= count + (count * count);
+		if(index >= count * count * count)
+			return EFBIG;
+
+		pointer = inode->triply_block;
+		span = count * count;
+	}
+
+	uint32_t *indirect = scratch_alloc(block_size);
+
+	// and walk down, one indirect block per level
+	while(pointer)
+	{
+		status = ext2_read_block(mountpoint, pointer, 1, indirect);
+		if(status != 0)
+		{
+			scratch_free(indirect);
+			return status;
+		}
+
+		pointer = indirect[index / span];
+		index %= span;
+
+		if(span == 1)
+			break;
+
+		span /= count;
+	}
+
+	// a zero anywhere on the way is a hole
+	destination[0] = pointer;
+	scratch_free(indirect);
+	return 0;
+}
+
+// ext2_page_io(): Reads or writes one page of a file
+// Param:	mountpoint_t *mountpoint - mountpoint
+// Param:	uint32_t inode_index - inode number of the file
+// Param:	size_t page - page number within the file
+// Param:	void *buffer - PAGE_SIZE bytes
+// Param:	int write - 1 to write, 0 to read
+// Return:	int - status code
+
+int ext2_page_io(mountpoint_t *mountpoint, uint32_t inode_index, size_t page, void *buffer, int write)
+{
+	// the page cache calls in here directly, not through a VFS call
+	scratch_mark_t mark = scratch_mark();
+	ext2_mount_t *ext2 = (ext2_mount_t*)mountpoint->fs_data;
+
+	// pages of larger blocks would each need part of a block
+	uint32_t block_size = ext2->block_size;
+	if(block_size > PAGE_SIZE)
+	{
+		kprintf("ext2: %d-byte blocks are larger than a page\n", block_size);
+		scratch_reset(mark);
+		return EIO;
+	}
+
+	ext2_inode_t *metadata = scratch_alloc(sizeof(ext2_inode_t));
+	int status = ext2_read_metadata(mountpoint, inode_index, metadata);
+	if(status != 0)
+	{
+		scratch_reset(mark);
+		return status;
+	}
+
+	size_t offset = page << PAGE_SIZE_SHIFT;
+	size_t end = offset + PAGE_SIZE;
+	uint32_t block;
+	size_t i = 0;
+
+	while(offset + i < end && offset + i < metadata->size_low)
+	{
+		status = ext2_file_block(mountpoint, metadata, (offset + i) / block_size, &block);
+		if(status != 0)
+			break;
+
+		if(write)
+		{
+			// writing would need the block allocated first
+			if(!block)
+			{
+				kprintf("ext2: inode %d has a hole at byte %d, not writing\n", inode_index, offset + i);
+				status = EIO;
+				break;
+			}
+
+			status = ext2_write_block(mountpoint, block, 1, buffer + i);
+		} else
+		{
+			if(block)
+				status = ext2_read_block(mountpoint, block, 1, buffer + i);
+			else
+				memset(buffer + i, 0, block_size);
+		}
+
+		if(status != 0)
+			break;
+
+		i += block_size;
+	}
+
+	// whatever is past the end of the file reads as zeroes
+	if(!write && status == 0)
+	{
+		if(offset >= metadata->size_low)
+			memset(buffer, 0, PAGE_SIZE);
+		else if(end > metadata->size_low)
+			memset(buffer + (metadata->size_low - offset), 0, end - metadata->size_low);
+	}
+
+	scratch_reset(mark);
+	return status;
+}
 
 
 
@@ -0,0 +1,658 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Memory-mapped Files and the Page Cache */
+
+#include <vfs.h>
+#include <ext2.h>
+#include <mmap.h>
+#include <mm.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+
+// mmap() only reserves virtual memory, pages are read in by the page fault
+// handler. A file's pages are read into its page cache once and every mapping
+// of the file maps those same frames: MAP_SHARED mappings map them writable
+// on the first write and mark them dirty, MAP_PRIVATE mappings copy a page on
+// its first write. msync() makes dirty pages read-only again before writing
+// them back, so the next write marks them dirty again.
+// Lock order is mmap_mutex, then vmm_mutex.
+
+extern lock_t vmm_mutex;
+
+lock_t mmap_mutex = 0;
+page_cache_t page_caches[MAX_PAGE_CACHES];
+mmap_area_t mmap_areas[MAX_MMAP_AREAS];
+size_t mmap_area_count = 0;
+
+uint64_t mmap_faults = 0;
+uint64_t mmap_copies = 0;
+uint64_t mmap_writebacks = 0;
+
+page_cache_t *page_cache_find(int, ino_t, size_t);
+size_t page_cache_get(page_cache_t *, size_t);
+int page_cache_writeback(page_cache_t *, size_t);
+void page_cache_drop(page_cache_t *);
+mmap_area_t *mmap_find(size_t);
+mmap_area_t *mmap_free_area();
+void mmap_protect(page_cache_t *, size_t);
+void mmap_release(mmap_area_t *, size_t, size_t);
+
+// mmap(): Maps a file into memory
+// Param:	void *address - ignored, the kernel chooses the address
+// Param:	size_t length - bytes to map
+// Param:	int prot - PROT_READ, PROT_WRITE, PROT_EXEC
+// Param:	int flags - MAP_SHARED or MAP_PRIVATE
+// Param:	int handle - file handle
+// Param:	off_t offset - offset in the file, page-aligned
+// Return:	void * - pointer to mapping, MAP_FAILED on error
+
+void *mmap(void *address, size_t length, int prot, int flags, int handle, off_t offset)
+{
+	if(!length || (offset & (PAGE_SIZE-1)))
+		return MAP_FAILED;
+
+	if((flags & (MAP_SHARED | MAP_PRIVATE)) == 0 || (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE))
+		return MAP_FAILED;
+
+	// hold the file so a close() on another CPU can't free it under us
+	file_handle_t *file = vfs_file_get(handle);
+	if(!file)
+		return MAP_FAILED;
+
+	// devices don't go through the page cache
+	int usable = memcmp(file->path, "/dev/", 5) != 0 && (file->flags & O_RDONLY);
+
+	// private copies never reach the file, so they don't need write access
+	if((prot & PROT_WRITE) && (flags & MAP_SHARED) && !(file->flags & O_WRONLY))
+		usable = 0;
+
+	struct stat file_info;
+	if(usable && (stat(file->path, &file_info) != 0 || !(file_info.st_mode & S_IFREG)))
+		usable = 0;
+
+	int mountpoint = -1;
+	if(usable)
+	{
+		acquire_lock(&vfs_mutex);
+		mountpoint = vfs_determine_mountpoint(file->path);
+		release_lock(&vfs_mutex);
+	}
+
+	// the page cache is keyed by mountpoint and inode, not by the handle
+	vfs_file_put(file);
+
+	if(mountpoint < 0 || strcmp(mountpoints[mountpoint]->fstype, "ext2") != 0)
+		return MAP_FAILED;
+
+	size_t count = (length + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+
+	acquire_lock(&mmap_mutex);
+
+	page_cache_t *cache = page_cache_find(mountpoint, file_info.st_ino, file_info.st_size);
+	mmap_area_t *area = mmap_free_area();
+	if(!cache || !area)
+	{
+		release_lock(&mmap_mutex);
+		return MAP_FAILED;
+	}
+
+	acquire_lock(&vmm_mutex);
+	vmm_arena_t *arena = vmm_arena_find(KERNEL_HEAP);
+	size_t base = arena ? vmm_arena_reserve(arena, count) : NULL;
+	release_lock(&vmm_mutex);
+
+	if(!base)
+	{
+		release_lock(&mmap_mutex);
+		return MAP_FAILED;
+	}
+
+	area->base = base;
+	area->count = count;
+	area->cache = cache;
+	area->first_page = offset >> PAGE_SIZE_SHIFT;
+	area->prot = prot;
+	area->flags = flags;
+	area->faults = 0;
+	area->copies = 0;
+
+	cache->mappings++;
+	mmap_area_count++;
+
+	release_lock(&mmap_mutex);
+	return (void*)base;
+}
+
+// munmap(): Unmaps all or part of a mapping
+// Param:	void *address - page-aligned pointer into the mapping
+// Param:	size_t length - bytes to unmap
+// Return:	int - status code
+
+int munmap(void *address, size_t length)
+{
+	size_t base = (size_t)address;
+	if(!length || (base & (PAGE_SIZE-1)))
+		return EINVAL;
+
+	size_t count = (length + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+
+	acquire_lock(&mmap_mutex);
+
+	mmap_area_t *area = mmap_find(base);
+	if(!area || base + (count << PAGE_SIZE_SHIFT) > area->base + (area->count << PAGE_SIZE_SHIFT))
+	{
+		release_lock(&mmap_mutex);
+		return EINVAL;
+	}
+
+	size_t start = (base - area->base) >> PAGE_SIZE_SHIFT;
+	size_t end = start + count;
+	mmap_area_t *tail = NULL;
+
+	// a hole in the middle leaves two areas
+	if(start && end < area->count)
+	{
+		tail = mmap_free_area();
+		if(!tail)
+		{
+			release_lock(&mmap_mutex);
+			return ENOBUFS;
+		}
+	}
+
+	mmap_release(area, start, count);
+
+	if(!start && end == area->count)
+	{
+		area->cache->mappings--;
+		area->base = 0;
+		mmap_area_count--;
+	} else if(!start)
+	{
+		area->base += count << PAGE_SIZE_SHIFT;
+		area->first_page += count;
+		area->count -= count;
+	} else if(end == area->count)
+	{
+		area->count = start;
+	} else
+	{
+		memcpy(tail, area, sizeof(mmap_area_t));
+		tail->base = area->base + (end << PAGE_SIZE_SHIFT);
+		tail->first_page = area->first_page + end;
+		tail->count = area->count - end;
+		area->count = start;
+
+		area->cache->mappings++;
+		mmap_area_count++;
+	}
+
+	release_lock(&mmap_mutex);
+	return 0;
+}
+
+// msync(): Writes the dirty pages of shared mappings back to their files
+// Param:	void *address - page-aligned pointer into a mapping
+// Param:	size_t length - bytes to write back
+// Param:	int flags - MS_ASYNC or MS_SYNC, and MS_INVALIDATE
+// Return:	int - status code
+
+int msync(void *address, size_t length, int flags)
+{
+	size_t base = (size_t)address;
+	if((base & (PAGE_SIZE-1)) || ((flags & MS_ASYNC) && (flags & MS_SYNC)))
+		return EINVAL;
+
+	// there's nothing to write back in the background, so MS_ASYNC is
+	// synchronous too, and MS_INVALIDATE has nothing to do because shared
+	// mappings already map the page cache itself
+	size_t count = (length + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+	size_t i = 0;
+	size_t page;
+	int status = 0, page_status;
+	mmap_area_t *area;
+
+	acquire_lock(&mmap_mutex);
+
+	while(i < count)
+	{
+		area = mmap_find(base + (i << PAGE_SIZE_SHIFT));
+		if(!area)
+		{
+			release_lock(&mmap_mutex);
+			return ENOMEM;
+		}
+
+		page = area->first_page + ((base + (i << PAGE_SIZE_SHIFT) - area->base) >> PAGE_SIZE_SHIFT);
+		if((area->flags & MAP_SHARED) && page < area->cache->page_count)
+		{
+			page_status = page_cache_writeback(area->cache, page);
+			if(page_status != 0 && status == 0)
+				status = page_status;
+		}
+
+		i++;
+	}
+
+	release_lock(&mmap_mutex);
+	return status;
+}
+
+// mmap_fault(): Reads in or copies a page of a mapping
+// Param:	size_t address - faulting address
+// Param:	size_t code - error code
+// Return:	int - 1 if the fault was handled, 0 if it's a real fault
+
+int mmap_fault(size_t address, size_t code)
+{
+	if(code & (PF_USER | PF_RESERVED))
+		return 0;
+
+	acquire_lock(&mmap_mutex);
+
+	mmap_area_t *area = mmap_find(address);
+	if(!area)
+	{
+		release_lock(&mmap_mutex);
+		return 0;
+	}
+
+	size_t page = address & (~(PAGE_SIZE-1));
+	size_t file_page = area->first_page + ((page - area->base) >> PAGE_SIZE_SHIFT);
+	int write = (code & PF_WRITE) ? 1 : 0;
+
+	// past the end of the file or not allowed by prot
+	if(file_page >= area->cache->page_count || !(area->prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) || (write && !(area->prot & PROT_WRITE)))
+	{
+		release_lock(&mmap_mutex);
+		return 0;
+	}
+
+	area->faults++;
+	mmap_faults++;
+
+	page_cache_t *cache = area->cache;
+	size_t frame = page_cache_get(cache, file_page);
+	if(!frame)
+	{
+		release_lock(&mmap_mutex);
+		return 0;
+	}
+
+	// the page may have been read without the lock, so the mapping may have
+	// been unmapped or moved meanwhile; let the access fault again if so
+	if(mmap_find(address) != area || area->cache != cache || area->first_page + ((page - area->base) >> PAGE_SIZE_SHIFT) != file_page)
+	{
+		release_lock(&mmap_mutex);
+		return 1;
+	}
+
+	acquire_lock(&vmm_mutex);
+	size_t entry = vmm_get_page(page);
+	release_lock(&vmm_mutex);
+
+	// another CPU may have had a stale TLB entry
+	if((entry & PAGE_PRESENT) && (!write || (entry & PAGE_RW)))
+	{
+		release_lock(&mmap_mutex);
+		return 1;
+	}
+
+	if(!write)
+	{
+		// read-only until written, for MAP_SHARED dirty tracking or MAP_PRIVATE copying
+		acquire_lock(&vmm_mutex);
+		vmm_map(page, frame, 1, PAGE_PRESENT);
+		release_lock(&vmm_mutex);
+	} else if(area->flags & MAP_SHARED)
+	{
+		area->cache->dirty[file_page] = 1;
+		pmm_set_flags(frame, 1, PMM_FRAME_DIRTY);
+
+		acquire_lock(&vmm_mutex);
+		vmm_map(page, frame, 1, PAGE_PRESENT | PAGE_RW);
+		release_lock(&vmm_mutex);
+	} else
+	{
+		size_t copy = pmm_alloc(1);
+		if(!copy)
+		{
+			release_lock(&mmap_mutex);
+			return 0;
+		}
+
+		void *source = kmap(frame);
+		void *destination = kmap(copy);
+		memcpy(destination, source, PAGE_SIZE);
+		kunmap(destination);
+		kunmap(source);
+		pmm_set_tag(copy, 1, PMM_TAG_ANON);
+
+		acquire_lock(&vmm_mutex);
+		vmm_map(page, copy, 1, PAGE_PRESENT | PAGE_RW);
+		release_lock(&vmm_mutex);
+
+		area->copies++;
+		mmap_copies++;
+	}
+
+	release_lock(&mmap_mutex);
+	return 1;
+}
+
+// mmap_dump(): Shows the mappings and page cache counters
+// Param:	Nothing
+// Return:	Nothing
+
+void mmap_dump()
+{
+	acquire_lock(&mmap_mutex);
+
+	size_t files_cached = 0, resident = 0, dirty = 0, hits = 0, misses = 0;
+	size_t i, j;
+
+	for(i = 0; i < MAX_PAGE_CACHES; i++)
+	{
+		if(!page_caches[i].present)
+			continue;
+
+		files_cached++;
+		resident += page_caches[i].resident;
+		hits += page_caches[i].hits;
+		misses += page_caches[i].misses;
+
+		for(j = 0; j < page_caches[i].page_count; j++)
+		{
+			if(page_caches[i].dirty[j])
+				dirty++;
+		}
+	}
+
+	kprintf("mmap: %d mappings, %d faults, %d private copies, %d pages written back\n", mmap_area_count, (uint32_t)mmap_faults, (uint32_t)mmap_copies, (uint32_t)mmap_writebacks);
+	kprintf("mmap: page cache has %d files, %d pages, %d dirty, %d hits, %d misses\n", files_cached, resident, dirty, hits, misses);
+
+	release_lock(&mmap_mutex);
+}
+
+/* Internal Functions */
+
+// page_cache_find(): Returns the page cache of a file, creating it if needed
+// Param:	int mountpoint - mountpoint index
+// Param:	ino_t inode - inode number
+// Param:	size_t size - file size in bytes
+// Return:	page_cache_t * - page cache, NULL if there's no room
+
+page_cache_t *page_cache_find(int mountpoint, ino_t inode, size_t size)
+{
+	page_cache_t *cache = NULL;
+	size_t i;
+
+	for(i = 0; i < MAX_PAGE_CACHES; i++)
+	{
+		if(page_caches[i].present && page_caches[i].mountpoint == mountpoint && page_caches[i].inode == inode)
+			return &page_caches[i];
+
+		if(!cache && !page_caches[i].present)
+			cache = &page_caches[i];
+	}
+
+	// make room by dropping a file nothing has mapped
+	if(!cache)
+	{
+		for(i = 0; i < MAX_PAGE_CACHES; i++)
+		{
+			if(!page_caches[i].mappings)
+			{
+				page_cache_drop(&page_caches[i]);
+				cache = &page_caches[i];
+				break;
+			}
+		}
+
+		if(!cache)
+			return NULL;
+	}
+
+	size_t page_count = (size + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+
+	cache->pages = kcalloc(sizeof(size_t), page_count ? page_count : 1);
+	cache->dirty = kcalloc(sizeof(uint8_t), page_count ? page_count : 1);
+	if(!cache->pages || !cache->dirty)
+	{
+		if(cache->pages)
+			kfree(cache->pages);
+
+		if(cache->dirty)
+			kfree(cache->dirty);
+
+		return NULL;
+	}
+
+	cache->present = 1;
+	cache->mountpoint = mountpoint;
+	cache->inode = inode;
+	cache->size = size;
+	cache->page_count = page_count;
+	cache->mappings = 0;
+	cache->resident = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+	return cache;
+}
+
+// page_cache_get(): Returns a page of a file, reading it in if needed; called
+// with mmap_mutex held, which is dropped while reading
+// Param:	page_cache_t *cache - page cache
+// Param:	size_t page - page number within the file
+// Return:	size_t - physical address, NULL on error
+
+size_t page_cache_get(page_cache_t *cache, size_t page)
+{
+	if(cache->pages[page])
+	{
+		cache->hits++;
+		return cache->pages[page];
+	}
+
+	cache->misses++;
+
+	size_t frame = pmm_alloc(1);
+	if(!frame)
+		return NULL;
+
+	// don't hold up every other mapping while the device reads, the extra
+	// mapping keeps page_cache_find() from dropping the cache meanwhile
+	cache->mappings++;
+	release_lock(&mmap_mutex);
+
+	void *buffer = kmap(frame);
+	int status = ext2_read_page(mountpoints[cache->mountpoint], (uint32_t)cache->inode, page, buffer);
+	kunmap(buffer);
+
+	acquire_lock(&mmap_mutex);
+	cache->mappings--;
+
+	if(status != 0)
+	{
+		kprintf("mmap: unable to read page %d of inode %d on %s\n", page, (uint32_t)cache->inode, mountpoints[cache->mountpoint]->device);
+		pmm_mark_free(frame, 1);
+		return NULL;
+	}
+
+	// another CPU faulted on the same page and read it first
+	if(cache->pages[page])
+	{
+		pmm_mark_free(frame, 1);
+		return cache->pages[page];
+	}
+
+	pmm_set_tag(frame, 1, PMM_TAG_PAGE_CACHE);
+	pmm_set_flags(frame, 1, PMM_FRAME_CACHE);
+
+	cache->pages[page] = frame;
+	cache->resident++;
+	return frame;
+}
+
+// page_cache_writeback(): Writes a page back to its file if it's dirty
+// Param:	page_cache_t *cache - page cache
+// Param:	size_t page - page number within the file
+// Return:	int - status code
+
+int page_cache_writeback(page_cache_t *cache, size_t page)
+{
+	if(!cache->dirty[page])
+		return 0;
+
+	// writes from now on must fault and dirty it again
+	mmap_protect(cache, page);
+	cache->dirty[page] = 0;
+	pmm_clear_flags(cache->pages[page], 1, PMM_FRAME_DIRTY);
+	pmm_set_flags(cache->pages[page], 1, PMM_FRAME_LOCKED);
+
+	void *buffer = kmap(cache->pages[page]);
+	int status = ext2_write_page(mountpoints[cache->mountpoint], (uint32_t)cache->inode, page, buffer);
+	kunmap(buffer);
+
+	pmm_clear_flags(cache->pages[page], 1, PMM_FRAME_LOCKED);
+
+	if(status != 0)
+	{
+		// keep it for the next msync()
+		cache->dirty[page] = 1;
+		pmm_set_flags(cache->pages[page], 1, PMM_FRAME_DIRTY);
+		return status;
+	}
+
+	mmap_writebacks++;
+	return 0;
+}
+
+// page_cache_drop(): Writes back and frees the pages of an unmapped file
+// Param:	page_cache_t *cache - page cache
+// Return:	Nothing
+
+void page_cache_drop(page_cache_t *cache)
+{
+	size_t i;
+	for(i = 0; i < cache->page_count; i++)
+	{
+		if(!cache->pages[i])
+			continue;
+
+		page_cache_writeback(cache, i);
+		pmm_mark_free(cache->pages[i], 1);
+	}
+
+	kfree(cache->pages);
+	kfree(cache->dirty);
+	cache->present = 0;
+}
+
+// mmap_find(): Finds the mapping containing an address
+// Param:	size_t address - virtual address
+// Return:	mmap_area_t * - mapping, NULL if there is none
+
+mmap_area_t *mmap_find(size_t address)
+{
+	if(!mmap_area_count)
+		return NULL;
+
+	size_t i = 0;
+	while(i < MAX_MMAP_AREAS)
+	{
+		if(mmap_areas[i].base && address >= mmap_areas[i].base && address < mmap_areas[i].base + (mmap_areas[i].count << PAGE_SIZE_SHIFT))
+			return &mmap_areas[i];
+
+		i++;
+	}
+
+	return NULL;
+}
+
+// mmap_free_area(): Finds an unused mapping slot
+// Param:	Nothing
+// Return:	mmap_area_t * - free slot, NULL if the table is full
+
+mmap_area_t *mmap_free_area()
+{
+	size_t i = 0;
+	while(i < MAX_MMAP_AREAS)
+	{
+		if(!mmap_areas[i].base)
+			return &mmap_areas[i];
+
+		i++;
+	}
+
+	return NULL;
+}
+
+// mmap_protect(): Makes a page of a file read-only in all shared mappings
+// Param:	page_cache_t *cache - page cache
+// Param:	size_t page - page number within the file
+// Return:	Nothing
+
+void mmap_protect(page_cache_t *cache, size_t page)
+{
+	size_t i, virtual, entry;
+
+	acquire_lock(&vmm_mutex);
+
+	for(i = 0; i < MAX_MMAP_AREAS; i++)
+	{
+		if(!mmap_areas[i].base || mmap_areas[i].cache != cache || !(mmap_areas[i].flags & MAP_SHARED))
+			continue;
+
+		if(page < mmap_areas[i].first_page || page >= mmap_areas[i].first_page + mmap_areas[i].count)
+			continue;
+
+		virtual = mmap_areas[i].base + ((page - mmap_areas[i].first_page) << PAGE_SIZE_SHIFT);
+		entry = vmm_get_page(virtual);
+		if((entry & PAGE_PRESENT) && (entry & PAGE_RW))
+			vmm_map(virtual, cache->pages[page], 1, PAGE_PRESENT);
+	}
+
+	release_lock(&vmm_mutex);
+}
+
+// mmap_release(): Unmaps pages of a mapping and frees its private copies
+// Param:	mmap_area_t *area - mapping
+// Param:	size_t start - first page within the mapping
+// Param:	size_t count - count of pages
+// Return:	Nothing
+
+void mmap_release(mmap_area_t *area, size_t start, size_t count)
+{
+	size_t virtual = area->base + (start << PAGE_SIZE_SHIFT);
+	size_t i, entry, file_page;
+
+	acquire_lock(&vmm_mutex);
+
+	for(i = 0; i < count; i++)
+	{
+		entry = vmm_get_page(virtual + (i << PAGE_SIZE_SHIFT));
+		if(!(entry & PAGE_PRESENT))
+			continue;
+
+		// only frames that aren't the page cache's are ours
+		file_page = area->first_page + start + i;
+		entry &= (~(PAGE_SIZE-1));
+		if(file_page >= area->cache->page_count || entry != area->cache->pages[file_page])
+			pmm_mark_free(entry, 1);
+	}
+
+	vmm_unmap(virtual, count);
+
+	vmm_arena_t *arena = vmm_arena_find(virtual);
+	if(arena)
+		vmm_arena_release(arena, virtual, count);
+
+	release_lock(&vmm_mutex);
+}
+
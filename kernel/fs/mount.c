@@ -9,6 +9,9 @@
 #include <kprintf.h>
 #include <string.h>
 #include <lock.h>
+#include <ext2.h>
+
+extern slab_cache_t *mountpoint_cache;
 
 // vfs_determine_mountpoint(): Determines the mountpoint of a path
 // Param:	char *path - fully resolved path
@@ -21,14 +24,14 @@ int vfs_determine_mountpoint(char *path)
 
 	while(mountpoint < MAX_MOUNTPOINTS)
 	{
-		if(mountpoints[mountpoint].present != 1)
+		if(!mountpoints[mountpoint] || mountpoints[mountpoint]->present != 1)
 		{
 			mountpoint++;
 			continue;
 		}
 
-		size = strlen(mountpoints[mountpoint].path);
-		if(memcmp(mountpoints[mountpoint].path, path, size) == 0)
+		size = strlen(mountpoints[mountpoint]->path);
+		if(memcmp(mountpoints[mountpoint]->path, path, size) == 0)
 		{
 			// keep the longest path
 			if(size > size2)
@@ -84,7 +87,7 @@ int mount(const char *device, const char *dir, const char *fstype, unsigned long
 
 	// find an empty mountpoint
 	int mountpoint = 0;
-	while(mountpoints[mountpoint].present != 0 && mountpoint < MAX_MOUNTPOINTS)
+	while(mountpoint < MAX_MOUNTPOINTS && mountpoints[mountpoint])
 		mountpoint++;
 
 	if(mountpoint >= MAX_MOUNTPOINTS)
@@ -93,20 +96,46 @@ int mount(const char *device, const char *dir, const char *fstype, unsigned long
 		return ENOBUFS;
 	}
 
-	// create the mountpoint structure
-	mountpoints[mountpoint].present = 1;
-	strcpy(mountpoints[mountpoint].fstype, fstype);
+	// create the mountpoint structure, path lookups skip it until it's mounted
+	mountpoints[mountpoint] = slab_alloc(mountpoint_cache);
+	if(!mountpoints[mountpoint])
+	{
+		release_lock(&vfs_mutex);
+		return ENOMEM;
+	}
+
+	mountpoints[mountpoint]->present = 2;
+	strcpy(mountpoints[mountpoint]->fstype, fstype);
 
 	vfs_resolve_path(full_path, device);
-	strcpy(mountpoints[mountpoint].device, full_path);
+	strcpy(mountpoints[mountpoint]->device, full_path);
 
 	vfs_resolve_path(full_path, dir);
-	strcpy(mountpoints[mountpoint].path, full_path);
+	strcpy(mountpoints[mountpoint]->path, full_path);
 
-	mountpoints[mountpoint].flags = flags;
+	mountpoints[mountpoint]->flags = flags;
 
 	// TO-DO: UID and GID stuff here!
 
+	release_lock(&vfs_mutex);
+
+	// the filesystem reads its device through the VFS
+	if(strcmp(fstype, "ext2") == 0)
+		status = ext2_mount(mountpoints[mountpoint]);
+
+	acquire_lock(&vfs_mutex);
+
+	if(status != 0)
+	{
+		slab_free(mountpoint_cache, mountpoints[mountpoint]);
+		mountpoints[mountpoint] = NULL;
+		release_lock(&vfs_mutex);
+		kprintf("vfs: unable to mount %s on %s, filesystem type '%s'\n", device, dir, fstype);
+		return status;
+	}
+
+	mountpoints[mountpoint]->present = 1;
+
 	kprintf("vfs: mounted %s on %s, filesystem type '%s'\n", device, dir, fstype);
 	release_lock(&vfs_mutex);
 	return 0;
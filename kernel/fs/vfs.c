@@ -14,9 +14,12 @@
 #include <tty.h>
 #include <ustar.h>
 #include <ext2.h>
+#include <dcache.h>
 
-file_handle_t *files;
-mountpoint_t *mountpoints;
+file_handle_t *files[MAX_FILES];
+mountpoint_t *mountpoints[MAX_MOUNTPOINTS];
+slab_cache_t *file_cache;
+slab_cache_t *mountpoint_cache;
 char full_path[1024];
 lock_t vfs_mutex = 0;
 struct stat root_stat;
@@ -28,8 +31,10 @@ struct stat root_stat;
 void vfs_init()
 {
 	kprintf("vfs: initializing virtual filesystem...\n");
-	files = kcalloc(sizeof(file_handle_t), MAX_FILES);
-	mountpoints = kcalloc(sizeof(mountpoint_t), MAX_MOUNTPOINTS);
+
+	// handles and mountpoints only take memory while they're in use
+	file_cache = slab_create("file_handle_t", sizeof(file_handle_t), 0);
+	mountpoint_cache = slab_create("mountpoint_t", sizeof(mountpoint_t), 0);
 
 	// stat for root filesystem
 	memset(&root_stat, 0, sizeof(struct stat));
@@ -40,16 +45,20 @@ void vfs_init()
 	root_stat.st_ctime = timestamp;
 
 	devfs_init();
+	dcache_init();
 
-	// mark the first three file handles as used, for stdin, stdout, stderr
-	files[STDIN].present = 1;
-	strcpy(files[STDIN].path, "/dev/stdin");
+	// the first three file handles are always used, for stdin, stdout, stderr
+	files[STDIN] = slab_alloc(file_cache);
+	strcpy(files[STDIN]->path, "/dev/stdin");
+	files[STDIN]->refcount = 1;
 
-	files[STDOUT].present = 1;
-	strcpy(files[STDOUT].path, "/dev/stdout");
+	files[STDOUT] = slab_alloc(file_cache);
+	strcpy(files[STDOUT]->path, "/dev/stdout");
+	files[STDOUT]->refcount = 1;
 
-	files[STDERR].present = 1;
-	strcpy(files[STDERR].path, "/dev/stderr");
+	files[STDERR] = slab_alloc(file_cache);
+	strcpy(files[STDERR]->path, "/dev/stderr");
+	files[STDERR]->refcount = 1;
 }
 
 // vfs_resolve_path(): Resolves a path
@@ -161,7 +170,7 @@ int open(const char *path, int flags, ...)
 	// find an empty handle
 	int handle = 0;
 
-	while(files[handle].present != 0 && handle < MAX_FILES)
+	while(handle < MAX_FILES && files[handle])
 		handle++;
 
 	if(handle >= MAX_FILES)
@@ -172,11 +181,18 @@ int open(const char *path, int flags, ...)
 	}
 
 	// create the file handle
-	files[handle].present = 1;
-	files[handle].position = 0;
-	files[handle].flags = flags;
-	files[handle].pid = get_pid();
-	strcpy(files[handle].path, full_path);
+	files[handle] = slab_alloc(file_cache);
+	if(!files[handle])
+	{
+		release_lock(&vfs_mutex);
+		return ENOMEM;
+	}
+
+	files[handle]->position = 0;
+	files[handle]->flags = flags;
+	files[handle]->pid = get_pid();
+	files[handle]->refcount = 1;		// the handle table's
+	strcpy(files[handle]->path, full_path);
 
 	release_lock(&vfs_mutex);
 	return handle;
@@ -188,11 +204,24 @@ int open(const char *path, int flags, ...)
 
 int close(int handle)
 {
-	if(files[handle].present != 1)
+	if(handle < 0 || handle >= MAX_FILES)
 		return EBADF;
 
 	acquire_lock(&vfs_mutex);
-	memset(&files[handle], 0, sizeof(file_handle_t));
+	if(!files[handle])
+	{
+		release_lock(&vfs_mutex);
+		return EBADF;
+	}
+
+	// a read() may still be using it, the last reference frees it
+	file_handle_t *file = files[handle];
+	files[handle] = NULL;
+
+	file->refcount--;
+	if(!file->refcount)
+		slab_free(file_cache, file);
+
 	release_lock(&vfs_mutex);
 	return 0;
 }
@@ -217,37 +246,42 @@ ssize_t read(int handle, char *buffer, size_t count)
 		return EIO;
 
 	acquire_lock(&vfs_mutex);
-	if(files[handle].present != 1)
+	if(handle < 0 || handle >= MAX_FILES || !files[handle])
 	{
 		release_lock(&vfs_mutex);
 		return EBADF;
 	}
 
-	if(memcmp(files[handle].path, "/dev/", 5) == 0)
+	if(memcmp(files[handle]->path, "/dev/", 5) == 0)
 		return devfs_read(handle, buffer, count);
 
 	// determine the actual mountpoint
-	int mountpoint = vfs_determine_mountpoint(full_path);
+	file_handle_t *file = files[handle];
+	int mountpoint = vfs_determine_mountpoint(file->path);
 	if(mountpoint < 0)
 	{
 		release_lock(&vfs_mutex);
 		return ENOENT;
 	}
 
-	char *tmp_path = kmalloc(1024);
-	strcpy(tmp_path, full_path);
+	// the filesystem reads without the lock, so don't let close() free it
+	file->refcount++;
 	release_lock(&vfs_mutex);
 
+	// the filesystem's buffers only live during this call
+	scratch_mark_t mark = scratch_mark();
 	ssize_t status;
 
-	if(strcmp(mountpoints[mountpoint].fstype, "ext2") == 0)
-		status = ext2_read(&mountpoints[mountpoint], &files[handle], buffer, count);
+	if(strcmp(mountpoints[mountpoint]->fstype, "ext2") == 0)
+		status = ext2_read(mountpoints[mountpoint], file, buffer, count);
 	else
 	{
-		kprintf("vfs: undefined filesystem type: %s\n", mountpoints[mountpoint].fstype);
+		kprintf("vfs: undefined filesystem type: %s\n", mountpoints[mountpoint]->fstype);
 		status = ENOENT;
 	}
 
+	scratch_reset(mark);
+	vfs_file_put(file);
 	return status;
 }
 
@@ -275,13 +309,13 @@ ssize_t write(int handle, char *buffer, size_t count)
 
 	// if we get here, it's probably a real file
 	acquire_lock(&vfs_mutex);
-	if(files[handle].present != 1)
+	if(handle < 0 || handle >= MAX_FILES || !files[handle])
 	{
 		release_lock(&vfs_mutex);
 		return EBADF;
 	}
 
-	if(memcmp(files[handle].path, "/dev/", 5) == 0)
+	if(memcmp(files[handle]->path, "/dev/", 5) == 0)
 		return devfs_write(handle, buffer, count);
 
 	// for now
@@ -297,36 +331,43 @@ ssize_t write(int handle, char *buffer, size_t count)
 
 int lseek(int handle, off_t position, int whence)
 {
-	if(files[handle].present != 1)
+	file_handle_t *file = vfs_file_get(handle);
+	if(!file)
 		return EBADF;
 
 	struct stat file_info;
-	int status = fstat(handle, &file_info);
+	int status = stat(file->path, &file_info);
 	if(status != 0)
+	{
+		vfs_file_put(file);
 		return status;
+	}
 
 	acquire_lock(&vfs_mutex);
 
 	// for /dev files
-	if(memcmp(files[handle].path, "/dev/", 5) == 0)
+	if(memcmp(file->path, "/dev/", 5) == 0)
 	{
 		if(whence == SEEK_SET)
-			files[handle].position = position;
+			file->position = position;
 
 		else if(whence == SEEK_CUR)
-			files[handle].position += position;
+			file->position += position;
 
 		else if(whence == SEEK_END)
-			files[handle].position = file_info.st_size - position;
+			file->position = file_info.st_size - position;
 
 		else
 		{
 			release_lock(&vfs_mutex);
+			vfs_file_put(file);
 			return EINVAL;
 		}
 
+		off_t new_position = file->position;
 		release_lock(&vfs_mutex);
-		return files[handle].position;
+		vfs_file_put(file);
+		return new_position;
 	}
 
 	// for other files
@@ -335,38 +376,48 @@ int lseek(int handle, off_t position, int whence)
 		if(position >= file_info.st_size)
 		{
 			release_lock(&vfs_mutex);
+			vfs_file_put(file);
 			return EINVAL;
 		}
 
-		files[handle].position = position;
+		file->position = position;
+		off_t new_position = file->position;
 		release_lock(&vfs_mutex);
-		return files[handle].position;
+		vfs_file_put(file);
+		return new_position;
 	} else if(whence == SEEK_CUR)
 	{
-		if((files[handle].position + position) >= file_info.st_size)
+		if((file->position + position) >= file_info.st_size)
 		{
 			release_lock(&vfs_mutex);
+			vfs_file_put(file);
 			return EINVAL;
 		}
 
-		files[handle].position += position;
+		file->position += position;
+		off_t new_position = file->position;
 		release_lock(&vfs_mutex);
-		return files[handle].position;
+		vfs_file_put(file);
+		return new_position;
 	} else if(whence == SEEK_END)
 	{
 		if((file_info.st_size - position) >= file_info.st_size)
 		{
 			release_lock(&vfs_mutex);
+			vfs_file_put(file);
 			return EINVAL;
 		}
 
-		files[handle].position = file_info.st_size - position;
+		file->position = file_info.st_size - position;
+		off_t new_position = file->position;
 		release_lock(&vfs_mutex);
-		return files[handle].position;
+		vfs_file_put(file);
+		return new_position;
 	} else
 	{
 		// undefined whence here
 		release_lock(&vfs_mutex);
+		vfs_file_put(file);
 		return EINVAL;
 	}
 }
@@ -412,21 +463,24 @@ int stat(const char *path, struct stat *destination)
 		return ENOENT;
 	}
 
-	char *tmp_path = kmalloc(1024);
+	// the filesystem's buffers only live during this call
+	scratch_mark_t mark = scratch_mark();
+
+	char *tmp_path = scratch_alloc(1024);
 	strcpy(tmp_path, full_path);
 	release_lock(&vfs_mutex);
 
-	if(strcmp(mountpoints[mountpoint].fstype, "ustar") == 0)
-		status = ustar_stat(&mountpoints[mountpoint], tmp_path, destination);
-	else if(strcmp(mountpoints[mountpoint].fstype, "ext2") == 0)
-		status = ext2_stat(&mountpoints[mountpoint], tmp_path, destination);
+	if(strcmp(mountpoints[mountpoint]->fstype, "ustar") == 0)
+		status = ustar_stat(mountpoints[mountpoint], tmp_path, destination);
+	else if(strcmp(mountpoints[mountpoint]->fstype, "ext2") == 0)
+		status = ext2_stat(mountpoints[mountpoint], tmp_path, destination);
 	else
 	{
-		kprintf("vfs: undefined filesystem type: %s\n", mountpoints[mountpoint].fstype);
+		kprintf("vfs: undefined filesystem type: %s\n", mountpoints[mountpoint]->fstype);
 		status = ENOENT;
 	}
 
-	kfree(tmp_path);
+	scratch_reset(mark);
 	return status;
 }
 
@@ -437,11 +491,48 @@ int stat(const char *path, struct stat *destination)
 
 int fstat(int handle, struct stat *destination)
 {
-	if(files[handle].present != 1)
+	file_handle_t *file = vfs_file_get(handle);
+	if(!file)
 		return EBADF;
 
 	// normal stat()
-	return stat(files[handle].path, destination);
+	int status = stat(file->path, destination);
+	vfs_file_put(file);
+	return status;
+}
+
+// vfs_file_get(): Takes a reference on an open file, so close() can't free it
+// Param:	int handle - file handle
+// Return:	file_handle_t * - the file, NULL if the handle isn't open
+
+file_handle_t *vfs_file_get(int handle)
+{
+	if(handle < 0 || handle >= MAX_FILES)
+		return NULL;
+
+	acquire_lock(&vfs_mutex);
+
+	file_handle_t *file = files[handle];
+	if(file)
+		file->refcount++;
+
+	release_lock(&vfs_mutex);
+	return file;
+}
+
+// vfs_file_put(): Drops a reference from vfs_file_get(), freeing a closed file
+// Param:	file_handle_t *file - the file
+// Return:	Nothing
+
+void vfs_file_put(file_handle_t *file)
+{
+	acquire_lock(&vfs_mutex);
+
+	file->refcount--;
+	if(!file->refcount)
+		slab_free(file_cache, file);
+
+	release_lock(&vfs_mutex);
 }
 
 
@@ -156,10 +156,13 @@ void lapic_write(size_t, uint32_t);
 uint8_t lapic_get_id();
 void lapic_init();
 void lapic_eoi();
+void lapic_send_ipi(uint8_t, uint8_t);
 extern void lapic_spurious_stub();
 
 void smp_init();
 void smp_register_cpu(size_t);
+extern uint32_t smp_online_cpus;
+extern struct cpu_t *smp_cpus[];
 extern char trampoline16[];
 extern uint16_t trampoline16_size[];
 
@@ -21,6 +21,15 @@
 #define BLKDEV_NONE		0
 #define BLKDEV_INITRD		1
 
+// Buffer Cache
+#define BLKDEV_BUFFER_SIZE	4096		// bytes per buffer, one frame
+#define BLKDEV_BUFFER_HASH	512		// hash buckets
+#define BLKDEV_CACHE_BUDGET	2048		// most buffers cached by default, 8 MB
+#define BLKDEV_CACHE_DIVISOR	32		// but never more than 1/32 of memory
+
+#define BLKDEV_BUFFER_LOADING	0x01		// being read, not to be used yet
+#define BLKDEV_BUFFER_STALE	0x02		// written to while it was read
+
 typedef struct blkdev_t
 {
 	uint8_t type;		// type of device as constants above
@@ -28,8 +37,27 @@ typedef struct blkdev_t
 	uint16_t sector_size;
 	uint8_t data[188];	// type-specific data
 	char name[64];		// name of device
+
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_evictions;
+	size_t cache_buffers;	// buffers of this device in the cache now
 } blkdev_t;
 
+// A cached piece of a block device, found by device and buffer number
+typedef struct blkdev_buffer_t
+{
+	dev_t device;
+	uint64_t block;		// byte offset / BLKDEV_BUFFER_SIZE
+	paddr_t frame;		// physical, reached through kmap()
+	size_t refcount;	// holders, only unheld buffers are evicted
+	uint8_t flags;		// BLKDEV_BUFFER_*
+
+	struct blkdev_buffer_t *hash_next;
+	struct blkdev_buffer_t *lru_prev;	// more recently used
+	struct blkdev_buffer_t *lru_next;	// less recently used
+} blkdev_buffer_t;
+
 typedef struct blkdev_initrd_t
 {
 	uint16_t size;		// total size of this specific structure
@@ -48,6 +76,14 @@ int blkdev_write(dev_t, uint64_t, uint64_t, void *);
 int blkdev_read_bytes(dev_t, uint64_t, uint64_t, void *);
 int blkdev_write_bytes(dev_t, uint64_t, uint64_t, void *);
 
+void blkdev_cache_init();
+void blkdev_cache_budget(size_t);
+blkdev_buffer_t *blkdev_buffer_get(dev_t, uint64_t);
+void blkdev_buffer_put(blkdev_buffer_t *);
+int blkdev_cache_read(dev_t, uint64_t, uint64_t, void *);
+void blkdev_cache_write(dev_t, uint64_t, uint64_t, void *);
+void blkdev_cache_dump();
+
 
 
 
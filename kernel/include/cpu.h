@@ -7,6 +7,8 @@
 #pragma once
 
 #include <types.h>
+#include <mm.h>
+#include <tlb.h>
 
 #define STACK_SIZE		65536		// kernel stack
 
@@ -21,8 +23,25 @@
 #define MSR_GS_BASE		0xC0000101
 #define MSR_KERNEL_GS_BASE	0xC0000102	// swapgs instruction
 
+// Control Register Bits
+#define CR4_PGE			0x00000080	// global pages
+#define CR4_PCIDE		0x00020000	// process-context identifiers
+#define CR3_NOFLUSH		0x8000000000000000	// keep the PCID's TLB entries
+
+// CPUID Feature Bits
+#define CPUID_1_EDX_PGE		0x00002000
+#define CPUID_1_ECX_PCID	0x00020000
+#define CPUID_7_EBX_INVPCID	0x00000400
+
 #endif
 
+// Page Attribute Table
+#define MSR_PAT			0x00000277
+#define CPUID_1_EDX_PAT		0x00010000
+#define CR0_NW			0x20000000	// not write-through
+#define CR0_CD			0x40000000	// cache disable
+#define CR4_PAE			0x00000020	// 64-bit page table entries, for i386
+
 typedef struct cpu_t
 {
 	size_t index;
@@ -32,6 +51,18 @@ typedef struct cpu_t
 	size_t process_count;
 	pid_t current_pid;
 	uint8_t tasking_enabled;
+	pmm_pcp_t pcp;			// per-CPU page frame cache
+	scratch_t *scratch;		// per-CPU arena for short-lived buffers
+	size_t kmap_depth;		// kmap() slots in use, i386 only
+	uint64_t kmaps;
+	uint8_t numa_node;
+	uint8_t numa_policy;
+	uint8_t numa_bind_node;		// for NUMA_POLICY_BIND
+	uint8_t numa_interleave;	// next node for NUMA_POLICY_INTERLEAVE
+	tlb_stats_t tlb;
+	vmm_space_t *space;		// current address space, x86_64 only
+	tlb_asid_t asids[TLB_ASIDS];	// PCIDs 1 to TLB_ASIDS
+	uint64_t asid_clock;
 } cpu_t;
 
 #if __i386__
@@ -56,9 +87,13 @@ extern uint64_t read_cr2();
 extern uint64_t read_cr3();
 extern uint64_t read_cr4();
 
+extern void invpcid_flush(uint64_t, uint64_t, size_t);
+#endif
+
 extern void write_msr(uint32_t, uint64_t);
 extern uint64_t read_msr(uint32_t);
-#endif
+extern void read_cpuid(uint32_t, uint32_t, uint32_t *);
+extern uint64_t read_tsc();
 
 extern void flush_tlb(size_t, size_t);
 
@@ -0,0 +1,47 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#pragma once
+
+#include <types.h>
+#include <vfs.h>
+
+#define DCACHE_SIZE			2048		// most entries, the least recently used go first
+#define DCACHE_HASH			1024		// hash buckets
+#define DCACHE_NAME_MAX			63		// longer names aren't cached
+#define DCACHE_DEPTHS			8		// path components counted apart, the last for all deeper ones
+
+// dcache_lookup() results
+#define DCACHE_MISS			0
+#define DCACHE_HIT			1
+#define DCACHE_NEGATIVE			2		// cached as not existing
+
+// A name in a directory, and the inode it leads to
+typedef struct dentry_t
+{
+	mountpoint_t *mountpoint;
+	ino_t parent;
+	ino_t inode;			// zero for a negative entry
+	uint32_t hash;
+	char name[DCACHE_NAME_MAX+1];
+
+	struct dentry_t *hash_next;
+	struct dentry_t *lru_prev;	// more recently used
+	struct dentry_t *lru_next;	// less recently used
+} dentry_t;
+
+// Lookups of one path component depth, the first component being depth 0
+typedef struct dcache_stats_t
+{
+	uint64_t hits;
+	uint64_t negative_hits;
+	uint64_t misses;
+} dcache_stats_t;
+
+void dcache_init();
+int dcache_lookup(mountpoint_t *, ino_t, const char *, size_t, ino_t *);
+void dcache_add(mountpoint_t *, ino_t, const char *, ino_t);
+void dcache_dump();
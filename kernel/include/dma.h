@@ -0,0 +1,51 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#pragma once
+
+#include <types.h>
+#include <lock.h>
+
+#define MAX_DMA_POOLS			32
+#define DMA_POOL_BLOCK_PAGES		4		// contiguous pages per block, unless a chunk is larger
+#define DMA_POOL_MIN_ALIGN		16
+
+// Physically contiguous pages, carved into chunks
+typedef struct dma_block_t
+{
+	size_t virtual;
+	paddr_t physical;
+	struct dma_block_t *next;
+	void *free_list;		// kept inside the free chunks themselves
+	size_t free_count;
+} dma_block_t;
+
+typedef struct dma_pool_t
+{
+	char present;
+	char name[32];
+	size_t size;			// of each chunk, rounded up to the alignment
+	size_t alignment;
+	uint8_t zone;			// highest zone the device can reach, PMM_ZONE_*
+	size_t block_pages;
+	size_t chunks_per_block;
+
+	dma_block_t *blocks;
+	size_t block_count;
+	size_t free_count;		// chunks, of all blocks
+
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t grows;			// blocks added after the pool was made
+	uint64_t failures;
+	lock_t lock;
+} dma_pool_t;
+
+dma_pool_t *dma_pool_create(const char *, size_t, size_t, uint8_t, size_t);
+void *dma_pool_alloc(dma_pool_t *, paddr_t *);
+void dma_pool_free(dma_pool_t *, void *);
+void dma_pool_destroy(dma_pool_t *);
+void dma_pool_dump();
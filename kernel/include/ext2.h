@@ -10,6 +10,16 @@
 #include <vfs.h>
 
 #define EXT2_ROOT_INODE			2	// the root dir is always inode 2
+#define EXT2_MAGIC			0xEF53
+#define EXT2_MAX_BLOCK_SIZE		6	// 64 KB, as 1024 << block_size
+
+// Required Features, a volume with any others can't be read
+#define EXT2_FEATURE_FILETYPE		0x0002	// directory entries have a type byte
+#define EXT2_FEATURES_SUPPORTED		EXT2_FEATURE_FILETYPE
+
+// Inode Cache, per volume
+#define EXT2_INODE_HASH			64		// hash buckets
+#define EXT2_INODE_CACHE		256		// most inodes kept unless all are held
 
 // File Permissions are stored in the Inode Metadata
 #define EXT2_READ_USER			0x100
@@ -130,8 +140,47 @@ typedef struct ext2_directory_t
 	char file_name[];
 }__attribute__((packed)) ext2_directory_t;
 
+// An inode's metadata kept in memory, see ext2_iget()
+typedef struct ext2_cached_inode_t
+{
+	uint32_t number;
+	size_t refcount;		// holders, only unheld inodes are evicted
+	ext2_inode_t inode;
+
+	struct ext2_cached_inode_t *hash_next;
+	struct ext2_cached_inode_t *lru_prev;	// more recently used
+	struct ext2_cached_inode_t *lru_next;	// less recently used
+} ext2_cached_inode_t;
+
+// What ext2_mount() reads and works out once, so nothing after it needs to
+// read the superblock or the block group descriptors again
+typedef struct ext2_mount_t
+{
+	ext2_superblock_t superblock;
+	ext2_block_group_t *groups;	// the block group descriptor table
+	uint32_t block_size;		// in bytes
+	uint32_t inode_size;
+	uint32_t group_count;
+	uint32_t inodes_per_group;
+	uint32_t pointers_per_block;	// block numbers in an indirect block
+	uint32_t first_block;		// block holding the superblock
+
+	ext2_cached_inode_t *inode_hash[EXT2_INODE_HASH];
+	ext2_cached_inode_t *inode_lru;		// most recently used
+	ext2_cached_inode_t *inode_lru_tail;	// least recently used
+	size_t inode_count;
+	uint64_t inode_hits;
+	uint64_t inode_misses;
+	uint64_t inode_evictions;
+	lock_t inode_lock;
+} ext2_mount_t;
+
+int ext2_mount(mountpoint_t *);
 int ext2_stat(mountpoint_t *, const char *, struct stat *);
 ssize_t ext2_read(mountpoint_t *, file_handle_t *, void *, size_t);
+int ext2_read_page(mountpoint_t *, uint32_t, size_t, void *);
+int ext2_write_page(mountpoint_t *, uint32_t, size_t, void *);
+void ext2_dump();
 
 
 
@@ -35,7 +35,6 @@ extern void tss_handler();
 extern void segment_handler();
 extern void stack_handler();
 extern void gpf_handler();
-extern void page_handler();
 extern void reserved_handler();
 extern void floating_handler();
 extern void alignment_handler();
@@ -0,0 +1,31 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#pragma once
+
+#include <types.h>
+#include <mm.h>
+
+#define KSM_RATE			64		// pages scanned per idle wakeup by default
+#define KSM_TABLE_SIZE			1024		// must be a power of two
+#define KSM_PROBES			8		// slots tried before overwriting one
+
+// A page seen by the scanner: in the stable table, a merged frame that never
+// changes; in the unstable table, a page that may be merged with a later one
+typedef struct ksm_node_t
+{
+	uint32_t hash;
+	size_t frame;			// physical, zero if the slot is free
+	size_t virtual;			// unstable only
+	vmm_lazy_t *region;		// unstable only
+} ksm_node_t;
+
+void ksm_init();
+void ksm_idle();
+void ksm_set_rate(size_t);
+int ksm_unshare(vmm_lazy_t *, size_t, size_t);
+void ksm_release(size_t);
+void ksm_dump();
@@ -12,6 +12,7 @@ typedef volatile uint32_t lock_t;
 
 void acquire_lock(lock_t *);
 void release_lock(lock_t *);
+int try_lock(lock_t *);
 
 
 
@@ -0,0 +1,19 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#pragma once
+
+#include <types.h>
+
+#define LZ4_HASH_BITS			12
+#define LZ4_WORK_SIZE			((1 << LZ4_HASH_BITS) * sizeof(uint32_t))
+#define LZ4_MIN_MATCH			4
+#define LZ4_LAST_LITERALS		5		// the block always ends with literals
+#define LZ4_MATCH_LIMIT			12		// no match starts this close to the end
+#define LZ4_MAX_OFFSET			65535
+
+size_t lz4_compress(const void *, size_t, void *, size_t, void *);
+int lz4_decompress(const void *, size_t, void *, size_t);
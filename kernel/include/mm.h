@@ -8,69 +8,446 @@
 
 #include <types.h>
 #include <boot.h>
+#include <lock.h>
 
 #if __i386__
-#define PMM_BITMAP_SIZE			0x100000
+#define PMM_FRAMES_BASE			0x1000000	// frame array lives at 16 MB
+#endif
+
+#if __i386__ && PAE
+#define PMM_MAX_MEMORY			0x1000000000	// 64 GB, 36-bit physical addresses
 #endif
 
 #if __x86_64__
-#define PMM_BITMAP_SIZE			0x200000	// maximum of 64 GB physical memory
+#define PMM_MAX_MEMORY			0x1000000000	// 64 GB, size of the physical map
 #endif
 
+// Buddy Allocator
+#define PMM_MAX_ORDER			10		// largest block is 4 MB
+#define PMM_NO_ORDER			0xFF
+#define PMM_NONE			0xFFFFFFFF
+
+// Physical Memory Zones, by which devices can reach them
+#define PMM_ZONE_DMA			0		// below 16 MB, for ISA DMA
+#define PMM_ZONE_DMA32			1		// below 4 GB, for 32-bit PCI devices
+#define PMM_ZONE_NORMAL			2
+#define PMM_ZONES			3
+#define PMM_ZONE_DMA_END		0x1000		// in frames, 16 MB
+#define PMM_ZONE_DMA32_END		0x100000	// 4 GB
+
+// Highest zone for frames whose address the kernel keeps in a size_t; with
+// PAE, frames above 4 GB only go to callers that ask for ZONE_NORMAL by name
+#if __i386__ && PAE
+#define PMM_ZONE_DEFAULT		PMM_ZONE_DMA32
+#else
+#define PMM_ZONE_DEFAULT		PMM_ZONE_NORMAL
+#endif
+
+// Page Frame Flags, in pmm_frame_t
+#define PMM_FRAME_CACHE			0x01		// file data in the page cache
+#define PMM_FRAME_DIRTY			0x02		// changed since last written back
+#define PMM_FRAME_LOCKED		0x04		// being written back
+#define PMM_FRAME_SLAB			0x08		// part of a slab
+#define PMM_FRAME_PINNED		0x10		// a device may access it, never reclaim it
+
+#define PMM_MAX_REFCOUNT		0xFFFF		// pmm_frame_t.refcount is 16 bits
+
+// Page Frame Owners, in pmm_frame_t
+#define PMM_TAG_NONE			0		// allocated, but nobody said what for
+#define PMM_TAG_RESERVED		1		// not usable RAM, holes in the memory map
+#define PMM_TAG_KERNEL			2		// kernel image and boot structures
+#define PMM_TAG_HEAP			3
+#define PMM_TAG_SLAB			4
+#define PMM_TAG_PAGE_TABLE		5
+#define PMM_TAG_PAGE_CACHE		6
+#define PMM_TAG_ANON			7		// copy-on-write and MAP_PRIVATE copies
+#define PMM_TAG_DMA			8
+#define PMM_TAG_ZERO_POOL		9
+#define PMM_TAG_PCP			10		// per-CPU frame caches
+#define PMM_TAG_ZRAM			11		// compressed pages, see mm/zram.c
+#define PMM_TAG_KSM			12		// identical pages merged into one, see mm/ksm.c
+#define PMM_TAG_BUFFER			13		// block device buffer cache
+#define PMM_TAGS			14
+
+// Per-CPU Page Caches
+#define PCP_SIZE			64		// must be a power of two
+#define PCP_BATCH			16		// frames moved to or from the buddy allocator at once
+
+// Temporary Mappings, i386 only
+#define KMAP_SLOTS			32		// per CPU, the most kmap()s in use at once
+
+// Per-CPU Scratch Arenas
+#define SCRATCH_SIZE			0x100000	// 1 MB, lazy, so only what's touched uses memory
+#define SCRATCH_ALIGN			16
+
 #define PAGE_SIZE			4096
 #define PAGE_SIZE_SHIFT			12		// 12 bits for 4096
 
 #define PAGE_PRESENT			0x01
 #define PAGE_RW				0x02
 #define PAGE_USER			0x04
-#define PAGE_UNCACHEABLE		0x10
+#define PAGE_WRITE_COMBINE		0x08		// PWT, which selects PAT entry 1
+#define PAGE_UNCACHEABLE		0x10		// PCD, UC- unless PWT is also set
+#define PAGE_ACCESSED			0x20		// set by the CPU
+#define PAGE_DIRTY			0x40		// set by the CPU
+#define PAGE_SWAPPED			0x40		// software, only in entries that aren't present
 #define PAGE_LARGE			0x80		// only used for x86_64
+#define LARGE_PAGE_SIZE			0x200000	// 2 MB
+
+// Software-only flags for vmm_alloc(), never written to the page tables; they
+// take bits the CPU ignores, above the ones page flags are passed in
+#define VMM_NOZERO			0x400		// caller overwrites the memory anyway
+#define VMM_LAZY			0x800		// reserve only, map pages on first touch
+
+// Page Fault Error Code
+#define PF_PRESENT			0x01		// protection violation, not a missing page
+#define PF_WRITE			0x02
+#define PF_USER				0x04
+#define PF_RESERVED			0x08
+
+// Lazy Regions
+#define MAX_VMM_LAZY			128
+#define KMALLOC_LAZY_PAGES		16		// kmalloc() of 64 KB or more is lazy
+
+// Pre-zeroed Page Pool
+#define ZERO_POOL_SIZE			512		// frames, 2 MB
+#define ZERO_POOL_BATCH			32		// frames zeroed per idle wakeup
+#define ZERO_POOL_MIN_FREE		16384		// don't refill below 64 MB of free memory
 
 #if __i386__
+#define KERNEL_SLAB			0xC8000000	// slab allocator
+#define KERNEL_SLAB_END			0xD8000000
 #define KERNEL_HEAP			0xD8000000
 #define HW_FRAMEBUFFER			0xF0000000
 #define SW_FRAMEBUFFER			0xF4000000
+#define KERNEL_MMIO			0xF8000000	// vmm_request_map()
+#define KERNEL_MMIO_END			0xFFC00000
+#define KERNEL_KMAP			0xFFC00000	// kmap() slots
 #define HEAP_ALIGNMENT			16		// SSE-aligned
 #endif
 
+// Page Table Entries; on i386 the page tables are one array of them for all 4 GB
+#if __i386__ && PAE
+typedef uint64_t pte_t;
+#define PAGE_DIRECTORY_ENTRIES		2048		// four directories, one per GB
+#define PAGE_DIRECTORY_POINTERS		4
+#else
+typedef size_t pte_t;
+#define PAGE_DIRECTORY_ENTRIES		1024		// i386 only
+#endif
+
 #if __x86_64__
 #define PHYSICAL_MEMORY			0x10000000000	// 1024 GB
 #define KERNEL_HEAP			0x8000000000	// 512 GB
 #define HW_FRAMEBUFFER			0x8080000000	// 514 GB
 #define SW_FRAMEBUFFER			0x8084000000	// after HW framebuffer
+#define KERNEL_SLAB			0x8100000000	// 516 GB
+#define KERNEL_SLAB_END			0x8200000000	// 520 GB
+#define KERNEL_MMIO			0x8200000000	// vmm_request_map()
+#define KERNEL_MMIO_END			0x8300000000	// 524 GB
 #define HEAP_ALIGNMENT			32		// 64-bit might use AVX, so do AVX alignment
+#define USER_SPACE			0x20000000000	// 2 TB, per address space
+#define USER_SPACE_END			0x800000000000	// 128 TB, end of the lower half
+#define PAGE_GLOBAL			0x100		// kernel pages, survive CR3 writes
+#define PAGE_COW			0x200		// software bit, read-only until written
 #endif
 
+// I/O Memory Types, for ioremap()
+#define IOREMAP_WB			0		// write-back, for tables in RAM
+#define IOREMAP_WC			1		// write-combining, for framebuffers
+#define IOREMAP_UC_MINUS		2		// uncached, but MTRRs may still make it WC
+#define IOREMAP_UC			3		// strongly uncached, for registers
+#define IOREMAP_TYPES			4
+#define MAX_IOREMAPS			64
+
+// PAT entries 0 to 3 are WB, WC, UC-, UC, picked by the PWT and PCD bits, and
+// entries 4 to 7 repeat them; only entry 1 differs from the power-on default
+#define PAT_VALUE			0x0007010600070106
+
+// Slab Allocator
+#define CACHE_LINE_SIZE			64
+#define SLAB_PAGES			4		// each slab is 16 KB
+#define SLAB_SIZE			(SLAB_PAGES << PAGE_SIZE_SHIFT)
+#define SLAB_MIN_SIZE			16		// smallest kmalloc() size class
+#define SLAB_MAX_SIZE			2048		// largest kmalloc() size class
+#define SLAB_CLASSES			8		// 16, 32, 64 ... 2048
+#define SLAB_EMPTY_KEEP			1		// empty slabs kept per cache
+#define MAX_SLAB_CACHES			32
+#define SLAB_MAGIC			0x42414C53	// 'SLAB'
+
+typedef struct slab_t
+{
+	size_t magic;
+	struct slab_cache_t *cache;
+	struct slab_t *next;
+	struct slab_t *prev;
+	void *free_list;
+	size_t free_count;
+} slab_t;
+
+typedef struct slab_cache_t
+{
+	char present;
+	char name[32];
+	size_t object_size;		// rounded up to the alignment
+	size_t alignment;
+	size_t first_object;		// offset of the first object in a slab
+	size_t objects_per_slab;
+
+	slab_t *partial;
+	slab_t *full;
+	slab_t *empty;
+
+	size_t slab_count;
+	size_t empty_count;
+	size_t object_count;		// objects currently allocated
+	lock_t lock;
+} slab_cache_t;
+
+// Virtual Address Arenas
+#define VMM_ARENAS			3		// heap, slab, MMIO
+#define MAX_VMM_EXTENTS			2048		// extent nodes each arena starts with
+
+// A free range of virtual pages; the free extents of an arena are kept in an
+// AVL tree sorted by base, where each node also knows the largest free
+// extent below it, so first-fit and release are both O(log n)
+typedef struct vmm_extent_t
+{
+	size_t base;
+	size_t count;			// in pages
+	size_t max_count;		// largest count in this subtree
+	struct vmm_extent_t *left;
+	struct vmm_extent_t *right;
+	size_t height;
+} vmm_extent_t;
+
+typedef struct vmm_arena_t
+{
+	char name[16];
+	size_t start;
+	size_t end;
+
+	vmm_extent_t *root;
+	vmm_extent_t *free_nodes;	// unused nodes, linked through left
+
+	size_t extent_count;
+	size_t pool_pages;		// pages of nodes, grows when they run out
+	size_t free_pages;
+	size_t leaked_pages;		// released while out of nodes and memory
+	lock_t lock;
+} vmm_arena_t;
+
+// A range of virtual memory that is only reserved, and populated by the page
+// fault handler; reads map the shared zero page, writes map a private frame
+typedef struct vmm_lazy_t
+{
+	size_t base;
+	size_t count;			// in pages
+	uint8_t flags;			// page flags for private frames
+	size_t owner;			// return address of the allocating code, if known
+
+	size_t faults;
+	size_t zero_faults;		// read faults served by the zero page
+	size_t resident;		// private frames mapped
+	size_t swapped;			// private frames compressed by zram
+	size_t merged;			// pages sharing a frame merged by ksm
+} vmm_lazy_t;
+
+// An address space; everything outside USER_SPACE is the kernel's and is
+// shared by all of them through the same PML4 entries
+typedef struct vmm_space_t
+{
+	size_t pml4;			// physical
+	size_t tables;			// paging structures owned, including the PML4
+
+	size_t shared;			// pages shared copy-on-write when this space was cloned
+	size_t copied;			// write faults that copied a shared page
+	size_t reused;			// write faults where the other sharers were already gone
+
+	uint64_t tlb_gen;		// changes whenever stale TLB entries may exist
+	volatile uint32_t cpus;		// bitmap of CPU indexes running it, all for the kernel's
+} vmm_space_t;
+
+// One per frame of RAM, 16 bytes each
+typedef struct pmm_frame_t
+{
+	uint32_t next;			// free list links by frame number, the owner's while allocated
+	uint32_t prev;
+	uint8_t order;			// PMM_NO_ORDER unless head of a free block
+	uint8_t node;			// NUMA node
+	uint16_t refcount;		// mappings of a shared frame, 0 if it has one owner
+	uint8_t flags;			// PMM_FRAME_*
+	uint8_t tag;			// PMM_TAG_*, who allocated it
+	uint16_t reserved;
+} pmm_frame_t;
+
+// Per-CPU cache of single frames, kept in cpu_t
+// This is a ring of frame numbers: the coldest frame is at start, and the
+// hottest frame, the one most recently freed, is at start+count-1
+typedef struct pmm_pcp_t
+{
+	uint32_t frames[PCP_SIZE];
+	size_t start;
+	size_t count;
+
+	uint64_t hits;			// allocations served from the cache
+	uint64_t misses;		// allocations that had to refill
+	uint64_t refills;		// batches taken from the buddy allocator
+	uint64_t drains;		// batches given back to the buddy allocator
+} pmm_pcp_t;
+
+// Per-CPU arena for buffers that only live during one call, see mm/scratch.c
+typedef struct scratch_t
+{
+	void *base;
+	size_t top;			// bytes in use
+	void *overflow;			// heap allocations, latest first
+
+	size_t high_water;
+	uint64_t allocs;
+	uint64_t overflows;		// allocations that didn't fit and went to the heap
+	uint64_t pops;			// frees that gave memory back right away
+} scratch_t;
+
+typedef struct scratch_mark_t
+{
+	size_t top;
+	void *overflow;
+} scratch_mark_t;
+
+// A range of device or firmware memory mapped by ioremap()
+typedef struct ioremap_t
+{
+	size_t physical;		// page-aligned
+	size_t count;			// pages, zero if the entry is free
+	size_t virtual;
+	size_t refcount;
+	uint8_t type;			// IOREMAP_*
+} ioremap_t;
+
 extern uint64_t total_memory, usable_memory;
-extern uint8_t *pmm_bitmap;
 extern size_t total_pages, used_pages, reserved_pages;
+extern pmm_frame_t *pmm_frames;
+extern size_t pmm_frame_count;
+extern size_t pmm_free_blocks[];
+extern size_t pmm_node_free[];
+extern size_t pmm_zone_free[];
+extern const char *pmm_zone_names[];
+extern uint8_t pmm_pcp_ready;
+extern scratch_t scratch_boot;
 
 // Generic Functions
 void *kmalloc(size_t);
+void *kmalloc_nozero(size_t);
 void *kcalloc(size_t, size_t);
 void *krealloc(void *, size_t);
 void kfree(void *);
 
 void mm_init(multiboot_info_t *);
 
+// Scratch Arenas
+void scratch_init(scratch_t *);
+scratch_mark_t scratch_mark();
+void scratch_reset(scratch_mark_t);
+void *scratch_alloc(size_t);
+void *scratch_calloc(size_t, size_t);
+void scratch_free(void *);
+void scratch_dump();
+
+// Temporary Mappings
+void *kmap(paddr_t);
+void kunmap(void *);
+void kmap_dump();
+
+// I/O Memory Mappings
+void ioremap_cpu_init();
+void *ioremap(size_t, size_t, uint8_t);
+void iounmap(void *);
+void ioremap_dump();
+
+// Slab Allocator
+void slab_init();
+slab_cache_t *slab_create(const char *, size_t, size_t);
+void *slab_alloc(slab_cache_t *);
+void *slab_alloc_nozero(slab_cache_t *);
+void slab_free(slab_cache_t *, void *);
+slab_cache_t *slab_find_class(size_t);
+size_t slab_shrink(size_t);
+
 // Physical Memory Manager
 void pmm_init(multiboot_info_t *);
-void pmm_mark_used(size_t, size_t);
-void pmm_mark_free(size_t, size_t);
-uint8_t pmm_is_page_free(size_t);
-size_t pmm_find_range(size_t);
-size_t pmm_alloc(size_t);
+void pmm_buddy_init(pmm_frame_t *, size_t);
+void pmm_mark_used(paddr_t, size_t);
+void pmm_mark_free(paddr_t, size_t);
+uint8_t pmm_is_page_free(paddr_t);
+void pmm_ref(paddr_t);
+size_t pmm_unref(paddr_t);
+size_t pmm_refcount(paddr_t);
+paddr_t pmm_alloc(size_t);
+paddr_t pmm_alloc_node(size_t, uint8_t);
+paddr_t pmm_alloc_zone(size_t, uint8_t);
+paddr_t pmm_alloc_chunk(size_t, uint8_t, uint8_t, size_t *);
+size_t pmm_largest_free();
+void pmm_numa_init();
+void pmm_set_tag(paddr_t, size_t, uint8_t);
+uint8_t pmm_get_tag(paddr_t);
+void pmm_set_flags(paddr_t, size_t, uint8_t);
+void pmm_clear_flags(paddr_t, size_t, uint8_t);
+uint8_t pmm_get_flags(paddr_t);
+void pmm_tag_dump();
+void pmm_dump_orders();
+void pmm_pcp_dump();
+void pmm_fragmentation_dump();
+void pmm_zone_dump();
+
+// Pre-zeroed Page Pool
+void zero_pool_init();
+size_t zero_pool_alloc();
+size_t zero_page_alloc();
+void zero_pool_idle();
+void zero_pool_dump();
 
 // Virtual Memory Manager
-size_t *page_directory, *page_tables;
+pte_t *page_directory, *page_tables;
 void vmm_init();
-size_t vmm_get_page(size_t);
-void vmm_map(size_t, size_t, size_t, uint8_t);
+pte_t vmm_get_page(size_t);
+void vmm_map(size_t, paddr_t, size_t, uint8_t);
+pte_t vmm_map_noflush(size_t, paddr_t, uint8_t);
 void vmm_unmap(size_t, size_t);
 size_t vmm_find_range(size_t, size_t);
-size_t vmm_alloc(size_t, size_t, uint8_t);
+size_t vmm_alloc(size_t, size_t, uint16_t);
+size_t vmm_alloc_contiguous(size_t, size_t, uint16_t, uint8_t, paddr_t *);
+int vmm_map_frames(size_t, size_t, uint8_t);
+void vmm_free_frames(size_t, size_t);
+void vmm_frames_dump();
 void vmm_free(size_t, size_t);
 size_t vmm_request_map(size_t, size_t, uint8_t);
+void vmm_dump_mappings();
+
+// Address Spaces, x86_64 only
+extern vmm_space_t vmm_kernel_space;
+vmm_space_t *vmm_space_create();
+vmm_space_t *vmm_space_clone(vmm_space_t *);
+void vmm_space_free(vmm_space_t *);
+void vmm_space_switch(vmm_space_t *);
+int vmm_cow_fault(size_t, size_t);
+void vmm_space_dump(vmm_space_t *);
+
+// Lazy Regions
+extern void page_fault_stub();
+void vmm_lazy_init();
+int vmm_lazy_add(size_t, size_t, uint8_t);
+int vmm_lazy_release(size_t, size_t);
+void vmm_lazy_set_owner(size_t, size_t);
+void vmm_page_fault(size_t, size_t, size_t);
+void vmm_lazy_dump();
+
+// Virtual Address Arenas
+void vmm_arena_init();
+vmm_arena_t *vmm_arena_find(size_t);
+size_t vmm_arena_reserve(vmm_arena_t *, size_t);
+size_t vmm_arena_reserve_aligned(vmm_arena_t *, size_t, size_t, size_t);
+void vmm_arena_release(vmm_arena_t *, size_t, size_t);
 
 
 
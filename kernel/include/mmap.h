@@ -0,0 +1,45 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#pragma once
+
+#include <types.h>
+#include <vfs.h>
+
+#define MAX_PAGE_CACHES			64
+#define MAX_MMAP_AREAS			128
+
+// One of these per cached file, the pages are shared by all its mappings
+typedef struct page_cache_t
+{
+	uint8_t present;
+	int mountpoint;
+	ino_t inode;
+	size_t size;			// in bytes
+	size_t page_count;
+	size_t *pages;			// physical, zero if not read yet
+	uint8_t *dirty;
+	size_t mappings;		// areas using it, can't be dropped until zero
+	size_t resident;
+	size_t hits;
+	size_t misses;
+} page_cache_t;
+
+typedef struct mmap_area_t
+{
+	size_t base;			// zero if the slot is free
+	size_t count;			// in pages
+	page_cache_t *cache;
+	size_t first_page;		// page number of the file at base
+	int prot;
+	int flags;
+	size_t faults;
+	size_t copies;			// pages copied by writes to MAP_PRIVATE
+} mmap_area_t;
+
+int mmap_fault(size_t, size_t);
+void mmap_dump();
+
@@ -0,0 +1,99 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#pragma once
+
+#include <types.h>
+#include <acpi.h>
+
+#define MAX_NUMA_NODES		8
+#define MAX_NUMA_RANGES		32
+
+#define NUMA_LOCAL_DISTANCE	10		// SLIT defaults when there's no SLIT
+#define NUMA_REMOTE_DISTANCE	20
+
+// Allocation Policies, per CPU
+#define NUMA_POLICY_LOCAL	0		// current CPU's node, then nearest
+#define NUMA_POLICY_INTERLEAVE	1		// round-robin over all nodes
+#define NUMA_POLICY_BIND	2		// one node only, no fallback
+
+// ACPI SRAT Table Fields
+#define SRAT_ENTRY_LAPIC	0
+#define SRAT_ENTRY_MEMORY	1
+#define SRAT_ENTRY_X2APIC	2
+#define SRAT_ENABLED		0x0001
+
+typedef struct acpi_srat_t
+{
+	acpi_header_t header;
+	uint32_t reserved1;
+	uint64_t reserved2;
+
+	uint8_t entries[];
+}__attribute__((packed)) acpi_srat_t;
+
+typedef struct srat_lapic_t
+{
+	uint8_t type;
+	uint8_t size;
+	uint8_t domain_low;
+	uint8_t apic_id;
+	uint32_t flags;
+	uint8_t sapic_eid;
+	uint8_t domain_high[3];
+	uint32_t clock_domain;
+}__attribute__((packed)) srat_lapic_t;
+
+typedef struct srat_memory_t
+{
+	uint8_t type;
+	uint8_t size;
+	uint32_t domain;
+	uint16_t reserved1;
+	uint64_t base;
+	uint64_t length;
+	uint32_t reserved2;
+	uint32_t flags;
+	uint64_t reserved3;
+}__attribute__((packed)) srat_memory_t;
+
+typedef struct srat_x2apic_t
+{
+	uint8_t type;
+	uint8_t size;
+	uint16_t reserved1;
+	uint32_t domain;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t clock_domain;
+	uint32_t reserved2;
+}__attribute__((packed)) srat_x2apic_t;
+
+typedef struct acpi_slit_t
+{
+	acpi_header_t header;
+	uint64_t count;
+
+	uint8_t distances[];
+}__attribute__((packed)) acpi_slit_t;
+
+typedef struct numa_range_t
+{
+	uint64_t base;
+	uint64_t length;
+	uint8_t node;
+} numa_range_t;
+
+extern size_t numa_node_count;
+extern uint8_t numa_distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+extern uint8_t numa_fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+void numa_init();
+uint8_t numa_cpu_node(uint8_t);
+uint8_t numa_memory_node(paddr_t);
+void numa_set_policy(uint8_t, uint8_t);
+void numa_dump();
+
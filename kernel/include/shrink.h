@@ -0,0 +1,58 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#pragma once
+
+#include <types.h>
+
+#define MAX_SHRINKERS			16
+#define SHRINK_MIN_DIVISOR		256		// min watermark is 1/256 of a zone
+#define SHRINK_MIN_PAGES		32		// but never less than 128 KB
+#define SHRINK_MAX_PAGES		4096		// nor more than 16 MB
+#define SHRINK_BATCH			32		// pages asked for per background pass
+
+#define SHRINKER_DIRECT			0x01		// safe to call from inside pmm_alloc()
+
+// Watermarks, in free pages
+#define WMARK_MIN			0		// allocations reclaim directly below this
+#define WMARK_LOW			1		// background reclaim starts below this
+#define WMARK_HIGH			2		// and goes on until this is free
+
+// Something holding memory it can give back. count() says how many pages it
+// could free, scan() tries to free at least the given count and says how many
+// it did. Shrinkers without SHRINKER_DIRECT may take locks that the caller of
+// pmm_alloc() already holds, so they're only called from idle reclaim.
+typedef struct shrinker_t
+{
+	char name[16];
+	size_t (*count)();
+	size_t (*scan)(size_t);
+	int priority;			// lower is called first
+	uint8_t flags;
+	uint8_t present;
+
+	uint64_t calls;
+	uint64_t reclaimed;		// pages
+	uint64_t cycles;		// TSC cycles spent in scan()
+	uint64_t max_cycles;
+} shrinker_t;
+
+typedef struct shrink_watermark_t
+{
+	size_t min;
+	size_t low;
+	size_t high;
+} shrink_watermark_t;
+
+void shrink_init();
+shrinker_t *shrink_register(const char *, size_t (*)(), size_t (*)(size_t), int, uint8_t);
+void shrink_unregister(shrinker_t *);
+int shrink_pressure(int);
+int shrink_zone_pressure(int, uint8_t);
+size_t shrink_memory(size_t, int);
+void shrink_wakeup();
+void shrink_idle();
+void shrink_dump();
@@ -19,9 +19,10 @@ char *hex64_to_string(uint64_t, char *);
 char *strcpy(char *, const char *);
 size_t oct_to_dec(char *);
 
-void *memset(void *, int, size_t);
+extern void *memset(void *, int, size_t);		// rep stos
 extern void *memcpy(void *, const void *, size_t);	// beautiful SSE2 memcpy
 int memcmp(const void *, const void *, size_t);
 int strcmp(const char *, const char *);
 extern void sse2_copy(void *, void *, size_t);		// copies blocks, each block is 128 bytes
+extern void sse2_zero_pages(void *, size_t);		// non-temporal, doesn't pollute the caches
 
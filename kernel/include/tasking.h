@@ -69,12 +69,13 @@ typedef struct process_t
 	size_t pmem_base;
 	size_t pmem_size;
 	size_t tty;
+	struct vmm_space_t *space;
 
 	char path[1024];
 } process_t;
 #endif
 
-process_t *processes;
+process_t *processes[MAX_PROCESSES];		// NULL where there is no process
 
 void tasking_init();
 char *get_path(char *);
@@ -0,0 +1,76 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#pragma once
+
+#include <types.h>
+
+#define TLB_VECTOR			0xFE		// shootdown IPI, right below the spurious IRQ
+#define TLB_BATCH_SIZE			16		// ranges per batch
+#define TLB_FULL_FLUSH_PAGES		64		// above this, reload CR3 instead of invlpg
+#define TLB_ALL_CPUS			0xFFFFFFFF
+#define TLB_ASIDS			8		// PCIDs 1-8 cached per CPU, 0 is the kernel's
+
+// INVPCID Types
+#define INVPCID_ADDRESS			0
+#define INVPCID_CONTEXT			1
+#define INVPCID_ALL_GLOBAL		2
+#define INVPCID_ALL			3
+
+// Pending invalidations, collected by the caller and flushed at once
+typedef struct tlb_batch_t
+{
+	size_t base[TLB_BATCH_SIZE];
+	size_t count[TLB_BATCH_SIZE];
+	size_t ranges;
+	size_t pages;
+	uint8_t full;			// too much to invlpg, reload CR3
+} tlb_batch_t;
+
+// A shootdown in flight, one slot per initiating CPU
+typedef struct tlb_request_t
+{
+	tlb_batch_t batch;
+	volatile uint32_t pending;	// bitmap of CPU indexes that haven't flushed yet
+} tlb_request_t;
+
+// Per-CPU counters, kept in cpu_t
+typedef struct tlb_stats_t
+{
+	uint64_t flushes;		// batches flushed on this CPU
+	uint64_t pages;			// pages invalidated with invlpg
+	uint64_t full_flushes;		// CR3 reloads
+	uint64_t shootdowns;		// batches sent to other CPUs
+	uint64_t ipis_sent;
+	uint64_t ipis_received;
+	uint64_t asid_hits;		// switches that kept their TLB entries
+	uint64_t asid_misses;		// switches that had to take a PCID
+	uint64_t asid_stale;		// switches to a PCID whose entries were stale
+} tlb_stats_t;
+
+// A PCID on one CPU, kept in cpu_t; tlb_gen is the space's generation when
+// the PCID's entries were last known to be valid
+typedef struct tlb_asid_t
+{
+	struct vmm_space_t *space;
+	uint64_t tlb_gen;
+	uint64_t last_used;
+} tlb_asid_t;
+
+extern void tlb_shootdown_stub();
+extern uint8_t tlb_pcid;
+extern volatile uint32_t tlb_requests_active;
+
+void tlb_init();
+void tlb_cpu_init();
+size_t tlb_asid_cr3(struct vmm_space_t *);
+void tlb_batch_init(tlb_batch_t *);
+void tlb_batch_add(tlb_batch_t *, size_t, size_t);
+void tlb_batch_flush(tlb_batch_t *, uint32_t);
+void tlb_flush(size_t, size_t);
+void tlb_shootdown_poll();
+void tlb_dump();
+
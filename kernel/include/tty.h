@@ -40,6 +40,7 @@ typedef struct tty_t
 } tty_t;
 
 extern uint8_t bootfont[];
+extern size_t hw_framebuffer;
 
 tty_t *ttys;
 
@@ -25,11 +25,18 @@ typedef int32_t pid_t;
 #if __x86_64__
 typedef unsigned long long size_t;
 typedef signed long long ssize_t;
+typedef size_t paddr_t;			// physical address
 #endif
 
 #if __i386__
 typedef unsigned int size_t;
 typedef signed int ssize_t;
+
+#if PAE
+typedef uint64_t paddr_t;		// PAE frames can be above 4 GB
+#else
+typedef size_t paddr_t;
+#endif
 #endif
 
 extern void *kend;
@@ -29,6 +29,8 @@
 #define ENODEV				-13
 #define ENOTBLK				-14
 #define EBUSY				-15
+#define ENOMEM				-16
+#define EFBIG				-17
 
 // open() flags
 #define O_RDONLY			0x0001
@@ -78,6 +80,21 @@
 #define SEEK_CUR			2
 #define SEEK_END			3
 
+// mmap() protection and flags
+#define PROT_NONE			0x0000
+#define PROT_READ			0x0001
+#define PROT_WRITE			0x0002
+#define PROT_EXEC			0x0004
+
+#define MAP_SHARED			0x0001
+#define MAP_PRIVATE			0x0002
+#define MAP_FAILED			((void*)-1)
+
+// msync() flags
+#define MS_ASYNC			0x0001
+#define MS_SYNC				0x0002
+#define MS_INVALIDATE			0x0004
+
 // Standard file descriptor numbers
 #define STDIN				0
 #define STDOUT				1
@@ -108,15 +125,13 @@ typedef size_t blkcnt_t;
 
 typedef struct file_handle_t
 {
-	char present;
 	char path[1024];
 	off_t position;
 	int flags;
 	pid_t pid;
+	size_t refcount;	// the handle table's and vfs_file_get()'s, freed at zero
 } file_handle_t;
 
-file_handle_t *files;
-
 typedef struct directory_t
 {
 	char path[1024];
@@ -131,13 +146,14 @@ typedef struct directory_entry_t
 
 typedef struct mountpoint_t
 {
-	char present;
+	char present;			// 2 while mounting, 1 once mounted
 	char fstype[16];
 	char path[1024];
 	char device[64];		// '/dev/hdxpx'
 	unsigned long int flags;
 	uid_t uid;
 	gid_t gid;
+	void *fs_data;			// the filesystem's own mount context
 } mountpoint_t;
 
 struct stat
@@ -158,13 +174,15 @@ struct stat
 };
 
 lock_t vfs_mutex;
-file_handle_t *files;
-mountpoint_t *mountpoints;
+file_handle_t *files[MAX_FILES];		// NULL where not open
+mountpoint_t *mountpoints[MAX_MOUNTPOINTS];	// NULL where nothing is mounted
 char full_path[1024];
 
 void vfs_init();
 size_t vfs_resolve_path(char *, const char *);
 int vfs_determine_mountpoint(char *);
+file_handle_t *vfs_file_get(int);
+void vfs_file_put(file_handle_t *);
 
 // Public functions
 int open(const char *, int, ...);
@@ -182,6 +200,9 @@ int mkdir(const char *, mode_t);
 int mount(const char *, const char *, const char *, unsigned long int, void *);
 int umount(const char *);
 int umount2(const char *, int);
+void *mmap(void *, size_t, int, int, int, off_t);
+int munmap(void *, size_t);
+int msync(void *, size_t, int);
 
 // Non-standard functions
 directory_t *dir_open(char *);
@@ -0,0 +1,41 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+#pragma once
+
+#include <types.h>
+
+#define ZRAM_MAX_SLOTS			8192		// compressed pages, 32 MB worth
+#define ZRAM_MAX_STORE			2048		// frames holding them, 8 MB
+#define ZRAM_MAX_OBJECT			3072		// pages that compress worse stay uncompressed
+#define ZRAM_BATCH			32		// fewest pages one reclaim tries to free
+
+#define ZRAM_SLOT_USED			0x01
+#define ZRAM_SLOT_ZERO			0x02		// page was all zeroes, nothing is stored
+
+// One per compressed page, its number is kept in the page table entry
+typedef struct zram_slot_t
+{
+	uint16_t store;			// index into zram_store
+	uint16_t offset;		// within the store frame
+	uint16_t size;			// compressed size
+	uint16_t flags;
+} zram_slot_t;
+
+// Compressed pages are packed into these frames one after another
+typedef struct zram_store_t
+{
+	size_t frame;			// physical, zero if unused
+	uint16_t used;			// bytes, holes left by loaded pages aren't reused
+	uint16_t live;			// compressed pages still in it
+} zram_store_t;
+
+void zram_init();
+size_t zram_reclaim(size_t);
+size_t zram_count();
+int zram_load(size_t, void *);
+void zram_free(size_t);
+void zram_dump();
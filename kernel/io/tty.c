@@ -14,7 +14,7 @@
 
 uint16_t width, height, pitch;
 uint16_t width_chars, height_chars;
-size_t framebuffer;
+size_t framebuffer, hw_framebuffer;
 size_t screen_size, screen_size_dwords, screen_size_sse2;
 size_t back_buffer;
 tty_t *ttys;
@@ -58,11 +58,17 @@ void screen_init(vbe_mode_t *vbe_info)
 	// ... and each register is 16 bytes, so 8*16 = 128
 	screen_size_sse2 = (screen_size+127) / 128;
 
-	// map the framebuffer
-	vmm_map(HW_FRAMEBUFFER, framebuffer, (screen_size / PAGE_SIZE) + 1, PAGE_PRESENT | PAGE_RW);
+	// map the framebuffer write-combining, redraws only ever write whole lines
+	hw_framebuffer = (size_t)ioremap(framebuffer, screen_size, IOREMAP_WC);
+	if(!hw_framebuffer)
+	{
+		kprintf("screen: unable to map framebuffer\n");
+		while(1);
+	}
 
 	// allocate a back buffer
 	back_buffer = pmm_alloc((screen_size / PAGE_SIZE) + 1);
+	pmm_set_tag(back_buffer, (screen_size / PAGE_SIZE) + 1, PMM_TAG_KERNEL);
 	vmm_map(SW_FRAMEBUFFER, back_buffer, (screen_size / PAGE_SIZE) + 1, PAGE_PRESENT | PAGE_RW);
 
 	ttys = kcalloc(TTY_COUNT, sizeof(tty_t));
@@ -115,7 +121,7 @@ inline void screen_redraw()
 	if(lock_flag != 0)
 		return;
 
-	sse2_copy((void*)(HW_FRAMEBUFFER), (void*)(SW_FRAMEBUFFER), screen_size_sse2);
+	sse2_copy((void*)(hw_framebuffer), (void*)(SW_FRAMEBUFFER), screen_size_sse2);
 }
 
 // screen_offset(): Returns offset of a pixel
@@ -9,13 +9,22 @@
 #include <devmgr.h>
 #include <timer.h>
 #include <mm.h>
+#include <tlb.h>
 #include <gdt.h>
 #include <tty.h>
 #include <acpi.h>
+#include <numa.h>
 #include <apic.h>
 #include <vfs.h>
+#include <mmap.h>
+#include <zram.h>
+#include <ksm.h>
+#include <shrink.h>
+#include <dma.h>
 #include <tasking.h>
 #include <blkdev.h>
+#include <ext2.h>
+#include <dcache.h>
 #include <string.h>
 #include <rand.h>
 #include <battery.h>
@@ -73,11 +82,13 @@ void kmain(uint32_t multiboot_magic, multiboot_info_t *multiboot_info, vbe_mode_
 	}
 
 	mm_init(multiboot_info);
+	install_exceptions();		// large kmalloc()s are lazy and fault on first touch
 	devmgr_init();
+	ioremap_cpu_init();		// the framebuffer is mapped WC
 	screen_init(vbe_mode);
 	gdt_init();
-	install_exceptions();
 	acpi_init();
+	numa_init();
 	apic_init();
 	timer_init();
 	acpi_enable();
@@ -88,9 +99,35 @@ void kmain(uint32_t multiboot_magic, multiboot_info_t *multiboot_info, vbe_mode_
 	battery_init();
 
 	kprintf("Boot finished, %d MB used, %d MB free\n", used_pages/256, (total_pages-used_pages) / 256);
+	pmm_fragmentation_dump();
+	pmm_zone_dump();
+	pmm_tag_dump();
+	numa_dump();
+	pmm_pcp_dump();
+	tlb_dump();
+	kmap_dump();
+	ioremap_dump();
+	vmm_dump_mappings();
+	vmm_frames_dump();
+	vmm_lazy_dump();
+	mmap_dump();
+	zero_pool_dump();
+	zram_dump();
+	ksm_dump();
+	shrink_dump();
+	scratch_dump();
+	dma_pool_dump();
+	blkdev_cache_dump();
+	ext2_dump();
+	dcache_dump();
 
 	while(1)
+	{
+		zero_pool_idle();
+		ksm_idle();
+		shrink_idle();
 		asm volatile ("sti\nhlt");
+	}
 }
 
 
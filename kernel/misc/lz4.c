@@ -0,0 +1,252 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* LZ4 Block Compression */
+
+#include <lz4.h>
+#include <string.h>
+
+// Output is in the LZ4 block format: a sequence is a token byte with the
+// literal length in its high nibble and the match length minus 4 in its low
+// nibble, extra length bytes for either nibble that is 15, the literals, and
+// a 16-bit little-endian offset back to the match. The last sequence has only
+// literals. Matches are found with a single hash table of 4-byte sequences,
+// which is fast rather than thorough.
+
+uint32_t lz4_read32(const uint8_t *);
+uint32_t lz4_hash(uint32_t);
+size_t lz4_put_length(uint8_t *, size_t, size_t, size_t);
+
+// lz4_compress(): Compresses a block
+// Param:	const void *source - data to compress
+// Param:	size_t size - size of data
+// Param:	void *destination - buffer for compressed data
+// Param:	size_t capacity - size of buffer
+// Param:	void *work - LZ4_WORK_SIZE bytes for the hash table
+// Return:	size_t - size of compressed data, zero if it doesn't fit
+
+size_t lz4_compress(const void *source, size_t size, void *destination, size_t capacity, void *work)
+{
+	const uint8_t *input = (const uint8_t*)source;
+	uint8_t *output = (uint8_t*)destination;
+	uint32_t *table = (uint32_t*)work;
+
+	size_t in = 0, out = 0, anchor = 0;
+	size_t literals, match, reference, token;
+	uint32_t sequence, hash;
+
+	// positions are stored plus one, so zero means empty
+	memset(table, 0, LZ4_WORK_SIZE);
+
+	while(size > LZ4_MATCH_LIMIT && in < size - LZ4_MATCH_LIMIT)
+	{
+		sequence = lz4_read32(input + in);
+		hash = lz4_hash(sequence);
+		reference = table[hash];
+		table[hash] = in + 1;
+
+		if(!reference || in - (reference - 1) > LZ4_MAX_OFFSET || lz4_read32(input + reference - 1) != sequence)
+		{
+			in++;
+			continue;
+		}
+
+		reference--;
+		match = LZ4_MIN_MATCH;
+		while(in + match < size - LZ4_LAST_LITERALS && input[in + match] == input[reference + match])
+			match++;
+
+		// token, literals, offset and both lengths, at worst
+		literals = in - anchor;
+		if(out + 1 + literals + (literals / 255) + 2 + ((match - LZ4_MIN_MATCH) / 255) + 2 > capacity)
+			return 0;
+
+		token = out;
+		output[token] = 0;
+		out++;
+
+		if(literals >= 15)
+		{
+			output[token] = 15 << 4;
+			out = lz4_put_length(output, out, literals - 15, capacity);
+		} else
+		{
+			output[token] = literals << 4;
+		}
+
+		memcpy(output + out, input + anchor, literals);
+		out += literals;
+
+		output[out] = (in - reference) & 0xFF;
+		output[out + 1] = ((in - reference) >> 8) & 0xFF;
+		out += 2;
+
+		if(match - LZ4_MIN_MATCH >= 15)
+		{
+			output[token] |= 15;
+			out = lz4_put_length(output, out, match - LZ4_MIN_MATCH - 15, capacity);
+		} else
+		{
+			output[token] |= match - LZ4_MIN_MATCH;
+		}
+
+		in += match;
+		anchor = in;
+	}
+
+	// whatever is left goes out as literals
+	literals = size - anchor;
+	if(out + 1 + literals + (literals / 255) + 1 > capacity)
+		return 0;
+
+	token = out;
+	out++;
+
+	if(literals >= 15)
+	{
+		output[token] = 15 << 4;
+		out = lz4_put_length(output, out, literals - 15, capacity);
+	} else
+	{
+		output[token] = literals << 4;
+	}
+
+	memcpy(output + out, input + anchor, literals);
+	out += literals;
+
+	return out;
+}
+
+// lz4_decompress(): Decompresses a block
+// Param:	const void *source - compressed data
+// Param:	size_t size - size of compressed data
+// Param:	void *destination - buffer for decompressed data
+// Param:	size_t capacity - size of buffer
+// Return:	int - size of decompressed data, -1 if the data is corrupt
+
+int lz4_decompress(const void *source, size_t size, void *destination, size_t capacity)
+{
+	const uint8_t *input = (const uint8_t*)source;
+	uint8_t *output = (uint8_t*)destination;
+
+	size_t in = 0, out = 0;
+	size_t literals, match, offset;
+	uint8_t token, byte;
+
+	while(in < size)
+	{
+		token = input[in];
+		in++;
+
+		literals = token >> 4;
+		if(literals == 15)
+		{
+			do
+			{
+				if(in >= size)
+					return -1;
+
+				byte = input[in];
+				in++;
+				literals += byte;
+			} while(byte == 255);
+		}
+
+		if(in + literals > size || out + literals > capacity)
+			return -1;
+
+		memcpy(output + out, input + in, literals);
+		in += literals;
+		out += literals;
+
+		// the last sequence has no match
+		if(in >= size)
+			break;
+
+		if(in + 2 > size)
+			return -1;
+
+		offset = input[in] | (input[in + 1] << 8);
+		in += 2;
+
+		if(!offset || offset > out)
+			return -1;
+
+		match = token & 15;
+		if(match == 15)
+		{
+			do
+			{
+				if(in >= size)
+					return -1;
+
+				byte = input[in];
+				in++;
+				match += byte;
+			} while(byte == 255);
+		}
+
+		match += LZ4_MIN_MATCH;
+		if(out + match > capacity)
+			return -1;
+
+		// matches may overlap what they produce, so copy byte by byte
+		while(match)
+		{
+			output[out] = output[out - offset];
+			out++;
+			match--;
+		}
+	}
+
+	return (int)out;
+}
+
+/* Internal Functions */
+
+// lz4_read32(): Reads 4 bytes that may not be aligned
+// Param:	const uint8_t *ptr - pointer to bytes
+// Return:	uint32_t - value
+
+uint32_t lz4_read32(const uint8_t *ptr)
+{
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+// lz4_hash(): Hashes a 4-byte sequence for the match table
+// Param:	uint32_t sequence - 4 bytes of input
+// Return:	uint32_t - index into the table
+
+uint32_t lz4_hash(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// lz4_put_length(): Writes the extra bytes of a literal or match length
+// Param:	uint8_t *output - compressed data
+// Param:	size_t out - where to write
+// Param:	size_t length - length minus the 15 in the token
+// Param:	size_t capacity - size of buffer, already checked by the caller
+// Return:	size_t - position after the length
+
+size_t lz4_put_length(uint8_t *output, size_t out, size_t length, size_t capacity)
+{
+	while(length >= 255 && out < capacity)
+	{
+		output[out] = 255;
+		out++;
+		length -= 255;
+	}
+
+	if(out < capacity)
+	{
+		output[out] = length;
+		out++;
+	}
+
+	return out;
+}
+
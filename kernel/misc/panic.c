@@ -8,6 +8,7 @@
 #include <kprintf.h>
 #include <idt.h>
 #include <cpu.h>
+#include <mm.h>
 
 // panic: Makes a panic message
 // Param:	char *string - string to display
@@ -79,7 +80,7 @@ void install_exceptions()
 	idt_install(11, (size_t)&segment_handler);
 	idt_install(12, (size_t)&stack_handler);
 	idt_install(13, (size_t)&gpf_handler);
-	idt_install(14, (size_t)&page_handler);
+	idt_install(14, (size_t)&page_fault_stub);
 	idt_install(15, (size_t)&reserved_handler);
 	idt_install(16, (size_t)&floating_handler);
 	idt_install(17, (size_t)&alignment_handler);
@@ -141,28 +141,6 @@ char *hex64_to_string(uint64_t value, char *string)
 	return string;
 }
 
-// memset: Sets memory to a value
-// Param:	void *dest - destination
-// Param:	int value - value to use
-// Param:	size_t count - size of memory
-// Return:	void * - pointer to destination
-
-void *memset(void *dest, int value, size_t count)
-{
-	uint8_t val = (uint8_t)(value & 0xFF);
-	uint8_t *dest2 = (uint8_t*)(dest);
-
-	size_t i = 0;
-
-	while(i < count)
-	{
-		dest2[i] = val;
-		i++;
-	}
-
-	return dest;
-}
-
 // memcmp: Compares memory
 // Param:	const void *ptr1 - memory
 // Param:	const void *ptr2 - memory
@@ -0,0 +1,288 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* DMA Pools, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <dma.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+
+// Drivers that hand many small buffers to a device, like descriptors and
+// command tables, get them from a pool instead of a page each. A pool carves
+// blocks of physically contiguous pages from the zone the device can reach
+// into chunks of one size, and reserves enough of them up front that a driver
+// usually never allocates pages after it has started. Chunks that fit in a page
+// never cross into the next one, since many devices can't follow that.
+// Lock order is dma_mutex, then the lock of a pool, then vmm_mutex.
+
+dma_pool_t dma_pools[MAX_DMA_POOLS];
+lock_t dma_mutex = 0;
+
+dma_block_t *dma_pool_grow(dma_pool_t *);
+size_t dma_pool_next(dma_pool_t *, size_t);
+
+// dma_pool_create(): Creates a pool of DMA buffers
+// Param:	const char *name - name of the pool
+// Param:	size_t size - size of each chunk
+// Param:	size_t alignment - chunk alignment, a power of two up to PAGE_SIZE, zero for default
+// Param:	uint8_t zone - highest zone the device can reach, PMM_ZONE_*
+// Param:	size_t reserve - count of chunks to allocate up front
+// Return:	dma_pool_t * - pointer to pool, NULL on error
+
+dma_pool_t *dma_pool_create(const char *name, size_t size, size_t alignment, uint8_t zone, size_t reserve)
+{
+	if(!size || zone >= PMM_ZONES || alignment > PAGE_SIZE || (alignment & (alignment - 1)))
+		return NULL;
+
+	if(alignment < DMA_POOL_MIN_ALIGN)
+		alignment = DMA_POOL_MIN_ALIGN;
+
+	acquire_lock(&dma_mutex);
+
+	size_t i = 0;
+	while(i < MAX_DMA_POOLS && dma_pools[i].present)
+		i++;
+
+	if(i >= MAX_DMA_POOLS)
+	{
+		release_lock(&dma_mutex);
+		kprintf("dma: no free pool descriptors for '%s'\n", name);
+		return NULL;
+	}
+
+	dma_pool_t *pool = &dma_pools[i];
+	memset(pool, 0, sizeof(dma_pool_t));
+
+	if(strlen(name) > 31)
+		memcpy(pool->name, name, 31);
+	else
+		strcpy(pool->name, name);
+
+	pool->size = (size + alignment - 1) & ~(alignment - 1);
+	pool->alignment = alignment;
+	pool->zone = zone;
+	pool->block_pages = DMA_POOL_BLOCK_PAGES;
+	if(pool->size > (DMA_POOL_BLOCK_PAGES << PAGE_SIZE_SHIFT))
+		pool->block_pages = (pool->size + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+
+	// count what fits the same way dma_pool_grow() carves it
+	size_t offset = dma_pool_next(pool, 0);
+	while(offset + pool->size <= (pool->block_pages << PAGE_SIZE_SHIFT))
+	{
+		pool->chunks_per_block++;
+		offset = dma_pool_next(pool, offset + pool->size);
+	}
+
+	pool->present = 1;
+
+	acquire_lock(&pool->lock);
+
+	while(pool->free_count < reserve)
+	{
+		if(!dma_pool_grow(pool))
+		{
+			release_lock(&pool->lock);
+			release_lock(&dma_mutex);
+
+			kprintf("dma: unable to reserve %d chunks for '%s'\n", reserve, name);
+			dma_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	// reserved blocks don't count as growing
+	pool->grows = 0;
+
+	release_lock(&pool->lock);
+	release_lock(&dma_mutex);
+	return pool;
+}
+
+// dma_pool_alloc(): Allocates a chunk from a pool
+// Param:	dma_pool_t *pool - pool to allocate from
+// Param:	paddr_t *physical - where to store the physical address
+// Return:	void * - pointer to zero-initialized chunk, NULL on error
+
+void *dma_pool_alloc(dma_pool_t *pool, paddr_t *physical)
+{
+	if(!pool || !pool->present)
+		return NULL;
+
+	acquire_lock(&pool->lock);
+
+	dma_block_t *block = pool->blocks;
+	while(block && !block->free_count)
+		block = block->next;
+
+	if(!block)
+	{
+		block = dma_pool_grow(pool);
+		if(!block)
+		{
+			pool->failures++;
+			release_lock(&pool->lock);
+			return NULL;
+		}
+	}
+
+	void *chunk = block->free_list;
+	block->free_list = ((void**)chunk)[0];
+	block->free_count--;
+	pool->free_count--;
+	pool->allocs++;
+
+	release_lock(&pool->lock);
+
+	memset(chunk, 0, pool->size);
+
+	if(physical)
+		physical[0] = block->physical + ((size_t)chunk - block->virtual);
+
+	return chunk;
+}
+
+// dma_pool_free(): Frees a chunk back to its pool
+// Param:	dma_pool_t *pool - pool it came from
+// Param:	void *chunk - pointer to chunk
+// Return:	Nothing
+
+void dma_pool_free(dma_pool_t *pool, void *chunk)
+{
+	if(!pool || !chunk)
+		return;
+
+	acquire_lock(&pool->lock);
+
+	// pools have few blocks, each of many chunks
+	size_t block_size = pool->block_pages << PAGE_SIZE_SHIFT;
+	dma_block_t *block = pool->blocks;
+	while(block && ((size_t)chunk < block->virtual || (size_t)chunk >= block->virtual + block_size))
+		block = block->next;
+
+	if(!block)
+	{
+		release_lock(&pool->lock);
+		kprintf("dma: %s: freeing 0x%xq, which isn't in the pool\n", pool->name, (uint64_t)(size_t)chunk);
+		return;
+	}
+
+	((void**)chunk)[0] = block->free_list;
+	block->free_list = chunk;
+	block->free_count++;
+	pool->free_count++;
+	pool->frees++;
+
+	release_lock(&pool->lock);
+}
+
+// dma_pool_destroy(): Destroys a pool, every chunk must have been freed
+// Param:	dma_pool_t *pool - pool
+// Return:	Nothing
+
+void dma_pool_destroy(dma_pool_t *pool)
+{
+	if(!pool)
+		return;
+
+	acquire_lock(&pool->lock);
+
+	if(pool->free_count != pool->block_count * pool->chunks_per_block)
+		kprintf("dma: %s: destroyed with %d chunks still in use\n", pool->name, (pool->block_count * pool->chunks_per_block) - pool->free_count);
+
+	dma_block_t *block = pool->blocks;
+	dma_block_t *next;
+	while(block)
+	{
+		next = block->next;
+		vmm_free(block->virtual, pool->block_pages);
+		kfree(block);
+		block = next;
+	}
+
+	pool->blocks = NULL;
+	pool->present = 0;
+
+	release_lock(&pool->lock);
+}
+
+// dma_pool_dump(): Shows every pool
+// Param:	Nothing
+// Return:	Nothing
+
+void dma_pool_dump()
+{
+	size_t i;
+
+	for(i = 0; i < MAX_DMA_POOLS; i++)
+	{
+		if(!dma_pools[i].present)
+			continue;
+
+		dma_pool_t *pool = &dma_pools[i];
+		kprintf("dma: %s: %d-byte chunks in %s memory, %d blocks, %d of %d chunks free, %d allocs, %d grows, %d failures\n", pool->name, pool->size, pmm_zone_names[pool->zone], pool->block_count, pool->free_count, pool->block_count * pool->chunks_per_block, (uint32_t)pool->allocs, (uint32_t)pool->grows, (uint32_t)pool->failures);
+	}
+}
+
+/* Internal Functions */
+
+// dma_pool_grow(): Adds a block to a pool, called with its lock held
+// Param:	dma_pool_t *pool - pool
+// Return:	dma_block_t * - new block, NULL if out of memory
+
+dma_block_t *dma_pool_grow(dma_pool_t *pool)
+{
+	dma_block_t *block = (dma_block_t*)kmalloc(sizeof(dma_block_t));
+	if(!block)
+		return NULL;
+
+	// chunks are zeroed when they're allocated, so the pages needn't be
+	block->virtual = vmm_alloc_contiguous(KERNEL_HEAP, pool->block_pages, PAGE_PRESENT | PAGE_RW | VMM_NOZERO, pool->zone, &block->physical);
+	if(!block->virtual)
+	{
+		kfree(block);
+		return NULL;
+	}
+
+	// build the free list in address order
+	size_t offset = dma_pool_next(pool, 0);
+	size_t chunk = block->virtual + offset;
+	block->free_list = (void*)chunk;
+	block->free_count = pool->chunks_per_block;
+
+	size_t i = 1;
+	while(i < pool->chunks_per_block)
+	{
+		offset = dma_pool_next(pool, offset + pool->size);
+		((void**)chunk)[0] = (void*)(block->virtual + offset);
+		chunk = block->virtual + offset;
+		i++;
+	}
+
+	((void**)chunk)[0] = NULL;
+
+	block->next = pool->blocks;
+	pool->blocks = block;
+	pool->block_count++;
+	pool->free_count += pool->chunks_per_block;
+	pool->grows++;
+	return block;
+}
+
+// dma_pool_next(): Returns where the next chunk of a block can start
+// Param:	dma_pool_t *pool - pool
+// Param:	size_t offset - first offset it may start at, already aligned
+// Return:	size_t - offset within the block
+
+size_t dma_pool_next(dma_pool_t *pool, size_t offset)
+{
+	// page-aligned offsets are aligned for any pool
+	if(pool->size <= PAGE_SIZE && (offset & (PAGE_SIZE - 1)) + pool->size > PAGE_SIZE)
+		offset = (offset + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	return offset;
+}
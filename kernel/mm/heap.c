@@ -7,26 +7,29 @@
 #include <mm.h>
 #include <string.h>
 
+// Small allocations (up to SLAB_MAX_SIZE) come from the slab allocator, and
+// larger ones are rounded up to whole pages with a header in front of them.
+// From KMALLOC_LAZY_PAGES up, pages are only mapped when they're touched.
+
+void *kmalloc_common(size_t, uint8_t, size_t);
+
 // kmalloc(): Allocates kernel memory
 // Param:	size_t size - number of bytes to allocate
 // Return:	void * - pointer to allocated memory, SSE-aligned
 
 void *kmalloc(size_t size)
 {
-	if(!size)
-		return NULL;
-
-	size_t pages = (size + HEAP_ALIGNMENT + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
-
-	void *ptr = (void*)(vmm_alloc(KERNEL_HEAP, pages, PAGE_PRESENT | PAGE_RW));
-	if(!ptr)
-		return NULL;
+	return kmalloc_common(size, 1, (size_t)__builtin_return_address(0));
+}
 
-	size_t *header = (size_t*)(ptr);
-	header[0] = pages;		// store number of pages
-	header[1] = size;		// store number of bytes
+// kmalloc_nozero(): Allocates kernel memory without zeroing it
+// For buffers the caller overwrites completely anyway
+// Param:	size_t size - number of bytes to allocate
+// Return:	void * - pointer to allocated memory, SSE-aligned
 
-	return ptr + HEAP_ALIGNMENT;
+void *kmalloc_nozero(size_t size)
+{
+	return kmalloc_common(size, 0, (size_t)__builtin_return_address(0));
 }
 
 // kcalloc(): Allocates kernel memory
@@ -47,9 +50,20 @@ void *kcalloc(size_t size, size_t count)
 void *krealloc(void *ptr, size_t size)
 {
 	void *newptr = kmalloc(size);
+	size_t old_size;
 
-	size_t *header = (size_t*)((size_t)ptr - HEAP_ALIGNMENT);
-	size_t old_size = header[1];
+	if((size_t)ptr >= KERNEL_SLAB && (size_t)ptr < KERNEL_SLAB_END)
+	{
+		slab_t *slab = (slab_t*)((size_t)ptr & ~(SLAB_SIZE-1));
+		old_size = slab->cache->object_size;
+	} else
+	{
+		size_t *header = (size_t*)((size_t)ptr - HEAP_ALIGNMENT);
+		old_size = header[1];
+	}
+
+	if(old_size > size)
+		old_size = size;
 
 	memcpy(newptr, ptr, old_size);
 
@@ -63,9 +77,52 @@ void *krealloc(void *ptr, size_t size)
 
 void kfree(void *ptr)
 {
+	if((size_t)ptr >= KERNEL_SLAB && (size_t)ptr < KERNEL_SLAB_END)
+	{
+		slab_t *slab = (slab_t*)((size_t)ptr & ~(SLAB_SIZE-1));
+		slab_free(slab->cache, ptr);
+		return;
+	}
+
 	size_t *header = (size_t*)((size_t)ptr - HEAP_ALIGNMENT);
 	vmm_free((size_t)ptr, header[0]);
 }
 
+/* Internal Functions */
 
+// kmalloc_common(): Allocates kernel memory, zeroed or not
+// Param:	size_t size - number of bytes to allocate
+// Param:	uint8_t zero - 1 to zero the memory
+// Param:	size_t owner - caller of kmalloc(), shown by vmm_lazy_dump()
+// Return:	void * - pointer to allocated memory, SSE-aligned
+
+void *kmalloc_common(size_t size, uint8_t zero, size_t owner)
+{
+	if(!size)
+		return NULL;
+
+	slab_cache_t *cache = slab_find_class(size);
+	if(cache)
+		return zero ? slab_alloc(cache) : slab_alloc_nozero(cache);
+
+	size_t pages = (size + HEAP_ALIGNMENT + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+
+	uint16_t flags = PAGE_PRESENT | PAGE_RW;
+	if(!zero)
+		flags |= VMM_NOZERO;
+	if(pages >= KMALLOC_LAZY_PAGES)
+		flags |= VMM_LAZY;
 
+	void *ptr = (void*)(vmm_alloc(KERNEL_HEAP, pages, flags));
+	if(!ptr)
+		return NULL;
+
+	if(flags & VMM_LAZY)
+		vmm_lazy_set_owner((size_t)ptr, owner);
+
+	size_t *header = (size_t*)(ptr);
+	header[0] = pages;		// store number of pages
+	header[1] = size;		// store number of bytes
+
+	return ptr + HEAP_ALIGNMENT;
+}
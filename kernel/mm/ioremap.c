@@ -0,0 +1,259 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* I/O Memory Mappings, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <cpu.h>
+#include <kprintf.h>
+#include <lock.h>
+
+// Drivers map registers, framebuffers and firmware tables with ioremap() and
+// a memory type instead of raw page flags. Every CPU programs its PAT so that
+// PWT alone selects write-combining, which leaves the PAT bit alone -- it's
+// PAGE_LARGE in page directory entries. Without a PAT, WC falls back to
+// write-through, which is still much better than uncached for a framebuffer.
+//
+// Mappings are kept in a table and shared: mapping a range that's inside one
+// already mapped with the same type only takes a reference, and mapping it
+// with a different type is refused, since the CPU doesn't allow two types for
+// the same memory. Write-back memory below PMM_MAX_MEMORY on x86_64 already
+// is in the physical memory map, so that's used instead and never counted.
+// Lock order is ioremap_mutex, then vmm_mutex.
+
+ioremap_t ioremaps[MAX_IOREMAPS];
+lock_t ioremap_mutex = 0;
+uint8_t ioremap_pat = 0;
+
+uint64_t ioremap_maps = 0;
+uint64_t ioremap_shared = 0;
+uint64_t ioremap_conflicts = 0;
+
+const uint8_t ioremap_flags[IOREMAP_TYPES] = {
+	0,					// WB, PAT entry 0
+	PAGE_WRITE_COMBINE,			// WC, PAT entry 1
+	PAGE_UNCACHEABLE,			// UC-, PAT entry 2
+	PAGE_UNCACHEABLE | PAGE_WRITE_COMBINE,	// UC, PAT entry 3
+};
+
+const char *ioremap_names[IOREMAP_TYPES] = {
+	"WB", "WC", "UC-", "UC",
+};
+
+extern lock_t vmm_mutex;
+
+size_t pmm_irq_save();
+void pmm_irq_restore(size_t);
+void ioremap_flush_tlb();
+
+// ioremap_cpu_init(): Programs the PAT on the current CPU
+// The BSP calls it before the first ioremap(), every CPU again as it registers
+// Param:	Nothing
+// Return:	Nothing
+
+void ioremap_cpu_init()
+{
+	uint32_t registers[4];		// EAX, EBX, ECX, EDX
+
+	read_cpuid(1, 0, registers);
+	if(!(registers[3] & CPUID_1_EDX_PAT))
+		return;
+
+	if(read_msr(MSR_PAT) == PAT_VALUE)
+	{
+		ioremap_pat = 1;
+		return;
+	}
+
+	// the SDM's sequence for changing memory types: with the caches off,
+	// write back and drop every line and TLB entry made with the old types
+	size_t flags = pmm_irq_save();
+	size_t cr0 = read_cr0();
+
+	write_cr0((cr0 | CR0_CD) & (~CR0_NW));
+	asm volatile ("wbinvd" ::: "memory");
+	ioremap_flush_tlb();
+
+	write_msr(MSR_PAT, PAT_VALUE);
+
+	asm volatile ("wbinvd" ::: "memory");
+	ioremap_flush_tlb();
+	write_cr0(cr0);
+
+	pmm_irq_restore(flags);
+	ioremap_pat = 1;
+}
+
+// ioremap(): Maps device or firmware memory with a memory type
+// Param:	size_t physical - physical address, need not be page-aligned
+// Param:	size_t size - size in bytes
+// Param:	uint8_t type - IOREMAP_*
+// Return:	void * - pointer to it, NULL on error
+
+void *ioremap(size_t physical, size_t size, uint8_t type)
+{
+	if(!size || type >= IOREMAP_TYPES)
+		return NULL;
+
+	size_t base = physical & (~(PAGE_SIZE-1));
+	size_t count = ((physical - base) + size + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+	size_t end = base + (count << PAGE_SIZE_SHIFT);
+
+#if __x86_64__
+	if(type == IOREMAP_WB && end <= PMM_MAX_MEMORY)
+		return (void*)(physical + PHYSICAL_MEMORY);
+#endif
+
+	acquire_lock(&ioremap_mutex);
+
+	size_t i, slot = MAX_IOREMAPS;
+	ioremap_t *entry;
+
+	for(i = 0; i < MAX_IOREMAPS; i++)
+	{
+		entry = &ioremaps[i];
+		if(!entry->count)
+		{
+			if(slot == MAX_IOREMAPS)
+				slot = i;
+			continue;
+		}
+
+		if(base >= entry->physical + (entry->count << PAGE_SIZE_SHIFT) || end <= entry->physical)
+			continue;
+
+		if(entry->type != type)
+		{
+			ioremap_conflicts++;
+			release_lock(&ioremap_mutex);
+			kprintf("ioremap: refusing to map 0x%xq as %s, it's already mapped as %s\n", (uint64_t)physical, ioremap_names[type], ioremap_names[entry->type]);
+			return NULL;
+		}
+
+		// a range that only partly overlaps gets its own mapping
+		if(base >= entry->physical && end <= entry->physical + (entry->count << PAGE_SIZE_SHIFT))
+		{
+			entry->refcount++;
+			ioremap_shared++;
+			release_lock(&ioremap_mutex);
+			return (void*)(entry->virtual + (physical - entry->physical));
+		}
+	}
+
+	if(slot >= MAX_IOREMAPS)
+	{
+		release_lock(&ioremap_mutex);
+		kprintf("ioremap: no free entries to map 0x%xq\n", (uint64_t)physical);
+		return NULL;
+	}
+
+	size_t virtual = vmm_request_map(base, count, PAGE_PRESENT | PAGE_RW | ioremap_flags[type]);
+	if(!virtual)
+	{
+		release_lock(&ioremap_mutex);
+		return NULL;
+	}
+
+	entry = &ioremaps[slot];
+	entry->physical = base;
+	entry->count = count;
+	entry->virtual = virtual;
+	entry->refcount = 1;
+	entry->type = type;
+	ioremap_maps++;
+
+	release_lock(&ioremap_mutex);
+	return (void*)(virtual + (physical - base));
+}
+
+// iounmap(): Drops a mapping made by ioremap()
+// Param:	void *pointer - pointer from ioremap()
+// Return:	Nothing
+
+void iounmap(void *pointer)
+{
+	size_t virtual = (size_t)pointer;
+
+#if __x86_64__
+	if(virtual >= PHYSICAL_MEMORY)
+		return;
+#endif
+
+	acquire_lock(&ioremap_mutex);
+
+	size_t i;
+	ioremap_t *entry;
+
+	for(i = 0; i < MAX_IOREMAPS; i++)
+	{
+		entry = &ioremaps[i];
+		if(entry->count && virtual >= entry->virtual && virtual < entry->virtual + (entry->count << PAGE_SIZE_SHIFT))
+			break;
+	}
+
+	if(i >= MAX_IOREMAPS)
+	{
+		release_lock(&ioremap_mutex);
+		kprintf("ioremap: unmapping 0x%xq, which isn't mapped\n", (uint64_t)virtual);
+		return;
+	}
+
+	entry->refcount--;
+	if(!entry->refcount)
+	{
+		acquire_lock(&vmm_mutex);
+		vmm_unmap(entry->virtual, entry->count);
+		release_lock(&vmm_mutex);
+
+		entry->count = 0;
+	}
+
+	release_lock(&ioremap_mutex);
+}
+
+// ioremap_dump(): Shows every mapping
+// Param:	Nothing
+// Return:	Nothing
+
+void ioremap_dump()
+{
+	acquire_lock(&ioremap_mutex);
+
+	kprintf("ioremap: %s, %d mappings made, %d shared, %d refused\n", ioremap_pat ? "WC through PAT" : "no PAT, WC is WT", (uint32_t)ioremap_maps, (uint32_t)ioremap_shared, (uint32_t)ioremap_conflicts);
+
+	size_t i;
+	for(i = 0; i < MAX_IOREMAPS; i++)
+	{
+		if(!ioremaps[i].count)
+			continue;
+
+		kprintf("ioremap: 0x%xq, %d pages %s at 0x%xq, %d references\n", (uint64_t)ioremaps[i].physical, ioremaps[i].count, ioremap_names[ioremaps[i].type], (uint64_t)ioremaps[i].virtual, ioremaps[i].refcount);
+	}
+
+	release_lock(&ioremap_mutex);
+}
+
+/* Internal Functions */
+
+// ioremap_flush_tlb(): Flushes the whole TLB of the current CPU, global pages too
+// Param:	Nothing
+// Return:	Nothing
+
+void ioremap_flush_tlb()
+{
+#if __x86_64__
+	// toggling PGE drops everything, reloading CR3 would leave global pages
+	uint64_t cr4 = read_cr4();
+	if(cr4 & CR4_PGE)
+	{
+		write_cr4(cr4 & ~CR4_PGE);
+		write_cr4(cr4);
+		return;
+	}
+#endif
+
+	write_cr3(read_cr3());
+}
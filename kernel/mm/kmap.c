@@ -0,0 +1,147 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Temporary Mappings, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <cpu.h>
+#include <apic.h>
+#include <gdt.h>
+#include <kprintf.h>
+
+// kmap() gives a pointer to any frame for as long as the caller needs it, and
+// kunmap() ends that. On x86_64 this is just the physical memory map.
+//
+// i386 has none, so every CPU has KMAP_SLOTS pages of its own at KERNEL_KMAP.
+// Their page tables always exist, so a slot is mapped by writing its entry and
+// invalidating it on this CPU only, without vmm_mutex or a shootdown -- no
+// other CPU ever touches it. Slots are a stack: mappings nest, and must be
+// undone in reverse order, which lets an interrupt handler use kmap() as long
+// as it unmaps before returning. Each CPU checks its own FS selector to know
+// whether it has a cpu_t yet. Only the BSP ever runs without one, because APs
+// load FS before anything else, and it uses the slots after the last CPU's.
+
+size_t pmm_irq_save();
+void pmm_irq_restore(size_t);
+
+#if __i386__
+size_t kmap_boot_depth = 0;
+uint64_t kmap_boot_maps = 0;
+
+int kmap_has_cpu();
+#endif
+
+// kmap(): Maps a frame for temporary use
+// Param:	paddr_t physical - physical address, need not be page-aligned
+// Return:	void * - pointer to it
+
+void *kmap(paddr_t physical)
+{
+#if __x86_64__
+	return (void*)(physical + PHYSICAL_MEMORY);
+#endif
+
+#if __i386__
+	size_t flags = pmm_irq_save();
+	size_t set, slot;
+
+	if(kmap_has_cpu())
+	{
+		cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+		set = cpu->index;
+		slot = cpu->kmap_depth;
+		cpu->kmap_depth++;
+		cpu->kmaps++;
+	} else
+	{
+		set = MAX_LAPICS;
+		slot = kmap_boot_depth;
+		kmap_boot_depth++;
+		kmap_boot_maps++;
+	}
+
+	pmm_irq_restore(flags);
+
+	if(slot >= KMAP_SLOTS)
+		panic("Out of kmap slots.");
+
+	size_t virtual = KERNEL_KMAP + (((set * KMAP_SLOTS) + slot) << PAGE_SIZE_SHIFT);
+	page_tables[virtual >> PAGE_SIZE_SHIFT] = (physical & (~(PAGE_SIZE-1))) | PAGE_PRESENT | PAGE_RW;
+	flush_tlb(virtual, 1);
+
+	return (void*)(virtual + (size_t)(physical & (PAGE_SIZE-1)));
+#endif
+}
+
+// kunmap(): Ends a temporary mapping, the latest one still in use
+// Param:	void *pointer - pointer from kmap()
+// Return:	Nothing
+
+void kunmap(void *pointer)
+{
+#if __i386__
+	size_t slot = (((size_t)pointer - KERNEL_KMAP) >> PAGE_SIZE_SHIFT) % KMAP_SLOTS;
+	size_t flags = pmm_irq_save();
+
+	// the entry stays until the slot is used again, which invalidates it;
+	// out of order, a later kmap() would reuse a slot that's still in use
+	if(kmap_has_cpu())
+	{
+		cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+		if(!cpu->kmap_depth || slot != cpu->kmap_depth - 1)
+		{
+			kprintf("kmap: CPU index %d unmapping slot %d out of order, %d in use\n", cpu->index, slot, cpu->kmap_depth);
+			panic("kmap slots unmapped out of order.");
+		}
+
+		cpu->kmap_depth--;
+	} else
+	{
+		if(!kmap_boot_depth || slot != kmap_boot_depth - 1)
+		{
+			kprintf("kmap: unmapping boot slot %d out of order, %d in use\n", slot, kmap_boot_depth);
+			panic("kmap slots unmapped out of order.");
+		}
+
+		kmap_boot_depth--;
+	}
+
+	pmm_irq_restore(flags);
+#endif
+}
+
+// kmap_dump(): Shows how many temporary mappings the current CPU made
+// Param:	Nothing
+// Return:	Nothing
+
+void kmap_dump()
+{
+#if __i386__
+	if(!kmap_has_cpu())
+		return;
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	kprintf("kmap: CPU index %d made %d mappings, %d in use, %d made while booting\n", cpu->index, (uint32_t)cpu->kmaps, cpu->kmap_depth, (uint32_t)kmap_boot_maps);
+#endif
+}
+
+/* Internal Functions */
+
+#if __i386__
+
+// kmap_has_cpu(): Returns whether FS points to this CPU's cpu_t yet
+// Param:	Nothing
+// Return:	int - 1 if it does
+
+int kmap_has_cpu()
+{
+	uint16_t selector;
+	asm volatile ("mov %%fs, %0" : "=r"(selector));
+
+	return (selector >= (GDT_CPU_INFO << 3)) ? 1 : 0;
+}
+
+#endif
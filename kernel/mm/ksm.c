@@ -0,0 +1,485 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Same-page Merging, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <ksm.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+#include <cpu.h>
+#include <tlb.h>
+
+// Idle CPUs go over the private frames of lazy regions looking for pages
+// with the same contents. Pages that are all zeroes go back to the shared
+// zero page, and other identical pages are mapped read-only to one frame,
+// counted in pmm_frame_t and tagged PMM_TAG_KSM. The lazy fault handler
+// copies such a page on the first write to it, or just makes it writable
+// again if every other user has let go of it.
+//
+// A page is hashed and looked up in the stable table of merged frames, then
+// in the unstable table of pages seen during this pass. Pages that were
+// written since the last pass are skipped, and both pages are made read-only
+// before they're compared, so they can't change while we look. The unstable
+// table is emptied after every pass, since its pages may have changed.
+//
+// Clearing the dirty bits of skipped pages is flushed once per wakeup, and
+// leaves their accessed bits alone, which zram needs to tell cold pages from
+// hot ones. Lock order is ksm_mutex, then vmm_lazy_mutex, which is only held
+// with interrupts disabled.
+
+extern lock_t vmm_lazy_mutex;
+extern vmm_lazy_t vmm_lazy[];
+extern size_t vmm_zero_page;
+
+lock_t ksm_mutex = 0;
+ksm_node_t ksm_stable[KSM_TABLE_SIZE];
+ksm_node_t ksm_unstable[KSM_TABLE_SIZE];
+size_t ksm_rate = KSM_RATE;
+size_t ksm_hand_region = 0;
+size_t ksm_hand_page = 0;
+
+size_t ksm_sharing = 0;				// frames saved right now
+uint64_t ksm_scanned = 0;
+uint64_t ksm_full_scans = 0;
+uint64_t ksm_merged = 0;
+uint64_t ksm_zero_merged = 0;
+uint64_t ksm_unshared = 0;
+uint64_t ksm_cycles = 0;
+
+size_t pmm_irq_save();
+void pmm_irq_restore(size_t);
+void ksm_scan_page(vmm_lazy_t *, size_t, tlb_batch_t *);
+int ksm_merge(vmm_lazy_t *, size_t, size_t, size_t);
+int ksm_merge_pair(vmm_lazy_t *, size_t, size_t, ksm_node_t *);
+void ksm_merge_zero(vmm_lazy_t *, size_t, size_t);
+void ksm_stable_add(uint32_t, size_t);
+uint32_t ksm_hash(size_t, uint8_t *);
+int ksm_compare(size_t, size_t);
+
+// ksm_init(): Sets up same-page merging
+// Param:	Nothing
+// Return:	Nothing
+
+void ksm_init()
+{
+	memset(ksm_stable, 0, sizeof(ksm_node_t) * KSM_TABLE_SIZE);
+	memset(ksm_unstable, 0, sizeof(ksm_node_t) * KSM_TABLE_SIZE);
+}
+
+// ksm_idle(): Scans some pages for duplicates, called from idle loops
+// Param:	Nothing
+// Return:	Nothing
+
+void ksm_idle()
+{
+	if(!ksm_rate || !vmm_zero_page)
+		return;
+
+	// one CPU scanning is enough
+	if(!try_lock(&ksm_mutex))
+		return;
+
+	uint64_t start = read_tsc();
+	size_t scanned = 0, skipped = 0;
+	size_t virtual, flags;
+	vmm_lazy_t *region;
+
+	tlb_batch_t batch;
+	tlb_batch_init(&batch);
+
+	while(scanned < ksm_rate && skipped < MAX_VMM_LAZY)
+	{
+		region = &vmm_lazy[ksm_hand_region];
+		if(ksm_hand_page >= region->count)
+		{
+			ksm_hand_region++;
+			ksm_hand_page = 0;
+			skipped++;
+
+			if(ksm_hand_region >= MAX_VMM_LAZY)
+			{
+				ksm_hand_region = 0;
+				ksm_full_scans++;
+				memset(ksm_unstable, 0, sizeof(ksm_node_t) * KSM_TABLE_SIZE);
+			}
+
+			continue;
+		}
+
+		virtual = region->base + (ksm_hand_page << PAGE_SIZE_SHIFT);
+		ksm_hand_page++;
+		skipped = 0;
+
+		// one page at a time, so allocations on other CPUs don't wait long
+		flags = pmm_irq_save();
+		acquire_lock(&vmm_lazy_mutex);
+		ksm_scan_page(region, virtual, &batch);
+		release_lock(&vmm_lazy_mutex);
+		pmm_irq_restore(flags);
+
+		scanned++;
+	}
+
+	tlb_batch_flush(&batch, TLB_ALL_CPUS);
+
+	ksm_scanned += scanned;
+	ksm_cycles += read_tsc() - start;
+
+	release_lock(&ksm_mutex);
+}
+
+// ksm_set_rate(): Sets how many pages are scanned per idle wakeup
+// Param:	size_t pages - count of pages, 0 to stop scanning
+// Return:	Nothing
+
+void ksm_set_rate(size_t pages)
+{
+	ksm_rate = pages;
+}
+
+// ksm_unshare(): Gives a lazy page its own copy of a merged frame, called with vmm_lazy_mutex held
+// The merged frame stays in the TLBs, the fault handler flushes it
+// Param:	vmm_lazy_t *region - lazy region with the page
+// Param:	size_t page - page being written
+// Param:	size_t entry - page table entry
+// Return:	int - 1 if the fault was handled, 0 if memory is full
+
+int ksm_unshare(vmm_lazy_t *region, size_t page, size_t entry)
+{
+	size_t frame = entry & (~(PAGE_SIZE-1));
+
+	if(!pmm_refcount(frame))
+	{
+		// everyone else let go of it, so it's ours again
+		pmm_set_tag(frame, 1, PMM_TAG_HEAP);
+		vmm_map_noflush(page, frame, region->flags);
+	} else
+	{
+		size_t copy = pmm_alloc(1);
+		if(!copy)
+			return 0;
+
+		void *destination = kmap(copy);
+		void *source = kmap(frame);
+		memcpy(destination, source, PAGE_SIZE);
+		kunmap(source);
+		kunmap(destination);
+
+		pmm_set_tag(copy, 1, PMM_TAG_HEAP);
+		vmm_map_noflush(page, copy, region->flags);
+
+		pmm_unref(frame);
+		ksm_sharing--;
+	}
+
+	region->resident++;
+	region->merged--;
+	ksm_unshared++;
+	return 1;
+}
+
+// ksm_release(): Drops a mapping of a merged frame, called with vmm_lazy_mutex held
+// Param:	size_t frame - physical address
+// Return:	Nothing
+
+void ksm_release(size_t frame)
+{
+	if(pmm_refcount(frame))
+		ksm_sharing--;
+
+	pmm_unref(frame);
+}
+
+// ksm_dump(): Shows how much was merged and what it cost
+// Param:	Nothing
+// Return:	Nothing
+
+void ksm_dump()
+{
+	size_t flags = pmm_irq_save();
+	acquire_lock(&vmm_lazy_mutex);
+
+	size_t stable = 0, i;
+	for(i = 0; i < KSM_TABLE_SIZE; i++)
+	{
+		if(ksm_stable[i].frame && pmm_get_tag(ksm_stable[i].frame) == PMM_TAG_KSM)
+			stable++;
+	}
+
+	release_lock(&vmm_lazy_mutex);
+	pmm_irq_restore(flags);
+
+	uint32_t per_page = 0;
+	if(ksm_scanned)
+		per_page = (uint32_t)(ksm_cycles / ksm_scanned);
+
+	kprintf("ksm: %d frames saved by %d merged frames, %d merges, %d into the zero page, %d copied back on write\n", ksm_sharing, stable, (uint32_t)ksm_merged, (uint32_t)ksm_zero_merged, (uint32_t)ksm_unshared);
+	kprintf("ksm: %d pages scanned in %d full passes at %d cycles each, %d pages per idle wakeup\n", (uint32_t)ksm_scanned, (uint32_t)ksm_full_scans, per_page, ksm_rate);
+}
+
+/* Internal Functions */
+
+// ksm_scan_page(): Merges a page with an identical one if there is one, called with vmm_lazy_mutex held
+// Param:	vmm_lazy_t *region - lazy region with the page
+// Param:	size_t virtual - page
+// Param:	tlb_batch_t *batch - batch for pages whose dirty bit was cleared
+// Return:	Nothing
+
+void ksm_scan_page(vmm_lazy_t *region, size_t virtual, tlb_batch_t *batch)
+{
+	size_t entry = vmm_get_page(virtual);
+
+	// untouched, the zero page, merged or compressed already
+	if(!(entry & PAGE_PRESENT) || !(entry & PAGE_RW))
+		return;
+
+	size_t frame = entry & (~(PAGE_SIZE-1));
+
+	// it would only be copied again, look next pass
+	if(entry & PAGE_DIRTY)
+	{
+		vmm_map_noflush(virtual, frame, region->flags | (entry & PAGE_ACCESSED));
+		tlb_batch_add(batch, virtual, 1);
+		return;
+	}
+
+	uint8_t zero;
+	uint32_t hash = ksm_hash(frame, &zero);
+	if(zero)
+	{
+		ksm_merge_zero(region, virtual, frame);
+		return;
+	}
+
+	size_t i;
+	ksm_node_t *node;
+
+	for(i = 0; i < KSM_PROBES; i++)
+	{
+		node = &ksm_stable[(hash + i) & (KSM_TABLE_SIZE-1)];
+		if(!node->frame || node->hash != hash)
+			continue;
+
+		// freed, or taken back by its last user
+		if(pmm_get_tag(node->frame) != PMM_TAG_KSM)
+		{
+			node->frame = 0;
+			continue;
+		}
+
+		if(ksm_merge(region, virtual, frame, node->frame))
+			return;
+	}
+
+	ksm_node_t *empty = NULL;
+	size_t candidate;
+
+	for(i = 0; i < KSM_PROBES; i++)
+	{
+		node = &ksm_unstable[(hash + i) & (KSM_TABLE_SIZE-1)];
+		if(node->frame && node->virtual == virtual)
+			node->frame = 0;
+
+		if(node->frame)
+		{
+			// freed, merged or compressed since we saw it
+			candidate = vmm_get_page(node->virtual);
+			if(!(candidate & PAGE_PRESENT) || !(candidate & PAGE_RW) || (candidate & (~(PAGE_SIZE-1))) != node->frame)
+				node->frame = 0;
+			else if(node->virtual < node->region->base || node->virtual >= node->region->base + (node->region->count << PAGE_SIZE_SHIFT))
+				node->frame = 0;
+		}
+
+		if(!node->frame)
+		{
+			if(!empty)
+				empty = node;
+
+			continue;
+		}
+
+		if(node->hash != hash)
+			continue;
+
+		if(ksm_merge_pair(region, virtual, frame, node))
+		{
+			ksm_stable_add(hash, node->frame);
+			node->frame = 0;
+			return;
+		}
+	}
+
+	// nothing like it yet, maybe a later page will be
+	if(!empty)
+		empty = &ksm_unstable[hash & (KSM_TABLE_SIZE-1)];
+
+	empty->hash = hash;
+	empty->frame = frame;
+	empty->virtual = virtual;
+	empty->region = region;
+}
+
+// ksm_merge(): Merges a page into a merged frame if they're identical
+// Param:	vmm_lazy_t *region - lazy region with the page
+// Param:	size_t virtual - page
+// Param:	size_t frame - physical address mapped there
+// Param:	size_t stable - merged frame
+// Return:	int - 1 if merged, 0 if they're different
+
+int ksm_merge(vmm_lazy_t *region, size_t virtual, size_t frame, size_t stable)
+{
+	// shared as much as it can be, the page can still pair up with another
+	if(pmm_refcount(stable) >= PMM_MAX_REFCOUNT)
+		return 0;
+
+	// nobody may write to it while it's compared
+	vmm_map(virtual, frame, 1, region->flags & (~PAGE_RW));
+
+	if(ksm_compare(frame, stable) != 0)
+	{
+		vmm_map(virtual, frame, 1, region->flags);
+		return 0;
+	}
+
+	pmm_ref(stable);
+	vmm_map(virtual, stable, 1, region->flags & (~PAGE_RW));
+	pmm_mark_free(frame, 1);
+
+	region->resident--;
+	region->merged++;
+	ksm_merged++;
+	ksm_sharing++;
+	return 1;
+}
+
+// ksm_merge_pair(): Merges two private pages if they're identical
+// Param:	vmm_lazy_t *region - lazy region with the page
+// Param:	size_t virtual - page
+// Param:	size_t frame - physical address mapped there
+// Param:	ksm_node_t *node - unstable page to merge with, its frame is kept
+// Return:	int - 1 if merged, 0 if they're different
+
+int ksm_merge_pair(vmm_lazy_t *region, size_t virtual, size_t frame, ksm_node_t *node)
+{
+	vmm_map(virtual, frame, 1, region->flags & (~PAGE_RW));
+	vmm_map(node->virtual, node->frame, 1, node->region->flags & (~PAGE_RW));
+
+	if(ksm_compare(frame, node->frame) != 0)
+	{
+		vmm_map(virtual, frame, 1, region->flags);
+		vmm_map(node->virtual, node->frame, 1, node->region->flags);
+		return 0;
+	}
+
+	pmm_set_tag(node->frame, 1, PMM_TAG_KSM);
+	pmm_ref(node->frame);
+	vmm_map(virtual, node->frame, 1, region->flags & (~PAGE_RW));
+	pmm_mark_free(frame, 1);
+
+	region->resident--;
+	region->merged++;
+	node->region->resident--;
+	node->region->merged++;
+	ksm_merged++;
+	ksm_sharing++;
+	return 1;
+}
+
+// ksm_merge_zero(): Maps the zero page in place of a page that is all zeroes
+// Param:	vmm_lazy_t *region - lazy region with the page
+// Param:	size_t virtual - page
+// Param:	size_t frame - physical address mapped there
+// Return:	Nothing
+
+void ksm_merge_zero(vmm_lazy_t *region, size_t virtual, size_t frame)
+{
+	vmm_map(virtual, frame, 1, region->flags & (~PAGE_RW));
+
+	uint8_t zero;
+	ksm_hash(frame, &zero);
+	if(!zero)
+	{
+		vmm_map(virtual, frame, 1, region->flags);
+		return;
+	}
+
+	// just like a page that was only ever read
+	vmm_map(virtual, vmm_zero_page, 1, PAGE_PRESENT);
+	pmm_mark_free(frame, 1);
+
+	region->resident--;
+	ksm_zero_merged++;
+}
+
+// ksm_stable_add(): Records a merged frame
+// Param:	uint32_t hash - hash of its contents
+// Param:	size_t frame - physical address
+// Return:	Nothing
+
+void ksm_stable_add(uint32_t hash, size_t frame)
+{
+	ksm_node_t *node;
+	size_t i;
+
+	for(i = 0; i < KSM_PROBES; i++)
+	{
+		node = &ksm_stable[(hash + i) & (KSM_TABLE_SIZE-1)];
+		if(!node->frame || pmm_get_tag(node->frame) != PMM_TAG_KSM)
+			break;
+	}
+
+	// a full table only means fewer merges later
+	if(i >= KSM_PROBES)
+		node = &ksm_stable[hash & (KSM_TABLE_SIZE-1)];
+
+	node->hash = hash;
+	node->frame = frame;
+	node->virtual = 0;
+	node->region = NULL;
+}
+
+// ksm_hash(): Hashes the contents of a page
+// Param:	size_t frame - physical address
+// Param:	uint8_t *zero - where to store 1 if the page is all zeroes
+// Return:	uint32_t - hash
+
+uint32_t ksm_hash(size_t frame, uint8_t *zero)
+{
+	uint32_t *data = kmap(frame);
+	uint32_t hash = 2166136261U;
+	uint32_t bits = 0;
+	size_t i;
+
+	for(i = 0; i < PAGE_SIZE / 4; i++)
+	{
+		hash = (hash ^ data[i]) * 16777619U;
+		bits |= data[i];
+	}
+
+	kunmap(data);
+
+	zero[0] = !bits;
+	return hash;
+}
+
+// ksm_compare(): Compares the contents of two frames
+// Param:	size_t first - physical address
+// Param:	size_t second - physical address
+// Return:	int - zero if they're the same
+
+int ksm_compare(size_t first, size_t second)
+{
+	void *a = kmap(first);
+	void *b = kmap(second);
+	int status = memcmp(a, b, PAGE_SIZE);
+
+	kunmap(b);
+	kunmap(a);
+	return status;
+}
+
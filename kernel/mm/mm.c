@@ -7,6 +7,9 @@
 #include <mm.h>
 #include <boot.h>
 #include <kprintf.h>
+#include <zram.h>
+#include <ksm.h>
+#include <shrink.h>
 
 // mm_init(): Initializes the memory manager
 // Param:	multiboot_info_t *multiboot_info - pointer to multiboot information
@@ -15,7 +18,15 @@
 void mm_init(multiboot_info_t *multiboot_info)
 {
 	pmm_init(multiboot_info);
+	shrink_init();
 	vmm_init();
+	vmm_arena_init();
+	vmm_lazy_init();
+	zero_pool_init();
+	zram_init();
+	ksm_init();
+	slab_init();
+	scratch_init(&scratch_boot);
 }
 
 
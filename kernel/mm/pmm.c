@@ -0,0 +1,1285 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Buddy Physical Page Allocator, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+#include <cpu.h>
+#include <apic.h>
+#include <numa.h>
+#include <shrink.h>
+
+// Every usable frame has a pmm_frame_t. A frame whose order is not
+// PMM_NO_ORDER is the first frame of a free block of (1 << order) frames, and
+// is linked into the free list of that order by frame number. All other
+// frames are either allocated or somewhere inside a larger free block.
+//
+// Each NUMA node has its own set of free lists, and blocks never merge across
+// nodes. Until numa_init() has parsed the SRAT, all memory is in node 0.
+//
+// Within a node, free lists are split again by zone, so memory a device can
+// reach is found without searching. Zone boundaries are aligned far beyond the
+// largest block, so buddies are always in the same zone. Allocations take the
+// highest zone they may use first, and ZONE_DMA only once everything else is
+// full, because it's small and ISA devices have nowhere else to go. With PAE,
+// ZONE_NORMAL is memory above 4 GB, and only pmm_alloc_zone() and
+// pmm_alloc_chunk() hand it out, to callers that keep addresses in a paddr_t.
+//
+// Allocated frames also carry a tag saying who owns them and PMM_FRAME_*
+// flags. Only the owner changes them, so they're not under pmm_mutex. Frames
+// go back to PMM_TAG_NONE when freed, and each allocator tags its own.
+//
+// Single frames are also cached per CPU in cpu_t, so most one-page allocations
+// and frees don't take pmm_mutex at all. Frames sitting in a per-CPU cache
+// count as used as far as the buddy allocator is concerned.
+
+pmm_frame_t *pmm_frames;
+size_t pmm_frame_count;
+uint32_t pmm_free_lists[MAX_NUMA_NODES][PMM_ZONES][PMM_MAX_ORDER+1];
+size_t pmm_free_blocks[PMM_MAX_ORDER+1];
+size_t pmm_node_free[MAX_NUMA_NODES];		// free pages per node
+size_t pmm_zone_free[PMM_ZONES];		// free pages per zone, of all nodes
+lock_t pmm_mutex = 0;
+
+const char *pmm_tag_names[PMM_TAGS] = {
+	"untagged", "reserved", "kernel", "heap", "slab", "page tables",
+	"page cache", "anonymous", "DMA", "zero pool", "per-CPU caches",
+	"compressed", "merged", "buffer cache"
+};
+
+const char *pmm_zone_names[PMM_ZONES] = {
+	"DMA", "DMA32", "normal"
+};
+uint8_t pmm_pcp_ready = 0;	// set once by the SMP code, FS points to a cpu_t on every CPU from then on
+
+void pmm_list_add(size_t, uint8_t);
+void pmm_list_remove(size_t, uint8_t);
+void pmm_free_block(size_t, uint8_t);
+size_t pmm_find_block(size_t, uint8_t *);
+void pmm_carve(size_t, uint8_t, size_t, size_t);
+void pmm_release(size_t, size_t);
+size_t pmm_alloc_large(size_t, uint8_t, uint8_t, size_t, size_t);
+size_t pmm_alloc_block(uint8_t, uint8_t, uint8_t, uint8_t);
+size_t pmm_alloc_zones(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t);
+paddr_t pmm_alloc_from(size_t, uint8_t, uint8_t, uint8_t);
+uint8_t pmm_zone(size_t);
+size_t pmm_zone_end(uint8_t);
+uint8_t pmm_policy_node(uint8_t *);
+size_t pmm_pcp_alloc();
+void pmm_pcp_free(size_t);
+size_t pmm_irq_save();
+void pmm_irq_restore(size_t);
+
+// pmm_buddy_init(): Sets up the buddy allocator with all memory used
+// Param:	pmm_frame_t *frames - memory for the frame array
+// Param:	size_t frame_count - number of frames to manage
+// Return:	Nothing
+
+void pmm_buddy_init(pmm_frame_t *frames, size_t frame_count)
+{
+	pmm_frames = frames;
+	pmm_frame_count = frame_count;
+
+	size_t i = 0;
+	while(i < frame_count)
+	{
+		pmm_frames[i].next = PMM_NONE;
+		pmm_frames[i].prev = PMM_NONE;
+		pmm_frames[i].order = PMM_NO_ORDER;
+		pmm_frames[i].node = 0;
+		pmm_frames[i].refcount = 0;
+		pmm_frames[i].flags = 0;
+		pmm_frames[i].tag = PMM_TAG_RESERVED;
+		pmm_frames[i].reserved = 0;
+		i++;
+	}
+
+	size_t node, zone;
+	i = 0;
+	while(i <= PMM_MAX_ORDER)
+	{
+		for(node = 0; node < MAX_NUMA_NODES; node++)
+		{
+			for(zone = 0; zone < PMM_ZONES; zone++)
+				pmm_free_lists[node][zone][i] = PMM_NONE;
+		}
+
+		pmm_free_blocks[i] = 0;
+		i++;
+	}
+
+	for(node = 0; node < MAX_NUMA_NODES; node++)
+		pmm_node_free[node] = 0;
+
+	for(zone = 0; zone < PMM_ZONES; zone++)
+		pmm_zone_free[zone] = 0;
+
+	// everything is used until the memory map says otherwise
+	used_pages = total_pages;
+}
+
+// pmm_mark_used(): Marks a range of pages as used
+// Param:	paddr_t base - 4KB-aligned base
+// Param:	size_t count - count of pages
+// Return:	Nothing
+
+void pmm_mark_used(paddr_t base, size_t count)
+{
+	if(!count)
+		return;
+
+	size_t frame = (size_t)(base >> PAGE_SIZE_SHIFT);
+	size_t end = frame + count;
+	if(end > pmm_frame_count)
+		end = pmm_frame_count;
+
+	size_t head;
+	uint8_t order;
+
+	acquire_lock(&pmm_mutex);
+
+	for(head = frame; head < end; head++)
+	{
+		if(pmm_frames[head].tag != PMM_TAG_RESERVED)
+			pmm_frames[head].tag = PMM_TAG_KERNEL;
+	}
+
+	while(frame < end)
+	{
+		head = pmm_find_block(frame, &order);
+		if(head == PMM_NONE)
+		{
+			// already used
+			frame++;
+			continue;
+		}
+
+		// take the whole block out and give back what's outside the range
+		pmm_list_remove(head, order);
+		pmm_carve(head, order, frame, end);
+
+		if(head + ((size_t)1 << order) < end)
+			used_pages += head + ((size_t)1 << order) - frame;
+		else
+			used_pages += end - frame;
+
+		frame = head + ((size_t)1 << order);
+	}
+
+	release_lock(&pmm_mutex);
+}
+
+// pmm_mark_free(): Marks a range of pages as free
+// Param:	paddr_t base - 4KB-aligned base
+// Param:	size_t count - count of pages
+// Return:	Nothing
+
+void pmm_mark_free(paddr_t base, size_t count)
+{
+	if(!count)
+		return;
+
+	size_t frame = (size_t)(base >> PAGE_SIZE_SHIFT);
+	size_t end = frame + count;
+	if(end > pmm_frame_count)
+		end = pmm_frame_count;
+
+	if(frame >= end)
+		return;
+
+	if(count == 1 && pmm_pcp_ready)
+	{
+		pmm_frames[frame].flags = 0;
+		pmm_frames[frame].tag = PMM_TAG_PCP;
+		pmm_pcp_free(frame);
+		return;
+	}
+
+	acquire_lock(&pmm_mutex);
+	pmm_release(frame, end - frame);
+	release_lock(&pmm_mutex);
+}
+
+// pmm_is_page_free(): Checks if a page is free or used
+// Param:	paddr_t page - 4KB-aligned page
+// Return:	uint8_t - 1 for used pages, 0 for free pages
+
+uint8_t pmm_is_page_free(paddr_t page)
+{
+	size_t frame = (size_t)(page >> PAGE_SIZE_SHIFT);
+	if(frame >= pmm_frame_count)
+		return 1;
+
+	uint8_t order;
+	if(pmm_find_block(frame, &order) == PMM_NONE)
+		return 1;
+
+	return 0;
+}
+
+// pmm_ref(): Adds a mapping to a frame that is being shared
+// Param:	paddr_t page - 4KB-aligned page
+// Return:	Nothing
+
+void pmm_ref(paddr_t page)
+{
+	size_t frame = (size_t)(page >> PAGE_SIZE_SHIFT);
+	if(frame >= pmm_frame_count)
+		return;		// not RAM, nothing to count
+
+	acquire_lock(&pmm_mutex);
+
+	// a frame that was never shared has one owner without counting it
+	if(!pmm_frames[frame].refcount)
+		pmm_frames[frame].refcount = 2;
+	else if(pmm_frames[frame].refcount < PMM_MAX_REFCOUNT)
+		pmm_frames[frame].refcount++;
+	else
+		panic("Page frame shared too many times.");	// wrapping to 0 would make every sharer its owner
+
+	release_lock(&pmm_mutex);
+}
+
+// pmm_unref(): Drops a mapping of a frame, freeing it with the last one
+// Param:	paddr_t page - 4KB-aligned page
+// Return:	size_t - mappings left, 1 if the caller is now the only owner
+
+size_t pmm_unref(paddr_t page)
+{
+	size_t frame = (size_t)(page >> PAGE_SIZE_SHIFT);
+	if(frame >= pmm_frame_count)
+		return 0;
+
+	acquire_lock(&pmm_mutex);
+
+	size_t refcount = pmm_frames[frame].refcount;
+	if(refcount)
+	{
+		refcount--;
+		pmm_frames[frame].refcount = (refcount == 1) ? 0 : refcount;
+	}
+
+	release_lock(&pmm_mutex);
+
+	if(!refcount)
+		pmm_mark_free(page, 1);
+
+	return refcount;
+}
+
+// pmm_refcount(): Returns how many mappings share a frame
+// Param:	paddr_t page - 4KB-aligned page
+// Return:	size_t - count of mappings, 0 if the frame has only one owner
+
+size_t pmm_refcount(paddr_t page)
+{
+	size_t frame = (size_t)(page >> PAGE_SIZE_SHIFT);
+	if(frame >= pmm_frame_count)
+		return 0;
+
+	return pmm_frames[frame].refcount;
+}
+
+// pmm_alloc(): Allocates contiguous physical pages
+// Follows the NUMA policy of the current CPU, and calls shrinkers when full
+// Param:	size_t count - count of pages
+// Return:	paddr_t - start of 4KB-aligned page, NULL on error, never above PMM_ZONE_DEFAULT
+
+paddr_t pmm_alloc(size_t count)
+{
+	if(!count)
+		return NULL;
+
+	uint8_t strict, node;
+	uint8_t local = 0;
+	size_t frame;
+	paddr_t physical;
+
+	// single frames come from the per-CPU cache, unless a policy says where
+	if(count == 1 && pmm_pcp_ready)
+	{
+		cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+		local = (cpu->numa_policy == NUMA_POLICY_LOCAL);
+	}
+
+	while(1)
+	{
+		if(local)
+		{
+			frame = pmm_pcp_alloc();
+			if(frame != PMM_NONE)
+			{
+				physical = (paddr_t)frame << PAGE_SIZE_SHIFT;
+				break;
+			}
+		} else
+		{
+			node = pmm_policy_node(&strict);
+			physical = pmm_alloc_from(count, node, strict, PMM_ZONE_DEFAULT);
+			if(physical)
+				break;
+		}
+
+		// have the shrinkers make room, and only give up if they can't
+		if(!shrink_memory(count, 1))
+			panic("Out of memory.");
+	}
+
+	if(shrink_zone_pressure(WMARK_LOW, pmm_zone((size_t)(physical >> PAGE_SIZE_SHIFT))))
+		shrink_wakeup();
+
+	return physical;
+}
+
+// pmm_alloc_node(): Allocates contiguous physical pages, preferably on a node
+// Falls back to other nodes in order of distance
+// Param:	size_t count - count of pages
+// Param:	uint8_t node - NUMA node
+// Return:	paddr_t - start of 4KB-aligned page, NULL on error, never above PMM_ZONE_DEFAULT
+
+paddr_t pmm_alloc_node(size_t count, uint8_t node)
+{
+	if(!count)
+		return NULL;
+
+	if(node >= numa_node_count)
+		node = 0;
+
+	paddr_t physical;
+	while(1)
+	{
+		physical = pmm_alloc_from(count, node, 0, PMM_ZONE_DEFAULT);
+		if(physical)
+			break;
+
+		if(!shrink_memory(count, 1))
+			panic("Out of memory.");
+	}
+
+	if(shrink_zone_pressure(WMARK_LOW, pmm_zone((size_t)(physical >> PAGE_SIZE_SHIFT))))
+		shrink_wakeup();
+
+	return physical;
+}
+
+// pmm_alloc_zone(): Allocates contiguous physical pages a device can reach
+// Doesn't panic, a driver can do without its buffer better than the kernel
+// Param:	size_t count - count of pages
+// Param:	uint8_t zone - highest zone the pages may be in, PMM_ZONE_*
+// Return:	paddr_t - start of 4KB-aligned page, NULL if the zone is full
+
+paddr_t pmm_alloc_zone(size_t count, uint8_t zone)
+{
+	if(!count || zone >= PMM_ZONES)
+		return NULL;
+
+	uint8_t strict;
+	uint8_t node = pmm_policy_node(&strict);
+
+	paddr_t physical = pmm_alloc_from(count, node, strict, zone);
+	if(!physical)
+	{
+		// shrinkers free memory wherever it is, so only try them once
+		if(!shrink_memory(count, 1))
+			return NULL;
+
+		physical = pmm_alloc_from(count, node, strict, zone);
+		if(!physical)
+			return NULL;
+	}
+
+	if(shrink_zone_pressure(WMARK_LOW, pmm_zone((size_t)(physical >> PAGE_SIZE_SHIFT))))
+		shrink_wakeup();
+
+	return physical;
+}
+
+// pmm_alloc_chunk(): Allocates as many contiguous pages as are free, up to a limit
+// Takes the largest free block that fits, so large ranges can be built out of
+// several blocks when memory is fragmented, and doesn't panic when it's full
+// Param:	size_t count - most pages wanted
+// Param:	uint8_t max_order - largest block order to take
+// Param:	uint8_t zone - highest zone the pages may be in, PMM_ZONE_*
+// Param:	size_t *allocated - where to store count of pages allocated
+// Return:	paddr_t - start of 4KB-aligned page, NULL if memory is full
+
+paddr_t pmm_alloc_chunk(size_t count, uint8_t max_order, uint8_t zone, size_t *allocated)
+{
+	allocated[0] = 0;
+	if(!count)
+		return NULL;
+
+	uint8_t strict;
+	uint8_t node;
+	size_t frame;
+
+	// single frames still come from the per-CPU cache
+	if((count == 1 || !max_order) && pmm_pcp_ready)
+	{
+		cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+		if(cpu->numa_policy == NUMA_POLICY_LOCAL)
+		{
+			frame = pmm_pcp_alloc();
+			if(frame == PMM_NONE)
+				return NULL;
+
+			allocated[0] = 1;
+			return (paddr_t)frame << PAGE_SIZE_SHIFT;
+		}
+	}
+
+	node = pmm_policy_node(&strict);
+
+	uint8_t order = 0;
+	while(order < max_order && order < PMM_MAX_ORDER && ((size_t)2 << order) <= count)
+		order++;
+
+	acquire_lock(&pmm_mutex);
+
+	while(1)
+	{
+		frame = pmm_alloc_block(order, node, strict, zone);
+		if(frame != PMM_NONE || !order)
+			break;
+
+		order--;
+	}
+
+	release_lock(&pmm_mutex);
+
+	if(frame == PMM_NONE)
+		return NULL;
+
+	allocated[0] = (size_t)1 << order;
+	return (paddr_t)frame << PAGE_SIZE_SHIFT;
+}
+
+// pmm_largest_free(): Returns the largest run of free contiguous pages
+// Param:	Nothing
+// Return:	size_t - count of pages
+
+size_t pmm_largest_free()
+{
+	size_t frame = 0, run = 0, largest = 0;
+
+	acquire_lock(&pmm_mutex);
+
+	// free blocks next to each other are one run, even if they can't merge
+	while(frame < pmm_frame_count)
+	{
+		if(pmm_frames[frame].order == PMM_NO_ORDER)
+		{
+			run = 0;
+			frame++;
+			continue;
+		}
+
+		run += (size_t)1 << pmm_frames[frame].order;
+		frame += (size_t)1 << pmm_frames[frame].order;
+
+		if(run > largest)
+			largest = run;
+	}
+
+	release_lock(&pmm_mutex);
+	return largest;
+}
+
+// pmm_set_tag(): Records who owns a range of frames
+// Param:	paddr_t base - 4KB-aligned base
+// Param:	size_t count - count of pages
+// Param:	uint8_t tag - PMM_TAG_*
+// Return:	Nothing
+
+void pmm_set_tag(paddr_t base, size_t count, uint8_t tag)
+{
+	size_t frame = (size_t)(base >> PAGE_SIZE_SHIFT);
+	size_t end = frame + count;
+	if(end > pmm_frame_count)
+		end = pmm_frame_count;
+
+	while(frame < end)
+	{
+		pmm_frames[frame].tag = tag;
+		frame++;
+	}
+}
+
+// pmm_get_tag(): Returns who owns a frame
+// Param:	paddr_t page - 4KB-aligned page
+// Return:	uint8_t - PMM_TAG_*, PMM_TAG_RESERVED if it isn't RAM
+
+uint8_t pmm_get_tag(paddr_t page)
+{
+	size_t frame = (size_t)(page >> PAGE_SIZE_SHIFT);
+	if(frame >= pmm_frame_count)
+		return PMM_TAG_RESERVED;
+
+	return pmm_frames[frame].tag;
+}
+
+// pmm_set_flags(): Sets flags of a range of frames
+// Param:	paddr_t base - 4KB-aligned base
+// Param:	size_t count - count of pages
+// Param:	uint8_t flags - PMM_FRAME_* flags to set
+// Return:	Nothing
+
+void pmm_set_flags(paddr_t base, size_t count, uint8_t flags)
+{
+	size_t frame = (size_t)(base >> PAGE_SIZE_SHIFT);
+	size_t end = frame + count;
+	if(end > pmm_frame_count)
+		end = pmm_frame_count;
+
+	while(frame < end)
+	{
+		pmm_frames[frame].flags |= flags;
+		frame++;
+	}
+}
+
+// pmm_clear_flags(): Clears flags of a range of frames
+// Param:	paddr_t base - 4KB-aligned base
+// Param:	size_t count - count of pages
+// Param:	uint8_t flags - PMM_FRAME_* flags to clear
+// Return:	Nothing
+
+void pmm_clear_flags(paddr_t base, size_t count, uint8_t flags)
+{
+	size_t frame = (size_t)(base >> PAGE_SIZE_SHIFT);
+	size_t end = frame + count;
+	if(end > pmm_frame_count)
+		end = pmm_frame_count;
+
+	while(frame < end)
+	{
+		pmm_frames[frame].flags &= ~flags;
+		frame++;
+	}
+}
+
+// pmm_get_flags(): Returns the flags of a frame
+// Param:	paddr_t page - 4KB-aligned page
+// Return:	uint8_t - PMM_FRAME_* flags
+
+uint8_t pmm_get_flags(paddr_t page)
+{
+	size_t frame = (size_t)(page >> PAGE_SIZE_SHIFT);
+	if(frame >= pmm_frame_count)
+		return 0;
+
+	return pmm_frames[frame].flags;
+}
+
+// pmm_numa_init(): Moves free memory into the free lists of its NUMA node
+// Param:	Nothing
+// Return:	Nothing
+
+void pmm_numa_init()
+{
+	acquire_lock(&pmm_mutex);
+
+	// take every free block out, chained through next with the order in prev
+	uint32_t chain = PMM_NONE;
+	size_t frame, end, run_end;
+	uint8_t order, node, zone;
+
+	for(zone = 0; zone < PMM_ZONES; zone++)
+	{
+		for(order = 0; order <= PMM_MAX_ORDER; order++)
+		{
+			while(pmm_free_lists[0][zone][order] != PMM_NONE)
+			{
+				frame = pmm_free_lists[0][zone][order];
+				pmm_list_remove(frame, order);
+				used_pages += (size_t)1 << order;
+
+				pmm_frames[frame].next = chain;
+				pmm_frames[frame].prev = order;
+				chain = frame;
+			}
+		}
+	}
+
+	// now every frame can be given its node
+	for(frame = 0; frame < pmm_frame_count; frame++)
+		pmm_frames[frame].node = numa_memory_node((paddr_t)frame << PAGE_SIZE_SHIFT);
+
+	// and give the blocks back, split where the node changes
+	while(chain != PMM_NONE)
+	{
+		frame = chain;
+		order = pmm_frames[frame].prev;
+		chain = pmm_frames[frame].next;
+		pmm_frames[frame].next = PMM_NONE;
+		pmm_frames[frame].prev = PMM_NONE;
+
+		end = frame + ((size_t)1 << order);
+		while(frame < end)
+		{
+			node = pmm_frames[frame].node;
+			run_end = frame + 1;
+			while(run_end < end && pmm_frames[run_end].node == node)
+				run_end++;
+
+			pmm_release(frame, run_end - frame);
+			frame = run_end;
+		}
+	}
+
+	release_lock(&pmm_mutex);
+}
+
+// pmm_dump_orders(): Shows free blocks and pages per order
+// Param:	Nothing
+// Return:	Nothing
+
+void pmm_dump_orders()
+{
+	size_t i = 0;
+	while(i <= PMM_MAX_ORDER)
+	{
+		kprintf("pmm: order %d (%d KB): %d free blocks, %d free pages\n", i, (PAGE_SIZE << i) / 1024, pmm_free_blocks[i], pmm_free_blocks[i] << i);
+		i++;
+	}
+}
+
+// pmm_fragmentation_dump(): Shows how much of free memory is contiguous
+// Param:	Nothing
+// Return:	Nothing
+
+void pmm_fragmentation_dump()
+{
+	size_t largest = pmm_largest_free();
+	kprintf("pmm: largest free contiguous run is %d KB, out of %d MB free\n", largest * (PAGE_SIZE / 1024), (total_pages - used_pages) / 256);
+}
+
+// pmm_tag_dump(): Shows how much memory each owner has
+// Param:	Nothing
+// Return:	Nothing
+
+void pmm_tag_dump()
+{
+	size_t pages[PMM_TAGS];
+	size_t dirty = 0, pinned = 0, shared = 0;
+	size_t frame = 0, i;
+
+	for(i = 0; i < PMM_TAGS; i++)
+		pages[i] = 0;
+
+	acquire_lock(&pmm_mutex);
+
+	while(frame < pmm_frame_count)
+	{
+		// free blocks have no owner
+		if(pmm_frames[frame].order != PMM_NO_ORDER)
+		{
+			frame += (size_t)1 << pmm_frames[frame].order;
+			continue;
+		}
+
+		if(pmm_frames[frame].tag < PMM_TAGS)
+			pages[pmm_frames[frame].tag]++;
+
+		if(pmm_frames[frame].flags & PMM_FRAME_DIRTY)
+			dirty++;
+
+		if(pmm_frames[frame].flags & PMM_FRAME_PINNED)
+			pinned++;
+
+		if(pmm_frames[frame].refcount)
+			shared++;
+
+		frame++;
+	}
+
+	release_lock(&pmm_mutex);
+
+	for(i = 0; i < PMM_TAGS; i++)
+	{
+		if(pages[i])
+			kprintf("pmm: %s: %d pages, %d KB\n", pmm_tag_names[i], pages[i], pages[i] * (PAGE_SIZE / 1024));
+	}
+
+	kprintf("pmm: %d dirty, %d pinned, %d shared frames\n", dirty, pinned, shared);
+}
+
+// pmm_zone_dump(): Shows free memory per zone
+// Param:	Nothing
+// Return:	Nothing
+
+void pmm_zone_dump()
+{
+	size_t node, zone;
+	int order;
+
+	acquire_lock(&pmm_mutex);
+
+	for(zone = 0; zone < PMM_ZONES; zone++)
+	{
+		// the largest order with a free block on any node
+		for(order = PMM_MAX_ORDER; order >= 0; order--)
+		{
+			for(node = 0; node < numa_node_count; node++)
+			{
+				if(pmm_free_lists[node][zone][order] != PMM_NONE)
+					break;
+			}
+
+			if(node < numa_node_count)
+				break;
+		}
+
+		if(order < 0)
+			kprintf("pmm: zone %s: no free memory\n", pmm_zone_names[zone]);
+		else
+			kprintf("pmm: zone %s: %d KB free, largest block %d KB\n", pmm_zone_names[zone], pmm_zone_free[zone] * (PAGE_SIZE / 1024), (PAGE_SIZE << order) / 1024);
+	}
+
+	release_lock(&pmm_mutex);
+}
+
+// pmm_pcp_dump(): Shows the page cache counters of every CPU
+// Param:	Nothing
+// Return:	Nothing
+
+void pmm_pcp_dump()
+{
+	if(!pmm_pcp_ready)
+		return;
+
+	// other CPUs keep going, so these are only close
+	size_t i;
+	cpu_t *cpu;
+	for(i = 0; i < MAX_LAPICS; i++)
+	{
+		cpu = smp_cpus[i];
+		if(!cpu || !(smp_online_cpus & (1 << i)))
+			continue;
+
+		kprintf("pmm: CPU index %d page cache: %d frames, %d hits, %d misses, %d refills, %d drains\n", cpu->index, cpu->pcp.count, (uint32_t)cpu->pcp.hits, (uint32_t)cpu->pcp.misses, (uint32_t)cpu->pcp.refills, (uint32_t)cpu->pcp.drains);
+	}
+}
+
+/* Internal Functions */
+
+// pmm_alloc_from(): Allocates contiguous physical pages from a node
+// Param:	size_t count - count of pages
+// Param:	uint8_t node - preferred NUMA node
+// Param:	uint8_t strict - 1 to never fall back to other nodes
+// Param:	uint8_t zone - highest zone to use
+// Return:	paddr_t - start of 4KB-aligned page, NULL if memory is full
+
+paddr_t pmm_alloc_from(size_t count, uint8_t node, uint8_t strict, uint8_t zone)
+{
+	acquire_lock(&pmm_mutex);
+
+	uint8_t order = 0;
+	while(((size_t)1 << order) < count)
+		order++;
+
+	size_t frame;
+
+	if(order > PMM_MAX_ORDER)
+	{
+		// same order of zones as pmm_alloc_block()
+		frame = PMM_NONE;
+		if(zone != PMM_ZONE_DMA)
+			frame = pmm_alloc_large(count, node, strict, PMM_ZONE_DMA_END, pmm_zone_end(zone));
+		if(frame == PMM_NONE)
+			frame = pmm_alloc_large(count, node, strict, 0, pmm_zone_end(zone));
+	} else
+	{
+		frame = pmm_alloc_block(order, node, strict, zone);
+	}
+
+	if(frame == PMM_NONE)
+	{
+		release_lock(&pmm_mutex);
+		return NULL;
+	}
+
+	// give back the tail if this isn't a power of two
+	if(order <= PMM_MAX_ORDER && ((size_t)1 << order) > count)
+		pmm_release(frame + count, ((size_t)1 << order) - count);
+
+	release_lock(&pmm_mutex);
+	return (paddr_t)frame << PAGE_SIZE_SHIFT;
+}
+
+// pmm_policy_node(): Picks the node to allocate from for the current CPU's NUMA policy
+// Param:	uint8_t *strict - where to store 1 if other nodes mustn't be used
+// Return:	uint8_t - NUMA node
+
+uint8_t pmm_policy_node(uint8_t *strict)
+{
+	strict[0] = 0;
+
+	// before FS points to a cpu_t, there's no policy to follow
+	if(!pmm_pcp_ready)
+		return 0;
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	uint8_t node;
+
+	switch(cpu->numa_policy)
+	{
+	case NUMA_POLICY_BIND:
+		strict[0] = 1;
+		return cpu->numa_bind_node;
+
+	case NUMA_POLICY_INTERLEAVE:
+		node = cpu->numa_interleave;
+		cpu->numa_interleave = (node + 1) % numa_node_count;
+		return node;
+
+	default:
+		return cpu->numa_node;
+	}
+}
+
+// pmm_alloc_block(): Takes a free block out of the buddy free lists
+// Param:	uint8_t order - order of block
+// Param:	uint8_t node - preferred NUMA node
+// Param:	uint8_t strict - 1 to never fall back to other nodes
+// Param:	uint8_t zone - highest zone to use
+// Return:	size_t - first frame of block, PMM_NONE on error
+
+size_t pmm_alloc_block(uint8_t order, uint8_t node, uint8_t strict, uint8_t zone)
+{
+	if(zone == PMM_ZONE_DMA)
+		return pmm_alloc_zones(order, node, strict, PMM_ZONE_DMA, PMM_ZONE_DMA);
+
+	size_t frame = pmm_alloc_zones(order, node, strict, zone, PMM_ZONE_DMA32);
+	if(frame == PMM_NONE)
+		frame = pmm_alloc_zones(order, node, strict, PMM_ZONE_DMA, PMM_ZONE_DMA);
+
+	return frame;
+}
+
+// pmm_alloc_zones(): Takes a free block from a range of zones
+// Param:	uint8_t order - order of block
+// Param:	uint8_t node - preferred NUMA node
+// Param:	uint8_t strict - 1 to never fall back to other nodes
+// Param:	uint8_t highest - zone to try first
+// Param:	uint8_t lowest - zone to try last
+// Return:	size_t - first frame of block, PMM_NONE on error
+
+size_t pmm_alloc_zones(uint8_t order, uint8_t node, uint8_t strict, uint8_t highest, uint8_t lowest)
+{
+	uint8_t current, candidate, zone;
+	size_t i = 0;
+
+	// try the nodes nearest first
+	while(i < numa_node_count)
+	{
+		candidate = numa_fallback[node][i];
+		i++;
+
+		if(strict && candidate != node)
+			continue;
+
+		// and within a node, leave lower zones for devices that need them
+		zone = highest + 1;
+		while(zone > lowest)
+		{
+			zone--;
+
+			// smallest order that has a free block
+			current = order;
+			while(current <= PMM_MAX_ORDER && pmm_free_lists[candidate][zone][current] == PMM_NONE)
+				current++;
+
+			if(current > PMM_MAX_ORDER)
+				continue;
+
+			size_t frame = pmm_free_lists[candidate][zone][current];
+			pmm_list_remove(frame, current);
+
+			// split it down, giving the upper halves back
+			while(current > order)
+			{
+				current--;
+				pmm_list_add(frame + ((size_t)1 << current), current);
+			}
+
+			used_pages += (size_t)1 << order;
+			return frame;
+		}
+	}
+
+	return PMM_NONE;
+}
+
+// pmm_pcp_alloc(): Allocates a single frame from the current CPU's cache
+// Param:	Nothing
+// Return:	size_t - frame number, PMM_NONE if memory is full
+
+size_t pmm_pcp_alloc()
+{
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	size_t flags = pmm_irq_save();
+
+	if(!cpu->pcp.count)
+	{
+		// refill a whole batch with one trip to the buddy allocator
+		// these frames haven't been touched recently, so they go in cold
+		cpu->pcp.misses++;
+
+		acquire_lock(&pmm_mutex);
+
+		size_t frame;
+		size_t i = 0;
+		while(i < PCP_BATCH)
+		{
+			frame = pmm_alloc_block(0, cpu->numa_node, 0, PMM_ZONE_DEFAULT);
+			if(frame == PMM_NONE)
+				break;
+
+			cpu->pcp.start = (cpu->pcp.start - 1) & (PCP_SIZE - 1);
+			cpu->pcp.frames[cpu->pcp.start] = frame;
+			pmm_frames[frame].tag = PMM_TAG_PCP;
+			cpu->pcp.count++;
+			i++;
+		}
+
+		release_lock(&pmm_mutex);
+
+		if(!cpu->pcp.count)
+		{
+			pmm_irq_restore(flags);
+			return PMM_NONE;
+		}
+
+		cpu->pcp.refills++;
+	} else
+	{
+		cpu->pcp.hits++;
+	}
+
+	// take the hottest frame
+	cpu->pcp.count--;
+	size_t frame = cpu->pcp.frames[(cpu->pcp.start + cpu->pcp.count) & (PCP_SIZE - 1)];
+	pmm_frames[frame].tag = PMM_TAG_NONE;
+
+	pmm_irq_restore(flags);
+	return frame;
+}
+
+// pmm_pcp_free(): Frees a single frame to the current CPU's cache
+// Param:	size_t frame - frame number
+// Return:	Nothing
+
+void pmm_pcp_free(size_t frame)
+{
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	size_t flags = pmm_irq_save();
+
+	if(cpu->pcp.count == PCP_SIZE)
+	{
+		// full, so give the coldest batch back to the buddy allocator
+		acquire_lock(&pmm_mutex);
+
+		size_t i = 0;
+		while(i < PCP_BATCH)
+		{
+			pmm_release(cpu->pcp.frames[cpu->pcp.start], 1);
+			cpu->pcp.start = (cpu->pcp.start + 1) & (PCP_SIZE - 1);
+			cpu->pcp.count--;
+			i++;
+		}
+
+		release_lock(&pmm_mutex);
+		cpu->pcp.drains++;
+	}
+
+	// a frame that was just freed is likely still in the cache, so it's hot
+	cpu->pcp.frames[(cpu->pcp.start + cpu->pcp.count) & (PCP_SIZE - 1)] = frame;
+	cpu->pcp.count++;
+
+	pmm_irq_restore(flags);
+}
+
+// pmm_irq_save(): Disables interrupts on the current CPU
+// Param:	Nothing
+// Return:	size_t - previous flags register
+
+size_t pmm_irq_save()
+{
+	size_t flags;
+	asm volatile ("pushf\npop %0\ncli" : "=r"(flags) :: "memory");
+	return flags;
+}
+
+// pmm_irq_restore(): Restores the interrupt flag on the current CPU
+// Param:	size_t flags - flags returned by pmm_irq_save()
+// Return:	Nothing
+
+void pmm_irq_restore(size_t flags)
+{
+	if(flags & 0x200)
+		asm volatile ("sti" ::: "memory");
+}
+
+// pmm_list_add(): Adds a free block to the list of its order
+// Param:	size_t frame - first frame of block
+// Param:	uint8_t order - order of block
+// Return:	Nothing
+
+void pmm_list_add(size_t frame, uint8_t order)
+{
+	uint32_t *list = &pmm_free_lists[pmm_frames[frame].node][pmm_zone(frame)][order];
+
+	pmm_frames[frame].order = order;
+	pmm_frames[frame].prev = PMM_NONE;
+	pmm_frames[frame].next = list[0];
+
+	if(list[0] != PMM_NONE)
+		pmm_frames[list[0]].prev = frame;
+
+	list[0] = frame;
+	pmm_free_blocks[order]++;
+	pmm_node_free[pmm_frames[frame].node] += (size_t)1 << order;
+	pmm_zone_free[pmm_zone(frame)] += (size_t)1 << order;
+}
+
+// pmm_list_remove(): Removes a free block from the list of its order
+// Param:	size_t frame - first frame of block
+// Param:	uint8_t order - order of block
+// Return:	Nothing
+
+void pmm_list_remove(size_t frame, uint8_t order)
+{
+	if(pmm_frames[frame].prev != PMM_NONE)
+		pmm_frames[pmm_frames[frame].prev].next = pmm_frames[frame].next;
+	else
+		pmm_free_lists[pmm_frames[frame].node][pmm_zone(frame)][order] = pmm_frames[frame].next;
+
+	if(pmm_frames[frame].next != PMM_NONE)
+		pmm_frames[pmm_frames[frame].next].prev = pmm_frames[frame].prev;
+
+	pmm_frames[frame].order = PMM_NO_ORDER;
+	pmm_frames[frame].next = PMM_NONE;
+	pmm_frames[frame].prev = PMM_NONE;
+	pmm_free_blocks[order]--;
+	pmm_node_free[pmm_frames[frame].node] -= (size_t)1 << order;
+	pmm_zone_free[pmm_zone(frame)] -= (size_t)1 << order;
+}
+
+// pmm_free_block(): Frees a block, merging it with its buddies
+// Param:	size_t frame - first frame of block
+// Param:	uint8_t order - order of block
+// Return:	Nothing
+
+void pmm_free_block(size_t frame, uint8_t order)
+{
+	size_t buddy;
+
+	while(order < PMM_MAX_ORDER)
+	{
+		buddy = frame ^ ((size_t)1 << order);
+		if(buddy + ((size_t)1 << order) > pmm_frame_count)
+			break;
+
+		if(pmm_frames[buddy].order != order || pmm_frames[buddy].node != pmm_frames[frame].node)
+			break;
+
+		pmm_list_remove(buddy, order);
+		if(buddy < frame)
+			frame = buddy;
+
+		order++;
+	}
+
+	pmm_list_add(frame, order);
+}
+
+// pmm_find_block(): Finds the free block containing a frame
+// Param:	size_t frame - frame number
+// Param:	uint8_t *order - destination to store the order of the block
+// Return:	size_t - first frame of free block, PMM_NONE if frame is used
+
+size_t pmm_find_block(size_t frame, uint8_t *order)
+{
+	size_t head;
+	uint8_t i = 0;
+
+	while(i <= PMM_MAX_ORDER)
+	{
+		head = frame & ~(((size_t)1 << i) - 1);
+		if(pmm_frames[head].order == i)
+		{
+			order[0] = i;
+			return head;
+		}
+
+		i++;
+	}
+
+	return PMM_NONE;
+}
+
+// pmm_carve(): Gives back the parts of an unlinked block outside of a range
+// Param:	size_t head - first frame of block
+// Param:	uint8_t order - order of block
+// Param:	size_t start - first frame of range being used
+// Param:	size_t end - frame after the range being used
+// Return:	Nothing
+
+void pmm_carve(size_t head, uint8_t order, size_t start, size_t end)
+{
+	size_t block_end = head + ((size_t)1 << order);
+
+	if(start <= head && block_end <= end)
+		return;				// all of it is used
+
+	if(end <= head || start >= block_end)
+	{
+		pmm_list_add(head, order);	// none of it is used
+		return;
+	}
+
+	order--;
+	pmm_carve(head, order, start, end);
+	pmm_carve(head + ((size_t)1 << order), order, start, end);
+}
+
+// pmm_release(): Frees a range of frames in the largest possible blocks
+// Param:	size_t frame - first frame
+// Param:	size_t count - count of frames
+// Return:	Nothing
+
+void pmm_release(size_t frame, size_t count)
+{
+	size_t end = frame + count;
+	uint8_t order, dummy;
+	size_t i;
+
+	while(frame < end)
+	{
+		order = 0;
+		while(order < PMM_MAX_ORDER && !(frame & (((size_t)1 << (order+1)) - 1)) && frame + ((size_t)1 << (order+1)) <= end)
+			order++;
+
+		// ignore double frees
+		if(pmm_find_block(frame, &dummy) != PMM_NONE)
+		{
+			frame++;
+			continue;
+		}
+
+		pmm_free_block(frame, order);
+		used_pages -= (size_t)1 << order;
+
+		for(i = 0; i < ((size_t)1 << order); i++)
+		{
+			pmm_frames[frame + i].flags = 0;
+			pmm_frames[frame + i].tag = PMM_TAG_NONE;
+		}
+
+		frame += (size_t)1 << order;
+	}
+}
+
+// pmm_alloc_large(): Allocates more frames than the largest block
+// Param:	size_t count - count of frames
+// Param:	uint8_t node - preferred NUMA node
+// Param:	uint8_t strict - 1 to never fall back to other nodes
+// Param:	size_t start - first frame to look at
+// Param:	size_t end - frame after the last one to use
+// Return:	size_t - first frame, PMM_NONE on error
+
+size_t pmm_alloc_large(size_t count, uint8_t node, uint8_t strict, size_t start, size_t end)
+{
+	// look for a run of adjacent free blocks of the highest order
+	size_t block_size = (size_t)1 << PMM_MAX_ORDER;
+	size_t blocks = (count + block_size - 1) >> PMM_MAX_ORDER;
+	size_t frame, run;
+	uint8_t candidate;
+	size_t n = 0;
+
+	while(n < numa_node_count)
+	{
+		candidate = numa_fallback[node][n];
+		n++;
+
+		if(strict && candidate != node)
+			continue;
+
+		frame = start;
+		run = 0;
+
+		while(frame + block_size <= end)
+		{
+			if(pmm_frames[frame].order == PMM_MAX_ORDER && pmm_frames[frame].node == candidate)
+			{
+				run++;
+				if(run >= blocks)
+					break;
+			} else
+			{
+				run = 0;
+			}
+
+			frame += block_size;
+		}
+
+		if(run < blocks)
+			continue;
+
+		frame -= (blocks - 1) << PMM_MAX_ORDER;
+
+		size_t i = 0;
+		while(i < blocks)
+		{
+			pmm_list_remove(frame + (i << PMM_MAX_ORDER), PMM_MAX_ORDER);
+			i++;
+		}
+
+		used_pages += blocks << PMM_MAX_ORDER;
+		if((blocks << PMM_MAX_ORDER) > count)
+			pmm_release(frame + count, (blocks << PMM_MAX_ORDER) - count);
+
+		return frame;
+	}
+
+	return PMM_NONE;
+}
+
+// pmm_zone(): Returns the zone of a frame
+// Param:	size_t frame - frame number
+// Return:	uint8_t - PMM_ZONE_*
+
+uint8_t pmm_zone(size_t frame)
+{
+	if(frame < PMM_ZONE_DMA_END)
+		return PMM_ZONE_DMA;
+
+	if(frame < PMM_ZONE_DMA32_END)
+		return PMM_ZONE_DMA32;
+
+	return PMM_ZONE_NORMAL;
+}
+
+// pmm_zone_end(): Returns the frame after the last one a zone can use
+// Param:	uint8_t zone - PMM_ZONE_*
+// Return:	size_t - frame number
+
+size_t pmm_zone_end(uint8_t zone)
+{
+	size_t end = pmm_frame_count;
+
+	if(zone == PMM_ZONE_DMA && end > PMM_ZONE_DMA_END)
+		end = PMM_ZONE_DMA_END;
+	else if(zone == PMM_ZONE_DMA32 && end > PMM_ZONE_DMA32_END)
+		end = PMM_ZONE_DMA32_END;
+
+	return end;
+}
+
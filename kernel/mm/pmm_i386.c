@@ -12,15 +12,12 @@
 
 #if __i386__
 
-uint8_t *pmm_bitmap;
 size_t total_pages, used_pages, reserved_pages;
 uint64_t total_memory, usable_memory;
-size_t highest_usable_address;
-lock_t pmm_mutex = 0;
+paddr_t highest_usable_address;
 
 void pmm_add_range(e820_entry_t *);
-void pmm_mark_page_used(size_t);
-void pmm_mark_page_free(size_t);
+void pmm_free_range(e820_entry_t *);
 
 // pmm_init(): Initializes the physical memory manager
 // Param:	multiboot_info_t *multiboot_info - pointer to multiboot information
@@ -41,16 +38,13 @@ void pmm_init(multiboot_info_t *multiboot_info)
 		while(1);
 	}
 
-	// create a bitmap at the end of the kernel binary
-	pmm_bitmap = (uint8_t*)kend;
-	memset(pmm_bitmap, 0, PMM_BITMAP_SIZE);
-
 	// and start!
 	total_pages = 0;
 	used_pages = 0;
 	reserved_pages = 0;
 	total_memory = 0;
 	usable_memory = 0;
+	highest_usable_address = 0;
 
 	kprintf("pmm: showing E820 memory map:\n");
 	kprintf(" STARTING ADDRESS - ENDING ADDRESS   - TYPE\n");
@@ -98,11 +92,35 @@ void pmm_init(multiboot_info_t *multiboot_info)
 		mmap = (e820_entry_t*)((uint32_t)mmap + mmap->size + 4);
 	}
 
-	kprintf("pmm: total of %d MB memory, of which %d MB are usable.\n", (uint32_t)total_memory/ 1024/1024, (uint32_t)usable_memory/1024/1024);
+	kprintf("pmm: total of %d MB memory, of which %d MB are usable.\n", (uint32_t)(total_memory / 1024 / 1024), (uint32_t)(usable_memory / 1024 / 1024));
+
+	// the frame array goes at 16 MB, above the kernel and paging structures
+	size_t frame_count = (size_t)(highest_usable_address >> PAGE_SIZE_SHIFT);
+	size_t frames_size = (frame_count * sizeof(pmm_frame_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+
+	// with PAE that can be 256 MB, and it has to be in the RAM right after 1 MB
+	if(PMM_FRAMES_BASE + frames_size > 0x100000 + ((size_t)multiboot_info->mem_upper << 10))
+	{
+		kprintf("boot error: too little memory for the frame array.\n");
+		while(1);
+	}
+
+	pmm_buddy_init((pmm_frame_t*)PMM_FRAMES_BASE, frame_count);
+
+	// now free all the usable memory
+	mmap = (e820_entry_t*)(multiboot_info->mmap_addr);
+	while(mmap < mmap_end)
+	{
+		pmm_free_range(mmap);
+		mmap = (e820_entry_t*)((uint32_t)mmap + mmap->size + 4);
+	}
+
+	// mark the lowest 16 MB for the kernel, and the frame array above it
+	pmm_mark_used(0, (PMM_FRAMES_BASE + frames_size) >> PAGE_SIZE_SHIFT);
 
-	// mark the lowest 16 MB for the kernel
-	pmm_mark_used(0, 4096);
 	kprintf("pmm: %d pages, %d used, %d hardware reserved.\n", total_pages, used_pages, reserved_pages);
+	kprintf("pmm: frame array is %d KB for %d frames\n", frames_size / 1024, frame_count);
+	pmm_dump_orders();
 }
 
 // pmm_add_range(): Adds a memory range to the physical memory manager
@@ -111,9 +129,15 @@ void pmm_init(multiboot_info_t *multiboot_info)
 
 void pmm_add_range(e820_entry_t *mmap)
 {
-	// ignore above 4 GB because we don't use PAE
+#if PAE
+	// the frame array only goes as far as PAE can reach
+	if(mmap->base >= PMM_MAX_MEMORY || mmap->base + mmap->length > PMM_MAX_MEMORY)
+		return;
+#else
+	// ignore above 4 GB without PAE
 	if(mmap->base >= 0x100000000 || mmap->base + mmap->length >= 0x100000000)
 		return;
+#endif
 
 	if(!mmap->length)		// zero-size entry?
 		return;			// ignore
@@ -132,148 +156,46 @@ void pmm_add_range(e820_entry_t *mmap)
 	if(mmap->type == E820_USABLE)
 	{
 		usable_memory += mmap->length;
-		highest_usable_address = (size_t)mmap->base + mmap->length - (PAGE_SIZE-1);
+		if((paddr_t)(mmap->base + mmap->length) > highest_usable_address)
+			highest_usable_address = (paddr_t)(mmap->base + mmap->length);
 	} else
 	{
 		reserved_pages += (mmap->length + PAGE_SIZE-1) / PAGE_SIZE;
-		pmm_mark_used((size_t)mmap->base, (size_t)(mmap->length + PAGE_SIZE-1) / PAGE_SIZE);
 	}
 }
 
-/* ******************************** */
-/*                                  */
-/* Actual management functions here */
-/*                                  */
-/* ******************************** */
-
-// pmm_mark_page_used(): Marks a single page as used
-// Param:	size_t page - 4KB-aligned page address
-// Return:	Nothing
-
-void pmm_mark_page_used(size_t page)
-{
-	if(pmm_bitmap[page >> PAGE_SIZE_SHIFT] == 1)
-		return;
-
-	pmm_bitmap[page >> PAGE_SIZE_SHIFT] = 1;
-	used_pages++;
-}
-
-// pmm_mark_page_free(): Marks a single page as free
-// Param:	size_t page - 4KB-aligned page address
+// pmm_free_range(): Gives a usable memory range to the buddy allocator
+// Param:	e820_entry_t *mmap - pointer to memory range structure
 // Return:	Nothing
 
-void pmm_mark_page_free(size_t page)
+void pmm_free_range(e820_entry_t *mmap)
 {
-	if(pmm_bitmap[page >> PAGE_SIZE_SHIFT] == 0)
+	// same rules as pmm_add_range()
+#if PAE
+	if(mmap->base >= PMM_MAX_MEMORY || mmap->base + mmap->length > PMM_MAX_MEMORY)
 		return;
-
-	pmm_bitmap[page >> PAGE_SIZE_SHIFT] = 0;
-	used_pages--;
-}
-
-// pmm_mark_used(): Marks a range of pages as used
-// Param:	size_t base - 4KB-aligned base
-// Param:	size_t count - count of pages
-// Return:	Nothing
-
-void pmm_mark_used(size_t base, size_t count)
-{
-	if(!count)
+#else
+	if(mmap->base >= 0x100000000 || mmap->base + mmap->length >= 0x100000000)
 		return;
+#endif
 
-	size_t i = 0;
-	while(i < count)
-	{
-		pmm_mark_page_used(base);
-		i++;
-		base += PAGE_SIZE;
-	}
-}
-
-// pmm_mark_free(): Marks a range of pages as free
-// Param:	size_t base - 4KB-aligned base
-// Param:	size_t count - count of pages
-// Return:	Nothing
-
-void pmm_mark_free(size_t base, size_t count)
-{
-	if(!count)
+	if(!mmap->length || mmap->type != E820_USABLE)
 		return;
 
-	size_t i = 0;
-	while(i < count)
-	{
-		pmm_mark_page_free(base);
-		i++;
-		base += PAGE_SIZE;
-	}
-}
-
-// pmm_is_page_free(): Checks if a page is free or used
-// Param:	size_t page - 4KB-aligned page
-// Return:	uint8_t - 1 for used pages, 0 for free pages
-
-uint8_t pmm_is_page_free(size_t page)
-{
-	if(page >= highest_usable_address)
-		return 1;
-
-	else
-		return pmm_bitmap[page >> PAGE_SIZE_SHIFT];
-}
-
-// pmm_find_range(): Finds a range of contiguous physical pages
-// Param:	size_t count - count of pages
-// Return:	size_t - start of 4KB-aligned page, NULL on error
-
-size_t pmm_find_range(size_t count)
-{
-	if(!count)
-		return NULL;
-
-	// we have reserved the lowest 16 MB for the kernel
-	// so start looking from 16 MB
-	size_t current_return = 0x1000000;
-	size_t free_count = 0;
-
-	while(free_count < count)
+	if(mmap->size >= 24)
 	{
-		if(pmm_is_page_free(current_return + (free_count << PAGE_SIZE_SHIFT)) == 0)
-			free_count++;
-
-		else
-		{
-			current_return += PAGE_SIZE;
-
-			if(current_return >= highest_usable_address)
-				return NULL;
-
-			free_count = 0;
-		}
+		if(!mmap->acpi_attributes & 1)
+			return;
 	}
 
-	return current_return;
-}
-
-// pmm_alloc(): Allocates contiguous physical pages
-// Param:	size_t count - count of pages
-// Return:	size_t - start of 4KB-aligned page, NULL on error
+	// only use whole pages
+	paddr_t base = ((paddr_t)mmap->base + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+	paddr_t end = ((paddr_t)mmap->base + (paddr_t)mmap->length) & ~(PAGE_SIZE-1);
 
-size_t pmm_alloc(size_t count)
-{
-	acquire_lock(&pmm_mutex);
-
-	size_t memory = pmm_find_range(count);
-	if(!memory)
-		panic("Out of memory.");
-
-	pmm_mark_used(memory, count);
-	release_lock(&pmm_mutex);
-	return memory;
+	if(end > base)
+		pmm_mark_free(base, (size_t)((end - base) >> PAGE_SIZE_SHIFT));
 }
 
 #endif // __i386__
 
 
-
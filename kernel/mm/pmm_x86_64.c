@@ -12,15 +12,12 @@
 
 #if __x86_64__
 
-uint8_t *pmm_bitmap;
 size_t total_pages, used_pages, reserved_pages;
 uint64_t total_memory, usable_memory;
 size_t highest_usable_address;
-lock_t pmm_mutex = 0;
 
 void pmm_add_range(e820_entry_t *);
-void pmm_mark_page_used(size_t);
-void pmm_mark_page_free(size_t);
+void pmm_free_range(e820_entry_t *);
 
 // pmm_init(): Initializes the physical memory manager
 // Param:	multiboot_info_t *multiboot_info - pointer to multiboot information
@@ -41,15 +38,13 @@ void pmm_init(multiboot_info_t *multiboot_info)
 		while(1);
 	}
 
-	pmm_bitmap = (uint8_t*)kend;
-	memset(pmm_bitmap, 0, PMM_BITMAP_SIZE);
-
 	// and start!
 	total_pages = 0;
 	used_pages = 0;
 	reserved_pages = 0;
 	total_memory = 0;
 	usable_memory = 0;
+	highest_usable_address = 0;
 
 	kprintf("pmm: showing BIOS-provided memory map:\n");
 	kprintf(" STARTING ADDRESS - ENDING ADDRESS   - TYPE\n");
@@ -106,9 +101,45 @@ void pmm_init(multiboot_info_t *multiboot_info)
 
 	kprintf("pmm: total of %d MB memory, of which %d MB are usable.\n", (uint32_t)(total_memory/ 1024/1024), (uint32_t)(usable_memory/1024/1024));
 
-	// mark the lowest 32 MB for the kernel
+	// the frame array goes where the kernel ends, in the physical map
+	if(highest_usable_address > PMM_MAX_MEMORY)
+		highest_usable_address = PMM_MAX_MEMORY;
+
+	size_t frame_count = highest_usable_address >> PAGE_SIZE_SHIFT;
+	size_t frames_size = (frame_count * sizeof(pmm_frame_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+
+	// kend may be physical when there are boot modules
+	size_t frames_phys = ((size_t)kend + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+	if(frames_phys >= PHYSICAL_MEMORY)
+		frames_phys -= PHYSICAL_MEMORY;
+
+	pmm_buddy_init((pmm_frame_t*)(frames_phys + PHYSICAL_MEMORY), frame_count);
+
+	// now free all the usable memory
+	mmap = (size_t)multiboot_info->mmap_addr & 0xFFFFFFFF;
+	mmap_ptr = (e820_entry_t*)mmap;
+	count = 0;
+
+	while(count < multiboot_info->mmap_length)
+	{
+		if(mmap_ptr->size < 20)
+			break;
+
+		pmm_free_range(mmap_ptr);
+
+		mmap += (size_t)(mmap_ptr->size + 4);
+		count += mmap_ptr->size + 4;
+
+		mmap_ptr = (e820_entry_t*)mmap;
+	}
+
+	// mark the lowest 32 MB for the kernel, and the frame array wherever it ends
 	pmm_mark_used(0, 8192);
+	pmm_mark_used(frames_phys, frames_size >> PAGE_SIZE_SHIFT);
+
 	kprintf("pmm: %d pages, %d used, %d hardware reserved.\n", total_pages, used_pages, reserved_pages);
+	kprintf("pmm: frame array is %d KB for %d frames\n", frames_size / 1024, frame_count);
+	pmm_dump_orders();
 }
 
 // pmm_add_range(): Adds a memory range to the physical memory manager
@@ -134,153 +165,35 @@ void pmm_add_range(e820_entry_t *mmap)
 	if(mmap->type == E820_USABLE)
 	{
 		usable_memory += mmap->length;
-		highest_usable_address = (size_t)mmap->base + mmap->length - (PAGE_SIZE-1);
+		if((size_t)mmap->base + mmap->length > highest_usable_address)
+			highest_usable_address = (size_t)mmap->base + mmap->length;
 	} else
 	{
 		reserved_pages += (mmap->length + PAGE_SIZE-1) / PAGE_SIZE;
-		pmm_mark_used((size_t)mmap->base, (size_t)(mmap->length + PAGE_SIZE-1) / PAGE_SIZE);
-	}
-}
-
-// pmm_mark_page_used(): Marks a single page as used
-// Param:	size_t page - 4KB-aligned page address
-// Return:	Nothing
-
-void pmm_mark_page_used(size_t page)
-{
-	size_t group = page >> (PAGE_SIZE_SHIFT + 3);
-	uint8_t page_number = (page - (group << (PAGE_SIZE_SHIFT + 3))) >> PAGE_SIZE_SHIFT;
-	uint8_t flag = 1 << page_number;
-
-	if((pmm_bitmap[group] & flag) != 0)
-		return;
-
-	pmm_bitmap[group] |= flag;
-	used_pages++;
-}
-
-// pmm_mark_page_free(): Marks a single page as free
-// Param:	size_t page - 4KB-aligned page address
-// Return:	Nothing
-
-void pmm_mark_page_free(size_t page)
-{
-	size_t group = page >> (PAGE_SIZE_SHIFT + 3);
-	uint8_t page_number = (page - (group << (PAGE_SIZE_SHIFT + 3))) >> PAGE_SIZE_SHIFT;
-	uint8_t flag = 1 << page_number;
-
-	if((pmm_bitmap[group] & flag) == 0)
-		return;
-
-	pmm_bitmap[group] &= (~flag);
-	used_pages--;
-}
-
-// pmm_mark_used(): Marks a range of pages as used
-// Param:	size_t base - 4KB-aligned base
-// Param:	size_t count - count of pages
-// Return:	Nothing
-
-void pmm_mark_used(size_t base, size_t count)
-{
-	if(!count)
-		return;
-
-	size_t i = 0;
-	while(i < count)
-	{
-		pmm_mark_page_used(base);
-		i++;
-		base += PAGE_SIZE;
 	}
 }
 
-// pmm_mark_free(): Marks a range of pages as free
-// Param:	size_t base - 4KB-aligned base
-// Param:	size_t count - count of pages
+// pmm_free_range(): Gives a usable memory range to the buddy allocator
+// Param:	e820_entry_t *mmap - pointer to memory range structure
 // Return:	Nothing
 
-void pmm_mark_free(size_t base, size_t count)
+void pmm_free_range(e820_entry_t *mmap)
 {
-	if(!count)
+	if(!mmap->length || mmap->type != E820_USABLE)
 		return;
 
-	size_t i = 0;
-	while(i < count)
-	{
-		pmm_mark_page_free(base);
-		i++;
-		base += PAGE_SIZE;
-	}
-}
-
-// pmm_is_page_free(): Checks if a page is free or used
-// Param:	size_t page - 4KB-aligned page
-// Return:	uint8_t - 1 for used pages, 0 for free pages
-
-uint8_t pmm_is_page_free(size_t page)
-{
-	if(page >= highest_usable_address)
-		return 1;
-
-	size_t group = page >> (PAGE_SIZE_SHIFT + 3);
-	uint8_t page_number = (page - (group << (PAGE_SIZE_SHIFT + 3))) >> PAGE_SIZE_SHIFT;
-
-	return (pmm_bitmap[group] >> page_number) & 1;
-}
-
-// pmm_find_range(): Finds a range of contiguous physical pages
-// Param:	size_t count - count of pages
-// Return:	size_t - start of 4KB-aligned page, NULL on error
-
-size_t pmm_find_range(size_t count)
-{
-	if(!count)
-		return NULL;
-
-	// we have reserved the lowest 32 MB for the kernel
-	// so start looking from 32 MB
-	size_t current_return = 0x2000000;
-	size_t free_count = 0;
-
-	while(free_count < count)
+	if(mmap->size >= 24)
 	{
-		if(pmm_is_page_free(current_return + (free_count << PAGE_SIZE_SHIFT)) == 0)
-			free_count++;
-
-		else
-		{
-			current_return += PAGE_SIZE;
-
-			if(current_return >= highest_usable_address)
-				return NULL;
-
-			free_count = 0;
-		}
+		if(!mmap->acpi_attributes & 1)
+			return;
 	}
 
-	return current_return;
-}
-
-// pmm_alloc(): Allocates contiguous physical pages
-// Param:	size_t count - count of pages
-// Return:	size_t - start of 4KB-aligned page, NULL on error
-
-size_t pmm_alloc(size_t count)
-{
-	acquire_lock(&pmm_mutex);
-
-	size_t memory = pmm_find_range(count);
-	if(!memory)
-		panic("Out of memory.");
+	// only use whole pages
+	size_t base = ((size_t)mmap->base + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+	size_t end = ((size_t)mmap->base + mmap->length) & ~(PAGE_SIZE-1);
 
-	pmm_mark_used(memory, count);
-	release_lock(&pmm_mutex);
-	return memory;
+	if(end > base)
+		pmm_mark_free(base, (end - base) >> PAGE_SIZE_SHIFT);
 }
 
 #endif		// __x86_64__
-
-
-
-
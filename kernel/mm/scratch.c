@@ -0,0 +1,242 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Per-CPU Scratch Arenas, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <cpu.h>
+#include <kprintf.h>
+#include <string.h>
+
+// Buffers that only live during one call, like a filesystem's superblock and
+// inode copies, are bump-allocated from an arena of the current CPU. A scope
+// takes a mark with scratch_mark() when it starts and gives back everything
+// allocated since with scratch_reset() when it ends. Scopes nest, so an
+// interrupt handler may use its own as long as it resets before returning.
+//
+// scratch_free() gives memory back right away only if it's the latest
+// allocation, anything else waits for the reset. What doesn't fit in the
+// arena comes from the heap, and the reset frees that too.
+//
+// Every allocation has a header with its size, so the latest one can be
+// freed without knowing where the one before it ends. Before FS points to a
+// cpu_t, there is only one CPU running, and it uses scratch_boot.
+
+typedef struct scratch_header_t
+{
+	void *next;			// heap allocations only, next older one
+	size_t size;			// including this header
+} __attribute__((aligned(SCRATCH_ALIGN))) scratch_header_t;
+
+scratch_t scratch_boot;
+
+size_t pmm_irq_save();
+void pmm_irq_restore(size_t);
+scratch_t *scratch_current();
+
+// scratch_init(): Reserves the memory of a scratch arena
+// Param:	scratch_t *scratch - arena
+// Return:	Nothing
+
+void scratch_init(scratch_t *scratch)
+{
+	memset(scratch, 0, sizeof(scratch_t));
+
+	// pages are only mapped when touched, so an arena that is never filled
+	// never uses all of its memory
+	scratch->base = kmalloc_nozero(SCRATCH_SIZE);
+}
+
+// scratch_mark(): Starts a scope on the current CPU's arena
+// Param:	Nothing
+// Return:	scratch_mark_t - mark to give to scratch_reset()
+
+scratch_mark_t scratch_mark()
+{
+	size_t flags = pmm_irq_save();
+
+	scratch_t *scratch = scratch_current();
+	scratch_mark_t mark;
+	mark.top = scratch->top;
+	mark.overflow = scratch->overflow;
+
+	pmm_irq_restore(flags);
+	return mark;
+}
+
+// scratch_reset(): Ends a scope, freeing everything allocated since its mark
+// Param:	scratch_mark_t mark - mark from scratch_mark()
+// Return:	Nothing
+
+void scratch_reset(scratch_mark_t mark)
+{
+	size_t flags = pmm_irq_save();
+
+	scratch_t *scratch = scratch_current();
+	scratch_header_t *chain = NULL;
+	scratch_header_t *header;
+
+	// take the heap allocations off first, kfree() can't run with IRQs off
+	while(scratch->overflow && scratch->overflow != mark.overflow)
+	{
+		header = (scratch_header_t*)scratch->overflow;
+		scratch->overflow = header->next;
+		header->next = chain;
+		chain = header;
+	}
+
+	if(mark.top < scratch->top)
+		scratch->top = mark.top;
+
+	pmm_irq_restore(flags);
+
+	while(chain)
+	{
+		header = chain;
+		chain = header->next;
+		kfree(header);
+	}
+}
+
+// scratch_alloc(): Allocates memory from the current CPU's arena
+// Param:	size_t size - size in bytes
+// Return:	void * - pointer to memory, not zeroed, NULL if out of memory
+
+void *scratch_alloc(size_t size)
+{
+	size = (size + sizeof(scratch_header_t) + SCRATCH_ALIGN - 1) & (~(SCRATCH_ALIGN-1));
+
+	size_t flags = pmm_irq_save();
+
+	scratch_t *scratch = scratch_current();
+	scratch_header_t *header;
+	scratch->allocs++;
+
+	if(scratch->base && scratch->top + size <= SCRATCH_SIZE)
+	{
+		header = (scratch_header_t*)(scratch->base + scratch->top);
+		scratch->top += size;
+		if(scratch->top > scratch->high_water)
+			scratch->high_water = scratch->top;
+
+		pmm_irq_restore(flags);
+
+		header->next = NULL;
+		header->size = size;
+		return (void*)header + sizeof(scratch_header_t);
+	}
+
+	scratch->overflows++;
+	pmm_irq_restore(flags);
+
+	// doesn't fit, so it comes from the heap
+	header = kmalloc_nozero(size);
+	if(!header)
+		return NULL;
+
+	header->size = size;
+
+	flags = pmm_irq_save();
+
+	// nested scopes that ran meanwhile have been reset, so this is the latest
+	scratch = scratch_current();
+	header->next = scratch->overflow;
+	scratch->overflow = header;
+
+	pmm_irq_restore(flags);
+	return (void*)header + sizeof(scratch_header_t);
+}
+
+// scratch_calloc(): Allocates zeroed memory from the current CPU's arena
+// Param:	size_t size - size of one item
+// Param:	size_t count - count of items
+// Return:	void * - pointer to memory, zeroed, NULL if out of memory
+
+void *scratch_calloc(size_t size, size_t count)
+{
+	void *ptr = scratch_alloc(size * count);
+	if(!ptr)
+		return NULL;
+
+	memset(ptr, 0, size * count);
+	return ptr;
+}
+
+// scratch_free(): Frees memory now if it's the latest allocation
+// Anything else stays allocated until the scope is reset
+// Param:	void *ptr - pointer from scratch_alloc()
+// Return:	Nothing
+
+void scratch_free(void *ptr)
+{
+	if(!ptr)
+		return;
+
+	scratch_header_t *header = (scratch_header_t*)(ptr - sizeof(scratch_header_t));
+	size_t flags = pmm_irq_save();
+
+	scratch_t *scratch = scratch_current();
+
+	if(scratch->base && (void*)header >= scratch->base && (void*)header < scratch->base + SCRATCH_SIZE)
+	{
+		if((size_t)((void*)header - scratch->base) + header->size == scratch->top)
+		{
+			scratch->top -= header->size;
+			scratch->pops++;
+		}
+
+		pmm_irq_restore(flags);
+		return;
+	}
+
+	if(scratch->overflow == header)
+	{
+		scratch->overflow = header->next;
+		scratch->pops++;
+
+		pmm_irq_restore(flags);
+		kfree(header);
+		return;
+	}
+
+	pmm_irq_restore(flags);
+}
+
+// scratch_dump(): Shows the arena counters of the current CPU
+// Param:	Nothing
+// Return:	Nothing
+
+void scratch_dump()
+{
+	scratch_t *scratch = scratch_current();
+
+	if(pmm_pcp_ready)
+	{
+		cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+		kprintf("scratch: CPU index %d arena: ", cpu->index);
+	} else
+	{
+		kprintf("scratch: boot arena: ");
+	}
+
+	kprintf("%d KB high-water of %d KB, %d allocations, %d freed right away, %d went to the heap\n", (scratch->high_water + 1023) / 1024, SCRATCH_SIZE / 1024, (uint32_t)scratch->allocs, (uint32_t)scratch->pops, (uint32_t)scratch->overflows);
+}
+
+/* Internal Functions */
+
+// scratch_current(): Returns the current CPU's arena
+// Param:	Nothing
+// Return:	scratch_t * - arena
+
+scratch_t *scratch_current()
+{
+	if(!pmm_pcp_ready)
+		return &scratch_boot;
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	return cpu->scratch;
+}
+
@@ -0,0 +1,332 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Memory Pressure and Shrinkers, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <shrink.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+#include <cpu.h>
+
+// Caches that hold memory they can give back register a shrinker here. Every
+// zone has three watermarks of free pages, counted over all NUMA nodes. When
+// an allocation leaves the zone it came from below low, idle CPUs are asked to
+// reclaim until every zone is back above high; when an allocation fails
+// outright, or a lazy fault finds its zone below min, reclaim happens right
+// away, with only the shrinkers that are safe to call from wherever the
+// allocation came from.
+//
+// shrink_mutex only guards the shrinker table and the counters, and is never
+// held while a shrinker runs, so shrinkers may allocate and even recurse.
+
+shrinker_t shrinkers[MAX_SHRINKERS];
+shrink_watermark_t shrink_marks[PMM_ZONES];
+lock_t shrink_mutex = 0;
+lock_t shrink_idle_mutex = 0;			// one CPU does background reclaim
+uint8_t shrink_pending = 0;			// set when a zone went below low
+
+uint64_t shrink_direct = 0;
+uint64_t shrink_direct_failed = 0;
+uint64_t shrink_background = 0;
+uint64_t shrink_wakeups = 0;
+uint64_t shrink_cycles = 0;			// total time spent in direct reclaim
+uint64_t shrink_max_cycles = 0;
+
+size_t shrink_collect(shrinker_t **, int);
+
+// shrink_init(): Sets the watermarks from the free memory of each zone
+// Param:	Nothing
+// Return:	Nothing
+
+void shrink_init()
+{
+	size_t zone, min;
+	for(zone = 0; zone < PMM_ZONES; zone++)
+	{
+		if(!pmm_zone_free[zone])
+		{
+			shrink_marks[zone].min = 0;
+			shrink_marks[zone].low = 0;
+			shrink_marks[zone].high = 0;
+			continue;
+		}
+
+		min = pmm_zone_free[zone] / SHRINK_MIN_DIVISOR;
+		if(min < SHRINK_MIN_PAGES)
+			min = SHRINK_MIN_PAGES;
+		if(min > SHRINK_MAX_PAGES)
+			min = SHRINK_MAX_PAGES;
+
+		// a small zone like ZONE_DMA would otherwise always be below them
+		if(min > pmm_zone_free[zone] / 8)
+			min = pmm_zone_free[zone] / 8;
+
+		shrink_marks[zone].min = min;
+		shrink_marks[zone].low = min * 2;
+		shrink_marks[zone].high = min * 3;
+	}
+}
+
+// shrink_register(): Registers a shrinker
+// Param:	const char *name - name for the dump
+// Param:	size_t (*count)() - returns pages that could be freed, may be NULL
+// Param:	size_t (*scan)(size_t) - frees pages and returns how many
+// Param:	int priority - lower is called first
+// Param:	uint8_t flags - SHRINKER_*
+// Return:	shrinker_t * - shrinker, NULL if the table is full
+
+shrinker_t *shrink_register(const char *name, size_t (*count)(), size_t (*scan)(size_t), int priority, uint8_t flags)
+{
+	if(!scan)
+		return NULL;
+
+	acquire_lock(&shrink_mutex);
+
+	size_t i = 0;
+	while(i < MAX_SHRINKERS && shrinkers[i].present)
+		i++;
+
+	if(i >= MAX_SHRINKERS)
+	{
+		release_lock(&shrink_mutex);
+		kprintf("mm: shrinker table is full, %s not registered\n", name);
+		return NULL;
+	}
+
+	shrinker_t *shrinker = &shrinkers[i];
+	memset(shrinker, 0, sizeof(shrinker_t));
+
+	if(strlen(name) > 15)
+		memcpy(shrinker->name, name, 15);
+	else
+		strcpy(shrinker->name, name);
+
+	shrinker->count = count;
+	shrinker->scan = scan;
+	shrinker->priority = priority;
+	shrinker->flags = flags;
+	shrinker->present = 1;
+
+	release_lock(&shrink_mutex);
+	return shrinker;
+}
+
+// shrink_unregister(): Unregisters a shrinker
+// The caller makes sure its scan() isn't running
+// Param:	shrinker_t *shrinker - shrinker
+// Return:	Nothing
+
+void shrink_unregister(shrinker_t *shrinker)
+{
+	if(!shrinker)
+		return;
+
+	acquire_lock(&shrink_mutex);
+	shrinker->present = 0;
+	release_lock(&shrink_mutex);
+}
+
+// shrink_pressure(): Checks whether any zone is below a watermark
+// Param:	int level - WMARK_*
+// Return:	int - 1 if a zone is below it
+
+int shrink_pressure(int level)
+{
+	uint8_t zone;
+	for(zone = 0; zone < PMM_ZONES; zone++)
+	{
+		if(shrink_zone_pressure(level, zone))
+			return 1;
+	}
+
+	return 0;
+}
+
+// shrink_zone_pressure(): Checks whether a zone is below a watermark
+// An empty zone stands for the next lower one, where its allocations go
+// Param:	int level - WMARK_*
+// Param:	uint8_t zone - PMM_ZONE_*
+// Return:	int - 1 if the zone is below it
+
+int shrink_zone_pressure(int level, uint8_t zone)
+{
+	while(zone && !shrink_marks[zone].min)
+		zone--;
+
+	size_t mark;
+	if(level == WMARK_MIN)
+		mark = shrink_marks[zone].min;
+	else if(level == WMARK_LOW)
+		mark = shrink_marks[zone].low;
+	else
+		mark = shrink_marks[zone].high;
+
+	return (pmm_zone_free[zone] < mark) ? 1 : 0;
+}
+
+// shrink_memory(): Calls shrinkers in order of priority until enough is freed
+// Param:	size_t target - count of pages wanted
+// Param:	int direct - 1 if called on behalf of an allocation
+// Return:	size_t - count of pages freed
+
+size_t shrink_memory(size_t target, int direct)
+{
+	shrinker_t *list[MAX_SHRINKERS];
+	size_t count = shrink_collect(list, direct);
+	size_t freed = 0, pages, i;
+	uint64_t begin = read_tsc();
+	uint64_t start, cycles;
+
+	for(i = 0; i < count && freed < target; i++)
+	{
+		// don't count a call that could never have freed anything
+		if(list[i]->count && !list[i]->count())
+			continue;
+
+		start = read_tsc();
+		pages = list[i]->scan(target - freed);
+		cycles = read_tsc() - start;
+		freed += pages;
+
+		acquire_lock(&shrink_mutex);
+		list[i]->calls++;
+		list[i]->reclaimed += pages;
+		list[i]->cycles += cycles;
+		if(cycles > list[i]->max_cycles)
+			list[i]->max_cycles = cycles;
+		release_lock(&shrink_mutex);
+	}
+
+	if(direct)
+	{
+		cycles = read_tsc() - begin;
+
+		acquire_lock(&shrink_mutex);
+		shrink_direct++;
+		if(!freed)
+			shrink_direct_failed++;
+
+		shrink_cycles += cycles;
+		if(cycles > shrink_max_cycles)
+			shrink_max_cycles = cycles;
+		release_lock(&shrink_mutex);
+	}
+
+	return freed;
+}
+
+// shrink_wakeup(): Asks idle CPUs to reclaim memory
+// Param:	Nothing
+// Return:	Nothing
+
+void shrink_wakeup()
+{
+	if(shrink_pending)
+		return;
+
+	shrink_pending = 1;
+	shrink_wakeups++;
+}
+
+// shrink_idle(): Reclaims memory in the background, called from idle loops
+// Param:	Nothing
+// Return:	Nothing
+
+void shrink_idle()
+{
+	if(!shrink_pending && !shrink_pressure(WMARK_LOW))
+		return;
+
+	if(!try_lock(&shrink_idle_mutex))
+		return;
+
+	shrink_pending = 0;
+	shrink_background++;
+
+	// stop early when nothing is left to give, so idle CPUs still go to sleep
+	while(shrink_pressure(WMARK_HIGH))
+	{
+		if(!shrink_memory(SHRINK_BATCH, 0))
+			break;
+	}
+
+	release_lock(&shrink_idle_mutex);
+}
+
+// shrink_dump(): Shows watermarks and shrinker counters
+// Param:	Nothing
+// Return:	Nothing
+
+void shrink_dump()
+{
+	acquire_lock(&shrink_mutex);
+
+	size_t zone, i;
+	for(zone = 0; zone < PMM_ZONES; zone++)
+		kprintf("mm: zone %s watermarks min %d, low %d, high %d, %d pages free\n", pmm_zone_names[zone], shrink_marks[zone].min, shrink_marks[zone].low, shrink_marks[zone].high, pmm_zone_free[zone]);
+
+	uint32_t average = 0;
+	if(shrink_direct)
+		average = (uint32_t)(shrink_cycles / shrink_direct);
+
+	kprintf("mm: %d direct reclaims, %d of them failed, at %d cycles, %d worst\n", (uint32_t)shrink_direct, (uint32_t)shrink_direct_failed, average, (uint32_t)shrink_max_cycles);
+	kprintf("mm: %d background reclaims after %d wakeups\n", (uint32_t)shrink_background, (uint32_t)shrink_wakeups);
+
+	for(i = 0; i < MAX_SHRINKERS; i++)
+	{
+		if(!shrinkers[i].present)
+			continue;
+
+		average = 0;
+		if(shrinkers[i].calls)
+			average = (uint32_t)(shrinkers[i].cycles / shrinkers[i].calls);
+
+		kprintf("mm: shrinker %s, priority %d%s: %d calls freed %d pages, %d cycles, %d worst\n", shrinkers[i].name, shrinkers[i].priority, (shrinkers[i].flags & SHRINKER_DIRECT) ? ", direct" : "", (uint32_t)shrinkers[i].calls, (uint32_t)shrinkers[i].reclaimed, average, (uint32_t)shrinkers[i].max_cycles);
+	}
+
+	release_lock(&shrink_mutex);
+}
+
+/* Internal Functions */
+
+// shrink_collect(): Lists the shrinkers to call, sorted by priority
+// Param:	shrinker_t **list - MAX_SHRINKERS entries
+// Param:	int direct - 1 to only list shrinkers with SHRINKER_DIRECT
+// Return:	size_t - count of shrinkers listed
+
+size_t shrink_collect(shrinker_t **list, int direct)
+{
+	size_t count = 0, i, j;
+	shrinker_t *shrinker;
+
+	acquire_lock(&shrink_mutex);
+
+	for(i = 0; i < MAX_SHRINKERS; i++)
+	{
+		if(!shrinkers[i].present)
+			continue;
+
+		if(direct && !(shrinkers[i].flags & SHRINKER_DIRECT))
+			continue;
+
+		// insertion sort, there are only a few
+		shrinker = &shrinkers[i];
+		j = count;
+		while(j && list[j-1]->priority > shrinker->priority)
+		{
+			list[j] = list[j-1];
+			j--;
+		}
+
+		list[j] = shrinker;
+		count++;
+	}
+
+	release_lock(&shrink_mutex);
+	return count;
+}
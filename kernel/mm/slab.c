@@ -0,0 +1,389 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Slab Allocator */
+
+#include <mm.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+#include <shrink.h>
+
+// Each slab is SLAB_SIZE bytes from the KERNEL_SLAB region, and because the
+// region is only ever allocated in SLAB_PAGES units, every slab is aligned on
+// SLAB_SIZE -- so the slab header of any object is found by masking its address
+
+slab_cache_t *slab_caches;
+slab_cache_t *kmalloc_caches[SLAB_CLASSES];
+lock_t slab_mutex = 0;
+
+void slab_list_add(slab_t **, slab_t *);
+void slab_list_remove(slab_t **, slab_t *);
+slab_t *slab_grow(slab_cache_t *);
+size_t slab_reclaimable();
+
+// slab_init(): Initializes the slab allocator and the kmalloc() size classes
+// Param:	Nothing
+// Return:	Nothing
+
+void slab_init()
+{
+	// the cache descriptors themselves come straight from the VMM
+	slab_caches = (slab_cache_t*)vmm_alloc(KERNEL_HEAP, ((sizeof(slab_cache_t) * MAX_SLAB_CACHES) + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT, PAGE_PRESENT | PAGE_RW);
+	if(!slab_caches)
+		panic("Unable to allocate slab caches.");
+
+	char name[32];
+	size_t size = SLAB_MIN_SIZE;
+	size_t i = 0;
+
+	while(i < SLAB_CLASSES)
+	{
+		sprintf(name, "kmalloc-%d", size);
+		kmalloc_caches[i] = slab_create(name, size, 0);
+
+		size <<= 1;
+		i++;
+	}
+
+	// freeing slabs takes vmm_mutex, so only from idle reclaim
+	shrink_register("slab", slab_reclaimable, slab_shrink, 10, 0);
+
+	kprintf("slab: %d kmalloc size classes from %d to %d bytes, %d KB slabs\n", SLAB_CLASSES, SLAB_MIN_SIZE, SLAB_MAX_SIZE, SLAB_SIZE / 1024);
+}
+
+// slab_create(): Creates an object cache
+// Param:	const char *name - name of the cache
+// Param:	size_t size - size of each object
+// Param:	size_t alignment - object alignment, zero for default
+// Return:	slab_cache_t * - pointer to cache, NULL on error
+
+slab_cache_t *slab_create(const char *name, size_t size, size_t alignment)
+{
+	if(!size)
+		return NULL;
+
+	// by default, objects up to half a cache line are naturally aligned
+	// and anything larger gets a whole cache line
+	if(!alignment)
+	{
+		if(size <= 16)
+			alignment = 16;
+		else if(size <= 32)
+			alignment = 32;
+		else
+			alignment = CACHE_LINE_SIZE;
+	}
+
+	size_t object_size = (size + alignment - 1) & ~(alignment - 1);
+	size_t first_object = (sizeof(slab_t) + alignment - 1) & ~(alignment - 1);
+
+	if(object_size > SLAB_SIZE - first_object)
+		return NULL;
+
+	acquire_lock(&slab_mutex);
+
+	size_t i = 0;
+	while(i < MAX_SLAB_CACHES && slab_caches[i].present != 0)
+		i++;
+
+	if(i >= MAX_SLAB_CACHES)
+	{
+		release_lock(&slab_mutex);
+		kprintf("slab: no free cache descriptors for '%s'\n", name);
+		return NULL;
+	}
+
+	slab_cache_t *cache = &slab_caches[i];
+	memset(cache, 0, sizeof(slab_cache_t));
+
+	if(strlen(name) > 31)
+		memcpy(cache->name, name, 31);
+	else
+		strcpy(cache->name, name);
+
+	cache->object_size = object_size;
+	cache->alignment = alignment;
+	cache->first_object = first_object;
+	cache->objects_per_slab = (SLAB_SIZE - first_object) / object_size;
+	cache->present = 1;
+
+	release_lock(&slab_mutex);
+	return cache;
+}
+
+// slab_alloc(): Allocates an object from a cache
+// Param:	slab_cache_t *cache - cache to allocate from
+// Return:	void * - pointer to zero-initialized object, NULL on error
+
+void *slab_alloc(slab_cache_t *cache)
+{
+	void *object = slab_alloc_nozero(cache);
+	if(object)
+		memset(object, 0, cache->object_size);
+
+	return object;
+}
+
+// slab_alloc_nozero(): Allocates an object from a cache without zeroing it
+// Param:	slab_cache_t *cache - cache to allocate from
+// Return:	void * - pointer to object, NULL on error
+
+void *slab_alloc_nozero(slab_cache_t *cache)
+{
+	acquire_lock(&cache->lock);
+
+	slab_t *slab = cache->partial;
+	if(!slab)
+	{
+		// reuse an empty slab before making a new one
+		slab = cache->empty;
+		if(slab)
+		{
+			slab_list_remove(&cache->empty, slab);
+			cache->empty_count--;
+		} else
+		{
+			slab = slab_grow(cache);
+			if(!slab)
+			{
+				release_lock(&cache->lock);
+				return NULL;
+			}
+		}
+
+		slab_list_add(&cache->partial, slab);
+	}
+
+	void *object = slab->free_list;
+	slab->free_list = ((void**)object)[0];
+	slab->free_count--;
+
+	if(!slab->free_count)
+	{
+		slab_list_remove(&cache->partial, slab);
+		slab_list_add(&cache->full, slab);
+	}
+
+	cache->object_count++;
+	release_lock(&cache->lock);
+	return object;
+}
+
+// slab_free(): Frees an object back to its cache
+// Param:	slab_cache_t *cache - cache of the object
+// Param:	void *object - pointer to object
+// Return:	Nothing
+
+void slab_free(slab_cache_t *cache, void *object)
+{
+	slab_t *slab = (slab_t*)((size_t)object & ~(SLAB_SIZE-1));
+	if(slab->magic != SLAB_MAGIC || slab->cache != cache)
+	{
+		kprintf("slab: attempt to free invalid object 0x%xq to cache '%s'\n", (uint64_t)(size_t)object, cache->name);
+		return;
+	}
+
+	acquire_lock(&cache->lock);
+
+	uint8_t was_full = (slab->free_count == 0);
+	slab_t *release = NULL;
+
+	((void**)object)[0] = slab->free_list;
+	slab->free_list = object;
+	slab->free_count++;
+	cache->object_count--;
+
+	if(was_full)
+		slab_list_remove(&cache->full, slab);
+	else if(slab->free_count == cache->objects_per_slab)
+		slab_list_remove(&cache->partial, slab);
+
+	if(slab->free_count == cache->objects_per_slab)
+	{
+		// keep a few empty slabs around to avoid thrashing the VMM
+		if(cache->empty_count < SLAB_EMPTY_KEEP)
+		{
+			slab_list_add(&cache->empty, slab);
+			cache->empty_count++;
+		} else
+		{
+			slab->magic = 0;
+			cache->slab_count--;
+			release = slab;
+		}
+	} else if(was_full)
+	{
+		slab_list_add(&cache->partial, slab);
+	}
+
+	release_lock(&cache->lock);
+
+	// the VMM takes its own locks, and may need a TLB shootdown
+	if(release)
+		vmm_free((size_t)release, SLAB_PAGES);
+}
+
+// slab_find_class(): Returns the kmalloc() size class for a size
+// Param:	size_t size - size in bytes
+// Return:	slab_cache_t * - smallest cache that fits, NULL if too large
+
+slab_cache_t *slab_find_class(size_t size)
+{
+	if(size > SLAB_MAX_SIZE)
+		return NULL;
+
+	size_t class_size = SLAB_MIN_SIZE;
+	size_t i = 0;
+
+	while(class_size < size)
+	{
+		class_size <<= 1;
+		i++;
+	}
+
+	return kmalloc_caches[i];
+}
+
+// slab_shrink(): Frees the empty slabs caches keep around
+// Param:	size_t count - count of pages wanted
+// Return:	size_t - count of pages freed
+
+size_t slab_shrink(size_t count)
+{
+	size_t freed = 0, i;
+	slab_cache_t *cache;
+	slab_t *slab;
+
+	for(i = 0; i < MAX_SLAB_CACHES && freed < count; i++)
+	{
+		cache = &slab_caches[i];
+		if(!cache->present)
+			continue;
+
+		// one slab at a time, so the lock isn't held while it's freed
+		while(freed < count)
+		{
+			acquire_lock(&cache->lock);
+
+			slab = cache->empty;
+			if(slab)
+			{
+				slab_list_remove(&cache->empty, slab);
+				cache->empty_count--;
+
+				slab->magic = 0;
+				cache->slab_count--;
+			}
+
+			release_lock(&cache->lock);
+
+			if(!slab)
+				break;
+
+			vmm_free((size_t)slab, SLAB_PAGES);
+			freed += SLAB_PAGES;
+		}
+	}
+
+	return freed;
+}
+
+/* Internal Functions */
+
+// slab_grow(): Allocates and carves a new slab for a cache
+// Param:	slab_cache_t *cache - cache
+// Return:	slab_t * - pointer to new slab, NULL on error
+
+slab_t *slab_grow(slab_cache_t *cache)
+{
+	// objects are zeroed when they're allocated, so the pages needn't be
+	slab_t *slab = (slab_t*)vmm_alloc(KERNEL_SLAB, SLAB_PAGES, PAGE_PRESENT | PAGE_RW | VMM_NOZERO);
+	if(!slab)
+		return NULL;
+
+	if((size_t)slab & (SLAB_SIZE-1))
+	{
+		// this should never happen as long as nothing else uses the region
+		kprintf("slab: misaligned slab at 0x%xq\n", (uint64_t)(size_t)slab);
+		vmm_free((size_t)slab, SLAB_PAGES);
+		return NULL;
+	}
+
+	slab->magic = SLAB_MAGIC;
+	slab->cache = cache;
+	slab->next = NULL;
+	slab->prev = NULL;
+	slab->free_count = cache->objects_per_slab;
+
+	// build the free list in address order
+	size_t object = (size_t)slab + cache->first_object;
+	slab->free_list = (void*)object;
+
+	size_t i = 1;
+	while(i < cache->objects_per_slab)
+	{
+		((void**)object)[0] = (void*)(object + cache->object_size);
+		object += cache->object_size;
+		i++;
+	}
+
+	((void**)object)[0] = NULL;
+
+	cache->slab_count++;
+	return slab;
+}
+
+// slab_list_add(): Adds a slab to the head of a list
+// Param:	slab_t **list - pointer to list head
+// Param:	slab_t *slab - slab to add
+// Return:	Nothing
+
+void slab_list_add(slab_t **list, slab_t *slab)
+{
+	slab->prev = NULL;
+	slab->next = list[0];
+
+	if(list[0])
+		list[0]->prev = slab;
+
+	list[0] = slab;
+}
+
+// slab_list_remove(): Removes a slab from a list
+// Param:	slab_t **list - pointer to list head
+// Param:	slab_t *slab - slab to remove
+// Return:	Nothing
+
+void slab_list_remove(slab_t **list, slab_t *slab)
+{
+	if(slab->prev)
+		slab->prev->next = slab->next;
+	else
+		list[0] = slab->next;
+
+	if(slab->next)
+		slab->next->prev = slab->prev;
+
+	slab->next = NULL;
+	slab->prev = NULL;
+}
+
+// slab_reclaimable(): Returns how many pages empty slabs hold
+// Param:	Nothing
+// Return:	size_t - count of pages
+
+size_t slab_reclaimable()
+{
+	size_t count = 0, i;
+	for(i = 0; i < MAX_SLAB_CACHES; i++)
+	{
+		if(slab_caches[i].present)
+			count += slab_caches[i].empty_count * SLAB_PAGES;
+	}
+
+	return count;
+}
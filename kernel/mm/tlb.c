@@ -0,0 +1,461 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* TLB Flushing and Cross-CPU Shootdown */
+
+#include <tlb.h>
+#include <mm.h>
+#include <cpu.h>
+#include <apic.h>
+#include <idt.h>
+#include <kprintf.h>
+#include <lock.h>
+
+// Callers collect invalidations in a tlb_batch_t and flush them at once. The
+// batch is flushed locally, and then copied into the request slot of the
+// initiating CPU and sent to the CPUs that may have the mappings cached, which
+// flush the same ranges and clear their bit in the request's pending mask.
+// Every CPU has its own slot, so any number of shootdowns can be in flight.
+//
+// Initiators usually hold vmm_mutex while they wait, and a target may be
+// spinning on that same lock with interrupts disabled -- in the page fault
+// handler, for one. So nobody waits with the IPI as the only way in: both the
+// wait here and the spin loop of acquire_lock() take pending shootdowns with
+// tlb_shootdown_poll() while tlb_requests_active says there are any.
+//
+// On x86_64, kernel pages are global and address spaces get a PCID from a
+// small per-CPU cache, so neither kernel entries nor those of recently used
+// spaces are lost on a CR3 write. invlpg only reaches the current PCID, so
+// kernel flushes also go to the other cached PCIDs, and spaces whose user
+// pages change get a new tlb_gen, which makes their stale PCIDs flush on
+// their next switch -- so only CPUs running a space need its shootdowns.
+
+tlb_request_t tlb_requests[MAX_LAPICS];
+volatile uint32_t tlb_requests_active = 0;	// bitmap of initiating CPU indexes
+
+uint8_t tlb_pge = 0;
+uint8_t tlb_pcid = 0;
+uint8_t tlb_invpcid = 0;
+
+void tlb_flush_local(tlb_batch_t *);
+void tlb_flush_all();
+void tlb_flush_kernel(size_t, size_t);
+
+// tlb_init(): Installs the shootdown IPI handler
+// Param:	Nothing
+// Return:	Nothing
+
+void tlb_init()
+{
+	idt_install(TLB_VECTOR, (size_t)&tlb_shootdown_stub);
+}
+
+// tlb_cpu_init(): Enables global pages and PCIDs on the current CPU
+// Param:	Nothing
+// Return:	Nothing
+
+void tlb_cpu_init()
+{
+#if __x86_64__
+	uint32_t registers[4];		// EAX, EBX, ECX, EDX
+
+	read_cpuid(0, 0, registers);
+	size_t max_leaf = registers[0];
+
+	read_cpuid(1, 0, registers);
+	tlb_pge = (registers[3] & CPUID_1_EDX_PGE) ? 1 : 0;
+	tlb_pcid = (registers[2] & CPUID_1_ECX_PCID) ? 1 : 0;
+
+	tlb_invpcid = 0;
+	if(max_leaf >= 7)
+	{
+		read_cpuid(7, 0, registers);
+		tlb_invpcid = (registers[1] & CPUID_7_EBX_INVPCID) ? 1 : 0;
+	}
+
+	// PCIDE can only be set while the current PCID is 0, which it is here
+	uint64_t cr4 = read_cr4();
+	if(tlb_pge)
+		cr4 |= CR4_PGE;
+	if(tlb_pcid)
+		cr4 |= CR4_PCIDE;
+
+	write_cr4(cr4);
+#endif
+}
+
+// tlb_asid_cr3(): Returns the CR3 value that switches to an address space
+// Must be called with interrupts disabled, the PCID cache is per CPU
+// Param:	vmm_space_t *space - address space
+// Return:	size_t - value for CR3
+
+size_t tlb_asid_cr3(vmm_space_t *space)
+{
+#if __x86_64__
+	if(!tlb_pcid || !pmm_pcp_ready)
+		return space->pml4;
+
+	// the kernel's space has no user pages, so PCID 0 only goes stale when
+	// kernel pages change, and without INVPCID we can't reach it then
+	if(space == &vmm_kernel_space)
+		return space->pml4 | (tlb_invpcid ? CR3_NOFLUSH : 0);
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	uint64_t tlb_gen = space->tlb_gen;
+	cpu->asid_clock++;
+
+	size_t i, oldest = 0;
+	for(i = 0; i < TLB_ASIDS; i++)
+	{
+		if(cpu->asids[i].space == space)
+		{
+			cpu->asids[i].last_used = cpu->asid_clock;
+			if(cpu->asids[i].tlb_gen == tlb_gen)
+			{
+				cpu->tlb.asid_hits++;
+				return space->pml4 | (i + 1) | CR3_NOFLUSH;
+			}
+
+			// the space changed since it last ran here
+			cpu->asids[i].tlb_gen = tlb_gen;
+			cpu->tlb.asid_stale++;
+			return space->pml4 | (i + 1);
+		}
+
+		if(cpu->asids[i].last_used < cpu->asids[oldest].last_used)
+			oldest = i;
+	}
+
+	// take the least recently used PCID, flushing what's left of its old space
+	cpu->asids[oldest].space = space;
+	cpu->asids[oldest].tlb_gen = tlb_gen;
+	cpu->asids[oldest].last_used = cpu->asid_clock;
+	cpu->tlb.asid_misses++;
+	return space->pml4 | (oldest + 1);
+#else
+	return space->pml4;
+#endif
+}
+
+// tlb_batch_init(): Initializes an empty batch
+// Param:	tlb_batch_t *batch - batch
+// Return:	Nothing
+
+void tlb_batch_init(tlb_batch_t *batch)
+{
+	batch->ranges = 0;
+	batch->pages = 0;
+	batch->full = 0;
+}
+
+// tlb_batch_add(): Adds a range of pages to a batch
+// Param:	tlb_batch_t *batch - batch
+// Param:	size_t base - virtual address
+// Param:	size_t count - count of pages
+// Return:	Nothing
+
+void tlb_batch_add(tlb_batch_t *batch, size_t base, size_t count)
+{
+	if(!count || batch->full)
+		return;
+
+	base &= ~(PAGE_SIZE-1);
+	batch->pages += count;
+
+	if(batch->pages > TLB_FULL_FLUSH_PAGES)
+	{
+		batch->full = 1;
+		return;
+	}
+
+	// extend the last range if this one follows it
+	if(batch->ranges)
+	{
+		size_t last = batch->ranges - 1;
+		if(batch->base[last] + (batch->count[last] << PAGE_SIZE_SHIFT) == base)
+		{
+			batch->count[last] += count;
+			return;
+		}
+	}
+
+	if(batch->ranges >= TLB_BATCH_SIZE)
+	{
+		batch->full = 1;
+		return;
+	}
+
+	batch->base[batch->ranges] = base;
+	batch->count[batch->ranges] = count;
+	batch->ranges++;
+}
+
+// tlb_batch_flush(): Flushes a batch on this CPU and others
+// Param:	tlb_batch_t *batch - batch
+// Param:	uint32_t cpus - bitmap of CPU indexes that may have the mappings cached
+// Return:	Nothing
+
+void tlb_batch_flush(tlb_batch_t *batch, uint32_t cpus)
+{
+	if(!batch->pages)
+		return;
+
+	tlb_flush_local(batch);
+
+	// with one CPU running, nobody else can have anything cached -- and
+	// before the BSP registers, FS doesn't point to a cpu_t yet either
+	uint32_t online = smp_online_cpus;
+	if(!pmm_pcp_ready || !(online & (online - 1)))
+	{
+		tlb_batch_init(batch);
+		return;
+	}
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	uint32_t self = 1 << cpu->index;
+	cpus &= online & ~self;
+
+	if(!cpus)
+	{
+		tlb_batch_init(batch);
+		return;
+	}
+
+	tlb_request_t *request = &tlb_requests[cpu->index];
+
+	request->batch.ranges = batch->ranges;
+	request->batch.pages = batch->pages;
+	request->batch.full = batch->full;
+
+	size_t i = 0;
+	while(i < batch->ranges)
+	{
+		request->batch.base[i] = batch->base[i];
+		request->batch.count[i] = batch->count[i];
+		i++;
+	}
+
+	// the batch has to be visible before anyone sees it's pending
+	asm volatile ("" ::: "memory");
+	request->pending = cpus;
+	asm volatile ("lock orl %1, %0" : "+m"(tlb_requests_active) : "r"(self) : "memory");
+
+	i = 0;
+	while(i < MAX_LAPICS)
+	{
+		if(cpus & (1 << i))
+		{
+			lapic_send_ipi(lapics[i].apic_id, TLB_VECTOR);
+			cpu->tlb.ipis_sent++;
+		}
+
+		i++;
+	}
+
+	// and wait for everyone to acknowledge, taking shootdowns of others
+	// that are waiting on us meanwhile
+	while(request->pending)
+	{
+		tlb_shootdown_poll();
+		asm volatile ("pause");
+	}
+
+	asm volatile ("lock andl %1, %0" : "+m"(tlb_requests_active) : "r"(~self) : "memory");
+	cpu->tlb.shootdowns++;
+
+	tlb_batch_init(batch);
+}
+
+// tlb_flush(): Flushes a single range on all CPUs
+// Param:	size_t base - virtual address
+// Param:	size_t count - count of pages
+// Return:	Nothing
+
+void tlb_flush(size_t base, size_t count)
+{
+	tlb_batch_t batch;
+	tlb_batch_init(&batch);
+	tlb_batch_add(&batch, base, count);
+	tlb_batch_flush(&batch, TLB_ALL_CPUS);
+}
+
+// tlb_shootdown_poll(): Flushes whatever other CPUs asked this one to flush
+// Called from the IPI handler, and while spinning on a lock or a shootdown
+// Param:	Nothing
+// Return:	Nothing
+
+void tlb_shootdown_poll()
+{
+	uint32_t active = tlb_requests_active;
+	if(!active || !pmm_pcp_ready)
+		return;
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	uint32_t self = 1 << cpu->index;
+	tlb_request_t *request;
+
+	size_t i;
+	for(i = 0; i < MAX_LAPICS; i++)
+	{
+		if(!(active & (1 << i)))
+			continue;
+
+		request = &tlb_requests[i];
+		if(!(request->pending & self))
+			continue;
+
+		// the initiator doesn't touch the batch until all bits are clear
+		tlb_flush_local(&request->batch);
+		asm volatile ("lock andl %1, %0" : "+m"(request->pending) : "r"(~self) : "memory");
+	}
+}
+
+// tlb_shootdown_irq(): Shootdown IPI handler
+// Param:	Nothing
+// Return:	Nothing
+
+void tlb_shootdown_irq()
+{
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	cpu->tlb.ipis_received++;
+
+	tlb_shootdown_poll();
+	lapic_eoi();
+}
+
+// tlb_dump(): Shows the TLB counters of the current CPU
+// Param:	Nothing
+// Return:	Nothing
+
+void tlb_dump()
+{
+	if(!pmm_pcp_ready)
+		return;
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	kprintf("tlb: CPU index %d: %d flushes, %d pages, %d full flushes, %d shootdowns, %d IPIs sent, %d received\n", cpu->index, (uint32_t)cpu->tlb.flushes, (uint32_t)cpu->tlb.pages, (uint32_t)cpu->tlb.full_flushes, (uint32_t)cpu->tlb.shootdowns, (uint32_t)cpu->tlb.ipis_sent, (uint32_t)cpu->tlb.ipis_received);
+	kprintf("tlb: global pages %s, PCID %s, INVPCID %s; %d PCID hits, %d misses, %d stale\n", tlb_pge ? "on" : "off", tlb_pcid ? "on" : "off", tlb_invpcid ? "on" : "off", (uint32_t)cpu->tlb.asid_hits, (uint32_t)cpu->tlb.asid_misses, (uint32_t)cpu->tlb.asid_stale);
+}
+
+/* Internal Functions */
+
+// tlb_flush_local(): Flushes a batch on the current CPU only
+// Param:	tlb_batch_t *batch - batch
+// Return:	Nothing
+
+void tlb_flush_local(tlb_batch_t *batch)
+{
+	if(batch->full)
+	{
+		tlb_flush_all();
+	} else
+	{
+		size_t i = 0;
+		while(i < batch->ranges)
+		{
+#if __x86_64__
+			if(batch->base[i] < USER_SPACE || batch->base[i] >= USER_SPACE_END)
+				tlb_flush_kernel(batch->base[i], batch->count[i]);
+			else
+				flush_tlb(batch->base[i], batch->count[i]);
+#else
+			flush_tlb(batch->base[i], batch->count[i]);
+#endif
+			i++;
+		}
+	}
+
+	if(pmm_pcp_ready)
+	{
+		cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+		cpu->tlb.flushes++;
+
+		if(batch->full)
+			cpu->tlb.full_flushes++;
+		else
+			cpu->tlb.pages += batch->pages;
+	}
+}
+
+// tlb_flush_all(): Flushes the whole TLB of the current CPU, global pages too
+// Param:	Nothing
+// Return:	Nothing
+
+void tlb_flush_all()
+{
+#if __x86_64__
+	if(tlb_invpcid)
+	{
+		invpcid_flush(INVPCID_ALL_GLOBAL, 0, 0);
+		return;
+	}
+
+	if(tlb_pge)
+	{
+		// toggling PGE drops everything, in every PCID
+		uint64_t cr4 = read_cr4();
+		write_cr4(cr4 & ~CR4_PGE);
+		write_cr4(cr4);
+		return;
+	}
+
+	write_cr3(read_cr3());
+
+	// that only reached the current PCID
+	if(tlb_pcid && pmm_pcp_ready)
+	{
+		cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+		size_t i;
+		for(i = 0; i < TLB_ASIDS; i++)
+			cpu->asids[i].tlb_gen = 0;
+	}
+#else
+	write_cr3(read_cr3());
+#endif
+}
+
+// tlb_flush_kernel(): Flushes kernel pages from every PCID of the current CPU
+// Param:	size_t base - virtual address
+// Param:	size_t count - count of pages
+// Return:	Nothing
+
+void tlb_flush_kernel(size_t base, size_t count)
+{
+	// invlpg drops global entries from all PCIDs, but paging-structure
+	// caches only from the current one
+	flush_tlb(base, count);
+
+#if __x86_64__
+	if(!tlb_pcid || !pmm_pcp_ready)
+		return;
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	size_t current = read_cr3() & (PAGE_SIZE-1);
+	size_t i, j;
+
+	if(!tlb_invpcid)
+	{
+		// no way to reach them now, so they flush when they're used next
+		for(i = 0; i < TLB_ASIDS; i++)
+		{
+			if(i + 1 != current)
+				cpu->asids[i].tlb_gen = 0;
+		}
+
+		return;
+	}
+
+	for(i = 0; i <= TLB_ASIDS; i++)
+	{
+		if(i == current || (i && !cpu->asids[i-1].space))
+			continue;
+
+		for(j = 0; j < count; j++)
+			invpcid_flush(INVPCID_ADDRESS, i, base + (j << PAGE_SIZE_SHIFT));
+	}
+#endif
+}
+
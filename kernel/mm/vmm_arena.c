@@ -0,0 +1,524 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Virtual Address Arenas, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+
+// Each arena keeps the free parts of a fixed virtual region as extents in an
+// augmented AVL tree. The nodes come from a pool mapped at the start of the
+// arena itself, so the arena doesn't depend on kmalloc() -- which depends on
+// the arena. When the pool runs out, another page of nodes is taken from the
+// arena before the operation that needs one, so freed ranges aren't leaked.
+
+vmm_arena_t vmm_arenas[VMM_ARENAS];
+uint8_t vmm_arenas_ready = 0;
+
+void vmm_arena_create(vmm_arena_t *, const char *, size_t, size_t);
+void vmm_arena_grow(vmm_arena_t *);
+vmm_extent_t *vmm_extent_new(vmm_arena_t *, size_t, size_t);
+void vmm_extent_update(vmm_extent_t *);
+vmm_extent_t *vmm_extent_balance(vmm_extent_t *);
+vmm_extent_t *vmm_extent_insert(vmm_extent_t *, vmm_extent_t *);
+vmm_extent_t *vmm_extent_remove(vmm_arena_t *, vmm_extent_t *, size_t);
+void vmm_extent_fix(vmm_extent_t *, size_t);
+vmm_extent_t *vmm_extent_first_fit(vmm_extent_t *, size_t);
+
+// vmm_arena_init(): Creates the kernel virtual address arenas
+// Param:	Nothing
+// Return:	Nothing
+
+void vmm_arena_init()
+{
+	vmm_arena_create(&vmm_arenas[0], "heap", KERNEL_HEAP, HW_FRAMEBUFFER);
+	vmm_arena_create(&vmm_arenas[1], "slab", KERNEL_SLAB, KERNEL_SLAB_END);
+	vmm_arena_create(&vmm_arenas[2], "mmio", KERNEL_MMIO, KERNEL_MMIO_END);
+
+	vmm_arenas_ready = 1;
+}
+
+// vmm_arena_find(): Returns the arena containing an address
+// Param:	size_t address - virtual address
+// Return:	vmm_arena_t * - arena, NULL if the address isn't in one
+
+vmm_arena_t *vmm_arena_find(size_t address)
+{
+	if(!vmm_arenas_ready)
+		return NULL;
+
+	size_t i = 0;
+	while(i < VMM_ARENAS)
+	{
+		if(address >= vmm_arenas[i].start && address < vmm_arenas[i].end)
+			return &vmm_arenas[i];
+
+		i++;
+	}
+
+	return NULL;
+}
+
+// vmm_arena_reserve(): Reserves a range of virtual pages, lowest address first
+// Param:	vmm_arena_t *arena - arena
+// Param:	size_t count - count of pages
+// Return:	size_t - virtual address, NULL on error
+
+size_t vmm_arena_reserve(vmm_arena_t *arena, size_t count)
+{
+	if(!count)
+		return NULL;
+
+	acquire_lock(&arena->lock);
+
+	vmm_extent_t *extent = vmm_extent_first_fit(arena->root, count);
+	if(!extent)
+	{
+		release_lock(&arena->lock);
+		return NULL;
+	}
+
+	size_t virtual = extent->base;
+
+	if(extent->count == count)
+	{
+		arena->root = vmm_extent_remove(arena, arena->root, virtual);
+	} else
+	{
+		// the order of the tree doesn't change, only the sizes do
+		extent->base += count << PAGE_SIZE_SHIFT;
+		extent->count -= count;
+		vmm_extent_fix(arena->root, extent->base);
+	}
+
+	arena->free_pages -= count;
+	release_lock(&arena->lock);
+	return virtual;
+}
+
+// vmm_arena_reserve_aligned(): Reserves a range of virtual pages at an alignment
+// Param:	vmm_arena_t *arena - arena
+// Param:	size_t count - count of pages
+// Param:	size_t alignment - alignment in bytes, power of two
+// Param:	size_t phase - offset from the alignment the range should start at
+// Return:	size_t - virtual address, NULL on error
+
+size_t vmm_arena_reserve_aligned(vmm_arena_t *arena, size_t count, size_t alignment, size_t phase)
+{
+	if(!count)
+		return NULL;
+
+	phase &= (alignment - 1) & (~(PAGE_SIZE-1));
+
+	// splitting an extent may need a node
+	vmm_arena_grow(arena);
+	acquire_lock(&arena->lock);
+
+	// any extent this large has an aligned range in it
+	vmm_extent_t *extent = vmm_extent_first_fit(arena->root, count + (alignment >> PAGE_SIZE_SHIFT) - 1);
+	if(!extent)
+	{
+		release_lock(&arena->lock);
+		return NULL;
+	}
+
+	size_t virtual = ((extent->base - phase + alignment - 1) & ~(alignment - 1)) + phase;
+
+	size_t before = (virtual - extent->base) >> PAGE_SIZE_SHIFT;
+	size_t after = extent->count - before - count;
+
+	if(!before)
+	{
+		if(!after)
+		{
+			arena->root = vmm_extent_remove(arena, arena->root, extent->base);
+		} else
+		{
+			extent->base += count << PAGE_SIZE_SHIFT;
+			extent->count = after;
+			vmm_extent_fix(arena->root, extent->base);
+		}
+	} else
+	{
+		// keep the part before, and the part after gets a node of its own
+		extent->count = before;
+		vmm_extent_fix(arena->root, extent->base);
+
+		if(after)
+		{
+			vmm_extent_t *next = vmm_extent_new(arena, virtual + (count << PAGE_SIZE_SHIFT), after);
+			if(next)
+			{
+				arena->root = vmm_extent_insert(arena->root, next);
+			} else
+			{
+				arena->leaked_pages += after;
+				arena->free_pages -= after;
+			}
+		}
+	}
+
+	arena->free_pages -= count;
+	release_lock(&arena->lock);
+	return virtual;
+}
+
+// vmm_arena_release(): Releases a range of virtual pages
+// Param:	vmm_arena_t *arena - arena
+// Param:	size_t virtual - 4KB-aligned virtual address
+// Param:	size_t count - count of pages
+// Return:	Nothing
+
+void vmm_arena_release(vmm_arena_t *arena, size_t virtual, size_t count)
+{
+	if(!count)
+		return;
+
+	vmm_arena_grow(arena);
+	acquire_lock(&arena->lock);
+
+	// find the free extents right before and right after this range
+	vmm_extent_t *before = NULL, *after = NULL;
+	vmm_extent_t *extent = arena->root;
+	while(extent)
+	{
+		if(extent->base < virtual)
+		{
+			before = extent;
+			extent = extent->right;
+		} else
+		{
+			after = extent;
+			extent = extent->left;
+		}
+	}
+
+	size_t end = virtual + (count << PAGE_SIZE_SHIFT);
+
+	if((before && before->base + (before->count << PAGE_SIZE_SHIFT) > virtual) || (after && after->base < end))
+	{
+		release_lock(&arena->lock);
+		kprintf("vmm: %s: double free of 0x%xq, %d pages\n", arena->name, (uint64_t)virtual, count);
+		return;
+	}
+
+	uint8_t merge_before = (before && before->base + (before->count << PAGE_SIZE_SHIFT) == virtual);
+	uint8_t merge_after = (after && after->base == end);
+
+	if(merge_before && merge_after)
+	{
+		before->count += count + after->count;
+		arena->root = vmm_extent_remove(arena, arena->root, after->base);
+		vmm_extent_fix(arena->root, before->base);
+	} else if(merge_before)
+	{
+		before->count += count;
+		vmm_extent_fix(arena->root, before->base);
+	} else if(merge_after)
+	{
+		after->base = virtual;
+		after->count += count;
+		vmm_extent_fix(arena->root, after->base);
+	} else
+	{
+		extent = vmm_extent_new(arena, virtual, count);
+		if(!extent)
+		{
+			// out of nodes and out of memory for more, so this range is
+			// lost until reboot
+			arena->leaked_pages += count;
+			release_lock(&arena->lock);
+			kprintf("vmm: %s: out of extent nodes, leaking 0x%xq, %d pages\n", arena->name, (uint64_t)virtual, count);
+			return;
+		}
+
+		arena->root = vmm_extent_insert(arena->root, extent);
+	}
+
+	arena->free_pages += count;
+	release_lock(&arena->lock);
+}
+
+/* Internal Functions */
+
+// vmm_arena_create(): Creates an arena and maps its node pool
+// Param:	vmm_arena_t *arena - arena
+// Param:	const char *name - name of arena
+// Param:	size_t start - start of region
+// Param:	size_t end - end of region
+// Return:	Nothing
+
+void vmm_arena_create(vmm_arena_t *arena, const char *name, size_t start, size_t end)
+{
+	memset(arena, 0, sizeof(vmm_arena_t));
+	strcpy(arena->name, name);
+	arena->start = start;
+	arena->end = end;
+
+	// the node pool takes the first few pages of the region
+	size_t pool_pages = ((MAX_VMM_EXTENTS * sizeof(vmm_extent_t)) + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+	arena->pool_pages = pool_pages;
+
+	size_t pool = pmm_alloc(pool_pages);
+	pmm_set_tag(pool, pool_pages, PMM_TAG_KERNEL);
+	vmm_map(start, pool, pool_pages, PAGE_PRESENT | PAGE_RW);
+
+	vmm_extent_t *nodes = (vmm_extent_t*)start;
+	size_t i = 0;
+	while(i < MAX_VMM_EXTENTS)
+	{
+		nodes[i].left = arena->free_nodes;
+		arena->free_nodes = &nodes[i];
+		i++;
+	}
+
+	// and everything else is free
+	size_t base = start + (pool_pages << PAGE_SIZE_SHIFT);
+	arena->free_pages = (end - base) >> PAGE_SIZE_SHIFT;
+	arena->root = vmm_extent_new(arena, base, arena->free_pages);
+
+	kprintf("vmm: %s arena 0x%xq - 0x%xq, %d KB of extent nodes\n", name, (uint64_t)start, (uint64_t)end, (pool_pages << PAGE_SIZE_SHIFT) / 1024);
+}
+
+// vmm_arena_grow(): Adds a page of nodes to the pool of an arena, if it's empty
+// The page comes from the arena itself; taking one page from the front of an
+// extent never needs a node
+// Param:	vmm_arena_t *arena - arena
+// Return:	Nothing
+
+void vmm_arena_grow(vmm_arena_t *arena)
+{
+	if(arena->free_nodes)
+		return;
+
+	// pmm_alloc() may call shrinkers, so don't hold the arena lock
+	size_t frame = pmm_alloc(1);
+	if(!frame)
+		return;
+
+	size_t page = vmm_arena_reserve(arena, 1);
+	if(!page)
+	{
+		pmm_mark_free(frame, 1);
+		return;
+	}
+
+	pmm_set_tag(frame, 1, PMM_TAG_KERNEL);
+	vmm_map(page, frame, 1, PAGE_PRESENT | PAGE_RW);
+
+	acquire_lock(&arena->lock);
+
+	vmm_extent_t *nodes = (vmm_extent_t*)page;
+	size_t i = 0;
+	while(i < PAGE_SIZE / sizeof(vmm_extent_t))
+	{
+		nodes[i].left = arena->free_nodes;
+		arena->free_nodes = &nodes[i];
+		i++;
+	}
+
+	arena->pool_pages++;
+	release_lock(&arena->lock);
+}
+
+// vmm_extent_new(): Takes a node from the pool of an arena
+// Param:	vmm_arena_t *arena - arena
+// Param:	size_t base - base of extent
+// Param:	size_t count - count of pages
+// Return:	vmm_extent_t * - new node, NULL if there are no free nodes
+
+vmm_extent_t *vmm_extent_new(vmm_arena_t *arena, size_t base, size_t count)
+{
+	vmm_extent_t *extent = arena->free_nodes;
+	if(!extent)
+		return NULL;
+
+	arena->free_nodes = extent->left;
+	arena->extent_count++;
+
+	extent->base = base;
+	extent->count = count;
+	extent->max_count = count;
+	extent->left = NULL;
+	extent->right = NULL;
+	extent->height = 1;
+	return extent;
+}
+
+// vmm_extent_update(): Recalculates the height and largest extent of a node
+// Param:	vmm_extent_t *extent - node
+// Return:	Nothing
+
+void vmm_extent_update(vmm_extent_t *extent)
+{
+	size_t left_height = extent->left ? extent->left->height : 0;
+	size_t right_height = extent->right ? extent->right->height : 0;
+	extent->height = 1 + (left_height > right_height ? left_height : right_height);
+
+	extent->max_count = extent->count;
+	if(extent->left && extent->left->max_count > extent->max_count)
+		extent->max_count = extent->left->max_count;
+	if(extent->right && extent->right->max_count > extent->max_count)
+		extent->max_count = extent->right->max_count;
+}
+
+// vmm_extent_balance(): Rebalances a subtree after an insertion or removal
+// Param:	vmm_extent_t *extent - root of subtree
+// Return:	vmm_extent_t * - new root of subtree
+
+vmm_extent_t *vmm_extent_balance(vmm_extent_t *extent)
+{
+	vmm_extent_update(extent);
+
+	size_t left_height = extent->left ? extent->left->height : 0;
+	size_t right_height = extent->right ? extent->right->height : 0;
+	vmm_extent_t *pivot;
+
+	if(left_height > right_height + 1)
+	{
+		// left-right case needs a rotation of the left child first
+		pivot = extent->left;
+		if((pivot->right ? pivot->right->height : 0) > (pivot->left ? pivot->left->height : 0))
+		{
+			extent->left = pivot->right;
+			pivot->right = extent->left->left;
+			extent->left->left = pivot;
+			vmm_extent_update(pivot);
+			pivot = extent->left;
+		}
+
+		extent->left = pivot->right;
+		pivot->right = extent;
+		vmm_extent_update(extent);
+		vmm_extent_update(pivot);
+		return pivot;
+	}
+
+	if(right_height > left_height + 1)
+	{
+		pivot = extent->right;
+		if((pivot->left ? pivot->left->height : 0) > (pivot->right ? pivot->right->height : 0))
+		{
+			extent->right = pivot->left;
+			pivot->left = extent->right->right;
+			extent->right->right = pivot;
+			vmm_extent_update(pivot);
+			pivot = extent->right;
+		}
+
+		extent->right = pivot->left;
+		pivot->left = extent;
+		vmm_extent_update(extent);
+		vmm_extent_update(pivot);
+		return pivot;
+	}
+
+	return extent;
+}
+
+// vmm_extent_insert(): Inserts a node into a subtree
+// Param:	vmm_extent_t *root - root of subtree
+// Param:	vmm_extent_t *extent - node to insert
+// Return:	vmm_extent_t * - new root of subtree
+
+vmm_extent_t *vmm_extent_insert(vmm_extent_t *root, vmm_extent_t *extent)
+{
+	if(!root)
+		return extent;
+
+	if(extent->base < root->base)
+		root->left = vmm_extent_insert(root->left, extent);
+	else
+		root->right = vmm_extent_insert(root->right, extent);
+
+	return vmm_extent_balance(root);
+}
+
+// vmm_extent_remove(): Removes a node from a subtree and returns it to the pool
+// Param:	vmm_arena_t *arena - arena
+// Param:	vmm_extent_t *root - root of subtree
+// Param:	size_t base - base of extent to remove
+// Return:	vmm_extent_t * - new root of subtree
+
+vmm_extent_t *vmm_extent_remove(vmm_arena_t *arena, vmm_extent_t *root, size_t base)
+{
+	if(!root)
+		return NULL;
+
+	if(base < root->base)
+	{
+		root->left = vmm_extent_remove(arena, root->left, base);
+		return vmm_extent_balance(root);
+	}
+
+	if(base > root->base)
+	{
+		root->right = vmm_extent_remove(arena, root->right, base);
+		return vmm_extent_balance(root);
+	}
+
+	if(root->left && root->right)
+	{
+		// take over the next extent, and remove that one instead
+		vmm_extent_t *next = root->right;
+		while(next->left)
+			next = next->left;
+
+		root->base = next->base;
+		root->count = next->count;
+		root->right = vmm_extent_remove(arena, root->right, next->base);
+		return vmm_extent_balance(root);
+	}
+
+	vmm_extent_t *child = root->left ? root->left : root->right;
+
+	root->left = arena->free_nodes;
+	arena->free_nodes = root;
+	arena->extent_count--;
+
+	return child;
+}
+
+// vmm_extent_fix(): Recalculates the largest extents on the path to a node
+// Param:	vmm_extent_t *root - root of subtree
+// Param:	size_t base - base of extent that changed size
+// Return:	Nothing
+
+void vmm_extent_fix(vmm_extent_t *root, size_t base)
+{
+	if(!root)
+		return;
+
+	if(base < root->base)
+		vmm_extent_fix(root->left, base);
+	else if(base > root->base)
+		vmm_extent_fix(root->right, base);
+
+	vmm_extent_update(root);
+}
+
+// vmm_extent_first_fit(): Finds the lowest extent with enough pages
+// Param:	vmm_extent_t *root - root of subtree
+// Param:	size_t count - count of pages
+// Return:	vmm_extent_t * - extent, NULL if none is large enough
+
+vmm_extent_t *vmm_extent_first_fit(vmm_extent_t *root, size_t count)
+{
+	while(root && root->max_count >= count)
+	{
+		if(root->left && root->left->max_count >= count)
+			root = root->left;
+		else if(root->count >= count)
+			return root;
+		else
+			root = root->right;
+	}
+
+	return NULL;
+}
+
@@ -0,0 +1,199 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Scattered and Contiguous Allocations, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+
+// vmm_alloc() doesn't need physically contiguous memory, so it builds its
+// ranges out of whatever free blocks the buddy allocator has, largest first.
+// Its frames are only ever reached through the page tables, so with PAE they
+// may come from above 4 GB.
+// Blocks only ever get smaller along a range, so each one starts at a virtual
+// offset aligned to its size, and 2 MB blocks can still use large pages.
+// Memory that a device reads or writes must be contiguous, and comes from
+// vmm_alloc_contiguous() instead. vmm_free() frees both kinds the same way.
+
+extern lock_t vmm_mutex;
+
+uint64_t vmm_scattered_allocs = 0;		// allocations built from more than one block
+
+void vmm_tag_frames(size_t, paddr_t, size_t);
+
+// vmm_alloc_contiguous(): Allocates physically contiguous memory, for DMA
+// Param:	size_t start - start of virtual base
+// Param:	size_t count - count of pages
+// Param:	uint16_t flags - page flags, VMM_NOZERO to skip zeroing
+// Param:	uint8_t zone - highest zone the device can reach, PMM_ZONE_*
+// Param:	paddr_t *physical - where to store the physical address, may be NULL
+// Return:	size_t - Pointer to allocated memory, NULL on error
+
+size_t vmm_alloc_contiguous(size_t start, size_t count, uint16_t flags, uint8_t zone, paddr_t *physical)
+{
+	// a device may touch it before the CPU does, so it can't be lazy
+	uint8_t zero = !(flags & VMM_NOZERO);
+	flags &= ~(VMM_NOZERO | VMM_LAZY);
+
+	if(!count)
+		return NULL;
+
+	acquire_lock(&vmm_mutex);
+
+	vmm_arena_t *arena = vmm_arena_find(start);
+	size_t virtual = NULL;
+
+	if(arena)
+	{
+#if __x86_64__
+		if(count >= (LARGE_PAGE_SIZE >> PAGE_SIZE_SHIFT))
+			virtual = vmm_arena_reserve_aligned(arena, count, LARGE_PAGE_SIZE, 0);
+#endif
+
+		if(!virtual)
+			virtual = vmm_arena_reserve(arena, count);
+	} else
+	{
+		virtual = vmm_find_range(start, count);
+	}
+
+	if(!virtual)
+	{
+		release_lock(&vmm_mutex);
+		return NULL;
+	}
+
+	paddr_t frames = pmm_alloc_zone(count, zone);
+	if(!frames)
+	{
+		if(arena)
+			vmm_arena_release(arena, virtual, count);
+
+		release_lock(&vmm_mutex);
+		return NULL;
+	}
+
+	vmm_map(virtual, frames, count, flags);
+	release_lock(&vmm_mutex);
+
+	pmm_set_tag(frames, count, PMM_TAG_DMA);
+	pmm_set_flags(frames, count, PMM_FRAME_PINNED);
+
+	if(zero)
+		memset((void*)virtual, 0, count << PAGE_SIZE_SHIFT);
+
+	if(physical)
+		physical[0] = frames;
+
+	return virtual;
+}
+
+// vmm_map_frames(): Maps newly allocated frames to a range, called with vmm_mutex held
+// Param:	size_t virtual - start of virtual range, already reserved
+// Param:	size_t count - count of pages
+// Param:	uint8_t flags - page flags
+// Return:	int - 1 on success, 0 if memory is full
+
+int vmm_map_frames(size_t virtual, size_t count, uint8_t flags)
+{
+	size_t done = 0, chunk;
+	paddr_t physical;
+	uint8_t max_order = PMM_MAX_ORDER;
+	size_t blocks = 0;
+
+	while(done < count)
+	{
+		physical = pmm_alloc_chunk(count - done, max_order, PMM_ZONE_NORMAL, &chunk);
+		if(!physical)
+		{
+			vmm_free_frames(virtual, done);
+			vmm_unmap(virtual, done);
+			return 0;
+		}
+
+		vmm_map(virtual + (done << PAGE_SIZE_SHIFT), physical, chunk, flags);
+		vmm_tag_frames(virtual + (done << PAGE_SIZE_SHIFT), physical, chunk);
+
+		// never take a larger block after a smaller one
+		while(((size_t)1 << max_order) > chunk)
+			max_order--;
+
+		done += chunk;
+		blocks++;
+	}
+
+	if(blocks > 1)
+		vmm_scattered_allocs++;
+
+	return 1;
+}
+
+// vmm_free_frames(): Frees the frames mapped to a range, called with vmm_mutex held
+// Param:	size_t virtual - start of virtual range
+// Param:	size_t count - count of pages
+// Return:	Nothing
+
+void vmm_free_frames(size_t virtual, size_t count)
+{
+	virtual &= (~(PAGE_SIZE-1));
+
+	// free physically contiguous runs together, they're usually whole blocks
+	paddr_t run_start = 0, page;
+	size_t run_count = 0;
+	size_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		page = vmm_get_page(virtual + (i << PAGE_SIZE_SHIFT));
+		if(!(page & PAGE_PRESENT))
+			continue;
+
+		page &= (~(PAGE_SIZE-1));
+		if(run_count && page == run_start + ((paddr_t)run_count << PAGE_SIZE_SHIFT))
+		{
+			run_count++;
+			continue;
+		}
+
+		pmm_mark_free(run_start, run_count);
+		run_start = page;
+		run_count = 1;
+	}
+
+	pmm_mark_free(run_start, run_count);
+}
+
+// vmm_frames_dump(): Shows how many allocations had to be scattered
+// Param:	Nothing
+// Return:	Nothing
+
+void vmm_frames_dump()
+{
+	kprintf("vmm: %d allocations built from more than one physical block\n", (uint32_t)vmm_scattered_allocs);
+}
+
+/* Internal Functions */
+
+// vmm_tag_frames(): Tags the frames of a kernel allocation as heap or slab
+// Param:	size_t virtual - virtual address they're mapped at
+// Param:	paddr_t physical - physical address
+// Param:	size_t count - count of pages
+// Return:	Nothing
+
+void vmm_tag_frames(size_t virtual, paddr_t physical, size_t count)
+{
+	if(virtual >= KERNEL_SLAB && virtual < KERNEL_SLAB_END)
+	{
+		pmm_set_tag(physical, count, PMM_TAG_SLAB);
+		pmm_set_flags(physical, count, PMM_FRAME_SLAB);
+	} else
+	{
+		pmm_set_tag(physical, count, PMM_TAG_HEAP);
+	}
+}
+
@@ -9,11 +9,27 @@
 #include <cpu.h>
 #include <string.h>
 #include <lock.h>
+#include <tlb.h>
 
 #if __i386__
 
-size_t *page_directory, *page_tables;
+// Without PAE, there is one page directory of 1024 entries, and page tables
+// are 4-byte entries. Built with PAE=1, entries are 8 bytes and can point
+// above 4 GB, and there are four page directories of 512 entries, one for
+// each GB, found through the four page directory pointers CR3 points to.
+// Either way, the page tables are one flat array covering all 4 GB, so a
+// page's entry is always page_tables[virtual >> PAGE_SIZE_SHIFT].
+
+pte_t *page_directory, *page_tables;
 lock_t vmm_mutex = 0;
+size_t vmm_small_mappings = 0;		// 4 KB PTEs made by vmm_map()
+size_t vmm_cr3, vmm_cr4;		// paging setup, APs load it in asm_i386/bootstrap.asm
+
+#if PAE
+pte_t *page_directory_pointers;
+#endif
+
+void vmm_set_entry(pte_t *, pte_t);
 
 // vmm_init(): Initializes paging and the virtual memory manager
 // Param:	Nothing
@@ -23,21 +39,48 @@ void vmm_init()
 {
 	size_t tmp_ptr;
 
-	tmp_ptr = (size_t)(pmm_bitmap + PMM_BITMAP_SIZE + (PAGE_SIZE - 1)) & (~(PAGE_SIZE-1));
-	page_directory = (size_t*)tmp_ptr;
+	tmp_ptr = (size_t)((size_t)kend + (PAGE_SIZE - 1)) & (~(PAGE_SIZE-1));
 
+#if PAE
+	page_directory_pointers = (pte_t*)tmp_ptr;
 	tmp_ptr += PAGE_SIZE;
-	page_tables = (size_t*)tmp_ptr;
+#endif
+
+	page_directory = (pte_t*)tmp_ptr;
+
+	tmp_ptr += PAGE_DIRECTORY_ENTRIES * sizeof(pte_t);
+	page_tables = (pte_t*)tmp_ptr;
+
+	// everything up to here is below the frame array at 16 MB
+	if(tmp_ptr + 1024 * 1024 * sizeof(pte_t) > PMM_FRAMES_BASE)
+	{
+		kprintf("boot error: kernel too large for its page tables.\n");
+		while(1);
+	}
 
 	// create the page directory
 	size_t i = 0;
 
-	while(i < 1024)
+	while(i < PAGE_DIRECTORY_ENTRIES)
 	{
 		page_directory[i] = (size_t)page_tables + (i << PAGE_SIZE_SHIFT) + PAGE_PRESENT | PAGE_RW | PAGE_USER;
 		i++;
 	}
 
+#if PAE
+	// the pointers only take the present and caching bits
+	i = 0;
+	while(i < PAGE_SIZE / sizeof(pte_t))
+	{
+		if(i < PAGE_DIRECTORY_POINTERS)
+			page_directory_pointers[i] = ((size_t)page_directory + (i << PAGE_SIZE_SHIFT)) | PAGE_PRESENT;
+		else
+			page_directory_pointers[i] = 0;
+
+		i++;
+	}
+#endif
+
 	// clear the page tables
 	i = 0;
 	while(i < 1024*1024)
@@ -46,17 +89,27 @@ void vmm_init()
 		i++;
 	}
 
-	// identity-map the lowest 16 MB
+	// identity-map the lowest 16 MB and the PMM frame array above it
+	size_t identity_pages = ((size_t)pmm_frames + (pmm_frame_count * sizeof(pmm_frame_t)) + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+
 	i = 0;
-	while(i < 4096)
+	while(i < identity_pages)
 	{
 		page_tables[i] = (i * PAGE_SIZE) | PAGE_PRESENT | PAGE_RW;
 		i++;
 	}
 
 	// enable paging
-	write_cr4(read_cr4() & ~0x20);
-	write_cr3((uint32_t)page_directory);
+#if PAE
+	vmm_cr3 = (size_t)page_directory_pointers;
+	vmm_cr4 = CR4_PAE;
+#else
+	vmm_cr3 = (size_t)page_directory;
+	vmm_cr4 = 0;
+#endif
+
+	write_cr4((read_cr4() & ~CR4_PAE) | vmm_cr4);
+	write_cr3(vmm_cr3);
 	uint32_t cr0 = read_cr0();
 	cr0 |= 0x80000000;		// paging
 	cr0 |= 0x10000;			// WP
@@ -66,33 +119,78 @@ void vmm_init()
 
 // vmm_get_page(): Returns physical address and flags of a page
 // Param:	size_t page - 4KB-aligned page
-// Return:	size_t - 4KB-aligned physical address and flags
+// Return:	pte_t - 4KB-aligned physical address and flags
 
-inline size_t vmm_get_page(size_t page)
+inline pte_t vmm_get_page(size_t page)
 {
 	return page_tables[page >> PAGE_SIZE_SHIFT];
 }
 
 // vmm_map(): Maps physical memory in the virtual address space
 // Param:	size_t virtual - start of virtual base
-// Param:	size_t physical - start of physical base
+// Param:	paddr_t physical - start of physical base
 // Param:	size_t count - count of pages
 // Param:	uint8_t flags - page flags
 // Return:	Nothing
 
-void vmm_map(size_t virtual, size_t physical, size_t count, uint8_t flags)
+void vmm_map(size_t virtual, paddr_t physical, size_t count, uint8_t flags)
 {
 	if(!count)
 		return;
 
+	// only entries that were present can be cached in the TLB
+	tlb_batch_t batch;
+	tlb_batch_init(&batch);
+
 	size_t i = 0;
 	while(i < count)
 	{
-		page_tables[(virtual >> PAGE_SIZE_SHIFT) + i] = (physical + (i << PAGE_SIZE_SHIFT)) | (size_t)flags;
+		// lazy faults map pages without vmm_mutex
+		if(page_tables[(virtual >> PAGE_SIZE_SHIFT) + i] & PAGE_PRESENT)
+		{
+			tlb_batch_add(&batch, virtual + (i << PAGE_SIZE_SHIFT), 1);
+			asm volatile ("lock decl %0" : "+m"(vmm_small_mappings));
+		}
+
+		if(flags & PAGE_PRESENT)
+			asm volatile ("lock incl %0" : "+m"(vmm_small_mappings));
+
+		vmm_set_entry(&page_tables[(virtual >> PAGE_SIZE_SHIFT) + i], (physical + ((paddr_t)i << PAGE_SIZE_SHIFT)) | (pte_t)flags);
 		i++;
 	}
 
-	flush_tlb(virtual, count);
+	// there is only the kernel's address space, and every CPU runs it
+	tlb_batch_flush(&batch, TLB_ALL_CPUS);
+}
+
+// vmm_map_noflush(): Maps a single page, leaving the old entry in the TLBs
+// For lazy faults, which flush after dropping vmm_lazy_mutex
+// Param:	size_t virtual - virtual address
+// Param:	paddr_t physical - physical address
+// Param:	uint8_t flags - page flags
+// Return:	pte_t - previous page table entry
+
+pte_t vmm_map_noflush(size_t virtual, paddr_t physical, uint8_t flags)
+{
+	pte_t old = page_tables[virtual >> PAGE_SIZE_SHIFT];
+	vmm_set_entry(&page_tables[virtual >> PAGE_SIZE_SHIFT], physical | (pte_t)flags);
+
+	if(old & PAGE_PRESENT)
+		asm volatile ("lock decl %0" : "+m"(vmm_small_mappings));
+	if(flags & PAGE_PRESENT)
+		asm volatile ("lock incl %0" : "+m"(vmm_small_mappings));
+
+	return old;
+}
+
+// vmm_dump_mappings(): Shows how many pages are mapped
+// Param:	Nothing
+// Return:	Nothing
+
+void vmm_dump_mappings()
+{
+	// there are no large pages without PSE, which we don't use
+	kprintf("vmm: 0 large mappings, %d 4 KB mappings\n", vmm_small_mappings);
 }
 
 // vmm_unmap(): Unmaps memory from the virtual address space
@@ -105,6 +203,17 @@ void vmm_unmap(size_t virtual, size_t count)
 	if(!count)
 		return;
 
+	// ranges from vmm_request_map() also give back their virtual space
+	if(virtual >= KERNEL_MMIO && virtual < KERNEL_MMIO_END)
+	{
+		count = ((virtual & (PAGE_SIZE-1)) + (count << PAGE_SIZE_SHIFT) + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+		virtual &= ~(PAGE_SIZE-1);
+
+		vmm_map(virtual, 0, count, 0);
+		vmm_arena_release(vmm_arena_find(virtual), virtual, count);
+		return;
+	}
+
 	vmm_map(virtual, 0, count, 0);
 	//flush_tlb(virtual, count);
 }
@@ -144,11 +253,15 @@ size_t vmm_find_range(size_t start, size_t count)
 // vmm_alloc(): Allocates memory
 // Param:	size_t start - start of virtual base
 // Param:	size_t count - count of pages
-// Param:	uint8_t flags - page flags
+// Param:	uint16_t flags - page flags, VMM_NOZERO to skip zeroing, VMM_LAZY to map on first touch
 // Return:	size_t - Pointer to allocated memory
 
-size_t vmm_alloc(size_t start, size_t count, uint8_t flags)
+size_t vmm_alloc(size_t start, size_t count, uint16_t flags)
 {
+	uint8_t zero = !(flags & VMM_NOZERO);
+	uint8_t lazy = (flags & VMM_LAZY) ? 1 : 0;
+	flags &= ~(VMM_NOZERO | VMM_LAZY);
+
 	acquire_lock(&vmm_mutex);
 
 	if(!count)
@@ -158,26 +271,43 @@ size_t vmm_alloc(size_t start, size_t count, uint8_t flags)
 	}
 
 	// allocate virtual memory
-	size_t virtual = vmm_find_range(start, count);
+	vmm_arena_t *arena = vmm_arena_find(start);
+	size_t virtual;
+
+	if(arena)
+		virtual = vmm_arena_reserve(arena, count);
+	else
+		virtual = vmm_find_range(start, count);
+
 	if(!virtual)
 	{
 		release_lock(&vmm_mutex);
 		return NULL;
 	}
 
-	// and physical memory
-	size_t physical = pmm_alloc(count);
-	if(!physical)
+	// lazy regions get their memory from the page fault handler
+	if(lazy && arena && vmm_lazy_add(virtual, count, flags))
 	{
 		release_lock(&vmm_mutex);
-		return NULL;
+		return virtual;
 	}
 
-	vmm_map(virtual, physical, count, flags);
+	// and physical memory, it doesn't have to be contiguous
+	if(!vmm_map_frames(virtual, count, flags))
+	{
+		if(arena)
+			vmm_arena_release(arena, virtual, count);
+
+		release_lock(&vmm_mutex);
+		return NULL;
+	}
 
-	// zero-initialize
-	memset((void*)virtual, 0, count << PAGE_SIZE_SHIFT);
 	release_lock(&vmm_mutex);
+
+	// zero-initialize, nobody else knows about this memory yet
+	if(zero)
+		memset((void*)virtual, 0, count << PAGE_SIZE_SHIFT);
+
 	return virtual;
 }
 
@@ -188,24 +318,37 @@ size_t vmm_alloc(size_t start, size_t count, uint8_t flags)
 
 void vmm_free(size_t ptr, size_t count)
 {
-	acquire_lock(&vmm_mutex);
 	if(!count)
+		return;
+
+	// only the heap and slab arenas hand out memory to free here; MMIO
+	// ranges go through vmm_unmap(), which gives their space back itself
+	vmm_arena_t *arena = vmm_arena_find(ptr);
+	if(!arena || (ptr >= KERNEL_MMIO && ptr < KERNEL_MMIO_END))
+	{
+		kprintf("vmm: attempt to free 0x%xq, which isn't heap memory\n", (uint64_t)ptr);
+		return;
+	}
+
+	acquire_lock(&vmm_mutex);
+
+	if(vmm_lazy_release(ptr, count))
 	{
 		release_lock(&vmm_mutex);
 		return;
 	}
 
-	size_t physical = vmm_get_page(ptr);
-	if(!physical & PAGE_PRESENT)		// page not present?
+	if(!(vmm_get_page(ptr) & PAGE_PRESENT))		// page not present?
 	{
 		release_lock(&vmm_mutex);
 		return;
 	}
 
-	physical &= (~(PAGE_SIZE-1));
+	// the frames may be scattered, so free them page by page
+	vmm_free_frames(ptr, count);
+	vmm_unmap(ptr, count);
+	vmm_arena_release(arena, ptr & (~(PAGE_SIZE-1)), count);
 
-	pmm_mark_free(physical, count);
-	vmm_unmap(ptr, count);	
 	release_lock(&vmm_mutex);
 }
 
@@ -225,20 +368,44 @@ size_t vmm_request_map(size_t physical, size_t count, uint8_t flags)
 		return NULL;
 	}
 
-	// allocate virtual memory
-	count++;
-	size_t virtual = vmm_find_range(KERNEL_HEAP, count);
+	// allocate virtual memory, including the page offset
+	count = ((physical & (PAGE_SIZE-1)) + (count << PAGE_SIZE_SHIFT) + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+
+	vmm_arena_t *arena = vmm_arena_find(KERNEL_MMIO);
+	size_t virtual = arena ? vmm_arena_reserve(arena, count) : NULL;
 	if(!virtual)
 	{
 		release_lock(&vmm_mutex);
 		return NULL;
 	}
 
-	vmm_map(virtual, physical, count, flags);
+	vmm_map(virtual, physical & (~(PAGE_SIZE-1)), count, flags);
 	release_lock(&vmm_mutex);
 	return virtual + (physical & (PAGE_SIZE-1));
 }
 
+/* Internal Functions */
+
+// vmm_set_entry(): Writes a page table entry another CPU may be walking
+// Param:	pte_t *entry - page table entry
+// Param:	pte_t value - new entry
+// Return:	Nothing
+
+void vmm_set_entry(pte_t *entry, pte_t value)
+{
+#if PAE
+	// a PAE entry is two dwords, and a plain store could be seen half done
+	uint64_t old = entry[0];
+	asm volatile ("1: lock cmpxchg8b %0\n"
+		"jnz 1b"
+		: "+m"(entry[0]), "+A"(old)
+		: "b"((uint32_t)value), "c"((uint32_t)(value >> 32))
+		: "memory");
+#else
+	entry[0] = value;
+#endif
+}
+
 #endif // __i386__
 
 
@@ -0,0 +1,404 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Lazy Regions, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+#include <mmap.h>
+#include <zram.h>
+#include <ksm.h>
+#include <shrink.h>
+#include <tlb.h>
+
+// vmm_alloc() with VMM_LAZY only reserves virtual memory and records it here.
+// The first read of a page maps the shared zero page read-only, and the first
+// write maps a private zeroed frame, so memory that is never touched never
+// uses a frame. Private frames may later be compressed by zram or merged with
+// identical ones by ksm, and are brought back or copied the same way. Every
+// frame a lazy region maps, the zero page too, comes from PMM_ZONE_DEFAULT,
+// so with PAE their entries and the frames ksm and zram keep fit in a size_t.
+//
+// The page fault handler runs with interrupts disabled if the faulting code
+// had them disabled, and the faulting code may hold vmm_mutex itself -- while
+// it reads a lazily allocated buffer, say. So lazy faults never take
+// vmm_mutex: the table and the entries of lazy regions are protected by
+// vmm_lazy_mutex, and their page tables are made when the region is added,
+// so populating a page only writes its entry. Lock order is vmm_mutex, then
+// vmm_lazy_mutex, then zram_mutex; ksm_mutex comes before vmm_lazy_mutex.
+//
+// Faults flush the old entry only after dropping the lock. ksm and zram have
+// to flush while they hold it, before they compare or compress a page, which
+// is safe because acquire_lock() takes shootdowns while it spins.
+//
+// Interrupt handlers may touch lazy memory too -- their scratch arenas are
+// lazy -- so vmm_lazy_mutex is only ever held with interrupts disabled, or a
+// handler could fault into the lock held by the code it interrupted.
+
+lock_t vmm_lazy_mutex = 0;
+
+vmm_lazy_t vmm_lazy[MAX_VMM_LAZY];
+size_t vmm_lazy_count = 0;
+size_t vmm_zero_page = 0;		// physical
+
+uint64_t vmm_lazy_faults = 0;
+uint64_t vmm_lazy_zero_faults = 0;
+uint64_t vmm_lazy_populated = 0;
+
+size_t pmm_irq_save();
+void pmm_irq_restore(size_t);
+vmm_lazy_t *vmm_lazy_find(size_t);
+int vmm_lazy_fault(size_t, size_t);
+int vmm_lazy_swap_in(vmm_lazy_t *, size_t, size_t);
+
+// vmm_lazy_init(): Allocates the shared zero page
+// Param:	Nothing
+// Return:	Nothing
+
+void vmm_lazy_init()
+{
+	// not mapped anywhere writable, nothing may ever write to it
+	vmm_zero_page = zero_page_alloc();
+	if(!vmm_zero_page)
+		return;
+
+	pmm_set_tag(vmm_zero_page, 1, PMM_TAG_HEAP);
+}
+
+// vmm_lazy_add(): Records a lazy region, called with vmm_mutex held
+// Param:	size_t base - virtual address, already reserved
+// Param:	size_t count - count of pages
+// Param:	uint8_t flags - page flags
+// Return:	int - 1 on success, 0 if the table is full
+
+int vmm_lazy_add(size_t base, size_t count, uint8_t flags)
+{
+	if(!vmm_zero_page)
+		return 0;
+
+	// make the page tables now, faults can't without vmm_mutex
+	vmm_map(base, 0, count, 0);
+
+	size_t irq_flags = pmm_irq_save();
+	acquire_lock(&vmm_lazy_mutex);
+
+	size_t i = 0;
+	while(i < MAX_VMM_LAZY)
+	{
+		if(!vmm_lazy[i].count)
+		{
+			vmm_lazy[i].base = base;
+			vmm_lazy[i].count = count;
+			vmm_lazy[i].flags = flags;
+			vmm_lazy[i].owner = 0;
+			vmm_lazy[i].faults = 0;
+			vmm_lazy[i].zero_faults = 0;
+			vmm_lazy[i].resident = 0;
+			vmm_lazy[i].swapped = 0;
+			vmm_lazy[i].merged = 0;
+
+			vmm_lazy_count++;
+			release_lock(&vmm_lazy_mutex);
+			pmm_irq_restore(irq_flags);
+			return 1;
+		}
+
+		i++;
+	}
+
+	release_lock(&vmm_lazy_mutex);
+	pmm_irq_restore(irq_flags);
+	return 0;
+}
+
+// vmm_lazy_release(): Frees a lazy region, called with vmm_mutex held
+// Param:	size_t ptr - pointer into the first page of the region
+// Param:	size_t count - count of pages
+// Return:	int - 1 if this was a lazy region, 0 if not
+
+int vmm_lazy_release(size_t ptr, size_t count)
+{
+	size_t flags = pmm_irq_save();
+	acquire_lock(&vmm_lazy_mutex);
+
+	vmm_lazy_t *region = vmm_lazy_find(ptr);
+	if(!region || region->base != (ptr & (~(PAGE_SIZE-1))))
+	{
+		release_lock(&vmm_lazy_mutex);
+		pmm_irq_restore(flags);
+		return 0;
+	}
+
+	if(count > region->count)
+		count = region->count;
+
+	// only the private frames belong to us
+	size_t i = 0;
+	size_t page;
+	while(i < count)
+	{
+		page = vmm_get_page(region->base + (i << PAGE_SIZE_SHIFT));
+		if((page & PAGE_PRESENT) && pmm_get_tag(page & (~(PAGE_SIZE-1))) == PMM_TAG_KSM)
+			ksm_release(page & (~(PAGE_SIZE-1)));
+		else if((page & PAGE_PRESENT) && (page & (~(PAGE_SIZE-1))) != vmm_zero_page)
+			pmm_mark_free(page & (~(PAGE_SIZE-1)), 1);
+		else if(!(page & PAGE_PRESENT) && (page & PAGE_SWAPPED))
+			zram_free(page);
+
+		i++;
+	}
+
+	vmm_unmap(region->base, count);
+
+	vmm_arena_t *arena = vmm_arena_find(region->base);
+	if(arena)
+		vmm_arena_release(arena, region->base, count);
+
+	region->count = 0;
+	vmm_lazy_count--;
+
+	release_lock(&vmm_lazy_mutex);
+	pmm_irq_restore(flags);
+	return 1;
+}
+
+// vmm_lazy_set_owner(): Records who allocated a lazy region
+// Param:	size_t ptr - pointer into the first page of the region
+// Param:	size_t owner - return address of the allocating code
+// Return:	Nothing
+
+void vmm_lazy_set_owner(size_t ptr, size_t owner)
+{
+	size_t flags = pmm_irq_save();
+	acquire_lock(&vmm_lazy_mutex);
+
+	vmm_lazy_t *region = vmm_lazy_find(ptr);
+	if(region)
+		region->owner = owner;
+
+	release_lock(&vmm_lazy_mutex);
+	pmm_irq_restore(flags);
+}
+
+// vmm_page_fault(): Page fault handler, called from page_fault_stub
+// Handles copy-on-write, lazy region and mmap() faults, anything else is fatal
+// Param:	size_t address - faulting address from CR2
+// Param:	size_t code - error code
+// Param:	size_t flags - EFLAGS/RFLAGS of the faulting code
+// Return:	Nothing
+
+void vmm_page_fault(size_t address, size_t code, size_t flags)
+{
+	// populating may need a TLB shootdown, so let the other CPUs' IPIs in
+	// if the faulting code could take them
+	if(flags & 0x200)
+		asm volatile ("sti");
+
+	// lazy faults need frames, so make some room before taking any locks
+	if(shrink_zone_pressure(WMARK_MIN, PMM_ZONE_DEFAULT))
+		shrink_memory(SHRINK_BATCH, 1);
+
+	int handled;
+
+#if __x86_64__
+	handled = vmm_cow_fault(address, code) || vmm_lazy_fault(address, code) || mmap_fault(address, code);
+#else
+	handled = vmm_lazy_fault(address, code) || mmap_fault(address, code);
+#endif
+
+	if(!handled)
+	{
+		asm volatile ("cli");
+		exception_handler("Page fault", code);
+	}
+
+	asm volatile ("cli");
+}
+
+// vmm_lazy_dump(): Shows the lazy regions and their fault counters
+// Param:	Nothing
+// Return:	Nothing
+
+void vmm_lazy_dump()
+{
+	size_t flags = pmm_irq_save();
+	acquire_lock(&vmm_lazy_mutex);
+
+	kprintf("vmm: %d lazy regions, %d faults, %d zero page faults, %d pages populated\n", vmm_lazy_count, (uint32_t)vmm_lazy_faults, (uint32_t)vmm_lazy_zero_faults, (uint32_t)vmm_lazy_populated);
+
+	size_t i = 0;
+	while(i < MAX_VMM_LAZY)
+	{
+		if(vmm_lazy[i].count)
+		{
+#if __i386__
+			kprintf("vmm:  0x%xd, %d pages, %d resident, %d compressed, %d faults, %d zero, owner 0x%xd\n", vmm_lazy[i].base, vmm_lazy[i].count, vmm_lazy[i].resident, vmm_lazy[i].swapped, vmm_lazy[i].faults, vmm_lazy[i].zero_faults, vmm_lazy[i].owner);
+#endif
+
+#if __x86_64__
+			kprintf("vmm:  0x%xq, %d pages, %d resident, %d compressed, %d faults, %d zero, owner 0x%xq\n", vmm_lazy[i].base, vmm_lazy[i].count, vmm_lazy[i].resident, vmm_lazy[i].swapped, vmm_lazy[i].faults, vmm_lazy[i].zero_faults, vmm_lazy[i].owner);
+#endif
+		}
+
+		i++;
+	}
+
+	release_lock(&vmm_lazy_mutex);
+	pmm_irq_restore(flags);
+}
+
+/* Internal Functions */
+
+// vmm_lazy_find(): Finds the lazy region containing an address
+// Param:	size_t address - virtual address
+// Return:	vmm_lazy_t * - region, NULL if there is none
+
+vmm_lazy_t *vmm_lazy_find(size_t address)
+{
+	if(!vmm_lazy_count)
+		return NULL;
+
+	size_t i = 0;
+	while(i < MAX_VMM_LAZY)
+	{
+		if(vmm_lazy[i].count && address >= vmm_lazy[i].base && address < vmm_lazy[i].base + (vmm_lazy[i].count << PAGE_SIZE_SHIFT))
+			return &vmm_lazy[i];
+
+		i++;
+	}
+
+	return NULL;
+}
+
+// vmm_lazy_fault(): Populates a page of a lazy region
+// Param:	size_t address - faulting address
+// Param:	size_t code - error code
+// Return:	int - 1 if the fault was handled, 0 if it's a real fault
+
+int vmm_lazy_fault(size_t address, size_t code)
+{
+	if(code & (PF_USER | PF_RESERVED))
+		return 0;
+
+	size_t flags = pmm_irq_save();
+	acquire_lock(&vmm_lazy_mutex);
+
+	vmm_lazy_t *region = vmm_lazy_find(address);
+	if(!region)
+	{
+		release_lock(&vmm_lazy_mutex);
+		pmm_irq_restore(flags);
+		return 0;
+	}
+
+	size_t page = address & (~(PAGE_SIZE-1));
+	size_t entry = vmm_get_page(page);
+
+	region->faults++;
+	vmm_lazy_faults++;
+
+	// compressed by zram, bring it back whether it's read or written
+	if(!(entry & PAGE_PRESENT) && (entry & PAGE_SWAPPED))
+	{
+		int status = vmm_lazy_swap_in(region, page, entry);
+		release_lock(&vmm_lazy_mutex);
+		pmm_irq_restore(flags);
+		return status;
+	}
+
+	if(!(code & PF_WRITE))
+	{
+		// another CPU may have populated it while we waited for the lock
+		if(!(entry & PAGE_PRESENT))
+		{
+			vmm_map_noflush(page, vmm_zero_page, PAGE_PRESENT);
+			region->zero_faults++;
+			vmm_lazy_zero_faults++;
+		}
+
+		release_lock(&vmm_lazy_mutex);
+		pmm_irq_restore(flags);
+		return 1;
+	}
+
+	if((entry & PAGE_PRESENT) && (entry & PAGE_RW))
+	{
+		release_lock(&vmm_lazy_mutex);
+		pmm_irq_restore(flags);
+		return 1;
+	}
+
+	// merged with identical pages, it needs its own copy now
+	if((entry & PAGE_PRESENT) && pmm_get_tag(entry & (~(PAGE_SIZE-1))) == PMM_TAG_KSM)
+	{
+		int status = ksm_unshare(region, page, entry);
+		release_lock(&vmm_lazy_mutex);
+		pmm_irq_restore(flags);
+
+		if(status)
+			tlb_flush(page, 1);
+
+		return status;
+	}
+
+	// zeroed before it's mapped, so nobody can see what was in it
+	size_t frame = zero_page_alloc();
+	if(!frame)
+	{
+		release_lock(&vmm_lazy_mutex);
+		pmm_irq_restore(flags);
+		return 0;
+	}
+
+	pmm_set_tag(frame, 1, PMM_TAG_HEAP);
+	vmm_map_noflush(page, frame, region->flags);
+
+	region->resident++;
+	vmm_lazy_populated++;
+
+	release_lock(&vmm_lazy_mutex);
+	pmm_irq_restore(flags);
+
+	// the zero page may still be cached read-only, here and elsewhere
+	if(entry & PAGE_PRESENT)
+		tlb_flush(page, 1);
+
+	return 1;
+}
+
+// vmm_lazy_swap_in(): Brings back a page compressed by zram, called with vmm_lazy_mutex held
+// Param:	vmm_lazy_t *region - lazy region with the page
+// Param:	size_t page - faulting page
+// Param:	size_t entry - page table entry with PAGE_SWAPPED
+// Return:	int - 1 if the fault was handled, 0 if the page is lost
+
+int vmm_lazy_swap_in(vmm_lazy_t *region, size_t page, size_t entry)
+{
+	size_t frame = pmm_alloc(1);
+	if(!frame)
+		return 0;
+
+	// decompressed before it's mapped, the entry wasn't present so there's
+	// nothing to flush
+	void *destination = kmap(frame);
+	int status = zram_load(entry, destination);
+	kunmap(destination);
+
+	if(status != 0)
+	{
+		pmm_mark_free(frame, 1);
+		return 0;
+	}
+
+	vmm_map_noflush(page, frame, region->flags);
+
+	pmm_set_tag(frame, 1, PMM_TAG_HEAP);
+	region->resident++;
+	region->swapped--;
+	return 1;
+}
@@ -0,0 +1,387 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Address Spaces and Copy-on-Write */
+
+#include <mm.h>
+#include <kprintf.h>
+#include <cpu.h>
+#include <string.h>
+#include <lock.h>
+#include <tlb.h>
+
+#if __x86_64__
+
+// Cloning a space copies the paging structures of USER_SPACE but not the pages
+// themselves: writable pages become read-only with PAGE_COW set in both
+// spaces, and every shared frame is counted in pmm_frame_t. The first write to
+// such a page faults, and the handler copies it -- or, if every other sharer
+// has copied or freed it already, just makes it writable again.
+
+extern size_t *pml4;
+extern lock_t vmm_mutex;
+void vmm_split_large(size_t *);
+
+vmm_space_t vmm_kernel_space;
+
+uint64_t vmm_cow_copies = 0;
+uint64_t vmm_cow_reuses = 0;
+uint64_t vmm_tlb_gen = 0;		// source of unique tlb_gen values
+
+size_t vmm_clone_table(size_t *, size_t, size_t, vmm_space_t *, tlb_batch_t *);
+void vmm_free_table(size_t *, size_t);
+size_t *vmm_space_pte(size_t, size_t);
+void vmm_space_changed(vmm_space_t *);
+
+// vmm_space_create(): Creates an address space with only the kernel in it
+// Param:	Nothing
+// Return:	vmm_space_t * - address space, NULL on error
+
+vmm_space_t *vmm_space_create()
+{
+	vmm_space_t *space = kcalloc(sizeof(vmm_space_t), 1);
+	if(!space)
+		return NULL;
+
+	space->pml4 = zero_page_alloc();
+	if(!space->pml4)
+	{
+		kfree(space);
+		return NULL;
+	}
+
+	space->tables = 1;
+	pmm_set_tag(space->pml4, 1, PMM_TAG_PAGE_TABLE);
+
+	// PCIDs other CPUs cached for a freed space at the same address mustn't
+	// look valid for this one
+	acquire_lock(&vmm_mutex);
+	vmm_space_changed(space);
+	release_lock(&vmm_mutex);
+
+	// the kernel's PML4 entries are shared, not copied
+	size_t *new_pml4 = (size_t*)(space->pml4 + PHYSICAL_MEMORY);
+	size_t i = 0;
+	while(i < 512)
+	{
+		if(i < (USER_SPACE >> 39) || i >= (USER_SPACE_END >> 39))
+			new_pml4[i] = pml4[i];
+
+		i++;
+	}
+
+	return space;
+}
+
+// vmm_space_clone(): Clones an address space, sharing its pages copy-on-write
+// Param:	vmm_space_t *source - address space to clone
+// Return:	vmm_space_t * - new address space, NULL on error
+
+vmm_space_t *vmm_space_clone(vmm_space_t *source)
+{
+	vmm_space_t *space = vmm_space_create();
+	if(!space)
+		return NULL;
+
+	size_t *source_pml4 = (size_t*)(source->pml4 + PHYSICAL_MEMORY);
+	size_t *new_pml4 = (size_t*)(space->pml4 + PHYSICAL_MEMORY);
+
+	// pages made read-only in the source may still be writable in TLBs
+	tlb_batch_t batch;
+	tlb_batch_init(&batch);
+
+	acquire_lock(&vmm_mutex);
+
+	size_t i;
+	for(i = (USER_SPACE >> 39); i < (USER_SPACE_END >> 39); i++)
+	{
+		if(source_pml4[i] & PAGE_PRESENT)
+			new_pml4[i] = vmm_clone_table(&source_pml4[i], 3, i << 39, space, &batch);
+	}
+
+	// before anyone can write through a stale writable entry into a frame
+	// the clone now shares
+	if(batch.pages)
+		vmm_space_changed(source);
+
+	tlb_batch_flush(&batch, source->cpus);
+	release_lock(&vmm_mutex);
+
+	return space;
+}
+
+// vmm_space_free(): Frees an address space and drops its pages
+// Param:	vmm_space_t *space - address space, must not be in use
+// Return:	Nothing
+
+void vmm_space_free(vmm_space_t *space)
+{
+	if(space == &vmm_kernel_space)
+		return;
+
+	size_t *space_pml4 = (size_t*)(space->pml4 + PHYSICAL_MEMORY);
+
+	acquire_lock(&vmm_mutex);
+
+	size_t i;
+	for(i = (USER_SPACE >> 39); i < (USER_SPACE_END >> 39); i++)
+	{
+		if(space_pml4[i] & PAGE_PRESENT)
+			vmm_free_table((size_t*)((space_pml4[i] & (~(PAGE_SIZE-1))) + PHYSICAL_MEMORY), 3);
+	}
+
+	release_lock(&vmm_mutex);
+
+	pmm_mark_free(space->pml4, 1);
+	kfree(space);
+}
+
+// vmm_space_switch(): Switches the current CPU to an address space
+// Param:	vmm_space_t *space - address space
+// Return:	Nothing
+
+void vmm_space_switch(vmm_space_t *space)
+{
+	if(!pmm_pcp_ready)
+	{
+		write_cr3(space->pml4);
+		return;
+	}
+
+	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+	uint32_t self = 1 << cpu->index;
+
+	// the PCID cache is per CPU, so don't move to another one halfway
+	size_t flags;
+	asm volatile ("pushf\npop %0\ncli" : "=r"(flags) :: "memory");
+
+	// join the space before reading its tlb_gen: whoever changes it either
+	// sees us in cpus and sends a shootdown, or we see the new generation
+	asm volatile ("lock orl %1, %0" : "+m"(space->cpus) : "r"(self) : "memory");
+
+	vmm_space_t *old = cpu->space;
+	write_cr3(tlb_asid_cr3(space));
+	cpu->space = space;
+
+	// a space we left keeps its entries only in a PCID, which its tlb_gen
+	// takes care of; the kernel's PCID 0 doesn't go by tlb_gen
+	if(old && old != space && old != &vmm_kernel_space)
+		asm volatile ("lock andl %1, %0" : "+m"(old->cpus) : "r"(~self) : "memory");
+
+	if(flags & 0x200)
+		asm volatile ("sti" ::: "memory");
+}
+
+// vmm_cow_fault(): Handles a write to a copy-on-write page
+// Param:	size_t address - faulting address
+// Param:	size_t code - error code
+// Return:	int - 1 if the fault was handled, 0 if it isn't copy-on-write
+
+int vmm_cow_fault(size_t address, size_t code)
+{
+	if(!(code & PF_PRESENT) || !(code & PF_WRITE))
+		return 0;
+
+	if(address < USER_SPACE || address >= USER_SPACE_END)
+		return 0;
+
+	size_t page = address & (~(PAGE_SIZE-1));
+	vmm_space_t *space = NULL;
+	if(pmm_pcp_ready)
+	{
+		cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
+		space = cpu->space;
+	}
+
+	acquire_lock(&vmm_mutex);
+
+	size_t *pte = vmm_space_pte(read_cr3() & (~(PAGE_SIZE-1)), page);
+	if(!pte || !(pte[0] & PAGE_PRESENT) || !(pte[0] & (PAGE_COW | PAGE_RW)))
+	{
+		release_lock(&vmm_mutex);
+		return 0;
+	}
+
+	// another CPU running this space may have dealt with it already
+	if(pte[0] & PAGE_RW)
+	{
+		release_lock(&vmm_mutex);
+		return 1;
+	}
+
+	size_t frame = pte[0] & (~(PAGE_SIZE-1));
+	size_t flags = (pte[0] & (PAGE_SIZE-1) & (~PAGE_COW)) | PAGE_RW;
+
+	if(!pmm_refcount(frame))
+	{
+		// everyone else let go of it, so it's ours
+		pte[0] = frame | flags;
+		vmm_cow_reuses++;
+		if(space)
+			space->reused++;
+	} else
+	{
+		size_t copy = pmm_alloc(1);
+		if(!copy)
+		{
+			release_lock(&vmm_mutex);
+			return 0;
+		}
+
+		memcpy((void*)(copy + PHYSICAL_MEMORY), (void*)(frame + PHYSICAL_MEMORY), PAGE_SIZE);
+		pmm_set_tag(copy, 1, PMM_TAG_ANON);
+		pte[0] = copy | flags;
+		pmm_unref(frame);
+
+		vmm_cow_copies++;
+		if(space)
+			space->copied++;
+	}
+
+	if(space)
+		vmm_space_changed(space);
+
+	release_lock(&vmm_mutex);
+
+	tlb_batch_t batch;
+	tlb_batch_init(&batch);
+	tlb_batch_add(&batch, page, 1);
+	tlb_batch_flush(&batch, space ? space->cpus : TLB_ALL_CPUS);
+	return 1;
+}
+
+// vmm_space_dump(): Shows how much of an address space is shared or copied
+// Param:	vmm_space_t *space - address space
+// Return:	Nothing
+
+void vmm_space_dump(vmm_space_t *space)
+{
+	kprintf("vmm: address space 0x%xq: %d paging structures, %d pages shared, %d copied, %d reused\n", space->pml4, space->tables, space->shared, space->copied, space->reused);
+}
+
+/* Internal Functions */
+
+// vmm_clone_table(): Clones a paging structure and what's below it
+// Param:	size_t *entry - entry pointing to the paging structure
+// Param:	size_t level - 3 for a PDPT, 2 for a page directory, 1 for a page table
+// Param:	size_t virtual - first virtual address the entry covers
+// Param:	vmm_space_t *space - new address space, for its counters
+// Param:	tlb_batch_t *batch - pages that need to be flushed
+// Return:	size_t - entry pointing to the copy
+
+size_t vmm_clone_table(size_t *entry, size_t level, size_t virtual, vmm_space_t *space, tlb_batch_t *batch)
+{
+	size_t *table = (size_t*)((entry[0] & (~(PAGE_SIZE-1))) + PHYSICAL_MEMORY);
+
+	size_t new_table = zero_page_alloc();
+	pmm_set_tag(new_table, 1, PMM_TAG_PAGE_TABLE);
+	size_t *new_table_ptr = (size_t*)(new_table + PHYSICAL_MEMORY);
+	space->tables++;
+
+	size_t shift = PAGE_SIZE_SHIFT + ((level - 1) * 9);
+	size_t i;
+	for(i = 0; i < 512; i++)
+	{
+		if(!(table[i] & PAGE_PRESENT))
+			continue;
+
+		// large pages can't be shared page by page, so split them first
+		if(level == 2 && (table[i] & PAGE_LARGE))
+		{
+			vmm_split_large(&table[i]);
+			tlb_batch_add(batch, virtual + (i << shift), 1);
+		}
+
+		if(level > 1)
+		{
+			new_table_ptr[i] = vmm_clone_table(&table[i], level - 1, virtual + (i << shift), space, batch);
+			continue;
+		}
+
+		// page table entries are the pages themselves
+		if(table[i] & PAGE_RW)
+		{
+			table[i] = (table[i] & (~PAGE_RW)) | PAGE_COW;
+			tlb_batch_add(batch, virtual + (i << shift), 1);
+		}
+
+		pmm_ref(table[i] & (~(PAGE_SIZE-1)));
+		new_table_ptr[i] = table[i];
+		space->shared++;
+	}
+
+	return new_table | (entry[0] & (PAGE_SIZE-1));
+}
+
+// vmm_free_table(): Frees a paging structure and what's below it
+// Param:	size_t *table - paging structure
+// Param:	size_t level - 3 for a PDPT, 2 for a page directory, 1 for a page table
+// Return:	Nothing
+
+void vmm_free_table(size_t *table, size_t level)
+{
+	size_t i;
+	for(i = 0; i < 512; i++)
+	{
+		if(!(table[i] & PAGE_PRESENT))
+			continue;
+
+		if(level == 2 && (table[i] & PAGE_LARGE))
+		{
+			size_t j;
+			for(j = 0; j < 512; j++)
+				pmm_unref((table[i] & (~(LARGE_PAGE_SIZE-1))) + (j << PAGE_SIZE_SHIFT));
+		} else if(level > 1)
+		{
+			vmm_free_table((size_t*)((table[i] & (~(PAGE_SIZE-1))) + PHYSICAL_MEMORY), level - 1);
+		} else
+		{
+			pmm_unref(table[i] & (~(PAGE_SIZE-1)));
+		}
+	}
+
+	pmm_mark_free((size_t)table - PHYSICAL_MEMORY, 1);
+}
+
+// vmm_space_changed(): Gives a space a new TLB generation, called with vmm_mutex held
+// Param:	vmm_space_t *space - address space whose pages changed
+// Return:	Nothing
+
+void vmm_space_changed(vmm_space_t *space)
+{
+	vmm_tlb_gen++;
+	space->tlb_gen = vmm_tlb_gen;
+
+	// and only then read cpus, see vmm_space_switch()
+	asm volatile ("mfence" ::: "memory");
+}
+
+// vmm_space_pte(): Returns the page table entry of a page, if it has one
+// Param:	size_t space_pml4 - physical address of the PML4
+// Param:	size_t virtual - virtual address
+// Return:	size_t * - pointer to page table entry, NULL if there's no page table
+
+size_t *vmm_space_pte(size_t space_pml4, size_t virtual)
+{
+	size_t *table = (size_t*)(space_pml4 + PHYSICAL_MEMORY);
+	size_t shift = 39;
+	size_t entry;
+
+	while(shift > PAGE_SIZE_SHIFT)
+	{
+		entry = table[(virtual >> shift) & 511];
+		if(!(entry & PAGE_PRESENT) || (entry & PAGE_LARGE))
+			return NULL;
+
+		table = (size_t*)((entry & (~(PAGE_SIZE-1))) + PHYSICAL_MEMORY);
+		shift -= 9;
+	}
+
+	return &table[(virtual >> PAGE_SIZE_SHIFT) & 511];
+}
+
+#endif			// __x86_64__
+
@@ -9,12 +9,22 @@
 #include <cpu.h>
 #include <string.h>
 #include <lock.h>
+#include <tlb.h>
 
 #if __x86_64__
 
 size_t *pml4;
 lock_t vmm_mutex = 0;
-void vmm_map_page(size_t, size_t, uint8_t);
+size_t vmm_large_mappings = 0;		// 2 MB PDEs made by vmm_map()
+size_t vmm_small_mappings = 0;		// 4 KB PTEs made by vmm_map()
+
+size_t *vmm_get_pde(size_t);
+size_t vmm_map_page(size_t, size_t, uint8_t);
+void vmm_map_large(size_t *, size_t, size_t, uint8_t, tlb_batch_t *);
+void vmm_split_large(size_t *);
+size_t vmm_global(size_t, uint8_t);
+void vmm_mark_global(size_t *, size_t);
+void vmm_tag_frames(size_t, size_t, size_t);
 
 // vmm_init(): Initializes paging and the virtual memory manager
 // Param:	Nothing
@@ -26,6 +36,20 @@ void vmm_init()
 	// -- because paging is always enabled in x86_64
 
 	pml4 = (size_t*)(read_cr3() & (~(PAGE_SIZE-1)));
+	vmm_kernel_space.pml4 = (size_t)pml4;
+	vmm_kernel_space.tables = 1;
+
+	// its PCID 0 entries survive switches to other spaces, so every CPU
+	// may have them cached
+	vmm_kernel_space.cpus = TLB_ALL_CPUS;
+
+	// the boot page tables map the kernel, make those mappings global too
+	size_t i;
+	for(i = 0; i < 512; i++)
+	{
+		if((pml4[i] & PAGE_PRESENT) && (i < (USER_SPACE >> 39) || i >= (USER_SPACE_END >> 39)))
+			vmm_mark_global((size_t*)((pml4[i] & (~(PAGE_SIZE-1))) + PHYSICAL_MEMORY), 3);
+	}
 	uint64_t cr0 = read_cr0();
 	cr0 |= 0x10000;		// WP
 	cr0 &= ~0x60000000;	// caching
@@ -36,7 +60,7 @@ void vmm_init()
 // Param:	size_t page - 4KB-aligned page
 // Return:	size_t - 4KB-aligned physical address and flags
 
-size_t vmm_get_page(size_t page)
+pte_t vmm_get_page(size_t page)
 {
 	// determine which PDPT has the page
 	size_t pdpt = pml4[(page >> 39) & 511];		// 512 GB per each PML4 entry
@@ -64,8 +88,9 @@ size_t vmm_get_page(size_t page)
 		return 0;
 
 	// for large pages, we don't actually have a page table to search
+	// return the 4 KB page within the 2 MB page, with the large page's flags
 	if((ptbl & PAGE_LARGE) != 0)
-		return ptbl;
+		return ptbl + (page & (LARGE_PAGE_SIZE-1) & (~(PAGE_SIZE-1)));
 
 	// determine which entry within the page table has the page
 	ptbl &= (~(PAGE_SIZE-1));
@@ -76,21 +101,19 @@ size_t vmm_get_page(size_t page)
 	return ptbl_ptr[(page >> PAGE_SIZE_SHIFT) & 511];
 }
 
-// vmm_map_page(): Maps a single page
+// vmm_get_pde(): Returns the page directory entry of a page, creating tables
 // Param:	size_t virtual - virtual address
-// Param:	size_t physical - physical address
-// Param:	uint8_t flags - page flags
-// Return:	Nothing
+// Return:	size_t * - pointer to page directory entry
 
-void vmm_map_page(size_t virtual, size_t physical, uint8_t flags)
+size_t *vmm_get_pde(size_t virtual)
 {
 	// determine which PDPT has the page
 	size_t pdpt = pml4[(virtual >> 39) & 511];
 	if((pdpt & PAGE_PRESENT) == 0)
 	{
 		// PDPT doesn't exist, make a PDPT
-		pdpt = pmm_alloc(1);
-		memset((void*)(pdpt + PHYSICAL_MEMORY), 0, 4096);
+		pdpt = zero_page_alloc();
+		pmm_set_tag(pdpt, 1, PMM_TAG_PAGE_TABLE);
 		pml4[(virtual >> 39) & 511] = pdpt | PAGE_PRESENT | PAGE_RW | PAGE_USER;
 	}
 
@@ -103,23 +126,40 @@ void vmm_map_page(size_t virtual, size_t physical, uint8_t flags)
 	if((pdir & PAGE_PRESENT) == 0)
 	{
 		// page directory doesn't exist, make a page directory
-		pdir = pmm_alloc(1);
-		memset((void*)(pdir + PHYSICAL_MEMORY), 0, 4096);
+		pdir = zero_page_alloc();
+		pmm_set_tag(pdir, 1, PMM_TAG_PAGE_TABLE);
 		pdpt_ptr[(virtual >> 30) & 511] = pdir | PAGE_PRESENT | PAGE_RW | PAGE_USER;
 	}
 
-	// determine which page table has the page
 	pdir &= (~(PAGE_SIZE-1));
 	pdir += PHYSICAL_MEMORY;
 	size_t *pdir_ptr = (size_t*)(pdir);
 
-	size_t ptbl = pdir_ptr[(virtual >> 21) & 511];
+	return &pdir_ptr[(virtual >> 21) & 511];
+}
+
+// vmm_map_page(): Maps a single page
+// Param:	size_t virtual - virtual address
+// Param:	size_t physical - physical address
+// Param:	uint8_t flags - page flags
+// Return:	size_t - previous page table entry
+
+size_t vmm_map_page(size_t virtual, size_t physical, uint8_t flags)
+{
+	// determine which page table has the page
+	size_t *pde = vmm_get_pde(virtual);
+
+	// mapping a small page inside a large page splits it
+	if((pde[0] & PAGE_PRESENT) && (pde[0] & PAGE_LARGE))
+		vmm_split_large(pde);
+
+	size_t ptbl = pde[0];
 	if((ptbl & PAGE_PRESENT) == 0)
 	{
 		// page table doesn't exist, make a page table
-		ptbl = pmm_alloc(1);
-		memset((void*)(ptbl + PHYSICAL_MEMORY), 0, 4096);
-		pdir_ptr[(virtual >> 21) & 511] = ptbl | PAGE_PRESENT | PAGE_RW | PAGE_USER;
+		ptbl = zero_page_alloc();
+		pmm_set_tag(ptbl, 1, PMM_TAG_PAGE_TABLE);
+		pde[0] = ptbl | PAGE_PRESENT | PAGE_RW | PAGE_USER;
 	}
 
 	// map the page
@@ -127,29 +167,163 @@ void vmm_map_page(size_t virtual, size_t physical, uint8_t flags)
 	ptbl += PHYSICAL_MEMORY;
 
 	size_t *ptbl_ptr = (size_t*)(ptbl);
-	ptbl_ptr[(virtual >> PAGE_SIZE_SHIFT) & 511] = physical | flags;
+	size_t old = ptbl_ptr[(virtual >> PAGE_SIZE_SHIFT) & 511];
+	ptbl_ptr[(virtual >> PAGE_SIZE_SHIFT) & 511] = physical | flags | vmm_global(virtual, flags);
+
+	// lazy faults map pages without vmm_mutex
+	if(old & PAGE_PRESENT)
+		asm volatile ("lock decq %0" : "+m"(vmm_small_mappings));
+	if(flags & PAGE_PRESENT)
+		asm volatile ("lock incq %0" : "+m"(vmm_small_mappings));
+
+	return old;
+}
+
+// vmm_map_large(): Maps or unmaps a single 2 MB page
+// Param:	size_t *pde - pointer to page directory entry
+// Param:	size_t virtual - 2MB-aligned virtual address
+// Param:	size_t physical - 2MB-aligned physical address
+// Param:	uint8_t flags - page flags
+// Param:	tlb_batch_t *batch - batch for pages that need to be flushed
+// Return:	Nothing
+
+void vmm_map_large(size_t *pde, size_t virtual, size_t physical, uint8_t flags, tlb_batch_t *batch)
+{
+	size_t old = pde[0];
+
+	// the counters are shared with vmm_map_page(), which runs without vmm_mutex
+	if((old & PAGE_PRESENT) && (old & PAGE_LARGE))
+	{
+		asm volatile ("lock decq %0" : "+m"(vmm_large_mappings));
+		tlb_batch_add(batch, virtual, 1);	// one invlpg drops the whole large page
+	} else if(old & PAGE_PRESENT)
+	{
+		// there's a page table here, drop whatever it mapped and free it
+		size_t ptbl = old & (~(PAGE_SIZE-1));
+		size_t *ptbl_ptr = (size_t*)(ptbl + PHYSICAL_MEMORY);
+
+		size_t i = 0, dropped = 0;
+		while(i < 512)
+		{
+			if(ptbl_ptr[i] & PAGE_PRESENT)
+				dropped++;
+
+			i++;
+		}
+
+		asm volatile ("lock subq %1, %0" : "+m"(vmm_small_mappings) : "r"(dropped));
+
+		// the table can't be reused until nobody can walk through it
+		pde[0] = 0;
+		tlb_flush(virtual, LARGE_PAGE_SIZE >> PAGE_SIZE_SHIFT);
+		pmm_mark_free(ptbl, 1);
+	}
+
+	if(flags & PAGE_PRESENT)
+	{
+		pde[0] = physical | flags | PAGE_LARGE | vmm_global(virtual, flags);
+		asm volatile ("lock incq %0" : "+m"(vmm_large_mappings));
+	} else
+	{
+		pde[0] = 0;
+	}
+}
+
+// vmm_split_large(): Splits a 2 MB page into a page table of 4 KB pages
+// Param:	size_t *pde - pointer to page directory entry
+// Return:	Nothing
+
+void vmm_split_large(size_t *pde)
+{
+	size_t ptbl = pmm_alloc(1);
+	pmm_set_tag(ptbl, 1, PMM_TAG_PAGE_TABLE);
+	size_t *ptbl_ptr = (size_t*)(ptbl + PHYSICAL_MEMORY);
+
+	size_t physical = pde[0] & (~(LARGE_PAGE_SIZE-1));
+	size_t flags = pde[0] & (PAGE_SIZE-1) & (~PAGE_LARGE);
+
+	size_t i = 0;
+	while(i < 512)
+	{
+		ptbl_ptr[i] = (physical + (i << PAGE_SIZE_SHIFT)) | flags;
+		i++;
+	}
+
+	// the caller flushes the page it's changing, which also drops the large page
+	pde[0] = ptbl | PAGE_PRESENT | PAGE_RW | PAGE_USER;
+
+	asm volatile ("lock decq %0" : "+m"(vmm_large_mappings));
+	asm volatile ("lock addq %1, %0" : "+m"(vmm_small_mappings) : "r"((size_t)512));
 }
 
 // vmm_map(): Maps physical memory in the virtual address space
+// Uses 2 MB pages where both addresses are 2MB-aligned
 // Param:	size_t virtual - start of virtual base
 // Param:	size_t physical - start of physical base
 // Param:	size_t count - count of pages
 // Param:	uint8_t flags - page flags
 // Return:	Nothing
 
-void vmm_map(size_t virtual, size_t physical, size_t count, uint8_t flags)
+void vmm_map(size_t virtual, paddr_t physical, size_t count, uint8_t flags)
 {
 	if(!count)
 		return;
 
+	// only entries that were present can be cached in the TLB
+	tlb_batch_t batch;
+	tlb_batch_init(&batch);
+
+	size_t current_virtual, current_physical, *pde;
 	size_t i = 0;
 	while(i < count)
 	{
-		vmm_map_page(virtual + (i << PAGE_SIZE_SHIFT), physical + (i << PAGE_SIZE_SHIFT), flags);
+		current_virtual = virtual + (i << PAGE_SIZE_SHIFT);
+		current_physical = physical + (i << PAGE_SIZE_SHIFT);
+
+		if(!(current_virtual & (LARGE_PAGE_SIZE-1)) && !(current_physical & (LARGE_PAGE_SIZE-1)) && count - i >= 512)
+		{
+			// unmapping only uses the large path if there's a large page
+			// to begin with, so page tables aren't torn down needlessly
+			pde = vmm_get_pde(current_virtual);
+			if((flags & PAGE_PRESENT) || (pde[0] & PAGE_LARGE))
+			{
+				vmm_map_large(pde, current_virtual, current_physical, flags, &batch);
+				i += 512;
+				continue;
+			}
+		}
+
+		if(vmm_map_page(current_virtual, current_physical, flags) & PAGE_PRESENT)
+			tlb_batch_add(&batch, current_virtual, 1);
+
 		i++;
 	}
 
-	flush_tlb(virtual, count);
+	// everything but user space is the same in every space; the user space
+	// this maps into is the kernel's own, which every CPU may have cached
+	tlb_batch_flush(&batch, TLB_ALL_CPUS);
+}
+
+// vmm_map_noflush(): Maps a single page, leaving the old entry in the TLBs
+// For lazy faults, which flush after dropping vmm_lazy_mutex; the page table
+// must exist already, since this may run without vmm_mutex
+// Param:	size_t virtual - virtual address
+// Param:	size_t physical - physical address
+// Param:	uint8_t flags - page flags
+// Return:	size_t - previous page table entry
+
+pte_t vmm_map_noflush(size_t virtual, paddr_t physical, uint8_t flags)
+{
+	return vmm_map_page(virtual, physical, flags);
+}
+
+// vmm_dump_mappings(): Shows how many large and small pages are mapped
+// Param:	Nothing
+// Return:	Nothing
+
+void vmm_dump_mappings()
+{
+	kprintf("vmm: %d 2 MB mappings, %d 4 KB mappings\n", vmm_large_mappings, vmm_small_mappings);
 }
 
 // vmm_unmap(): Unmaps memory from the virtual address space
@@ -162,6 +336,17 @@ void vmm_unmap(size_t virtual, size_t count)
 	if(virtual >= PHYSICAL_MEMORY)
 		return;
 
+	// ranges from vmm_request_map() also give back their virtual space
+	if(virtual >= KERNEL_MMIO && virtual < KERNEL_MMIO_END)
+	{
+		count = ((virtual & (PAGE_SIZE-1)) + (count << PAGE_SIZE_SHIFT) + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+		virtual &= ~(PAGE_SIZE-1);
+
+		vmm_map(virtual, 0, count, 0);
+		vmm_arena_release(vmm_arena_find(virtual), virtual, count);
+		return;
+	}
+
 	vmm_map(virtual, 0, count, 0);
 }
 
@@ -200,11 +385,15 @@ size_t vmm_find_range(size_t start, size_t count)
 // vmm_alloc(): Allocates memory
 // Param:	size_t start - start of virtual base
 // Param:	size_t count - count of pages
-// Param:	uint8_t flags - page flags
+// Param:	uint16_t flags - page flags, VMM_NOZERO to skip zeroing, VMM_LAZY to map on first touch
 // Return:	size_t - Pointer to allocated memory
 
-size_t vmm_alloc(size_t start, size_t count, uint8_t flags)
+size_t vmm_alloc(size_t start, size_t count, uint16_t flags)
 {
+	uint8_t zero = !(flags & VMM_NOZERO);
+	uint8_t lazy = (flags & VMM_LAZY) ? 1 : 0;
+	flags &= ~(VMM_NOZERO | VMM_LAZY);
+
 	acquire_lock(&vmm_mutex);
 
 	if(!count)
@@ -214,26 +403,65 @@ size_t vmm_alloc(size_t start, size_t count, uint8_t flags)
 	}
 
 	// allocate virtual memory
-	size_t virtual = vmm_find_range(start, count);
+	vmm_arena_t *arena = vmm_arena_find(start);
+	size_t virtual;
+
+	if(arena)
+	{
+		// large blocks from the PMM are 2MB-aligned, so match them to use large pages
+		virtual = NULL;
+		if(!lazy && count >= (LARGE_PAGE_SIZE >> PAGE_SIZE_SHIFT))
+			virtual = vmm_arena_reserve_aligned(arena, count, LARGE_PAGE_SIZE, 0);
+
+		if(!virtual)
+			virtual = vmm_arena_reserve(arena, count);
+	} else
+	{
+		virtual = vmm_find_range(start, count);
+	}
+
 	if(!virtual)
 	{
 		release_lock(&vmm_mutex);
 		return NULL;
 	}
 
-	// and physical memory
-	size_t physical = pmm_alloc(count);
-	if(!physical)
+	// lazy regions get their memory from the page fault handler
+	if(lazy && arena && vmm_lazy_add(virtual, count, flags))
 	{
 		release_lock(&vmm_mutex);
-		return NULL;
+		return virtual;
 	}
 
-	vmm_map(virtual, physical, count, flags);
+	// and physical memory, already zeroed if we're lucky
+	size_t physical = NULL;
+	if(count == 1 && zero)
+	{
+		physical = zero_pool_alloc();
+		if(physical)
+			zero = 0;
+	}
+
+	// it doesn't have to be contiguous, vmm_alloc_contiguous() is for that
+	if(physical)
+	{
+		vmm_map(virtual, physical, count, flags);
+		vmm_tag_frames(virtual, physical, count);
+	} else if(!vmm_map_frames(virtual, count, flags))
+	{
+		if(arena)
+			vmm_arena_release(arena, virtual, count);
+
+		release_lock(&vmm_mutex);
+		return NULL;
+	}
 
-	// zero-initialize
-	memset((void*)virtual, 0, count << PAGE_SIZE_SHIFT);
 	release_lock(&vmm_mutex);
+
+	// zero-initialize, nobody else knows about this memory yet
+	if(zero)
+		memset((void*)virtual, 0, count << PAGE_SIZE_SHIFT);
+
 	return virtual;
 }
 
@@ -244,24 +472,37 @@ size_t vmm_alloc(size_t start, size_t count, uint8_t flags)
 
 void vmm_free(size_t ptr, size_t count)
 {
-	acquire_lock(&vmm_mutex);
 	if(!count)
+		return;
+
+	// only the heap and slab arenas hand out memory to free here; MMIO
+	// ranges go through vmm_unmap(), which gives their space back itself
+	vmm_arena_t *arena = vmm_arena_find(ptr);
+	if(!arena || (ptr >= KERNEL_MMIO && ptr < KERNEL_MMIO_END))
+	{
+		kprintf("vmm: attempt to free 0x%xq, which isn't heap memory\n", (uint64_t)ptr);
+		return;
+	}
+
+	acquire_lock(&vmm_mutex);
+
+	if(vmm_lazy_release(ptr, count))
 	{
 		release_lock(&vmm_mutex);
 		return;
 	}
 
-	size_t physical = vmm_get_page(ptr);
-	if(!physical & PAGE_PRESENT)		// page not present?
+	if(!(vmm_get_page(ptr) & PAGE_PRESENT))		// page not present?
 	{
 		release_lock(&vmm_mutex);
 		return;
 	}
 
-	physical &= (~(PAGE_SIZE-1));
+	// the frames may be scattered, so free them page by page
+	vmm_free_frames(ptr, count);
+	vmm_unmap(ptr, count);
+	vmm_arena_release(arena, ptr & (~(PAGE_SIZE-1)), count);
 
-	pmm_mark_free(physical, count);
-	vmm_unmap(ptr, count);	
 	release_lock(&vmm_mutex);
 }
 
@@ -281,20 +522,74 @@ size_t vmm_request_map(size_t physical, size_t count, uint8_t flags)
 
 	acquire_lock(&vmm_mutex);
 
-	// allocate virtual memory
-	count++;
-	size_t virtual = vmm_find_range(KERNEL_HEAP, count);
+	// allocate virtual memory, including the page offset
+	count = ((physical & (PAGE_SIZE-1)) + (count << PAGE_SIZE_SHIFT) + PAGE_SIZE - 1) >> PAGE_SIZE_SHIFT;
+
+	vmm_arena_t *arena = vmm_arena_find(KERNEL_MMIO);
+	if(!arena)
+	{
+		release_lock(&vmm_mutex);
+		return NULL;
+	}
+
+	// keep the same offset within 2 MB as the physical address, so the
+	// middle of large ranges can use large pages
+	size_t virtual = NULL;
+	if(count >= (LARGE_PAGE_SIZE >> PAGE_SIZE_SHIFT))
+		virtual = vmm_arena_reserve_aligned(arena, count, LARGE_PAGE_SIZE, physical);
+
+	if(!virtual)
+		virtual = vmm_arena_reserve(arena, count);
+
 	if(!virtual)
 	{
 		release_lock(&vmm_mutex);
 		return NULL;
 	}
 
-	vmm_map(virtual, physical, count, flags);
+	vmm_map(virtual, physical & (~(PAGE_SIZE-1)), count, flags);
 	release_lock(&vmm_mutex);
 	return virtual + (physical & (PAGE_SIZE-1));
 }
 
+/* Internal Functions */
+
+// vmm_global(): Returns the global bit for a mapping, if it should have one
+// Param:	size_t virtual - virtual address
+// Param:	uint8_t flags - page flags
+// Return:	size_t - PAGE_GLOBAL for present kernel pages, 0 otherwise
+
+size_t vmm_global(size_t virtual, uint8_t flags)
+{
+	if(!(flags & PAGE_PRESENT) || (flags & PAGE_USER))
+		return 0;
+
+	if(virtual >= USER_SPACE && virtual < USER_SPACE_END)
+		return 0;
+
+	return PAGE_GLOBAL;
+}
+
+// vmm_mark_global(): Makes all pages under a paging structure global
+// Param:	size_t *table - paging structure
+// Param:	size_t level - 3 for a PDPT, 2 for a page directory, 1 for a page table
+// Return:	Nothing
+
+void vmm_mark_global(size_t *table, size_t level)
+{
+	size_t i;
+	for(i = 0; i < 512; i++)
+	{
+		if(!(table[i] & PAGE_PRESENT) || (table[i] & PAGE_USER && level == 1))
+			continue;
+
+		if(level == 1 || (table[i] & PAGE_LARGE))
+			table[i] |= PAGE_GLOBAL;
+		else
+			vmm_mark_global((size_t*)((table[i] & (~(PAGE_SIZE-1))) + PHYSICAL_MEMORY), level - 1);
+	}
+}
+
 #endif			// __x86_64__
 
 
@@ -0,0 +1,179 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Pre-zeroed Page Pool */
+
+#include <mm.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+#include <shrink.h>
+
+// Idle CPUs zero free frames with non-temporal stores and keep them here, so
+// single-page allocations that need zeroed memory don't have to zero it while
+// holding vmm_mutex. Zeroing goes through the physical memory map, so on i386,
+// which has none, the pool always stays empty.
+
+uint32_t zero_pool[ZERO_POOL_SIZE];
+size_t zero_pool_count = 0;
+lock_t zero_mutex = 0;
+
+uint64_t zero_pool_hits = 0;
+uint64_t zero_pool_misses = 0;
+uint64_t zero_pool_zeroed = 0;
+uint64_t zero_pool_shrunk = 0;
+
+size_t zero_pool_pages();
+size_t zero_pool_shrink(size_t);
+
+// zero_pool_init(): Lets the pool be emptied when memory is low
+// Param:	Nothing
+// Return:	Nothing
+
+void zero_pool_init()
+{
+	// zeroed frames are the cheapest memory to give back
+	shrink_register("zero pool", zero_pool_pages, zero_pool_shrink, 0, SHRINKER_DIRECT);
+}
+
+// zero_pool_alloc(): Takes a pre-zeroed frame from the pool
+// Param:	Nothing
+// Return:	size_t - physical address, NULL if the pool is empty
+
+size_t zero_pool_alloc()
+{
+	acquire_lock(&zero_mutex);
+
+	if(!zero_pool_count)
+	{
+		zero_pool_misses++;
+		release_lock(&zero_mutex);
+		return NULL;
+	}
+
+	zero_pool_count--;
+	size_t frame = zero_pool[zero_pool_count];
+	zero_pool_hits++;
+
+	release_lock(&zero_mutex);
+
+	pmm_set_tag(frame << PAGE_SIZE_SHIFT, 1, PMM_TAG_NONE);
+	return frame << PAGE_SIZE_SHIFT;
+}
+
+// zero_page_alloc(): Allocates a zeroed frame, from the pool if possible
+// Param:	Nothing
+// Return:	size_t - physical address
+
+size_t zero_page_alloc()
+{
+	size_t page = zero_pool_alloc();
+	if(page)
+		return page;
+
+	page = pmm_alloc(1);
+	if(!page)
+		return NULL;
+
+	void *pointer = kmap(page);
+	memset(pointer, 0, PAGE_SIZE);
+	kunmap(pointer);
+
+	return page;
+}
+
+// zero_pool_idle(): Refills the pool, called from idle loops
+// Param:	Nothing
+// Return:	Nothing
+
+void zero_pool_idle()
+{
+#if __x86_64__
+	size_t i = 0;
+	size_t page;
+
+	while(i < ZERO_POOL_BATCH)
+	{
+		// don't compete with real allocations when memory is low
+		if(zero_pool_count >= ZERO_POOL_SIZE || total_pages - used_pages < ZERO_POOL_MIN_FREE)
+			return;
+
+		page = pmm_alloc(1);
+		sse2_zero_pages((void*)(page + PHYSICAL_MEMORY), 1);
+		pmm_set_tag(page, 1, PMM_TAG_ZERO_POOL);
+
+		acquire_lock(&zero_mutex);
+
+		if(zero_pool_count >= ZERO_POOL_SIZE)
+		{
+			// another CPU filled it in the meantime
+			release_lock(&zero_mutex);
+			pmm_mark_free(page, 1);
+			return;
+		}
+
+		zero_pool[zero_pool_count] = page >> PAGE_SIZE_SHIFT;
+		zero_pool_count++;
+		zero_pool_zeroed++;
+
+		release_lock(&zero_mutex);
+		i++;
+	}
+#endif
+}
+
+// zero_pool_dump(): Shows the pool counters
+// Param:	Nothing
+// Return:	Nothing
+
+void zero_pool_dump()
+{
+	kprintf("mm: zero pool has %d frames, %d hits, %d misses, %d zeroed in idle, %d given back\n", zero_pool_count, (uint32_t)zero_pool_hits, (uint32_t)zero_pool_misses, (uint32_t)zero_pool_zeroed, (uint32_t)zero_pool_shrunk);
+}
+
+/* Internal Functions */
+
+// zero_pool_pages(): Returns the count of frames in the pool
+// Param:	Nothing
+// Return:	size_t - count of frames
+
+size_t zero_pool_pages()
+{
+	return zero_pool_count;
+}
+
+// zero_pool_shrink(): Frees frames from the pool
+// Param:	size_t count - count of frames wanted
+// Return:	size_t - count of frames freed
+
+size_t zero_pool_shrink(size_t count)
+{
+	size_t freed = 0;
+	size_t page;
+
+	while(freed < count)
+	{
+		acquire_lock(&zero_mutex);
+
+		if(!zero_pool_count)
+		{
+			release_lock(&zero_mutex);
+			break;
+		}
+
+		zero_pool_count--;
+		page = (size_t)zero_pool[zero_pool_count] << PAGE_SIZE_SHIFT;
+		zero_pool_shrunk++;
+
+		release_lock(&zero_mutex);
+
+		pmm_mark_free(page, 1);
+		freed++;
+	}
+
+	return freed;
+}
+
@@ -0,0 +1,445 @@
+
+/*
+ * lux OS kernel
+ * copyright (c) 2018 by Omar Mohammad
+ */
+
+/* Compressed Memory, shared by i386 and x86_64 */
+
+#include <mm.h>
+#include <zram.h>
+#include <shrink.h>
+#include <lz4.h>
+#include <kprintf.h>
+#include <string.h>
+#include <lock.h>
+#include <cpu.h>
+#include <tlb.h>
+
+// When memory runs out, cold private frames of lazy regions are compressed
+// and freed. Their page table entries are left not present with PAGE_SWAPPED
+// and the slot number in the address bits, and the lazy fault handler brings
+// them back. Pages are picked by a clock hand going over the lazy regions: a
+// page that was accessed since the hand last passed loses its accessed bit
+// and gets a second chance. Those are flushed together when the hand leaves
+// a region, not one shootdown per page, and keep their dirty bit for ksm.
+//
+// Compressed pages are packed into store frames. A store frame is freed once
+// every page in it has been loaded back, and a new one is made out of the
+// frame of the page being compressed, so reclaiming never needs free memory.
+// Lock order is vmm_lazy_mutex, then zram_mutex, and like vmm_lazy_mutex,
+// zram_mutex is only held with interrupts disabled, since a handler faulting
+// on a compressed page of its scratch arena needs both.
+
+extern lock_t vmm_lazy_mutex;
+extern vmm_lazy_t vmm_lazy[];
+
+lock_t zram_mutex = 0;
+zram_slot_t zram_slots[ZRAM_MAX_SLOTS];
+zram_store_t zram_store[ZRAM_MAX_STORE];
+size_t zram_current = ZRAM_MAX_STORE;		// store frame being filled, ZRAM_MAX_STORE if none
+size_t zram_slot_hint = 0;
+size_t zram_hand_region = 0;
+size_t zram_hand_page = 0;
+
+uint8_t zram_buffer[ZRAM_MAX_OBJECT];
+uint8_t zram_work[LZ4_WORK_SIZE];
+
+size_t zram_stored = 0;				// pages compressed right now
+size_t zram_zero_pages = 0;
+size_t zram_store_frames = 0;
+size_t zram_compressed_bytes = 0;
+uint64_t zram_stores = 0;
+uint64_t zram_loads = 0;
+uint64_t zram_compressions = 0;
+uint64_t zram_rejected = 0;
+uint64_t zram_reclaims = 0;
+uint64_t zram_freed = 0;
+uint64_t zram_compress_cycles = 0;
+uint64_t zram_decompress_cycles = 0;
+
+size_t pmm_irq_save();
+void pmm_irq_restore(size_t);
+int zram_swap_out(vmm_lazy_t *, size_t, size_t);
+size_t zram_slot_alloc();
+void zram_release(size_t);
+
+// zram_init(): Sets up compressed memory
+// Param:	Nothing
+// Return:	Nothing
+
+void zram_init()
+{
+	memset(zram_slots, 0, sizeof(zram_slot_t) * ZRAM_MAX_SLOTS);
+	memset(zram_store, 0, sizeof(zram_store_t) * ZRAM_MAX_STORE);
+
+	// it only ever try_lock()s vmm_lazy_mutex, so allocations may call it
+	shrink_register("zram", zram_count, zram_reclaim, 20, SHRINKER_DIRECT);
+}
+
+// zram_reclaim(): Compresses cold pages to free their frames
+// Param:	size_t count - count of frames wanted
+// Return:	size_t - count of frames freed
+
+size_t zram_reclaim(size_t count)
+{
+	if(count < ZRAM_BATCH)
+		count = ZRAM_BATCH;
+
+	// lazy regions can't be changed under whoever holds them, and that may
+	// be our own caller
+	size_t flags = pmm_irq_save();
+	if(!try_lock(&vmm_lazy_mutex))
+	{
+		pmm_irq_restore(flags);
+		return 0;
+	}
+
+	acquire_lock(&zram_mutex);
+	zram_reclaims++;
+
+	// every page gets its second chance before we give up
+	size_t limit = 0, i;
+	for(i = 0; i < MAX_VMM_LAZY; i++)
+		limit += vmm_lazy[i].count;
+
+	limit *= 2;
+
+	size_t freed = 0, scanned = 0;
+	uint64_t rejected = zram_rejected;
+	size_t virtual, entry, frame;
+	vmm_lazy_t *region;
+	int status;
+
+	tlb_batch_t batch;
+	tlb_batch_init(&batch);
+
+	while(freed < count && scanned < limit)
+	{
+		region = &vmm_lazy[zram_hand_region];
+		if(zram_hand_page >= region->count)
+		{
+			// the hand may be back before we return, and a page that is
+			// still cached as accessed would never be seen as accessed again
+			tlb_batch_flush(&batch, TLB_ALL_CPUS);
+
+			zram_hand_region = (zram_hand_region + 1) % MAX_VMM_LAZY;
+			zram_hand_page = 0;
+			continue;
+		}
+
+		virtual = region->base + (zram_hand_page << PAGE_SIZE_SHIFT);
+		zram_hand_page++;
+		scanned++;
+
+		// untouched, the zero page, or compressed already
+		entry = vmm_get_page(virtual);
+		if(!(entry & PAGE_PRESENT) || !(entry & PAGE_RW))
+			continue;
+
+		frame = entry & (~(PAGE_SIZE-1));
+
+		if(entry & PAGE_ACCESSED)
+		{
+			vmm_map_noflush(virtual, frame, region->flags | (entry & PAGE_DIRTY));
+			tlb_batch_add(&batch, virtual, 1);
+			continue;
+		}
+
+		status = zram_swap_out(region, virtual, frame);
+		if(status < 0)
+			break;
+
+		freed += status;
+
+		// memory full of pages that don't compress would have every call
+		// compress all of them, and still free nothing
+		if(zram_rejected - rejected >= count)
+			break;
+	}
+
+	tlb_batch_flush(&batch, TLB_ALL_CPUS);
+	zram_freed += freed;
+
+	release_lock(&zram_mutex);
+	release_lock(&vmm_lazy_mutex);
+	pmm_irq_restore(flags);
+	return freed;
+}
+
+// zram_load(): Decompresses a page, called with vmm_lazy_mutex held
+// Param:	size_t entry - page table entry with PAGE_SWAPPED
+// Param:	void *destination - where to put the page
+// Return:	int - 0 on success, -1 if there is no such page
+
+int zram_load(size_t entry, void *destination)
+{
+	size_t slot = entry >> PAGE_SIZE_SHIFT;
+
+	acquire_lock(&zram_mutex);
+
+	if(slot >= ZRAM_MAX_SLOTS || !(zram_slots[slot].flags & ZRAM_SLOT_USED))
+	{
+		release_lock(&zram_mutex);
+		return -1;
+	}
+
+	uint64_t start = read_tsc();
+
+	if(zram_slots[slot].flags & ZRAM_SLOT_ZERO)
+	{
+		memset(destination, 0, PAGE_SIZE);
+	} else
+	{
+		uint8_t *source = kmap(zram_store[zram_slots[slot].store].frame);
+		int size = lz4_decompress(source + zram_slots[slot].offset, zram_slots[slot].size, destination, PAGE_SIZE);
+		kunmap(source);
+
+		if(size != PAGE_SIZE)
+		{
+			release_lock(&zram_mutex);
+			return -1;
+		}
+	}
+
+	zram_decompress_cycles += read_tsc() - start;
+	zram_loads++;
+	zram_release(slot);
+
+	release_lock(&zram_mutex);
+	return 0;
+}
+
+// zram_free(): Drops a compressed page without loading it, called with vmm_lazy_mutex held
+// Param:	size_t entry - page table entry with PAGE_SWAPPED
+// Return:	Nothing
+
+void zram_free(size_t entry)
+{
+	size_t slot = entry >> PAGE_SIZE_SHIFT;
+
+	acquire_lock(&zram_mutex);
+
+	if(slot < ZRAM_MAX_SLOTS && (zram_slots[slot].flags & ZRAM_SLOT_USED))
+		zram_release(slot);
+
+	release_lock(&zram_mutex);
+}
+
+// zram_count(): Returns how many frames reclaiming could free
+// Param:	Nothing
+// Return:	size_t - count of private frames in lazy regions
+
+size_t zram_count()
+{
+	size_t count = 0, i;
+	for(i = 0; i < MAX_VMM_LAZY; i++)
+		count += vmm_lazy[i].resident;
+
+	return count;
+}
+
+// zram_dump(): Shows how much is compressed and how well
+// Param:	Nothing
+// Return:	Nothing
+
+void zram_dump()
+{
+	size_t flags = pmm_irq_save();
+	acquire_lock(&zram_mutex);
+
+	size_t data_pages = zram_stored - zram_zero_pages;
+	size_t ratio = 0, effective = 0;
+
+	// in tenths, there's no floating point here
+	if(zram_compressed_bytes)
+		ratio = (data_pages * PAGE_SIZE * 10) / zram_compressed_bytes;
+
+	if(zram_store_frames)
+		effective = (zram_stored * 10) / zram_store_frames;
+
+	uint32_t compress_avg = 0, decompress_avg = 0;
+	if(zram_compressions)
+		compress_avg = (uint32_t)(zram_compress_cycles / zram_compressions);
+	if(zram_loads)
+		decompress_avg = (uint32_t)(zram_decompress_cycles / zram_loads);
+
+	kprintf("zram: %d pages stored, %d of them zero-filled, %d KB compressed in %d frames\n", zram_stored, zram_zero_pages, zram_compressed_bytes / 1024, zram_store_frames);
+	kprintf("zram: ratio %d.%d to 1, %d.%d to 1 counting whole frames, %d pages too random to compress\n", ratio / 10, ratio % 10, effective / 10, effective % 10, (uint32_t)zram_rejected);
+	kprintf("zram: %d stores at %d cycles, %d loads at %d cycles, %d reclaims freed %d frames\n", (uint32_t)zram_stores, compress_avg, (uint32_t)zram_loads, decompress_avg, (uint32_t)zram_reclaims, (uint32_t)zram_freed);
+
+	release_lock(&zram_mutex);
+	pmm_irq_restore(flags);
+}
+
+/* Internal Functions */
+
+// zram_swap_out(): Compresses a page and frees its frame
+// Param:	vmm_lazy_t *region - lazy region with the page
+// Param:	size_t virtual - page
+// Param:	size_t frame - physical address mapped there
+// Return:	int - count of frames freed, -1 if zram is full
+
+int zram_swap_out(vmm_lazy_t *region, size_t virtual, size_t frame)
+{
+	size_t slot = zram_slot_alloc();
+	if(slot >= ZRAM_MAX_SLOTS)
+		return -1;
+
+	// nobody may write to it while it's compressed
+	vmm_map(virtual, slot << PAGE_SIZE_SHIFT, 1, PAGE_SWAPPED);
+
+	uint32_t *source = kmap(frame);
+	uint64_t start = read_tsc();
+
+	size_t i = 0;
+	while(i < PAGE_SIZE / 4 && !source[i])
+		i++;
+
+	if(i == PAGE_SIZE / 4)
+	{
+		kunmap(source);
+
+		// all zeroes, so there's nothing to store
+		zram_slots[slot].flags = ZRAM_SLOT_USED | ZRAM_SLOT_ZERO;
+		zram_zero_pages++;
+		zram_stored++;
+		zram_stores++;
+
+		region->resident--;
+		region->swapped++;
+
+		pmm_mark_free(frame, 1);
+		return 1;
+	}
+
+	size_t size = lz4_compress(source, PAGE_SIZE, zram_buffer, ZRAM_MAX_OBJECT, zram_work);
+	kunmap(source);
+	zram_compress_cycles += read_tsc() - start;
+	zram_compressions++;
+
+	if(!size)
+	{
+		// it wouldn't save enough, put it back as if it was just used, so
+		// the hand doesn't try it again on its next pass
+		vmm_map(virtual, frame, 1, region->flags | PAGE_ACCESSED);
+		zram_slots[slot].flags = 0;
+		zram_rejected++;
+		return 0;
+	}
+
+	int freed = 1;
+
+	if(zram_current >= ZRAM_MAX_STORE || zram_store[zram_current].used + size > PAGE_SIZE)
+	{
+		size_t store = 0;
+		while(store < ZRAM_MAX_STORE && zram_store[store].frame)
+			store++;
+
+		if(store >= ZRAM_MAX_STORE)
+		{
+			vmm_map(virtual, frame, 1, region->flags);
+			zram_slots[slot].flags = 0;
+			return -1;
+		}
+
+		// the frame we're freeing becomes the new store frame
+		zram_store[store].frame = frame;
+		zram_store[store].used = 0;
+		zram_store[store].live = 0;
+		pmm_set_tag(frame, 1, PMM_TAG_ZRAM);
+		zram_store_frames++;
+		freed = 0;
+
+		// every page in the old one may have been loaded back already
+		if(zram_current < ZRAM_MAX_STORE && !zram_store[zram_current].live)
+		{
+			pmm_mark_free(zram_store[zram_current].frame, 1);
+			zram_store[zram_current].frame = 0;
+			zram_store_frames--;
+			freed = 1;
+		}
+
+		zram_current = store;
+	}
+
+	zram_store_t *store = &zram_store[zram_current];
+	uint8_t *destination = kmap(store->frame);
+	memcpy(destination + store->used, zram_buffer, size);
+	kunmap(destination);
+
+	zram_slots[slot].store = zram_current;
+	zram_slots[slot].offset = store->used;
+	zram_slots[slot].size = size;
+	zram_slots[slot].flags = ZRAM_SLOT_USED;
+
+	store->used += size;
+	store->live++;
+
+	zram_compressed_bytes += size;
+	zram_stored++;
+	zram_stores++;
+
+	region->resident--;
+	region->swapped++;
+
+	if(frame != store->frame)
+		pmm_mark_free(frame, 1);
+
+	return freed;
+}
+
+// zram_slot_alloc(): Finds a free slot
+// Param:	Nothing
+// Return:	size_t - slot number, ZRAM_MAX_SLOTS if they're all used
+
+size_t zram_slot_alloc()
+{
+	size_t i = 0;
+	size_t slot;
+
+	while(i < ZRAM_MAX_SLOTS)
+	{
+		slot = (zram_slot_hint + i) % ZRAM_MAX_SLOTS;
+		if(!(zram_slots[slot].flags & ZRAM_SLOT_USED))
+		{
+			zram_slot_hint = (slot + 1) % ZRAM_MAX_SLOTS;
+			return slot;
+		}
+
+		i++;
+	}
+
+	return ZRAM_MAX_SLOTS;
+}
+
+// zram_release(): Frees a slot, and its store frame if it was the last page in it
+// Param:	size_t slot - slot number
+// Return:	Nothing
+
+void zram_release(size_t slot)
+{
+	zram_slot_t *entry = &zram_slots[slot];
+
+	if(entry->flags & ZRAM_SLOT_ZERO)
+	{
+		zram_zero_pages--;
+	} else
+	{
+		zram_store_t *store = &zram_store[entry->store];
+		store->live--;
+		zram_compressed_bytes -= entry->size;
+
+		// the one being filled is kept, it still has room
+		if(!store->live && entry->store != zram_current)
+		{
+			pmm_mark_free(store->frame, 1);
+			store->frame = 0;
+			zram_store_frames--;
+		}
+	}
+
+	entry->flags = 0;
+	zram_stored--;
+}
+
@@ -10,7 +10,8 @@
 #include <string.h>
 #include <kprintf.h>
 
-process_t *processes;
+process_t *processes[MAX_PROCESSES];
+slab_cache_t *process_cache;
 
 // tasking_init(): Initializes the scheduler
 // Param:	Nothing
@@ -19,13 +20,18 @@ process_t *processes;
 void tasking_init()
 {
 	kprintf("tasking: initializing scheduler...\n");
-	processes = kcalloc(sizeof(process_t), MAX_PROCESSES);
+	process_cache = slab_create("process_t", sizeof(process_t), 0);
 
 	// configure the kernel task
-	processes[0].flags = PROCESS_FLAGS_PRESENT;
-	processes[0].tty = 0;
-	processes[0].path[0] = '/';
-	processes[0].path[1] = 0;
+	processes[0] = slab_alloc(process_cache);
+	processes[0]->flags = PROCESS_FLAGS_PRESENT;
+	processes[0]->tty = 0;
+	processes[0]->path[0] = '/';
+	processes[0]->path[1] = 0;
+
+#if __x86_64__
+	processes[0]->space = &vmm_kernel_space;
+#endif
 }
 
 // get_path(): Returns the path of the current process
@@ -36,7 +42,7 @@ char *get_path(char *destination)
 {
 	// CPU-specific information
 	cpu_t FS_BASE *cpu = (cpu_t FS_BASE*)0;
-	return strcpy(destination, processes[cpu->current_pid].path);
+	return strcpy(destination, processes[cpu->current_pid]->path);
 }
 
 // get_pid(): Returns the current PID
@@ -56,11 +62,6 @@ pid_t get_pid()
 size_t get_tty()
 {
 	pid_t pid = get_pid();
-	return processes[pid].tty;
+	return processes[pid]->tty;
 }
 
-
-
-
-
-